@@ -16,6 +16,8 @@
 #include "../../lib/components/XyPad.h"
 #include "../../lib/components/FxmeLookAndFeel.h"
 #include "../../lib/components/HorizontalBar.h"
+#include "../../lib/components/LoadBar.h"
+#include "../../lib/components/InfoOverlay.h"
 #include "../../lib/components/FxmeLogo.h"
 #include "../../lib/assets/defines.h"
 
@@ -73,6 +75,7 @@ private:
     Gui::XyPad2h xyPad2;
 
     fxme::FxmeButton autoButton{audioProcessor.apvts,"Update",FXMECOLOUR};
+    fxme::FxmeButton embedIrButton{audioProcessor.apvts,"Embed IR",FXMECOLOUR};
 
     FxmeLogo logo{"", false};
     
@@ -82,6 +85,10 @@ private:
     FxmeKnobLookAndFeel knobLookAndFeel;
 
     Gui::HorizontalBar progressBar{[&]() { return audioProcessor.roomIR.getProgress(); }};
+    Gui::LoadBar loadBar{audioProcessor.loadMeter};
+    // (metrics of the IR, over the progress bar)
+    Gui::InfoOverlay irInfo{[&]() { return audioProcessor.roomIR.getIrMetrics().getSummary(); }};
+    Gui::InfoOverlay memoryInfo{[&]() { return audioProcessor.roomIR.getMemoryUsage().getSummary(); }, juce::Justification::centredRight};
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ReverbAudioProcessorEditor)
 };
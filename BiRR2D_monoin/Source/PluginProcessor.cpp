@@ -10,14 +10,8 @@
 
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
-
-#define DEBUG_OUTPUTS
-
-#ifdef DEBUG_OUTPUTS
-#include <iostream>
-#include <chrono>
-using namespace std;
-#endif
+#include "../../lib/dsp/IrState.h"
+#include "../../lib/dsp/Log.h"
 
 //==============================================================================
 ReverbAudioProcessor::ReverbAudioProcessor()
@@ -32,6 +26,24 @@ ReverbAudioProcessor::ReverbAudioProcessor()
                        )
 #endif
 {
+    // (looked up once, processBlock reads them at each block)
+    controls.latency = apvts.getRawParameterValue("Latency");
+    controls.directLevel = apvts.getRawParameterValue("Direct Level");
+    controls.reflectionsLevel = apvts.getRawParameterValue("Reflections Level");
+    controls.cpuSafety = apvts.getRawParameterValue("CPU Safety");
+    controls.embedIr = apvts.getRawParameterValue("Embed IR");
+    controls.roomSizeX = apvts.getRawParameterValue("Room Size X");
+    controls.roomSizeY = apvts.getRawParameterValue("Room Size Y");
+    controls.listenerX = apvts.getRawParameterValue("ListenerX");
+    controls.listenerY = apvts.getRawParameterValue("ListenerY");
+    controls.sourceX = apvts.getRawParameterValue("SourceX");
+    controls.sourceY = apvts.getRawParameterValue("SourceY");
+    controls.damping = apvts.getRawParameterValue("Damping");
+    controls.hfDamping = apvts.getRawParameterValue("HF Damping");
+    controls.reverbType = apvts.getRawParameterValue("Reverb type");
+    controls.listenerO = apvts.getRawParameterValue("ListenerO");
+    controls.stereoWidth = apvts.getRawParameterValue("Stereo Width");
+
     startTimerHz(5);
 }
 
@@ -75,7 +87,9 @@ bool ReverbAudioProcessor::isMidiEffect() const
 
 double ReverbAudioProcessor::getTailLengthSeconds() const
 {
-    return 0.0;
+    // (the IRs are trimmed where their decay reaches TRIM_FLOOR, the
+    // latency and the early paths are included)
+    return roomIR.getTailLengthSeconds();
 }
 
 int ReverbAudioProcessor::getNumPrograms()
@@ -111,7 +125,21 @@ void ReverbAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock
     spec.numChannels = getTotalNumOutputChannels();
 
     roomIR.initialize();
+    roomIR.setMemoryBudget(MemoryUsage::getDefaultBudget());
+
+    // The latency is set before the convolutions are prepared
+    latencyChoice = int(controls.latency->load());
+    auto latency = PartitionedConvolution::getLatencyFromChoice(latencyChoice);
+    roomIR.setLatency(latency);
+
     roomIR.prepare(spec);
+    setLatencySamples(roomIR.getLatency());
+    cpuSafety.prepare(sampleRate);
+    loadMeter.prepare(sampleRate);
+
+    // If the IR is already known (embedded in the state or stored),
+    // it is loaded right away
+    setIrLoader();
 
 }
 
@@ -119,6 +147,8 @@ void ReverbAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
+
+    RtAudit::checkViolations();
 }
 
 bool ReverbAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) const
@@ -133,16 +163,26 @@ bool ReverbAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) c
 void ReverbAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
     juce::ScopedNoDenormals noDenormals;
-    auto totalNumInputChannels  = getTotalNumInputChannels();
-    auto totalNumOutputChannels = getTotalNumOutputChannels();
+    // (debug builds : no allocation nor lock below, see RtAudit)
+    RtAudit::ScopedRealtime realtime;
+    cpuSafety.startBlock();
+    loadMeter.startBlock();
+
+    roomIR.directLevel = juce::Decibels::decibelsToGain(controls.directLevel->load());
+    roomIR.reflectionsLevel = juce::Decibels::decibelsToGain(controls.reflectionsLevel->load());
+
+    // The direct path and the early reflections follow the controls at each block
+    roomIR.updateEarlyPaths(getParams());
 
-    for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
-        buffer.copyFrom(1,0,buffer,0,0,buffer.getNumSamples());
+    // The mono input is read before the stereo output is written
+    roomIR.process(buffer, 0, buffer, false);
 
-    roomIR.directLevel = juce::Decibels::decibelsToGain(apvts.getRawParameterValue("Direct Level")->load());
-    roomIR.reflectionsLevel = juce::Decibels::decibelsToGain(apvts.getRawParameterValue("Reflections Level")->load());
+    loadMeter.endBlock(buffer.getNumSamples(), {&roomIR.loadSections});
 
-    roomIR.process(buffer);
+    // The IR tails are shortened when the processing gets close to the
+    // deadline of the host (see CpuSafety)
+    auto level = cpuSafety.endBlock(buffer.getNumSamples(), int(controls.cpuSafety->load()));
+    roomIR.setSafetyLevel(level);
 }
 
 //==============================================================================
@@ -160,7 +200,17 @@ juce::AudioProcessorEditor* ReverbAudioProcessor::createEditor()
 void ReverbAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
     juce::MemoryOutputStream mos(destData, true);
-    apvts.state.writeToStream(mos);
+    auto state = apvts.copyState();
+
+    // Optionally, the finished IRs are saved with the state, so that
+    // nothing has to be calculated when the project is reopened
+    if (controls.embedIr->load() > 0.5f)
+    {
+        if (auto ir = roomIR.getCurrentIr())
+            state.appendChild(IrState::toValueTree(*ir, "IR"), nullptr);
+    }
+
+    state.writeToStream(mos);
 }
 
 void ReverbAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
@@ -169,6 +219,11 @@ void ReverbAudioProcessor::setStateInformation (const void* data, int sizeInByte
     auto tree = juce::ValueTree::readFromData(data,sizeInBytes);
     if (tree.isValid())
     {
+        // The embedded IR is kept by the room, and loaded when the
+        // parameters (and sample rate) are calculated
+        auto irs = IrState::extractAll(tree);
+        roomIR.restoreIr(irs["IR"]);
+
         apvts.replaceState(tree);
     }
 
@@ -201,39 +256,93 @@ juce::AudioProcessorValueTreeState::ParameterLayout ReverbAudioProcessor::create
     choices.addArray(CHOICES);
     layout.add(std::make_unique<juce::AudioParameterChoice>("Reverb type", "Reverb type", choices, 1));
     layout.add(std::make_unique<juce::AudioParameterBool>("Update","Update", true));
+    layout.add(std::make_unique<juce::AudioParameterBool>("Embed IR","Embed IR", false));
+
+    juce::StringArray latencies;
+    latencies.addArray(CONV_LATENCYCHOICES);
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Latency", "Latency", latencies, 0));
+
+    juce::StringArray safetyChoices;
+    safetyChoices.addArray(SAFETY_CHOICES);
+    layout.add(std::make_unique<juce::AudioParameterChoice>("CPU Safety", "CPU Safety", safetyChoices, 1));
 
     return layout;
 }
 
-// This is the function where the impulse response is calculated
-void ReverbAudioProcessor::setIrLoader()
+// Parameters of the room, from the current values of the controls
+IrBoxCalculatorParams ReverbAudioProcessor::getParams()
 {
-    // std::cout << "In setIrLoader" << endl;
-
     IrBoxCalculatorParams p;
 
-    // std::cout << "Set parameters" << endl;
-
-    p.rx = apvts.getRawParameterValue("Room Size X")->load();
-    p.ry = apvts.getRawParameterValue("Room Size Y")->load();
-    p.lx = p.rx*(apvts.getRawParameterValue("ListenerX")->load());
-    p.ly = p.ry*(apvts.getRawParameterValue("ListenerY")->load());
-    p.sx = p.rx*(apvts.getRawParameterValue("SourceX")->load());
-    p.sy = p.ry*(apvts.getRawParameterValue("SourceY")->load());
-    p.damp = apvts.getRawParameterValue("Damping")->load();
-    p.hfDamp = apvts.getRawParameterValue("HF Damping")->load();
-    p.type = apvts.getRawParameterValue("Reverb type")->load();
-    p.headAzim = apvts.getRawParameterValue("ListenerO")->load();
-    p.sWidth = apvts.getRawParameterValue("Stereo Width")->load();
+    p.rx = controls.roomSizeX->load();
+    p.ry = controls.roomSizeY->load();
+    p.lx = p.rx*(controls.listenerX->load());
+    p.ly = p.ry*(controls.listenerY->load());
+    p.sx = p.rx*(controls.sourceX->load());
+    p.sy = p.ry*(controls.sourceY->load());
+    p.damp = controls.damping->load();
+    p.hfDamp = controls.hfDamping->load();
+    p.type = controls.reverbType->load();
+    p.headAzim = controls.listenerO->load();
+    p.sWidth = controls.stereoWidth->load();
     p.sampleRate = spec.sampleRate;
+    return p;
+}
+
+// This is the function where the impulse response is calculated
+void ReverbAudioProcessor::setIrLoader(bool speculative)
+{
+    LOG_TRACE("In setIrLoader");
+
+    auto p = getParams();
 
-    if (roomIR.hasInitialized) roomIR.calculate(p);
+    if (!roomIR.hasInitialized) return;
+    if (speculative)
+      roomIR.speculate(p);
+    else
+      roomIR.calculate(p);
 }
 
 void ReverbAudioProcessor::timerCallback()
 {
-    if (autoUpdate)
+    updateLatency();
+
+    // Reports when the IR tails have been shortened or restored
+    auto level = cpuSafety.getLevel();
+    if (level != safetyLevel)
+    {
+        safetyLevel = level;
+        LOG_INFO("CPU safety level " << level << " (load " << cpuSafety.getLoad() << ", "
+                 << cpuSafety.getNumDegradations() << " degradations)");
+    }
+
+    // While a control is moved, the IRs are prepared in the background,
+    // with the automatic update or not (on release, the IR is then
+    // found in the store, or its calculation in flight is kept)
+    if (isEditing)
+    {
+        setIrLoader(true);
+    }
+    else if (autoUpdate)
     {
         setIrLoader();
     }
 }
+
+// Applies the latency chosen by the user. The convolutions are prepared
+// again, so the processing is suspended meanwhile.
+void ReverbAudioProcessor::updateLatency()
+{
+    auto choice = int(controls.latency->load());
+    if (choice == latencyChoice)
+        return;
+
+    latencyChoice = choice;
+    auto latency = PartitionedConvolution::getLatencyFromChoice(choice);
+
+    suspendProcessing(true);
+    roomIR.setLatency(latency);
+    suspendProcessing(false);
+
+    setLatencySamples(roomIR.getLatency());
+}
@@ -17,10 +17,12 @@ ReverbAudioProcessorEditor::ReverbAudioProcessorEditor (ReverbAudioProcessor& p)
 {
     auto startDrag = [this](){      
       audioProcessor.autoUpdate = false;
+      audioProcessor.isEditing = true;
     };
 
     auto stopDrag = [this](){   
       audioProcessor.autoUpdate = autoButton.button.getToggleStateValue().getValue();
+      audioProcessor.isEditing = false;
     };
 
     auto exportFile = [this](){   
@@ -152,12 +154,20 @@ ReverbAudioProcessorEditor::ReverbAudioProcessorEditor (ReverbAudioProcessor& p)
 
     addAndMakeVisible(autoButton.button);
     autoButton.button.setLookAndFeel(&fxmeLookAndFeel);
+    addAndMakeVisible(embedIrButton.button);
+    embedIrButton.button.setLookAndFeel(&fxmeLookAndFeel);
     autoButton.button.onClick = stopDrag;
 
     // Progress bar
     addAndMakeVisible(progressBarL);
     addAndMakeVisible(progressBarR);
 
+    // Load of the audio thread
+    addAndMakeVisible(loadBar);
+    addAndMakeVisible(irInfoL);
+    addAndMakeVisible(irInfoR);
+    addAndMakeVisible(memoryInfo);
+
     addAndMakeVisible(logo);
 
     // Make sure that before the constructor has finished, you've set the
@@ -271,11 +281,13 @@ void ReverbAudioProcessorEditor::resized()
     fb31.items.add(fi(typeComboBox).withFlex(0.2f).withMargin(juce::FlexItem::Margin(25.f,0.f,0.f,0.f)));
 
     fb312.items.add(fi(autoButton.flex()).withFlex(1.f).withMargin(juce::FlexItem::Margin(0.f,0.f,0.f,0.f)));
+    fb312.items.add(fi(embedIrButton.flex()).withFlex(1.f).withMargin(juce::FlexItem::Margin(0.f,0.f,0.f,0.f)));
     fb312.items.add(fi(exportIrButton.flex()).withFlex(0.75f).withMargin(juce::FlexItem::Margin(0.f,0.f,0.f,0.f)));
 
     fb31.items.add(fi(fb312).withFlex(0.25f).withMargin(juce::FlexItem::Margin(20.f,20.f,0.f,20.f)));
     fb31.items.add(fi(progressBarL).withFlex(0.18f));
     fb31.items.add(fi(progressBarR).withFlex(0.18f));
+    fb31.items.add(fi(loadBar).withFlex(0.18f));
     fb32.items.add(fi(directLevelKnob.flex()).withFlex(1.f).withMargin(juce::FlexItem::Margin(20.f,0.f,0.f,0.f)));
     fb32.items.add(fi(reflectionsLevelKnob.flex()).withFlex(1.f).withMargin(juce::FlexItem::Margin(20.f,0.f,0.f,0.f)));
     fb32.items.add(juce::FlexItem(logo).withFlex(0.65f).withMargin(juce::FlexItem::Margin(5.f, 5.f, 5.f, 5.f)).withAlignSelf(juce::FlexItem::AlignSelf::stretch));
@@ -299,6 +311,10 @@ void ReverbAudioProcessorEditor::resized()
     fb20.performLayout(getLocalBounds());
     fb1.performLayout(getLocalBounds());
     fbmain.performLayout(getLocalBounds());
+
+    irInfoL.setBounds(progressBarL.getBounds());
+    irInfoR.setBounds(progressBarR.getBounds());
+    memoryInfo.setBounds(loadBar.getBounds());
 }
 
 void ReverbAudioProcessorEditor::addController(juce::Slider& slider,
@@ -333,12 +349,12 @@ void ReverbAudioProcessorEditor::saveWaveFile()
     auto chooserFlags = juce::FileBrowserComponent::saveMode;
     myChooser->launchAsync (chooserFlags, [this] (const juce::FileChooser& chooser)
     {
-      std::cout << "In launchAsync..." << std::endl;
+      LOG_DEBUG("In launchAsync...");
       juce::File wavFile (chooser.getResult()); 
-      std::cout << "You choosed 💾 " << wavFile.getFullPathName() << std::endl;
-      std::cout << "File name without extension: " << wavFile.getFileNameWithoutExtension() << std::endl;
-      std::cout << "File extension: " << wavFile.getFileExtension() << std::endl;
-      std::cout << "Parent directory: " << wavFile.getParentDirectory().getFullPathName() << std::endl;
+      LOG_INFO("You choosed 💾 " << wavFile.getFullPathName());
+      LOG_DEBUG("File name without extension: " << wavFile.getFileNameWithoutExtension());
+      LOG_DEBUG("File extension: " << wavFile.getFileExtension());
+      LOG_DEBUG("Parent directory: " << wavFile.getParentDirectory().getFullPathName());
       
       auto fname = wavFile.getParentDirectory().getFullPathName()
                     + "/"
@@ -15,6 +15,8 @@
 #include "../../lib/components/XyPad.h"
 #include "../../lib/components/FxmeLookAndFeel.h"
 #include "../../lib/components/HorizontalBar.h"
+#include "../../lib/components/LoadBar.h"
+#include "../../lib/components/InfoOverlay.h"
 #include "../../lib/components/FxmeLogo.h"
 #include "../../lib/assets/defines.h"
 
@@ -79,6 +81,7 @@ private:
     juce::TextButton calculateButton;
  
     fxme::FxmeButton autoButton{audioProcessor.apvts,"Update",FXMECOLOUR};
+    fxme::FxmeButton embedIrButton{audioProcessor.apvts,"Embed IR",FXMECOLOUR};
 
     FxmeLogo logo{"", false};
 
@@ -89,6 +92,11 @@ private:
 
     Gui::HorizontalBar progressBarL{[&]() { return audioProcessor.roomIRL.getProgress(); }};
     Gui::HorizontalBar progressBarR{[&]() { return audioProcessor.roomIRR.getProgress(); }};
+    Gui::LoadBar loadBar{audioProcessor.loadMeter};
+    // (metrics of the IR of each room, over its progress bar)
+    Gui::InfoOverlay irInfoL{[&]() { return audioProcessor.roomIRL.getIrMetrics().getSummary(); }};
+    Gui::InfoOverlay irInfoR{[&]() { return audioProcessor.roomIRR.getIrMetrics().getSummary(); }};
+    Gui::InfoOverlay memoryInfo{[&]() { return audioProcessor.getMemoryUsage().getSummary(); }, juce::Justification::centredRight};
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ReverbAudioProcessorEditor)
 };
@@ -10,14 +10,8 @@
 
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
-
-#define DEBUG_OUTPUTS
-
-#ifdef DEBUG_OUTPUTS
-#include <iostream>
-#include <chrono>
-using namespace std;
-#endif
+#include "../../lib/dsp/IrState.h"
+#include "../../lib/dsp/Log.h"
 
 //==============================================================================
 ReverbAudioProcessor::ReverbAudioProcessor()
@@ -32,6 +26,26 @@ ReverbAudioProcessor::ReverbAudioProcessor()
                        )
 #endif
 {
+    // (looked up once, processBlock reads them at each block)
+    controls.latency = apvts.getRawParameterValue("Latency");
+    controls.directLevel = apvts.getRawParameterValue("Direct Level");
+    controls.reflectionsLevel = apvts.getRawParameterValue("Reflections Level");
+    controls.cpuSafety = apvts.getRawParameterValue("CPU Safety");
+    controls.embedIr = apvts.getRawParameterValue("Embed IR");
+    controls.roomSizeX = apvts.getRawParameterValue("Room Size X");
+    controls.roomSizeY = apvts.getRawParameterValue("Room Size Y");
+    controls.listenerX = apvts.getRawParameterValue("ListenerX");
+    controls.listenerY = apvts.getRawParameterValue("ListenerY");
+    controls.sourceLX = apvts.getRawParameterValue("SourceLX");
+    controls.sourceLY = apvts.getRawParameterValue("SourceLY");
+    controls.damping = apvts.getRawParameterValue("Damping");
+    controls.hfDamping = apvts.getRawParameterValue("HF Damping");
+    controls.reverbType = apvts.getRawParameterValue("Reverb type");
+    controls.listenerO = apvts.getRawParameterValue("ListenerO");
+    controls.stereoWidth = apvts.getRawParameterValue("Stereo Width");
+    controls.sourceRX = apvts.getRawParameterValue("SourceRX");
+    controls.sourceRY = apvts.getRawParameterValue("SourceRY");
+
     startTimerHz(5);
 }
 
@@ -74,7 +88,16 @@ bool ReverbAudioProcessor::isMidiEffect() const
 
 double ReverbAudioProcessor::getTailLengthSeconds() const
 {
-    return 0.0;
+    // (the IRs are trimmed where their decay reaches TRIM_FLOOR, the
+    // latency and the early paths are included)
+    return juce::jmax(roomIRL.getTailLengthSeconds(), roomIRR.getTailLengthSeconds());
+}
+
+MemoryUsage ReverbAudioProcessor::getMemoryUsage() const
+{
+    auto usage = roomIRL.getMemoryUsage();
+    usage.add(roomIRR.getMemoryUsage());
+    return usage;
 }
 
 int ReverbAudioProcessor::getNumPrograms()
@@ -108,10 +131,30 @@ void ReverbAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock
     spec.sampleRate = sampleRate;
     spec.numChannels = getTotalNumOutputChannels();
 
+    outputBuffer.setSize(getTotalNumOutputChannels(), samplesPerBlock);
+    outputBufferR.setSize(getTotalNumOutputChannels(), samplesPerBlock);
+
     roomIRL.initialize();
     roomIRR.initialize();
+    // (the budget of the instance is shared by the rooms)
+    roomIRL.setMemoryBudget(MemoryUsage::getDefaultBudget()/2);
+    roomIRR.setMemoryBudget(MemoryUsage::getDefaultBudget()/2);
+    // The latency is set before the convolutions are prepared
+    latencyChoice = int(controls.latency->load());
+    auto latency = PartitionedConvolution::getLatencyFromChoice(latencyChoice);
+    roomIRL.setLatency(latency);
+    roomIRR.setLatency(latency);
+
     roomIRL.prepare(spec);
     roomIRR.prepare(spec);
+    setLatencySamples(roomIRL.getLatency());
+    cpuSafety.prepare(sampleRate);
+    loadMeter.prepare(sampleRate);
+
+    // If the IRs are already known (embedded in the state or stored),
+    // they are loaded right away
+    setIrLoaderL();
+    setIrLoaderR();
 
 }
 
@@ -119,6 +162,8 @@ void ReverbAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
+
+    RtAudit::checkViolations();
 }
 
 bool ReverbAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) const
@@ -132,31 +177,59 @@ bool ReverbAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) c
 
 void ReverbAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
-    // std::cout << "In process Block \n";
+    LOG_TRACE("In process Block");
     juce::ScopedNoDenormals noDenormals;
+    // (debug builds : no allocation nor lock below, see RtAudit)
+    RtAudit::ScopedRealtime realtime;
+    cpuSafety.startBlock();
+    loadMeter.startBlock();
+
+    LOG_TRACE("Get parameters in process");
 
-    // std::cout << "Start buffer copy \n";
-    bufferCopyR.makeCopyOf(buffer,true);
-    bufferCopyR.copyFrom(0,0,bufferCopyR,1,0,bufferCopyR.getNumSamples());
-    buffer.copyFrom(1,0,buffer,0,0,buffer.getNumSamples());
+    roomIRL.directLevel = juce::Decibels::decibelsToGain(controls.directLevel->load());
+    roomIRL.reflectionsLevel = juce::Decibels::decibelsToGain(controls.reflectionsLevel->load());
+    roomIRR.directLevel = juce::Decibels::decibelsToGain(controls.directLevel->load());
+    roomIRR.reflectionsLevel = juce::Decibels::decibelsToGain(controls.reflectionsLevel->load());
 
-    // std::cout << "Get parameters in process \n";
+    // The direct paths and the early reflections follow the controls at each block
+    roomIRL.updateEarlyPaths(getParamsL());
+    roomIRR.updateEarlyPaths(getParamsR());
 
-    roomIRL.directLevel = juce::Decibels::decibelsToGain(apvts.getRawParameterValue("Direct Level")->load());
-    roomIRL.reflectionsLevel = juce::Decibels::decibelsToGain(apvts.getRawParameterValue("Reflections Level")->load());
-    roomIRR.directLevel = juce::Decibels::decibelsToGain(apvts.getRawParameterValue("Direct Level")->load());
-    roomIRR.reflectionsLevel = juce::Decibels::decibelsToGain(apvts.getRawParameterValue("Reflections Level")->load());
+    // The output is built in the preallocated outputBuffer (by parts,
+    // if the host sends a longer block than announced)
+    for (int start=0; start<buffer.getNumSamples(); start+=outputBuffer.getNumSamples())
+    {
+      const int n = juce::jmin(outputBuffer.getNumSamples(), buffer.getNumSamples()-start);
+      juce::AudioBuffer<float> block(buffer.getArrayOfWritePointers(), buffer.getNumChannels(), start, n);
+      juce::AudioBuffer<float> output(outputBuffer.getArrayOfWritePointers(), outputBuffer.getNumChannels(), 0, n);
+      juce::AudioBuffer<float> outputR(outputBufferR.getArrayOfWritePointers(), outputBufferR.getNumChannels(), 0, n);
+
+      // (the rooms share nothing but their input)
+      rooms.process([&] (int room)
+      {
+        if (room == 0)
+          roomIRL.process(block, 0, output, false);
+        else
+          roomIRR.process(block, 1, outputR, false);
+      });
+
+      const LoadMeter::ScopedSection section(mixSections, LoadMeter::mixing);
+      for (int c=0; c<output.getNumChannels(); c++)
+      {
+        block.copyFrom(c,0,output,c,0,n);
+        block.addFrom(c,0,outputR,c,0,n);
+      }
+    }
 
-    // std::cout << "Start process L \n";
-    roomIRL.process(buffer);
-    // std::cout << "Start process R \n";
-    roomIRR.process(bufferCopyR);
-    // std::cout << "Processed\n";
+    loadMeter.endBlock(buffer.getNumSamples(), {&roomIRL.loadSections, &roomIRR.loadSections, &mixSections});
 
-    buffer.addFrom(0,0,bufferCopyR,0,0,buffer.getNumSamples(),1.0f);
-    buffer.addFrom(1,0,bufferCopyR,1,0,buffer.getNumSamples(),1.0f);
+    // The IR tails are shortened when the processing gets close to the
+    // deadline of the host (see CpuSafety)
+    auto level = cpuSafety.endBlock(buffer.getNumSamples(), int(controls.cpuSafety->load()));
+    roomIRL.setSafetyLevel(level);
+    roomIRR.setSafetyLevel(level);
 
-    // std::cout << "End of process Block \n";
+    LOG_TRACE("End of process Block");
 
 }
 
@@ -175,7 +248,19 @@ juce::AudioProcessorEditor* ReverbAudioProcessor::createEditor()
 void ReverbAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
     juce::MemoryOutputStream mos(destData, true);
-    apvts.state.writeToStream(mos);
+    auto state = apvts.copyState();
+
+    // Optionally, the finished IRs are saved with the state, so that
+    // nothing has to be calculated when the project is reopened
+    if (controls.embedIr->load() > 0.5f)
+    {
+        if (auto ir = roomIRL.getCurrentIr())
+            state.appendChild(IrState::toValueTree(*ir, "L"), nullptr);
+        if (auto ir = roomIRR.getCurrentIr())
+            state.appendChild(IrState::toValueTree(*ir, "R"), nullptr);
+    }
+
+    state.writeToStream(mos);
 }
 
 void ReverbAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
@@ -183,6 +268,12 @@ void ReverbAudioProcessor::setStateInformation (const void* data, int sizeInByte
     auto tree = juce::ValueTree::readFromData(data,sizeInBytes);
     if (tree.isValid())
     {
+        // Embedded IRs are kept by their rooms, and loaded when the
+        // parameters (and sample rate) are calculated
+        auto irs = IrState::extractAll(tree);
+        roomIRL.restoreIr(irs["L"]);
+        roomIRR.restoreIr(irs["R"]);
+
         apvts.replaceState(tree);
     }
 
@@ -217,65 +308,130 @@ juce::AudioProcessorValueTreeState::ParameterLayout ReverbAudioProcessor::create
     choices.addArray(CHOICES);
     layout.add(std::make_unique<juce::AudioParameterChoice>("Reverb type", "Reverb type", choices, 1));
     layout.add(std::make_unique<juce::AudioParameterBool>("Update","Update", true));
+    layout.add(std::make_unique<juce::AudioParameterBool>("Embed IR","Embed IR", false));
+
+    juce::StringArray latencies;
+    latencies.addArray(CONV_LATENCYCHOICES);
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Latency", "Latency", latencies, 0));
+
+    juce::StringArray safetyChoices;
+    safetyChoices.addArray(SAFETY_CHOICES);
+    layout.add(std::make_unique<juce::AudioParameterChoice>("CPU Safety", "CPU Safety", safetyChoices, 1));
 
     return layout;
 }
 
-// This is the function where the impulse response is calculated
-void ReverbAudioProcessor::setIrLoaderL()
+// Parameters of the room for the left input, from the current values of the controls
+IrBoxCalculatorParams ReverbAudioProcessor::getParamsL()
 {
-    // std::cout << "In setIrLoader" << endl;
-
     IrBoxCalculatorParams p;
 
-    // std::cout << "Set parameters" << endl;
-
-    p.rx = apvts.getRawParameterValue("Room Size X")->load();
-    p.ry = apvts.getRawParameterValue("Room Size Y")->load();
-    p.lx = p.rx*(apvts.getRawParameterValue("ListenerX")->load());
-    p.ly = p.ry*(apvts.getRawParameterValue("ListenerY")->load());
-    p.sx = p.rx*(apvts.getRawParameterValue("SourceLX")->load());
-    p.sy = p.ry*(apvts.getRawParameterValue("SourceLY")->load());
-    p.damp = apvts.getRawParameterValue("Damping")->load();
-    p.hfDamp = apvts.getRawParameterValue("HF Damping")->load();
-    p.type = apvts.getRawParameterValue("Reverb type")->load();
-    p.headAzim = apvts.getRawParameterValue("ListenerO")->load();
-    p.sWidth = apvts.getRawParameterValue("Stereo Width")->load();
+    p.rx = controls.roomSizeX->load();
+    p.ry = controls.roomSizeY->load();
+    p.lx = p.rx*(controls.listenerX->load());
+    p.ly = p.ry*(controls.listenerY->load());
+    p.sx = p.rx*(controls.sourceLX->load());
+    p.sy = p.ry*(controls.sourceLY->load());
+    p.damp = controls.damping->load();
+    p.hfDamp = controls.hfDamping->load();
+    p.type = controls.reverbType->load();
+    p.headAzim = controls.listenerO->load();
+    p.sWidth = controls.stereoWidth->load();
     p.sampleRate = spec.sampleRate;
-
-    if (roomIRL.hasInitialized) roomIRL.calculate(p);
+    return p;
 }
 
 // This is the function where the impulse response is calculated
-void ReverbAudioProcessor::setIrLoaderR()
+void ReverbAudioProcessor::setIrLoaderL(bool speculative)
 {
-    // std::cout << "In setIrLoader" << endl;
+    LOG_TRACE("In setIrLoader");
 
+    auto p = getParamsL();
+
+    if (!roomIRL.hasInitialized) return;
+    if (speculative)
+      roomIRL.speculate(p);
+    else
+      roomIRL.calculate(p);
+}
+
+// Parameters of the room for the right input, from the current values of the controls
+IrBoxCalculatorParams ReverbAudioProcessor::getParamsR()
+{
     IrBoxCalculatorParams p;
 
-    // std::cout << "Set parameters" << endl;
-
-    p.rx = apvts.getRawParameterValue("Room Size X")->load();
-    p.ry = apvts.getRawParameterValue("Room Size Y")->load();
-    p.lx = p.rx*(apvts.getRawParameterValue("ListenerX")->load());
-    p.ly = p.ry*(apvts.getRawParameterValue("ListenerY")->load());
-    p.sx = p.rx*(apvts.getRawParameterValue("SourceRX")->load());
-    p.sy = p.ry*(apvts.getRawParameterValue("SourceRY")->load());
-    p.damp = apvts.getRawParameterValue("Damping")->load();
-    p.hfDamp = apvts.getRawParameterValue("HF Damping")->load();
-    p.type = apvts.getRawParameterValue("Reverb type")->load();
-    p.headAzim = apvts.getRawParameterValue("ListenerO")->load();
-    p.sWidth = apvts.getRawParameterValue("Stereo Width")->load();
+    p.rx = controls.roomSizeX->load();
+    p.ry = controls.roomSizeY->load();
+    p.lx = p.rx*(controls.listenerX->load());
+    p.ly = p.ry*(controls.listenerY->load());
+    p.sx = p.rx*(controls.sourceRX->load());
+    p.sy = p.ry*(controls.sourceRY->load());
+    p.damp = controls.damping->load();
+    p.hfDamp = controls.hfDamping->load();
+    p.type = controls.reverbType->load();
+    p.headAzim = controls.listenerO->load();
+    p.sWidth = controls.stereoWidth->load();
     p.sampleRate = spec.sampleRate;
+    return p;
+}
 
-    if (roomIRR.hasInitialized) roomIRR.calculate(p);
+// This is the function where the impulse response is calculated
+void ReverbAudioProcessor::setIrLoaderR(bool speculative)
+{
+    LOG_TRACE("In setIrLoader");
+
+    auto p = getParamsR();
+
+    if (!roomIRR.hasInitialized) return;
+    if (speculative)
+      roomIRR.speculate(p);
+    else
+      roomIRR.calculate(p);
 }
 
 void ReverbAudioProcessor::timerCallback()
 {
-    if (autoUpdate)
+    updateLatency();
+
+    // Reports when the IR tails have been shortened or restored
+    auto level = cpuSafety.getLevel();
+    if (level != safetyLevel)
+    {
+        safetyLevel = level;
+        LOG_INFO("CPU safety level " << level << " (load " << cpuSafety.getLoad() << ", "
+                 << cpuSafety.getNumDegradations() << " degradations)");
+    }
+
+    // While a control is moved, the IRs are prepared in the background,
+    // with the automatic update or not (on release, the IR is then
+    // found in the store, or its calculation in flight is kept)
+    if (isEditing)
+    {
+        setIrLoaderL(true);
+        setIrLoaderR(true);
+    }
+    else if (autoUpdate)
     {
         setIrLoaderL();
         setIrLoaderR();
     }
-}
\ No newline at end of file
+}
+
+// Applies the latency chosen by the user. The convolutions are prepared
+// again, so the processing is suspended meanwhile.
+void ReverbAudioProcessor::updateLatency()
+{
+    auto choice = int(controls.latency->load());
+    if (choice == latencyChoice)
+        return;
+
+    latencyChoice = choice;
+    auto latency = PartitionedConvolution::getLatencyFromChoice(choice);
+
+    suspendProcessing(true);
+    roomIRL.setLatency(latency);
+    roomIRR.setLatency(latency);
+    suspendProcessing(false);
+
+    setLatencySamples(roomIRL.getLatency());
+}
@@ -12,6 +12,10 @@
 
 #include <JuceHeader.h>
 #include "../../lib/dsp/RoomIR2D.h"
+#include "../../lib/dsp/RtAudit.h"
+#include "../../lib/dsp/CpuSafety.h"
+#include "../../lib/dsp/LoadMeter.h"
+#include "../../lib/dsp/RealtimeWorkers.h"
 
 //==============================================================================
 /**
@@ -56,21 +60,50 @@ public:
     void getStateInformation (juce::MemoryBlock& destData) override;
     void setStateInformation (const void* data, int sizeInBytes) override;
 
-    void setIrLoaderL();
-    void setIrLoaderR();
+    IrBoxCalculatorParams getParamsL(), getParamsR();
+    void setIrLoaderL(bool speculative=false);
+    void setIrLoaderR(bool speculative=false);
+    // Memory held by both rooms (any thread but the audio one)
+    MemoryUsage getMemoryUsage() const;
     bool autoUpdate{true};
+    bool isEditing{false};
+    int latencyChoice{-1};
+    int safetyLevel{0};
 
+    // (before the rooms, which write messages until they are deleted)
+    juce::SharedResourcePointer<Log::Writer> logWriter;
     BoxRoomIR roomIRL, roomIRR;
+    CpuSafety cpuSafety;
+    // Timing of processBlock, shown by the editor (and readable from
+    // any thread)
+    LoadMeter loadMeter;
+    LoadMeter::Sections mixSections;
 
     juce::dsp::ProcessSpec spec;
-    juce::AudioBuffer<float> bufferCopyR;
+    // Outputs of both rooms (each one reads its input channel from the
+    // processed buffer)
+    juce::AudioBuffer<float> outputBuffer, outputBufferR;
+    // Both rooms are processed at once by the real-time helpers
+    ParallelChains rooms{2};
 
     static juce::AudioProcessorValueTreeState::ParameterLayout createParameters();  
     juce::AudioProcessorValueTreeState apvts{*this,nullptr,"Parameters",createParameters()};
 
+    // Values of the parameters (see the constructor)
+    struct Controls
+    {
+        std::atomic<float> *latency{nullptr}, *directLevel{nullptr}, *reflectionsLevel{nullptr},
+                           *cpuSafety{nullptr}, *embedIr{nullptr}, *roomSizeX{nullptr},
+                           *roomSizeY{nullptr}, *listenerX{nullptr}, *listenerY{nullptr},
+                           *sourceLX{nullptr}, *sourceLY{nullptr}, *damping{nullptr},
+                           *hfDamping{nullptr}, *reverbType{nullptr}, *listenerO{nullptr},
+                           *stereoWidth{nullptr}, *sourceRX{nullptr}, *sourceRY{nullptr};
+    } controls;
+
 private:
 
     void timerCallback() override;
+    void updateLatency();
 
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ReverbAudioProcessor)
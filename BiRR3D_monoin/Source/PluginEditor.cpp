@@ -19,10 +19,12 @@ ReverbAudioProcessorEditor::ReverbAudioProcessorEditor (ReverbAudioProcessor& p)
 
     auto startDrag = [this](){      
       audioProcessor.autoUpdate = false;
+      audioProcessor.isEditing = true;
     };
 
     auto stopDrag = [this](){   
       audioProcessor.autoUpdate = autoButton.button.getToggleStateValue().getValue();
+      audioProcessor.isEditing = false;
     };
 
     auto exportFile = [this](){   
@@ -164,11 +166,18 @@ ReverbAudioProcessorEditor::ReverbAudioProcessorEditor (ReverbAudioProcessor& p)
 
     addAndMakeVisible(autoButton.button);
     autoButton.button.setLookAndFeel(&fxmeLookAndFeel);
+    addAndMakeVisible(embedIrButton.button);
+    embedIrButton.button.setLookAndFeel(&fxmeLookAndFeel);
     autoButton.button.onClick = stopDrag;
 
     // Progress bar
     addAndMakeVisible(progressBar);
 
+    // Load of the audio thread
+    addAndMakeVisible(loadBar);
+    addAndMakeVisible(irInfo);
+    addAndMakeVisible(memoryInfo);
+
     addAndMakeVisible(logo);
 
     // Make sure that before the constructor has finished, you've set the
@@ -283,10 +292,12 @@ void ReverbAudioProcessorEditor::resized()
     fb31.items.add(fi(fb311).withFlex(1.f).withMargin(juce::FlexItem::Margin(0.f,20.f,0.f,0.f)));
     fb31.items.add(fi(typeComboBox).withFlex(0.2f).withMargin(juce::FlexItem::Margin(25.f,0.f,0.f,0.f)));
     fb312.items.add(fi(autoButton.flex()).withFlex(1.f).withMargin(juce::FlexItem::Margin(0.f,0.f,0.f,0.f)));
+    fb312.items.add(fi(embedIrButton.flex()).withFlex(1.f).withMargin(juce::FlexItem::Margin(0.f,0.f,0.f,0.f)));
     fb312.items.add(fi(exportIrButton.flex()).withFlex(0.75f).withMargin(juce::FlexItem::Margin(0.f,0.f,0.f,0.f)));
 
     fb31.items.add(fi(fb312).withFlex(0.25f).withMargin(juce::FlexItem::Margin(20.f,20.f,0.f,20.f)));
     fb31.items.add(fi(progressBar).withFlex(0.18f));
+    fb31.items.add(fi(loadBar).withFlex(0.18f));
     fb32.items.add(fi(directLevelKnob.flex()).withFlex(1.f).withMargin(juce::FlexItem::Margin(20.f,0.f,0.f,0.f)));
     fb32.items.add(fi(reflectionsLevelKnob.flex()).withFlex(1.f).withMargin(juce::FlexItem::Margin(20.f,0.f,0.f,0.f)));
     fb32.items.add(juce::FlexItem(logo).withFlex(0.65f).withMargin(juce::FlexItem::Margin(5.f, 5.f, 5.f, 5.f)).withAlignSelf(juce::FlexItem::AlignSelf::stretch));
@@ -310,6 +321,9 @@ void ReverbAudioProcessorEditor::resized()
     fb20.performLayout(getLocalBounds());
     fb1.performLayout(getLocalBounds());
     fbmain.performLayout(getLocalBounds());
+
+    irInfo.setBounds(progressBar.getBounds());
+    memoryInfo.setBounds(loadBar.getBounds());
 }
 
 void ReverbAudioProcessorEditor::addController(juce::Slider& slider,
@@ -344,12 +358,12 @@ void ReverbAudioProcessorEditor::saveWaveFile()
     auto chooserFlags = juce::FileBrowserComponent::saveMode;
     myChooser->launchAsync (chooserFlags, [this] (const juce::FileChooser& chooser)
     {
-      std::cout << "In launchAsync..." << std::endl;
+      LOG_DEBUG("In launchAsync...");
       juce::File wavFile (chooser.getResult()); 
-      std::cout << "You choosed 💾 " << wavFile.getFullPathName() << std::endl;
-      std::cout << "File name without extension: " << wavFile.getFileNameWithoutExtension() << std::endl;
-      std::cout << "File extension: " << wavFile.getFileExtension() << std::endl;
-      std::cout << "Parent directory: " << wavFile.getParentDirectory().getFullPathName() << std::endl;
+      LOG_INFO("You choosed 💾 " << wavFile.getFullPathName());
+      LOG_DEBUG("File name without extension: " << wavFile.getFileNameWithoutExtension());
+      LOG_DEBUG("File extension: " << wavFile.getFileExtension());
+      LOG_DEBUG("Parent directory: " << wavFile.getParentDirectory().getFullPathName());
       
       auto fname = wavFile.getParentDirectory().getFullPathName()
                     + "/"
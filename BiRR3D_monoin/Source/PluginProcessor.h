@@ -12,6 +12,9 @@
 
 #include <JuceHeader.h>
 #include "../../lib/dsp/RoomIR.h"
+#include "../../lib/dsp/RtAudit.h"
+#include "../../lib/dsp/CpuSafety.h"
+#include "../../lib/dsp/LoadMeter.h"
 
 //==============================================================================
 /**
@@ -56,19 +59,42 @@ public:
     void getStateInformation (juce::MemoryBlock& destData) override;
     void setStateInformation (const void* data, int sizeInBytes) override;
 
-    void setIrLoader();
+    IrBoxCalculatorParams getParams();
+    void setIrLoader(bool speculative=false);
     bool autoUpdate{true};
+    bool isEditing{false};
+    int latencyChoice{-1};
+    int safetyLevel{0};
 
+    // (before the rooms, which write messages until they are deleted)
+    juce::SharedResourcePointer<Log::Writer> logWriter;
     BoxRoomIR roomIR;
+    CpuSafety cpuSafety;
+    // Timing of processBlock, shown by the editor (and readable from
+    // any thread)
+    LoadMeter loadMeter;
 
     juce::dsp::ProcessSpec spec;
 
     static juce::AudioProcessorValueTreeState::ParameterLayout createParameters();  
     juce::AudioProcessorValueTreeState apvts{*this,nullptr,"Parameters",createParameters()};
 
+    // Values of the parameters (see the constructor)
+    struct Controls
+    {
+        std::atomic<float> *latency{nullptr}, *directLevel{nullptr}, *reflectionsLevel{nullptr},
+                           *cpuSafety{nullptr}, *embedIr{nullptr}, *roomSizeX{nullptr},
+                           *roomSizeY{nullptr}, *roomSizeZ{nullptr}, *listenerX{nullptr},
+                           *listenerY{nullptr}, *listenerZ{nullptr}, *sourceX{nullptr},
+                           *sourceY{nullptr}, *sourceZ{nullptr}, *damping{nullptr},
+                           *hfDamping{nullptr}, *reverbType{nullptr}, *listenerO{nullptr},
+                           *stereoWidth{nullptr};
+    } controls;
+
 private:
 
     void timerCallback() override;
+    void updateLatency();
 
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ReverbAudioProcessor)
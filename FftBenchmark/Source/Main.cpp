@@ -0,0 +1,43 @@
+/*
+  ==============================================================================
+
+    Binaural Room Reverb - FftBenchmark, Main.cpp
+
+    Times the FFT backends of the convolutions (see lib/dsp/RealFft.h) on
+    the transforms of the partitions the engine uses : for each head size
+    (the latency, or the block size without latency), the partitions of
+    its stages at the full rate and at the reduced ones.
+
+    Usage : FftBenchmark
+
+    (c) Olivier Doaré, 2022-2025
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../lib/dsp/PartitionedConvolution.h"
+#include "../../lib/dsp/RealFft.h"
+
+//==============================================================================
+int main (int, char*[])
+{
+    std::cout << "Default backend : " << RealFft::getBackendName (RealFft::getDefaultBackend()) << std::endl;
+
+    std::vector<int> sizes;
+    for (int headSize = CONV_MINHEADSIZE; headSize <= CONV_MAXHEADSIZE; headSize *= 2)
+    {
+        std::cout << "Head of " << headSize << " samples, partitions :";
+        for (int size : PartitionedConvolution::getPartitionSizes (headSize))
+        {
+            std::cout << " " << size;
+            sizes.push_back (2 * size);
+        }
+        std::cout << std::endl;
+    }
+
+    std::sort (sizes.begin(), sizes.end());
+    sizes.erase (std::unique (sizes.begin(), sizes.end()), sizes.end());
+    std::cout << RealFft::benchmark (sizes);
+    return 0;
+}
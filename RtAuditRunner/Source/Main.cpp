@@ -0,0 +1,110 @@
+/*
+  ==============================================================================
+
+    Binaural Room Reverb - RtAuditRunner, Main.cpp
+
+    Runs the processing of BiRR3D stereo in under the real-time audit :
+    for each sample rate and announced block size, the plugin is prepared,
+    then an audio thread calls processBlock at the pace of real time with
+    blocks of random sizes (as the hosts do), while the message thread
+    moves the parameters. Exits with 1 if any allocation, lock or wait for
+    a worker happened on the audio thread (see lib/dsp/RtAudit.h).
+
+    Usage : RtAuditRunner [seconds per configuration]
+
+    (c) Olivier Doaré, 2022-2025
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../lib/dsp/RtAudit.h"
+
+juce::AudioProcessor* JUCE_CALLTYPE createPluginFilter();
+
+//==============================================================================
+// Calls processBlock as a host would, from a real-time thread
+class AudioThread : public juce::Thread
+{
+public:
+    AudioThread (juce::AudioProcessor& p, double rate, int maxBlock)
+        : juce::Thread ("audio"), processor (p), sampleRate (rate), maxBlockSize (maxBlock),
+          buffer (juce::jmax (p.getTotalNumInputChannels(), p.getTotalNumOutputChannels()), maxBlock)
+    {
+    }
+
+    void run() override
+    {
+        juce::Random random (maxBlockSize);
+        juce::MidiBuffer midi;
+        auto deadline = juce::Time::getMillisecondCounterHiRes();
+
+        while (! threadShouldExit())
+        {
+            // (half of the blocks have the announced size)
+            const int n = random.nextBool() ? maxBlockSize : 1 + random.nextInt (maxBlockSize);
+            for (int c = 0; c < buffer.getNumChannels(); c++)
+                for (int i = 0; i < n; i++)
+                    buffer.setSample (c, i, 0.1f * (2.0f * random.nextFloat() - 1.0f));
+
+            juce::AudioBuffer<float> block (buffer.getArrayOfWritePointers(), buffer.getNumChannels(), 0, n);
+            processor.processBlock (block, midi);
+
+            deadline += 1000.0 * n / sampleRate;
+            const auto wait = deadline - juce::Time::getMillisecondCounterHiRes();
+            if (wait > 1.0)
+                juce::Thread::sleep (int (wait));
+        }
+    }
+
+private:
+    juce::AudioProcessor& processor;
+    double sampleRate;
+    int maxBlockSize;
+    juce::AudioBuffer<float> buffer;
+};
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    const juce::ScopedJuceInitialiser_GUI juceInitialiser;
+    const int seconds = argc > 1 ? juce::jmax (1, juce::String (argv[1]).getIntValue()) : 5;
+
+    std::unique_ptr<juce::AudioProcessor> processor (createPluginFilter());
+    auto& parameters = processor->getParameters();
+    juce::Random random (1);
+    int numViolations = 0;
+
+    for (double sampleRate : { 44100.0, 48000.0, 96000.0 })
+    {
+        for (int maxBlockSize : { 32, 256, 2048 })
+        {
+            processor->setRateAndBufferSizeDetails (sampleRate, maxBlockSize);
+            processor->prepareToPlay (sampleRate, maxBlockSize);
+            RtAudit::resetViolations();
+
+            AudioThread audio (*processor, sampleRate, maxBlockSize);
+            if (! audio.startRealtimeThread (juce::Thread::RealtimeOptions{}))
+                audio.startThread (juce::Thread::Priority::highest);
+
+            // (a parameter moves every half second, the IRs are calculated
+            // again meanwhile)
+            for (int i = 0; i < 2 * seconds; i++)
+            {
+                juce::MessageManager::getInstance()->runDispatchLoopUntil (500);
+                if (! parameters.isEmpty())
+                    parameters[random.nextInt (parameters.size())]->setValueNotifyingHost (random.nextFloat());
+            }
+
+            audio.stopThread (5000);
+            const int n = RtAudit::checkViolations();
+            std::cout << sampleRate << " Hz, blocks of up to " << maxBlockSize << " samples : "
+                      << n << " violations" << std::endl;
+            numViolations += n;
+            processor->releaseResources();
+        }
+    }
+
+    processor = nullptr;
+    return numViolations > 0 ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+namespace Gui
+{
+  // Line of text drawn over another component (e.g. the metrics of the
+  // IR over its progress bar), refreshed twice a second. It lets the
+  // mouse through.
+  class InfoOverlay : public juce::Component, public juce::Timer
+  {
+  public:
+    InfoOverlay(std::function<juce::String()>&& textFunction, juce::Justification j = juce::Justification::centredLeft)
+      : textSupplier(std::move(textFunction)), justification(j)
+    {
+      setInterceptsMouseClicks(false, false);
+      startTimerHz(2);
+    }
+
+    void paint(juce::Graphics& g) override
+    {
+      const auto bounds = getLocalBounds().reduced(10).toFloat();
+
+      g.setColour(juce::Colours::white);
+      g.setFont(juce::jmin(11.f, bounds.getHeight()));
+      g.drawText(text, bounds.reduced(5.f, 0.f), justification, true);
+    }
+
+    void timerCallback() override
+    {
+      const auto newText = textSupplier();
+      if (newText != text)
+      {
+        text = newText;
+        repaint();
+      }
+    }
+
+  private:
+    std::function<juce::String()> textSupplier;
+    juce::String text;
+    juce::Justification justification;
+  };
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "../dsp/LoadMeter.h"
+#include "../dsp/TraceLog.h"
+
+namespace Gui
+{
+  // Load of the audio thread of an instance : the mean load of the
+  // sections of processBlock (stacked, the rest in grey), a mark at the
+  // 99th percentile, and the statistics with the number of blocks that
+  // have missed their deadline. A click writes the trace of the
+  // calculations, when it is recorded (see TraceLog).
+  class LoadBar : public juce::Component, public juce::Timer
+  {
+  public:
+    LoadBar(const LoadMeter& m) : meter(m)
+    {
+      startTimerHz(5);
+    }
+
+    void paint(juce::Graphics& g) override
+    {
+      static const juce::Colour colours[LoadMeter::numSections] = {
+        juce::Colours::green, juce::Colours::olive, juce::Colours::teal, juce::Colours::slategrey };
+
+      const auto s = meter.getSnapshot();
+      const auto bounds = getLocalBounds().reduced(10).toFloat();
+      const auto width = bounds.getWidth();
+
+      g.setColour(juce::Colours::black);
+      g.fillRoundedRectangle(bounds, 5.0f);
+
+      auto x = bounds.getX();
+      auto addSegment = [&] (float load, juce::Colour colour)
+      {
+        const auto w = juce::jlimit(0.f, bounds.getRight()-x, load*width);
+        g.setColour(colour);
+        g.fillRect(juce::Rectangle<float>(x, bounds.getY(), w, bounds.getHeight()));
+        x += w;
+      };
+      float sum = 0.f;
+      for (int i=0; i<LoadMeter::numSections; i++)
+      {
+        addSegment(s.sections[i].mean, colours[i]);
+        sum += s.sections[i].mean;
+      }
+      addSegment(juce::jmax(0.f, s.total.mean-sum), juce::Colours::darkgrey);
+
+      g.setColour(s.total.p99 > 1.f ? juce::Colours::red : juce::Colours::white);
+      const auto p99 = bounds.getX() + juce::jmin(1.f, s.total.p99)*width;
+      g.drawVerticalLine(juce::roundToInt(p99), bounds.getY(), bounds.getBottom());
+
+      g.setColour(s.numOverBudget > 0 ? juce::Colours::orange : juce::Colours::white);
+      g.setFont(juce::jmin(12.f, bounds.getHeight()));
+      g.drawText(juce::String("CPU ") + juce::String(juce::roundToInt(100.f*s.total.mean)) + "% (p99 "
+                 + juce::String(juce::roundToInt(100.f*s.total.p99)) + "%, max "
+                 + juce::String(juce::roundToInt(100.f*s.total.max)) + "%), late blocks : "
+                 + juce::String(s.numOverBudget),
+                 bounds.reduced(5.f, 0.f), juce::Justification::centredLeft, true);
+    }
+
+    void timerCallback() override
+    {
+      repaint();
+    }
+
+    void mouseUp(const juce::MouseEvent&) override
+    {
+      if (TraceLog::isEnabled())
+        TraceLog::writeChromeTrace(TraceLog::getDefaultFile());
+    }
+
+  private:
+    const LoadMeter& meter;
+  };
+}
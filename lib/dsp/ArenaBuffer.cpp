@@ -0,0 +1,110 @@
+#include "ArenaBuffer.h"
+#include "Log.h"
+#include "TraceLog.h"
+
+#include <new>
+
+#if JUCE_WINDOWS
+ #define NOMINMAX
+ #include <windows.h>
+#else
+ #include <sys/mman.h>
+#endif
+
+// Pages of at least bytes, aligned on a page, zeroed and faulted in
+// (the large pages of Windows need a privilege that the hosts don't
+// have, so they are not asked for)
+static void* allocatePages(size_t bytes)
+{
+#if JUCE_WINDOWS
+  void* p = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (p == nullptr)
+    throw std::bad_alloc();
+#else
+  void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::bad_alloc();
+ #ifdef MADV_HUGEPAGE
+  // (transparent huge pages, if they are enabled on demand)
+  if (bytes >= ARENA_HUGEPAGESIZE)
+    madvise(p, bytes, MADV_HUGEPAGE);
+ #endif
+#endif
+  for (size_t i=0; i<bytes; i+=ARENA_PAGESIZE)
+    static_cast<volatile char*>(p)[i] = 0;
+  return p;
+}
+
+static void freePages(void* p, size_t bytes)
+{
+#if JUCE_WINDOWS
+  juce::ignoreUnused(bytes);
+  VirtualFree(p, 0, MEM_RELEASE);
+#else
+  munmap(p, bytes);
+#endif
+}
+
+ArenaBuffer::~ArenaBuffer()
+{
+  release();
+}
+
+juce::AudioBuffer<float>& ArenaBuffer::prepare(int numChannels, int numSamples, int capacity)
+{
+  jassert(numChannels <= ARENA_MAXCHANNELS);
+  const int newCapacity = juce::jmax(numSamples, capacity);
+  if (numChannels > numAllocatedChannels || numSamples > channelSize
+      || (capacity > 0 && channelSize > 2*newCapacity))
+  {
+    release();
+    allocate(numChannels, newCapacity);
+    // (nothing to refer to)
+    if (data == nullptr)
+      return buffer;
+  }
+  else
+  {
+    // (the samples after them have not been written)
+    for (int c=0; c<buffer.getNumChannels(); c++)
+      juce::FloatVectorOperations::clear(channels[c], buffer.getNumSamples());
+  }
+
+  buffer.setDataToReferTo(channels, numChannels, numSamples);
+  return buffer;
+}
+
+void ArenaBuffer::release()
+{
+  buffer = juce::AudioBuffer<float>();
+  if (data != nullptr)
+    freePages(data, allocatedBytes);
+  data = nullptr;
+  allocatedBytes = 0;
+  numAllocatedChannels = 0;
+  channelSize = 0;
+  std::fill(std::begin(channels), std::end(channels), nullptr);
+}
+
+void ArenaBuffer::allocate(int numChannels, int capacity)
+{
+  if (numChannels == 0 || capacity == 0)
+    return;
+
+  TraceLog::Scope trace("allocate");
+  // (each channel starts on ARENA_ALIGNMENT bytes)
+  const size_t floatsPerAlignment = ARENA_ALIGNMENT/sizeof(float);
+  const size_t stride = (size_t(capacity)+floatsPerAlignment-1)/floatsPerAlignment*floatsPerAlignment;
+  size_t bytes = size_t(numChannels)*stride*sizeof(float);
+  // (whole huge pages, or whole pages)
+  const size_t pageSize = bytes >= ARENA_HUGEPAGESIZE ? ARENA_HUGEPAGESIZE : ARENA_PAGESIZE;
+  bytes = (bytes+pageSize-1)/pageSize*pageSize;
+
+  data = allocatePages(bytes);
+  allocatedBytes = bytes;
+  numAllocatedChannels = numChannels;
+  channelSize = capacity;
+  for (int c=0; c<numChannels; c++)
+    channels[c] = static_cast<float*>(data)+size_t(c)*stride;
+  LOG_DEBUG("Buffer of " << double(bytes)/1048576.0 << " MB allocated for " << capacity << " samples");
+}
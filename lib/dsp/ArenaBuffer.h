@@ -0,0 +1,49 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+
+// Alignment of the channels (bytes)
+#define ARENA_ALIGNMENT 64
+#define ARENA_MAXCHANNELS 4
+// Stride of the touches that fault the memory in (the smallest page
+// size), and size of the huge pages (bytes)
+#define ARENA_PAGESIZE 4096
+#define ARENA_HUGEPAGESIZE 2097152
+
+// ==================================================================
+// Buffer of a calculator, kept from an IR to the next : its memory is
+// allocated once for capacity samples (the longest IR expected, with
+// aligned channels, in huge pages where the system provides them) and
+// faulted in at once, then each calculation only clears the samples
+// prepared by the previous one, the rest being still zero. The
+// calculations write through a juce::AudioBuffer which refers to it.
+class ArenaBuffer
+{
+public:
+  ArenaBuffer() = default;
+  ~ArenaBuffer();
+
+  // Zeroes the first numSamples of numChannels channels and returns them
+  // (the memory is allocated again if it is too small, or more than
+  // twice capacity, after a change of sample rate)
+  juce::AudioBuffer<float>& prepare(int numChannels, int numSamples, int capacity);
+  // The samples of the last prepare()
+  juce::AudioBuffer<float>& getBuffer() { return buffer; }
+  const juce::AudioBuffer<float>& getBuffer() const { return buffer; }
+  // Frees the memory, the next prepare() allocates it again
+  void release();
+  // Memory held (any thread)
+  size_t getSizeInBytes() const { return allocatedBytes; }
+
+private:
+  void allocate(int numChannels, int capacity);
+
+  void* data{nullptr};
+  std::atomic<size_t> allocatedBytes{0};
+  float* channels[ARENA_MAXCHANNELS]{};
+  int numAllocatedChannels{0}, channelSize{0};
+  juce::AudioBuffer<float> buffer;
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ArenaBuffer)
+};
@@ -0,0 +1,65 @@
+#include "CpuSafety.h"
+
+void CpuSafety::prepare(double rate)
+{
+  sampleRate = rate;
+  load = 0.0;
+  sinceChange = SAFETY_HOLDTIME;
+  sinceHighLoad = 0.0;
+  level = 0;
+  numDegradations = 0;
+  publishedLoad = 0.f;
+}
+
+void CpuSafety::startBlock()
+{
+  startTicks = juce::Time::getHighResolutionTicks();
+}
+
+int CpuSafety::endBlock(int numSamples, int maxLevel)
+{
+  if (numSamples <= 0)
+    return level.load();
+
+  const double duration = double(numSamples)/sampleRate;
+  const double elapsed = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks()-startTicks);
+  const double blockLoad = elapsed/duration;
+
+  // (one pole smoothing, over the time and not over the blocks)
+  const double a = std::exp(-duration/SAFETY_LOADTIME);
+  load = a*load + (1.0-a)*blockLoad;
+  publishedLoad = float(load);
+  sinceChange += duration;
+  sinceHighLoad = load > SAFETY_LOWLOAD ? 0.0 : sinceHighLoad+duration;
+
+  int l = juce::jmin(level.load(), maxLevel);
+  if ((load > SAFETY_HIGHLOAD || blockLoad > 1.0) && l < maxLevel && sinceChange >= SAFETY_HOLDTIME)
+  {
+    l++;
+    numDegradations++;
+    sinceChange = sinceHighLoad = 0.0;
+  }
+  else if (l > 0 && sinceHighLoad >= SAFETY_RESTORETIME)
+  {
+    l--;
+    sinceChange = sinceHighLoad = 0.0;
+  }
+
+  level = l;
+  return l;
+}
+
+int CpuSafety::getLevel() const
+{
+  return level.load();
+}
+
+float CpuSafety::getLoad() const
+{
+  return publishedLoad.load();
+}
+
+int CpuSafety::getNumDegradations() const
+{
+  return numDegradations.load();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// Choices of the "CPU Safety" parameter : the highest safety level of the
+// convolutions that can be used (see CONV_SAFETYFLOORS)
+#define SAFETY_CHOICES {"Off", "Moderate", "Strong"}
+// Load of the audio thread (time spent in processBlock over the duration
+// of the block) above which the IR tails are shortened, and below which
+// they are restored
+#define SAFETY_HIGHLOAD 0.6
+#define SAFETY_LOWLOAD 0.25
+// Time constant of the smoothing of the load (seconds)
+#define SAFETY_LOADTIME 0.05
+// Shortest time between two degradations (seconds), and time the load
+// must stay low before a level is restored (seconds)
+#define SAFETY_HOLDTIME 0.5
+#define SAFETY_RESTORETIME 3.0
+
+// ==================================================================
+// Protection against the xruns when the host gets close to its
+// deadline : the processor times its processBlock against the duration
+// of the block. When the load is too high, or when a block has taken
+// longer than its duration, the tails of the IRs are shortened one
+// level further (the convolutions crossfade to fewer partitions); they
+// are restored one level at a time once the load has been low for a
+// while. The state can be read from any thread.
+class CpuSafety
+{
+public:
+  void prepare(double sampleRate);
+
+  // Called from the audio thread, at the start and at the end of
+  // processBlock : returns the safety level to apply to the convolutions
+  // (at most maxLevel, 0 to keep the full IRs)
+  void startBlock();
+  int endBlock(int numSamples, int maxLevel);
+
+  int getLevel() const;
+  // (smoothed load, 1 when processBlock takes the whole block duration)
+  float getLoad() const;
+  // Number of times the IRs have been shortened since prepare()
+  int getNumDegradations() const;
+
+private:
+  double sampleRate{44100.0};
+  juce::int64 startTicks{0};
+  // (audio thread, in seconds)
+  double load{0.0}, sinceChange{0.0}, sinceHighLoad{0.0};
+
+  std::atomic<int> level{0}, numDegradations{0};
+  std::atomic<float> publishedLoad{0.f};
+};
@@ -0,0 +1,241 @@
+#include "IrDiskCache.h"
+#include "Log.h"
+
+static const char irFileMagic[8] = {'B','i','R','R','-','I','R','\0'};
+
+// Number of floats of a channel, padded to 64 bytes
+static size_t getChannelStride(juce::uint32 numSamples)
+{
+  return (size_t(numSamples)+15) & ~size_t(15);
+}
+
+static size_t getPayloadSize(juce::uint32 numBoxChannels, juce::uint32 numBoxSamples)
+{
+  return sizeof(float) * numBoxChannels*getChannelStride(numBoxSamples);
+}
+
+// ======================================================================
+
+IrDiskCache::IrDiskCache() : juce::Thread("IR disk cache"), directory(getDefaultDirectory())
+{
+
+}
+
+IrDiskCache::~IrDiskCache()
+{
+  stopThread(2000);
+}
+
+juce::File IrDiskCache::getDefaultDirectory()
+{
+ #if JUCE_LINUX
+  auto xdgCache = juce::SystemStats::getEnvironmentVariable("XDG_CACHE_HOME", {});
+  if (xdgCache.isNotEmpty())
+    return juce::File(xdgCache).getChildFile("BiRR");
+  return juce::File::getSpecialLocation(juce::File::userHomeDirectory).getChildFile(".cache/BiRR");
+ #else
+  return juce::File::getSpecialLocation(juce::File::userApplicationDataDirectory).getChildFile("BiRR/Cache");
+ #endif
+}
+
+juce::File IrDiskCache::getDirectory() const
+{
+  return directory;
+}
+
+juce::File IrDiskCache::getFile(juce::uint64 key) const
+{
+  return directory.getChildFile(juce::String::toHexString(juce::int64(key)).paddedLeft('0',16) + ".ir");
+}
+
+bool IrDiskCache::contains(juce::uint64 key)
+{
+  return getFile(key).existsAsFile();
+}
+
+void IrDiskCache::setMaxSizeInBytes(juce::int64 maxBytes)
+{
+  maxSizeInBytes = maxBytes;
+}
+
+// ======================================================================
+
+std::shared_ptr<const IrSnapshot> IrDiskCache::read(juce::uint64 key)
+{
+  auto file = getFile(key);
+  if (!file.existsAsFile())
+    return nullptr;
+
+  auto mappedFile = std::make_shared<juce::MemoryMappedFile>(file, juce::MemoryMappedFile::readOnly);
+  auto* data = static_cast<const char*>(mappedFile->getData());
+  auto size = mappedFile->getSize();
+
+  bool isValid = data != nullptr && size >= sizeof(IrFileHeader);
+  IrFileHeader header;
+  if (isValid)
+  {
+    memcpy(&header, data, sizeof(IrFileHeader));
+    isValid = memcmp(header.magic, irFileMagic, sizeof(irFileMagic)) == 0
+              && header.version == IRDISKCACHE_VERSION
+              && header.key == key
+              && header.payloadSize == getPayloadSize(header.numBoxChannels, header.numBoxSamples)
+              && size == sizeof(IrFileHeader) + header.payloadSize
+              && getChecksum(data + sizeof(IrFileHeader), header.payloadSize) == header.checksum;
+  }
+
+  if (!isValid)
+  {
+    LOG_WARNING("Corrupted IR file removed : " << file.getFullPathName());
+    mappedFile = nullptr;
+    file.deleteFile();
+    return nullptr;
+  }
+
+  // The buffers point directly to the mapped file
+  auto ir = std::make_shared<IrSnapshot>();
+  ir->key = key;
+  ir->sampleRate = header.sampleRate;
+  ir->mappedFile = mappedFile;
+
+  auto* samples = reinterpret_cast<float*>(const_cast<char*>(data) + sizeof(IrFileHeader));
+  std::vector<float*> channels;
+
+  auto stride = getChannelStride(header.numBoxSamples);
+  for (juce::uint32 i=0; i<header.numBoxChannels; i++)
+    channels.push_back(samples + i*stride);
+  ir->box.setDataToReferTo(channels.data(), int(header.numBoxChannels), int(header.numBoxSamples));
+
+  // Used as the LRU time stamp
+  file.setLastModificationTime(juce::Time::getCurrentTime());
+
+  return ir;
+}
+
+void IrDiskCache::write(std::shared_ptr<const IrSnapshot> ir)
+{
+  if (ir == nullptr || ir->mappedFile != nullptr)
+    return;
+
+  {
+    const juce::ScopedLock sl(queueLock);
+    for (auto& q : queue)
+      if (q->key == ir->key)
+        return;
+    queue.push_back(ir);
+  }
+
+  if (!isThreadRunning())
+    startThread(juce::Thread::Priority::background);
+  notify();
+}
+
+void IrDiskCache::run()
+{
+  while (!threadShouldExit())
+  {
+    std::shared_ptr<const IrSnapshot> ir;
+    {
+      const juce::ScopedLock sl(queueLock);
+      if (!queue.empty())
+      {
+        ir = queue.front();
+        queue.pop_front();
+      }
+    }
+
+    if (ir == nullptr)
+    {
+      wait(-1);
+      continue;
+    }
+
+    if (!contains(ir->key) && writeFile(*ir))
+      removeOldFiles();
+  }
+}
+
+// ======================================================================
+
+bool IrDiskCache::writeFile(const IrSnapshot& ir)
+{
+  if (!directory.createDirectory())
+    return false;
+
+  IrFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, irFileMagic, sizeof(irFileMagic));
+  header.version = IRDISKCACHE_VERSION;
+  header.numBoxChannels = juce::uint32(ir.box.getNumChannels());
+  header.numBoxSamples = juce::uint32(ir.box.getNumSamples());
+  header.key = ir.key;
+  header.sampleRate = ir.sampleRate;
+  header.payloadSize = getPayloadSize(header.numBoxChannels, header.numBoxSamples);
+
+  // Payload with each channel padded to 64 bytes
+  juce::HeapBlock<char> payload(header.payloadSize, true);
+  auto* samples = reinterpret_cast<float*>(payload.get());
+  auto stride = getChannelStride(header.numBoxSamples);
+  for (int i=0; i<ir.box.getNumChannels(); i++)
+    memcpy(samples + i*stride, ir.box.getReadPointer(i), sizeof(float)*header.numBoxSamples);
+
+  header.checksum = getChecksum(payload.get(), header.payloadSize);
+
+  // Written to a temporary file first, so that a partially written
+  // file is never seen by the readers (its extension keeps it out of
+  // the files counted and deleted by removeOldFiles)
+  auto file = getFile(ir.key);
+  juce::TemporaryFile temp(file, file.withFileExtension(".tmp").getNonexistentSibling());
+  {
+    juce::FileOutputStream out(temp.getFile());
+    if (out.failedToOpen()
+        || !out.write(&header, sizeof(header))
+        || !out.write(payload.get(), header.payloadSize))
+      return false;
+    out.flush();
+  }
+  return temp.overwriteTargetFileWithTemporary();
+}
+
+// Deletes the least recently used files until the directory fits in its
+// limit (and the temporary files left by a crash)
+void IrDiskCache::removeOldFiles()
+{
+  const auto lastDay = juce::Time::getCurrentTime() - juce::RelativeTime::days(1);
+  for (auto& f : directory.findChildFiles(juce::File::findFiles, false, "*.tmp"))
+    if (f.getLastModificationTime() < lastDay)
+      f.deleteFile();
+
+  auto files = directory.findChildFiles(juce::File::findFiles, false, "*.ir");
+
+  juce::int64 totalSize = 0;
+  for (auto& f : files)
+    totalSize += f.getSize();
+
+  if (totalSize <= maxSizeInBytes)
+    return;
+
+  std::sort(files.begin(), files.end(), [](const juce::File& a, const juce::File& b)
+            { return a.getLastModificationTime() < b.getLastModificationTime(); });
+
+  for (auto& f : files)
+  {
+    if (totalSize <= maxSizeInBytes)
+      break;
+    auto fileSize = f.getSize();
+    if (f.deleteFile())
+      totalSize -= fileSize;
+  }
+}
+
+// 64 bits FNV-1a, one word at a time (the payload size is a multiple of 64 bytes)
+juce::uint64 IrDiskCache::getChecksum(const void* data, size_t size)
+{
+  auto* words = static_cast<const juce::uint64*>(data);
+  juce::uint64 hash = 14695981039346656037ull;
+  for (size_t i=0; i<size/sizeof(juce::uint64); i++)
+  {
+    hash ^= words[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
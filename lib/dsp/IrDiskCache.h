@@ -0,0 +1,66 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "IrStore.h"
+
+#include <deque>
+
+// Maximum size of the cache directory
+#define IRDISKCACHE_MAXBYTES (juce::int64(2)<<30)
+#define IRDISKCACHE_VERSION 2
+
+// ==================================================================
+// Header of a cached IR file. It is followed by the box channels,
+// each starting on a 64 bytes boundary, so the file can be mapped in
+// memory and used as is.
+struct IrFileHeader
+{
+  char magic[8];
+  juce::uint32 version;
+  juce::uint32 numBoxChannels;
+  juce::uint32 numBoxSamples;
+  juce::uint32 reserved[3];
+  juce::uint64 key;
+  double sampleRate;
+  juce::uint64 checksum;
+  juce::uint64 payloadSize;
+};
+
+static_assert(sizeof(IrFileHeader) == 64, "IrFileHeader must be 64 bytes long");
+
+// ==================================================================
+// IRs saved on disk (in ~/.cache/BiRR on Linux), so that they don't
+// have to be calculated again when a session is reopened.
+// Files are written by a background thread, to temporary files (.tmp)
+// renamed once complete. The least recently used files are deleted
+// when the directory exceeds its size limit.
+class IrDiskCache : public juce::Thread
+{
+public:
+  IrDiskCache();
+  ~IrDiskCache() override;
+  void run() override;
+
+  // Returns nullptr if the file doesn't exist or is corrupted
+  std::shared_ptr<const IrSnapshot> read(juce::uint64 key);
+  bool contains(juce::uint64 key);
+  // Queues the IR to be written (if it is not already on disk)
+  void write(std::shared_ptr<const IrSnapshot> ir);
+
+  void setMaxSizeInBytes(juce::int64 maxBytes);
+  juce::File getDirectory() const;
+  static juce::File getDefaultDirectory();
+
+private:
+  juce::File directory;
+  juce::int64 maxSizeInBytes{IRDISKCACHE_MAXBYTES};
+  juce::CriticalSection queueLock;
+  std::deque<std::shared_ptr<const IrSnapshot>> queue;
+
+  juce::File getFile(juce::uint64 key) const;
+  bool writeFile(const IrSnapshot& ir);
+  void removeOldFiles();
+  static juce::uint64 getChecksum(const void* data, size_t size);
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (IrDiskCache)
+};
@@ -0,0 +1,108 @@
+#include "IrMetrics.h"
+
+const char* IrMetrics::getPhaseName(Phase phase)
+{
+  static const char* const names[numPhases] = { "geometry", "filtering", "splat", "reduction", "transfer" };
+  return names[phase];
+}
+
+void IrMetrics::addCalculators(const IrCalculatorCounters* counters, int num)
+{
+  const double secondsPerTick = 1.0/double(juce::Time::getHighResolutionTicksPerSecond());
+  juce::int64 firstStart = 0, lastEnd = 0, busyTicks = 0;
+
+  for (int i=0; i<num; i++)
+  {
+    const auto& c = counters[i];
+    const auto numRendered = c.numImages-c.numCulled;
+    numImages += c.numImages;
+    numCulled += c.numCulled;
+    numSplatted += numRendered;
+    peakMemory += c.memory;
+
+    // (the untimed images are assumed to cost the same as the timed ones)
+    const double scale = c.numTimed > 0 ? double(numRendered)/double(c.numTimed) : 0.0;
+    const double render = scale*double(c.renderTicks)*secondsPerTick;
+    const double splatTime = scale*double(c.splatTicks)*secondsPerTick;
+    const double merge = double(c.mergeTicks)*secondsPerTick;
+    const double busy = double(c.endTicks-c.startTicks)*secondsPerTick;
+    phaseTimes[splat] += splatTime;
+    phaseTimes[filtering] += juce::jmax(0.0, render-splatTime);
+    phaseTimes[reduction] += merge;
+    // (the rest : the enumeration of the images and their positions)
+    phaseTimes[geometry] += juce::jmax(0.0, busy-render-merge);
+
+    busyTicks += c.endTicks-c.startTicks;
+    firstStart = i == 0 ? c.startTicks : juce::jmin(firstStart, c.startTicks);
+    lastEnd = juce::jmax(lastEnd, c.endTicks);
+  }
+
+  numThreads += num;
+  calculationTime = double(lastEnd-firstStart)*secondsPerTick;
+  if (lastEnd > firstStart)
+    threadUtilisation = double(busyTicks)/(double(num)*double(lastEnd-firstStart));
+}
+
+void IrMetrics::addPart(const IrMetrics& part)
+{
+  for (int i=0; i<numPhases; i++)
+    phaseTimes[i] += part.phaseTimes[i];
+  numImages += part.numImages;
+  numSplatted += part.numSplatted;
+  numCulled += part.numCulled;
+  peakMemory += part.peakMemory;
+  if (part.numThreads > numThreads)
+  {
+    numThreads = part.numThreads;
+    calculationTime = part.calculationTime;
+    threadUtilisation = part.threadUtilisation;
+  }
+  irLength = juce::jmax(irLength, part.irLength);
+  timeToLoad = juce::jmax(timeToLoad, part.timeToLoad);
+}
+
+juce::String IrMetrics::getSummary() const
+{
+  if (key == 0)
+    return {};
+
+  juce::String s = "IR " + juce::String(double(irLength)/sampleRate, 1) + " s";
+  if (isFromStore)
+    s << ", from store";
+  else
+    s << ", " << juce::String(double(numSplatted)/1000.0, 0) << "k images"
+      << ", " << juce::String(calculationTime, 2) << " s on " << numThreads << " threads ("
+      << juce::roundToInt(100.0*threadUtilisation) << "%)"
+      << ", " << juce::String(double(peakMemory)/1048576.0, 1) << " MB";
+  s << ", loaded after " << juce::String(timeToLoad, 2) << " s";
+  return s;
+}
+
+juce::var IrMetrics::toVar() const
+{
+  auto* o = new juce::DynamicObject();
+  o->setProperty("key", juce::String::toHexString(juce::int64(key)));
+  o->setProperty("sampleRate", sampleRate);
+  o->setProperty("fromStore", isFromStore);
+  o->setProperty("irLength", irLength);
+  o->setProperty("threads", numThreads);
+  o->setProperty("images", numImages);
+  o->setProperty("imagesSplatted", numSplatted);
+  o->setProperty("imagesCulled", numCulled);
+
+  auto* phases = new juce::DynamicObject();
+  for (int i=0; i<numPhases; i++)
+    phases->setProperty(getPhaseName(Phase(i)), phaseTimes[i]);
+  o->setProperty("phaseTimes", juce::var(phases));
+
+  o->setProperty("calculationTime", calculationTime);
+  o->setProperty("threadUtilisation", threadUtilisation);
+  o->setProperty("timeToLoad", timeToLoad);
+  o->setProperty("peakMemory", juce::int64(peakMemory));
+  return juce::var(o);
+}
+
+juce::String IrMetrics::toJson() const
+{
+  return juce::JSON::toString(toVar(), true);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// One splatted image in IRMETRICS_SAMPLING is timed in detail (filtering
+// and splat), the times of the others are estimated from them
+#define IRMETRICS_SAMPLING 8
+
+// ==================================================================
+// Counters of a calculator thread, reset at the start of each of its
+// runs and only written by the thread
+class IrCalculatorCounters
+{
+public:
+  void start()
+  {
+    *this = IrCalculatorCounters();
+    startTicks = juce::Time::getHighResolutionTicks();
+  }
+  void finish()
+  {
+    endTicks = juce::Time::getHighResolutionTicks();
+  }
+
+  // Each image enumerated, culled when it isn't in the IR (rendered in
+  // real time)
+  void countImage(bool isCulled)
+  {
+    numImages++;
+    numCulled += isCulled ? 1 : 0;
+  }
+
+  // Around the filtering and the splat of an image
+  void beginRender()
+  {
+    isTiming = (numImages-numCulled)%IRMETRICS_SAMPLING == 1;
+    if (isTiming)
+    {
+      numTimed++;
+      renderStart = juce::Time::getHighResolutionTicks();
+    }
+  }
+  void endRender()
+  {
+    if (isTiming)
+      renderTicks += juce::Time::getHighResolutionTicks()-renderStart;
+  }
+
+  // Around the splats (returns the start of the splat, if it is timed)
+  juce::int64 beginSplat() const
+  {
+    return isTiming ? juce::Time::getHighResolutionTicks() : 0;
+  }
+  void endSplat(juce::int64 splatStart)
+  {
+    if (isTiming)
+      splatTicks += juce::Time::getHighResolutionTicks()-splatStart;
+  }
+
+  // Merge of the reflections calculated at the reduced rate
+  void addMergeTime(juce::int64 ticks)
+  {
+    mergeTicks += ticks;
+  }
+
+  juce::int64 numImages{0}, numCulled{0}, numTimed{0};
+  juce::int64 startTicks{0}, endTicks{0}, renderTicks{0}, splatTicks{0}, mergeTicks{0};
+  // (buffers of the thread, bytes)
+  size_t memory{0};
+
+private:
+  bool isTiming{false};
+  juce::int64 renderStart{0};
+};
+
+// ==================================================================
+// Metrics of the calculation of an IR, from the change of the parameters
+// to the load of the IR into the convolution (which takes it at its next
+// block) : cost of each phase, images, memory and use of the threads.
+// The phase times are CPU times, summed over the threads.
+class IrMetrics
+{
+public:
+  enum Phase { geometry, filtering, splat, reduction, transfer, numPhases };
+
+  static const char* getPhaseName(Phase phase);
+
+  // (called by the transfer thread, once the calculators have finished)
+  void addCalculators(const IrCalculatorCounters* counters, int num);
+  // Adds the metrics of another part of the same IR (transferred by its
+  // own thread)
+  void addPart(const IrMetrics& part);
+
+  // Compact description, for the editor
+  juce::String getSummary() const;
+  juce::var toVar() const;
+  juce::String toJson() const;
+
+  juce::uint64 key{0};
+  double sampleRate{0.0};
+  // Found in the IR store (nothing has been calculated)
+  bool isFromStore{false};
+  int numThreads{0}, irLength{0};
+  juce::int64 numImages{0}, numSplatted{0}, numCulled{0};
+  double phaseTimes[numPhases]{};
+  // Time of the calculators (from the first start to the last end), and
+  // part of it used by the threads
+  double calculationTime{0.0}, threadUtilisation{0.0};
+  // From the change of the parameters to the load of the IR (seconds)
+  double timeToLoad{0.0};
+  // Largest memory used at once by the calculation (bytes)
+  size_t peakMemory{0};
+};
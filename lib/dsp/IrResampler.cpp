@@ -0,0 +1,119 @@
+#include "IrResampler.h"
+
+// Modified Bessel function of the first kind, order 0
+static double besselI0(double x)
+{
+  double sum = 1.0, term = 1.0;
+  for (int k=1; k<50; k++)
+  {
+    term *= (x/(2*k))*(x/(2*k));
+    sum += term;
+    if (term < 1e-12*sum)
+      break;
+  }
+  return sum;
+}
+
+// Kaiser windowed sinc, at the distance x (in input samples) from the
+// output instant
+static double getKernel(double x, double cutoff, double halfWidth)
+{
+  const double beta = 8.0;
+  if (x >= halfWidth)
+    return 0.0;
+  double sinc = x == 0.0 ? 1.0 : std::sin(juce::MathConstants<double>::pi*cutoff*x)/(juce::MathConstants<double>::pi*cutoff*x);
+  double r = x/halfWidth;
+  double window = besselI0(beta*std::sqrt(1.0-r*r))/besselI0(beta);
+  return cutoff*sinc*window;
+}
+
+// ======================================================================
+
+juce::AudioBuffer<float> IrResampler::process(const juce::AudioBuffer<float>& in, double inRate, double outRate)
+{
+  const double ratio = outRate/inRate;
+  const int numIn = in.getNumSamples();
+  const int numOut = int(std::ceil(numIn*ratio));
+
+  // Lowpass cutoff (relative to the input Nyquist frequency), lowered
+  // to the output Nyquist frequency when downsampling
+  const double cutoff = RESAMPLER_CUTOFF*juce::jmin(1.0, ratio);
+  const double halfWidth = RESAMPLER_HALFZEROS/cutoff;    // in input samples
+
+  // Tabulated kernel, as a function of the distance to the output instant
+  const int tableSize = int(std::ceil(halfWidth*RESAMPLER_TABLERES))+2;
+  std::vector<float> table(size_t(tableSize), 0.f);
+  for (int i=0; i<tableSize; i++)
+    table[size_t(i)] = float(getKernel(double(i)/RESAMPLER_TABLERES, cutoff, halfWidth));
+
+  juce::AudioBuffer<float> out(in.getNumChannels(), numOut);
+  const float gain = float(inRate/outRate);
+
+  for (int c=0; c<in.getNumChannels(); c++)
+  {
+    auto* x = in.getReadPointer(c);
+    auto* y = out.getWritePointer(c);
+    for (int n=0; n<numOut; n++)
+    {
+      const double t = n/ratio;
+      const int kmin = juce::jmax(0, int(std::ceil(t-halfWidth)));
+      const int kmax = juce::jmin(numIn-1, int(std::floor(t+halfWidth)));
+      double acc = 0.0;
+      for (int k=kmin; k<=kmax; k++)
+      {
+        const double pos = std::abs(t-k)*RESAMPLER_TABLERES;
+        const int i = int(pos);
+        const float frac = float(pos-i);
+        acc += x[k]*(table[size_t(i)]+frac*(table[size_t(i+1)]-table[size_t(i)]));
+      }
+      y[n] = gain*float(acc);
+    }
+  }
+  return out;
+}
+
+// The output samples of each phase (n = m*factor+phase) are the input
+// filtered by the kernel shifted by phase/factor
+void IrResampler::addUpsampled(const juce::AudioBuffer<float>& in, int factor, int startSample, juce::AudioBuffer<float>& out, int offset)
+{
+  const int numIn = in.getNumSamples();
+  const int numOut = out.getNumSamples()-offset;
+  const int numChannels = juce::jmin(in.getNumChannels(), out.getNumChannels());
+  if (startSample >= numIn)
+    return;
+
+  const double cutoff = RESAMPLER_CUTOFF;
+  const double halfWidth = RESAMPLER_HALFZEROS/cutoff;
+  const int maxTap = int(std::ceil(halfWidth));
+  std::vector<float> phaseOutput(size_t(numIn+2*maxTap));
+
+  for (int phase=0; phase<factor; phase++)
+  {
+    const double shift = double(phase)/factor;
+    const int minTap = -maxTap;
+    const int mStart = juce::jmax(0, startSample+minTap);
+    const int mEnd = juce::jmin((numOut-phase+factor-1)/factor, numIn+maxTap);
+    if (mEnd <= mStart)
+      continue;
+
+    for (int c=0; c<numChannels; c++)
+    {
+      auto* x = in.getReadPointer(c);
+      std::fill(phaseOutput.begin(), phaseOutput.begin()+(mEnd-mStart), 0.f);
+
+      // (output m gets the input m-j with the weight of the distance j+shift)
+      for (int j=minTap; j<=maxTap; j++)
+      {
+        const float w = float(getKernel(std::abs(j+shift), cutoff, halfWidth)/factor);
+        const int kStart = juce::jmax(startSample, mStart-j);
+        const int kEnd = juce::jmin(numIn, mEnd-j);
+        if (w != 0.f && kEnd > kStart)
+          juce::FloatVectorOperations::addWithMultiply(phaseOutput.data()+(kStart+j-mStart), x+kStart, w, kEnd-kStart);
+      }
+
+      auto* y = out.getWritePointer(c)+offset;
+      for (int m=mStart; m<mEnd; m++)
+        y[m*factor+phase] += phaseOutput[size_t(m-mStart)];
+    }
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// Number of zero crossings of the interpolation kernel on each side
+#define RESAMPLER_HALFZEROS 32
+// Kernel table resolution (points per input sample)
+#define RESAMPLER_TABLERES 512
+// Lowpass cutoff, relative to the lowest Nyquist frequency
+#define RESAMPLER_CUTOFF 0.95
+
+// ==================================================================
+// High quality (Kaiser windowed sinc) sample rate conversion of IRs,
+// used to keep playing a correct sounding IR while the exact one is
+// calculated at the new sample rate.
+// The IR is scaled by inRate/outRate, so that the gain of the
+// convolution doesn't depend on the sample rate.
+class IrResampler
+{
+public:
+  static juce::AudioBuffer<float> process(const juce::AudioBuffer<float>& in, double inRate, double outRate);
+
+  // Adds an IR calculated at 1/factor of the sample rate of out (from
+  // its sample startSample, the previous ones being zero), delayed by
+  // offset samples of out, with the scaling of process()
+  static void addUpsampled(const juce::AudioBuffer<float>& in, int factor, int startSample, juce::AudioBuffer<float>& out, int offset = 0);
+};
@@ -0,0 +1,113 @@
+#include "IrState.h"
+#include "Log.h"
+
+const juce::Identifier IrState::embeddedIrType{"EmbeddedIR"};
+
+// ======================================================================
+
+juce::ValueTree IrState::toValueTree(const IrSnapshot& ir, const juce::String& slot)
+{
+  juce::MemoryBlock data;
+  {
+    juce::MemoryOutputStream mos(data, false);
+    juce::GZIPCompressorOutputStream zip(mos, 9);
+    writeBuffer(zip, ir.box);
+    zip.flush();
+  }
+
+  juce::ValueTree tree(embeddedIrType);
+  tree.setProperty("slot", slot, nullptr);
+  tree.setProperty("key", juce::String::toHexString(juce::int64(ir.key)), nullptr);
+  tree.setProperty("sampleRate", ir.sampleRate, nullptr);
+  tree.setProperty("boxChannels", ir.box.getNumChannels(), nullptr);
+  tree.setProperty("boxSamples", ir.box.getNumSamples(), nullptr);
+  tree.setProperty("data", data, nullptr);
+  return tree;
+}
+
+std::shared_ptr<const IrSnapshot> IrState::fromValueTree(const juce::ValueTree& tree)
+{
+  if (!tree.hasType(embeddedIrType))
+    return nullptr;
+
+  auto* data = tree.getProperty("data").getBinaryData();
+  if (data == nullptr)
+    return nullptr;
+
+  auto ir = std::make_shared<IrSnapshot>();
+  ir->key = juce::uint64(tree.getProperty("key").toString().getHexValue64());
+  ir->sampleRate = tree.getProperty("sampleRate");
+  if (!(ir->sampleRate > 0.0 && ir->sampleRate <= IRSTATE_MAXSAMPLERATE))
+  {
+    LOG_WARNING("Embedded IR with an invalid sample rate");
+    return nullptr;
+  }
+
+  juce::MemoryInputStream mis(*data, false);
+  juce::GZIPDecompressorInputStream unzip(mis);
+  // (the direct path IR that follows in the states of earlier versions
+  // is ignored)
+  if (!readBuffer(unzip, ir->box, tree.getProperty("boxChannels"), tree.getProperty("boxSamples"), int(IRSTATE_MAXTIME*ir->sampleRate)))
+  {
+    LOG_WARNING("Embedded IR could not be read");
+    return nullptr;
+  }
+  return ir;
+}
+
+std::map<juce::String, std::shared_ptr<const IrSnapshot>> IrState::extractAll(juce::ValueTree& state)
+{
+  std::map<juce::String, std::shared_ptr<const IrSnapshot>> irs;
+  for (int i = state.getNumChildren()-1; i >= 0; i--)
+  {
+    auto child = state.getChild(i);
+    if (child.hasType(embeddedIrType))
+    {
+      if (auto ir = fromValueTree(child))
+        irs[child.getProperty("slot").toString()] = ir;
+      state.removeChild(i, nullptr);
+    }
+  }
+  return irs;
+}
+
+// ======================================================================
+
+// Each channel is written as four planes : all the first bytes of the
+// samples, then all the second bytes, etc.
+void IrState::writeBuffer(juce::OutputStream& out, const juce::AudioBuffer<float>& buffer)
+{
+  auto numSamples = size_t(buffer.getNumSamples());
+  juce::HeapBlock<juce::uint8> planes(4*numSamples);
+
+  for (int c=0; c<buffer.getNumChannels(); c++)
+  {
+    auto* bytes = reinterpret_cast<const juce::uint8*>(buffer.getReadPointer(c));
+    for (size_t i=0; i<numSamples; i++)
+      for (size_t b=0; b<4; b++)
+        planes[b*numSamples+i] = bytes[4*i+b];
+    out.write(planes.get(), 4*numSamples);
+  }
+}
+
+// (the sizes are checked before anything is allocated)
+bool IrState::readBuffer(juce::InputStream& in, juce::AudioBuffer<float>& buffer, int numChannels, int numSamples, int maxSamples)
+{
+  if (numChannels <= 0 || numChannels > IRSTATE_MAXCHANNELS || numSamples <= 0 || numSamples > maxSamples)
+    return false;
+
+  buffer.setSize(numChannels, numSamples);
+  auto n = size_t(numSamples);
+  juce::HeapBlock<juce::uint8> planes(4*n);
+
+  for (int c=0; c<numChannels; c++)
+  {
+    if (in.read(planes.get(), 4*numSamples) != 4*numSamples)
+      return false;
+    auto* bytes = reinterpret_cast<juce::uint8*>(buffer.getWritePointer(c));
+    for (size_t i=0; i<n; i++)
+      for (size_t b=0; b<4; b++)
+        bytes[4*i+b] = planes[b*n+i];
+  }
+  return true;
+}
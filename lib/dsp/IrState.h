@@ -0,0 +1,36 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "IrStore.h"
+
+#include <map>
+
+// Largest IRs read from a state, which can't be trusted : number of
+// channels, duration at their sample rate (the longest IRs of the rooms
+// last less than 10 s) and sample rate
+#define IRSTATE_MAXCHANNELS 8
+#define IRSTATE_MAXTIME 12.0
+#define IRSTATE_MAXSAMPLERATE 384000.0
+
+// ==================================================================
+// Conversion of finished IRs to and from ValueTrees, so that they can
+// be saved with the plugin state.
+// Samples are stored losslessly : the bytes of the floats are grouped
+// by significance before being compressed with zlib, which is much
+// more efficient than compressing the raw floats.
+class IrState
+{
+public:
+  static const juce::Identifier embeddedIrType;
+
+  static juce::ValueTree toValueTree(const IrSnapshot& ir, const juce::String& slot);
+  static std::shared_ptr<const IrSnapshot> fromValueTree(const juce::ValueTree& tree);
+
+  // Removes the embedded IRs from a plugin state and returns them by
+  // slot (the ones that could not be read are dropped)
+  static std::map<juce::String, std::shared_ptr<const IrSnapshot>> extractAll(juce::ValueTree& state);
+
+private:
+  static void writeBuffer(juce::OutputStream& out, const juce::AudioBuffer<float>& buffer);
+  static bool readBuffer(juce::InputStream& in, juce::AudioBuffer<float>& buffer, int numChannels, int numSamples, int maxSamples);
+};
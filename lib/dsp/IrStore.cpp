@@ -0,0 +1,172 @@
+#include "IrStore.h"
+#include "IrDiskCache.h"
+
+// ======================================================================
+
+size_t IrSnapshot::getSizeInBytes() const
+{
+  return sizeof(float) * size_t(box.getNumChannels()) * size_t(box.getNumSamples());
+}
+
+// ======================================================================
+
+IrKeyBuilder& IrKeyBuilder::add(float value, float quantum)
+{
+  juce::int64 q = juce::int64(std::round(value/quantum));
+  addBytes(&q, sizeof(q));
+  return *this;
+}
+
+IrKeyBuilder& IrKeyBuilder::add(int value)
+{
+  juce::int64 q = value;
+  addBytes(&q, sizeof(q));
+  return *this;
+}
+
+IrKeyBuilder& IrKeyBuilder::add(const char* text)
+{
+  addBytes(text, strlen(text));
+  return *this;
+}
+
+juce::uint64 IrKeyBuilder::getKey() const
+{
+  return hash;
+}
+
+// FNV-1a
+void IrKeyBuilder::addBytes(const void* data, size_t size)
+{
+  auto* bytes = static_cast<const juce::uint8*>(data);
+  for (size_t i=0; i<size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+}
+
+// ======================================================================
+
+IrStore::IrStore() : diskCache(std::make_unique<IrDiskCache>())
+{
+
+}
+
+IrStore::~IrStore()
+{
+
+}
+
+std::shared_ptr<const IrSnapshot> IrStore::find(juce::uint64 key)
+{
+  if (auto ir = findInMemory(key))
+    return ir;
+
+  // (no lock held while reading the file)
+  if (auto ir = diskCache->read(key))
+  {
+    insert(ir);
+    return ir;
+  }
+  return nullptr;
+}
+
+std::shared_ptr<const IrSnapshot> IrStore::findInMemory(juce::uint64 key)
+{
+  const juce::ScopedLock sl(lock);
+  for (auto it = entries.begin(); it != entries.end(); ++it)
+  {
+    if ((*it)->key == key)
+    {
+      // Move the entry to the front of the list
+      entries.splice(entries.begin(), entries, it);
+      return entries.front();
+    }
+  }
+  return nullptr;
+}
+
+bool IrStore::contains(juce::uint64 key)
+{
+  {
+    const juce::ScopedLock sl(lock);
+    for (auto& ir : entries)
+      if (ir->key == key)
+        return true;
+  }
+  return diskCache->contains(key);
+}
+
+void IrStore::persist(std::shared_ptr<const IrSnapshot> ir)
+{
+  diskCache->write(ir);
+}
+
+void IrStore::insert(std::shared_ptr<const IrSnapshot> ir)
+{
+  if (ir == nullptr)
+    return;
+
+  const juce::ScopedLock sl(lock);
+  for (auto it = entries.begin(); it != entries.end(); ++it)
+  {
+    if ((*it)->key == ir->key)
+    {
+      sizeInBytes -= (*it)->getSizeInBytes();
+      entries.erase(it);
+      break;
+    }
+  }
+  entries.push_front(ir);
+  sizeInBytes += ir->getSizeInBytes();
+  removeOldEntries();
+}
+
+void IrStore::clear()
+{
+  const juce::ScopedLock sl(lock);
+  entries.clear();
+  sizeInBytes = 0;
+}
+
+bool IrStore::beginCalculation(juce::uint64 key)
+{
+  const juce::ScopedLock sl(lock);
+  return inFlight.insert(key).second;
+}
+
+void IrStore::endCalculation(juce::uint64 key)
+{
+  const juce::ScopedLock sl(lock);
+  inFlight.erase(key);
+}
+
+bool IrStore::isInFlight(juce::uint64 key)
+{
+  const juce::ScopedLock sl(lock);
+  return inFlight.count(key) > 0;
+}
+
+void IrStore::setMaxSizeInBytes(size_t maxBytes)
+{
+  const juce::ScopedLock sl(lock);
+  maxSizeInBytes = maxBytes;
+  removeOldEntries();
+}
+
+size_t IrStore::getSizeInBytes()
+{
+  const juce::ScopedLock sl(lock);
+  return sizeInBytes;
+}
+
+// The most recent entry is always kept, even if it is bigger than the limit
+void IrStore::removeOldEntries()
+{
+  while (sizeInBytes > maxSizeInBytes && entries.size() > 1)
+  {
+    sizeInBytes -= entries.back()->getSizeInBytes();
+    entries.pop_back();
+  }
+}
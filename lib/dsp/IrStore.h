@@ -0,0 +1,91 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <list>
+#include <set>
+#include <memory>
+
+// ==================================================================
+// A finished impulse response, as it is loaded in the convolution engines.
+// Snapshots are never modified once they have been stored in the cache.
+struct IrSnapshot
+{
+  juce::uint64 key;
+  double sampleRate;
+  // (the direct path and the early reflections are rendered apart, see TapNetwork)
+  juce::AudioBuffer<float> box;
+  // Set when the buffers point to a file of the disk cache
+  std::shared_ptr<juce::MemoryMappedFile> mappedFile;
+
+  size_t getSizeInBytes() const;
+};
+
+// ==================================================================
+// Builds a hash of a set of (quantized) parameters.
+// Two parameter sets that only differ by less than the quantization
+// steps produce the same key.
+class IrKeyBuilder
+{
+public:
+  IrKeyBuilder& add(float value, float quantum);
+  IrKeyBuilder& add(int value);
+  IrKeyBuilder& add(const char* text);
+  juce::uint64 getKey() const;
+
+private:
+  void addBytes(const void* data, size_t size);
+  juce::uint64 hash{14695981039346656037ull};
+};
+
+// Maximum amount of memory used by the stored IRs
+#define IRSTORE_MAXBYTES (size_t(256)<<20)
+
+class IrDiskCache;
+
+// ==================================================================
+// Finished impulse responses, indexed by their key and shared by
+// all the plugin instances of the process (use it through a
+// juce::SharedResourcePointer<IrStore>).
+// The least recently used IRs are dropped when the memory used
+// exceeds the limit. A snapshot still in use by an instance stays
+// alive until it is released.
+// IRs being calculated are registered as "in flight", so that an
+// instance needing the same IR can wait for it instead of
+// calculating it again.
+// IRs that are not in memory are looked for in the disk cache.
+class IrStore
+{
+public:
+  IrStore();
+  ~IrStore();
+  std::shared_ptr<const IrSnapshot> find(juce::uint64 key);
+  bool contains(juce::uint64 key);
+  void insert(std::shared_ptr<const IrSnapshot> ir);
+  // Saves the IR in the disk cache (in the background)
+  void persist(std::shared_ptr<const IrSnapshot> ir);
+  void clear();
+
+  // Returns false if the IR is already being calculated elsewhere
+  bool beginCalculation(juce::uint64 key);
+  void endCalculation(juce::uint64 key);
+  bool isInFlight(juce::uint64 key);
+
+  void setMaxSizeInBytes(size_t maxBytes);
+  size_t getSizeInBytes();
+
+private:
+  juce::CriticalSection lock;
+  // Most recently used entries first
+  std::list<std::shared_ptr<const IrSnapshot>> entries;
+  std::set<juce::uint64> inFlight;
+  size_t sizeInBytes{0};
+  size_t maxSizeInBytes{IRSTORE_MAXBYTES};
+  std::unique_ptr<IrDiskCache> diskCache;
+
+  std::shared_ptr<const IrSnapshot> findInMemory(juce::uint64 key);
+
+  void removeOldEntries();
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (IrStore)
+};
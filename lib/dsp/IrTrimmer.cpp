@@ -0,0 +1,77 @@
+#include "IrTrimmer.h"
+#include "Log.h"
+
+int IrTrimmer::getDecayLength(const juce::AudioBuffer<float>& ir, double floorDb)
+{
+  const int length = ir.getNumSamples();
+  double total = 0.0;
+  for (int c=0; c<ir.getNumChannels(); c++)
+  {
+    auto* h = ir.getReadPointer(c);
+    for (int n=0; n<length; n++)
+      total += double(h[n])*h[n];
+  }
+  if (total <= 0.0)
+    return length;
+
+  // (Schroeder integral, from the end of the IR)
+  const double floorEnergy = total*std::pow(10.0, floorDb/10.0);
+  double remaining = 0.0;
+  int n = length;
+  while (n > 0)
+  {
+    double e = 0.0;
+    for (int c=0; c<ir.getNumChannels(); c++)
+      e += double(ir.getSample(c, n-1))*ir.getSample(c, n-1);
+    if (remaining + e > floorEnergy)
+      break;
+    remaining += e;
+    n--;
+  }
+  return n;
+}
+
+bool IrTrimmer::trim(juce::AudioBuffer<float>& ir, double sampleRate, double floorDb)
+{
+  const int length = ir.getNumSamples();
+  const int fadeLength = juce::jmax(1, int(TRIM_FADETIME*sampleRate));
+  const int fadeStart = getDecayLength(ir, floorDb);
+  if (fadeStart+fadeLength >= length)
+    return false;
+
+  fadeOut(ir, fadeStart, fadeLength);
+  ir.setSize(ir.getNumChannels(), fadeStart+fadeLength, true);
+
+  LOG_INFO("IR trimmed from " << length/sampleRate << " to " << (fadeStart+fadeLength)/sampleRate << " s");
+  return true;
+}
+
+bool IrTrimmer::copyTrimmed(const juce::AudioBuffer<float>& ir, juce::AudioBuffer<float>& dest, double sampleRate, double floorDb)
+{
+  const int length = ir.getNumSamples();
+  const int fadeLength = juce::jmax(1, int(TRIM_FADETIME*sampleRate));
+  const int fadeStart = getDecayLength(ir, floorDb);
+  const bool isTrimmed = fadeStart+fadeLength < length;
+  const int newLength = isTrimmed ? fadeStart+fadeLength : length;
+
+  dest.setSize(ir.getNumChannels(), newLength);
+  for (int c=0; c<ir.getNumChannels(); c++)
+    dest.copyFrom(c, 0, ir, c, 0, newLength);
+  if (!isTrimmed)
+    return false;
+
+  fadeOut(dest, fadeStart, fadeLength);
+  LOG_INFO("IR trimmed from " << length/sampleRate << " to " << newLength/sampleRate << " s");
+  return true;
+}
+
+// (the fade only affects the samples below the floor)
+void IrTrimmer::fadeOut(juce::AudioBuffer<float>& ir, int fadeStart, int fadeLength)
+{
+  for (int c=0; c<ir.getNumChannels(); c++)
+  {
+    auto* h = ir.getWritePointer(c);
+    for (int n=0; n<fadeLength; n++)
+      h[fadeStart+n] *= 0.5f + 0.5f*std::cos(juce::MathConstants<float>::pi*float(n)/float(fadeLength));
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// Level of the energy decay below which the end of the IRs is removed
+// (dB, relative to the IR energy)
+#define TRIM_FLOOR -90.0
+// Duration of the fade out at the end of a trimmed IR (seconds)
+#define TRIM_FADETIME 0.01
+
+// ==================================================================
+// Removal of the end of the calculated IRs, whose length is estimated
+// from the room size and the number of reflection orders : the IR is
+// cut (with a short fade out) where its energy decay, integrated
+// backwards over all its channels, falls below a floor. The convolutions
+// don't process the silent tails, and the plugins report the tail
+// length of the IRs to the host.
+class IrTrimmer
+{
+public:
+  // Length (in samples) from which the energy left in the IR is below
+  // floorDb
+  static int getDecayLength(const juce::AudioBuffer<float>& ir, double floorDb);
+  // Trims the IR, returns true if it has been shortened
+  static bool trim(juce::AudioBuffer<float>& ir, double sampleRate, double floorDb = TRIM_FLOOR);
+  // Copies the IR into dest as trim() would leave it, without copying
+  // its silent end, returns true if it has been shortened
+  static bool copyTrimmed(const juce::AudioBuffer<float>& ir, juce::AudioBuffer<float>& dest, double sampleRate, double floorDb = TRIM_FLOOR);
+
+private:
+  static void fadeOut(juce::AudioBuffer<float>& ir, int fadeStart, int fadeLength);
+};
@@ -0,0 +1,108 @@
+#include "LoadMeter.h"
+
+#include <numeric>
+
+const char* LoadMeter::getSectionName(Section section)
+{
+  static const char* const names[numSections] = { "box convolution", "direct paths", "filtering", "mixing" };
+  return names[section];
+}
+
+void LoadMeter::prepare(double rate)
+{
+  sampleRate = rate;
+  numLoads = loadIndex = 0;
+  blocksSincePublication = 0;
+  current = Snapshot{};
+  publish();
+}
+
+void LoadMeter::startBlock()
+{
+  startTicks = juce::Time::getHighResolutionTicks();
+}
+
+void LoadMeter::endBlock(int numSamples, std::initializer_list<Sections*> parts)
+{
+  const juce::int64 endTicks = juce::Time::getHighResolutionTicks();
+  if (numSamples <= 0)
+    return;
+
+  const double duration = double(numSamples)/sampleRate;
+  const double ticksPerBlock = duration*double(juce::Time::getHighResolutionTicksPerSecond());
+
+  loads[0][loadIndex] = float(double(endTicks-startTicks)/ticksPerBlock);
+  for (int s=0; s<numSections; s++)
+  {
+    juce::int64 ticks = 0;
+    for (auto* p : parts)
+    {
+      ticks += p->ticks[s];
+      p->ticks[s] = 0;
+    }
+    loads[1+s][loadIndex] = float(double(ticks)/ticksPerBlock);
+  }
+
+  current.numBlocks++;
+  if (loads[0][loadIndex] > 1.f)
+    current.numOverBudget++;
+  current.budget = float(1000.0*duration);
+
+  loadIndex = (loadIndex+1)%LOAD_WINDOW;
+  numLoads = juce::jmin(numLoads+1, LOAD_WINDOW);
+
+  // (the statistics take a few microseconds, they aren't calculated at
+  // each block)
+  if (++blocksSincePublication >= juce::jmax(1, int(LOAD_PUBLISHTIME/duration)))
+  {
+    blocksSincePublication = 0;
+    for (int s=0; s<1+numSections; s++)
+    {
+      auto& st = s == 0 ? current.total : current.sections[s-1];
+      std::copy(loads[s], loads[s]+numLoads, sorted);
+      const double sum = std::accumulate(sorted, sorted+numLoads, 0.0);
+      st.mean = float(sum/numLoads);
+      st.max = *std::max_element(sorted, sorted+numLoads);
+      auto* p99 = sorted + (99*(numLoads-1))/100;
+      std::nth_element(sorted, p99, sorted+numLoads);
+      st.p99 = *p99;
+    }
+    publish();
+  }
+}
+
+void LoadMeter::publish()
+{
+  juce::uint32 w[numWords];
+  std::memcpy(w, &current, sizeof(Snapshot));
+
+  // (odd while the words are written)
+  sequence.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (int i=0; i<numWords; i++)
+    words[i].store(w[i], std::memory_order_relaxed);
+  sequence.fetch_add(1, std::memory_order_release);
+}
+
+LoadMeter::Snapshot LoadMeter::getSnapshot() const
+{
+  juce::uint32 w[numWords];
+  for (;;)
+  {
+    const auto before = sequence.load(std::memory_order_acquire);
+    if ((before & 1) != 0)
+    {
+      juce::Thread::yield();
+      continue;
+    }
+    for (int i=0; i<numWords; i++)
+      w[i] = words[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence.load(std::memory_order_relaxed) == before)
+      break;
+  }
+
+  Snapshot s;
+  std::memcpy(&s, w, sizeof(Snapshot));
+  return s;
+}
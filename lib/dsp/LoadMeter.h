@@ -0,0 +1,94 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// Number of blocks over which the statistics are calculated
+#define LOAD_WINDOW 1024
+// Time between two publications of the statistics (seconds)
+#define LOAD_PUBLISHTIME 0.1
+
+// ==================================================================
+// Timing of processBlock, in parts of the duration of the blocks (1
+// when the processing takes the whole time left before the deadline).
+// The audio thread times each block and the sections it goes through,
+// keeps the loads of the last LOAD_WINDOW blocks, and regularly
+// publishes their mean, 99th percentile and maximum in a snapshot,
+// with the number of blocks that have taken longer than their
+// duration. The snapshot can be read from any thread, without blocking
+// the audio thread (sequence lock).
+class LoadMeter
+{
+public:
+  enum Section { boxConvolution, directPaths, filtering, mixing, numSections };
+
+  // Times of the sections during a block, kept by the code that runs
+  // them (one per room, so that the rooms processed in parallel don't
+  // share anything)
+  class Sections
+  {
+  public:
+    juce::int64 ticks[numSections]{};
+  };
+
+  // Adds the time of its scope to a section
+  class ScopedSection
+  {
+  public:
+    ScopedSection(Sections& s, Section sec) : sections(s), section(sec), start(juce::Time::getHighResolutionTicks()) {}
+    ~ScopedSection() { sections.ticks[section] += juce::Time::getHighResolutionTicks()-start; }
+
+  private:
+    Sections& sections;
+    Section section;
+    juce::int64 start;
+    JUCE_DECLARE_NON_COPYABLE (ScopedSection)
+  };
+
+  struct Statistics
+  {
+    float mean, p99, max;
+  };
+
+  struct Snapshot
+  {
+    Statistics total;
+    // (CPU time of the sections, summed over the rooms processed in
+    // parallel)
+    Statistics sections[numSections];
+    // Since prepare()
+    juce::uint32 numBlocks, numOverBudget;
+    // Duration of the last block (milliseconds)
+    float budget;
+  };
+
+  static const char* getSectionName(Section section);
+
+  // (called before the processing starts)
+  void prepare(double sampleRate);
+
+  // Called from the audio thread, at the start and at the end of
+  // processBlock : the times of the sections are collected and reset
+  void startBlock();
+  void endBlock(int numSamples, std::initializer_list<Sections*> parts);
+
+  // (any thread)
+  Snapshot getSnapshot() const;
+
+private:
+  void publish();
+
+  double sampleRate{44100.0};
+  juce::int64 startTicks{0};
+
+  // (audio thread)
+  float loads[1+numSections][LOAD_WINDOW];
+  float sorted[LOAD_WINDOW];
+  int numLoads{0}, loadIndex{0};
+  int blocksSincePublication{0};
+  Snapshot current{};
+
+  static_assert(std::is_trivially_copyable<Snapshot>::value && sizeof(Snapshot)%sizeof(juce::uint32) == 0, "Snapshot must be copied by words");
+  static constexpr int numWords = int(sizeof(Snapshot)/sizeof(juce::uint32));
+  std::atomic<juce::uint32> sequence{0};
+  std::atomic<juce::uint32> words[numWords]{};
+};
@@ -0,0 +1,198 @@
+#include "Log.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+  static_assert((LOG_CAPACITY & (LOG_CAPACITY-1)) == 0, "LOG_CAPACITY must be a power of 2");
+
+  // Bounded queue of messages, with many producers and one consumer. A
+  // producer takes a position, writes its slot and publishes it by its
+  // sequence, which the consumer then sets for the next round.
+  class MessageQueue
+  {
+  public:
+    MessageQueue()
+    {
+      for (size_t i=0; i<LOG_CAPACITY; i++)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(Log::Level level, const char* text, int length)
+    {
+      auto pos = enqueuePos.load(std::memory_order_relaxed);
+      Slot* slot;
+      for (;;)
+      {
+        slot = &slots[pos & (LOG_CAPACITY-1)];
+        const auto diff = (long long) slot->sequence.load(std::memory_order_acquire) - (long long) pos;
+        if (diff == 0)
+        {
+          if (enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+            break;
+        }
+        else if (diff < 0)
+        {
+          numDropped.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+        else
+          pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+
+      slot->level = level;
+      std::memcpy(slot->text, text, size_t(length));
+      slot->text[length] = 0;
+      slot->sequence.store(pos+1, std::memory_order_release);
+      return true;
+    }
+
+    template <typename Function>
+    bool pop(Function&& write)
+    {
+      auto& slot = slots[dequeuePos & (LOG_CAPACITY-1)];
+      if (slot.sequence.load(std::memory_order_acquire) != dequeuePos+1)
+        return false;
+      write(slot.level, slot.text);
+      slot.sequence.store(dequeuePos+LOG_CAPACITY, std::memory_order_release);
+      dequeuePos++;
+      return true;
+    }
+
+    std::atomic<int> numDropped{0};
+
+  private:
+    struct Slot
+    {
+      std::atomic<size_t> sequence{0};
+      Log::Level level{Log::info};
+      char text[LOG_MESSAGESIZE];
+    };
+
+    Slot slots[LOG_CAPACITY];
+    std::atomic<size_t> enqueuePos{0};
+    size_t dequeuePos{0};
+  };
+
+  // (built on the first message, whichever the thread)
+  MessageQueue& getQueue()
+  {
+    static MessageQueue queue;
+    return queue;
+  }
+
+  int getDefaultLevel()
+  {
+    static const char* const names[] = { "error", "warning", "info", "debug", "trace" };
+    if (const char* name = std::getenv(LOG_VARIABLE))
+      for (int i=0; i<5; i++)
+        if (std::strcmp(name, names[i]) == 0)
+          return i;
+ #if JUCE_DEBUG
+    return Log::debug;
+ #else
+    return Log::info;
+ #endif
+  }
+}
+
+std::atomic<int> Log::maxLevel{getDefaultLevel()};
+
+void Log::setLevel(Level level)
+{
+  maxLevel = int(level);
+}
+
+// ==================================================================
+Log::Message& Log::Message::operator<<(const char* s)
+{
+  if (s == nullptr)
+    return *this;
+  const int n = juce::jmin(int(std::strlen(s)), LOG_MESSAGESIZE-1-length);
+  std::memcpy(text+length, s, size_t(n));
+  length += n;
+  return *this;
+}
+
+Log::Message& Log::Message::operator<<(char c)
+{
+  if (length < LOG_MESSAGESIZE-1)
+    text[length++] = c;
+  return *this;
+}
+
+// (as printed by a std::ostream, with 6 significant digits)
+Log::Message& Log::Message::operator<<(double v)
+{
+  char s[32];
+  std::snprintf(s, sizeof(s), "%g", v);
+  return *this << (const char*) s;
+}
+
+Log::Message& Log::Message::append(long long v)
+{
+  char s[24];
+  std::snprintf(s, sizeof(s), "%lld", v);
+  return *this << (const char*) s;
+}
+
+Log::Message& Log::Message::append(unsigned long long v)
+{
+  char s[24];
+  std::snprintf(s, sizeof(s), "%llu", v);
+  return *this << (const char*) s;
+}
+
+bool Log::Message::push()
+{
+  // (one line per message)
+  while (length > 0 && (text[length-1] == '\n' || text[length-1] == ' '))
+    length--;
+  return getQueue().push(level, text, length);
+}
+
+// ==================================================================
+Log::Writer::Writer() : juce::Thread("log")
+{
+  startThread(juce::Thread::Priority::low);
+}
+
+Log::Writer::~Writer()
+{
+  stopThread(1000);
+  // (the last messages)
+  writeMessages();
+}
+
+void Log::Writer::run()
+{
+  while (!threadShouldExit())
+  {
+    writeMessages();
+    wait(LOG_WRITEINTERVAL);
+  }
+}
+
+void Log::writeMessages()
+{
+  auto& queue = getQueue();
+  bool hasWritten = false;
+  while (queue.pop([] (Level level, const char* text)
+                   {
+                     (level <= warning ? std::cerr : std::cout) << text << '\n';
+                   }))
+    hasWritten = true;
+
+  if (const int n = queue.numDropped.exchange(0))
+  {
+    std::cerr << n << " log messages dropped" << '\n';
+    hasWritten = true;
+  }
+  if (hasWritten)
+  {
+    std::cout.flush();
+    std::cerr.flush();
+  }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+// The trace messages are compiled only with LOG_TRACEENABLED=1
+#ifndef LOG_TRACEENABLED
+ #define LOG_TRACEENABLED 0
+#endif
+
+// Messages waiting to be written (the next ones are dropped), and their
+// maximum length (they are truncated)
+#define LOG_CAPACITY 256
+#define LOG_MESSAGESIZE 1024
+// Period of the writer thread (ms)
+#define LOG_WRITEINTERVAL 20
+// Environment variable which sets the lowest level written (error,
+// warning, info, debug or trace). By default, debug in the debug builds
+// and info otherwise.
+#define LOG_VARIABLE "BIRR_LOG"
+
+// Messages of the engines and the processors. Any thread (the audio
+// thread too) formats its message in place and pushes it into a
+// lock-free queue, without allocating. A writer thread prints them to
+// the standard output (the errors and warnings to the standard error).
+//   LOG_INFO("IR trimmed from " << length << " to " << newLength << " s");
+#define LOG_AT(level, message) \
+  do { if (Log::isEnabled(level)) { Log::Message logMessage_(level); logMessage_ << message; logMessage_.push(); } } while (false)
+
+#define LOG_ERROR(message) LOG_AT(Log::error, message)
+#define LOG_WARNING(message) LOG_AT(Log::warning, message)
+#define LOG_INFO(message) LOG_AT(Log::info, message)
+#define LOG_DEBUG(message) LOG_AT(Log::debug, message)
+#if LOG_TRACEENABLED
+ #define LOG_TRACE(message) LOG_AT(Log::trace, message)
+#else
+ #define LOG_TRACE(message) do {} while (false)
+#endif
+
+class Log
+{
+public:
+  enum Level { error, warning, info, debug, trace };
+
+  static bool isEnabled(Level level)
+  {
+    return int(level) <= maxLevel.load(std::memory_order_relaxed);
+  }
+  static void setLevel(Level level);
+
+  // Message being formatted (as with a std::ostream)
+  class Message
+  {
+  public:
+    explicit Message(Level l) : level(l) {}
+
+    Message& operator<<(const char* s);
+    Message& operator<<(const std::string& s) { return *this << s.c_str(); }
+    Message& operator<<(const juce::String& s) { return *this << s.toRawUTF8(); }
+    Message& operator<<(char c);
+    Message& operator<<(bool b) { return *this << int(b); }
+    Message& operator<<(double v);
+    Message& operator<<(float v) { return *this << double(v); }
+    template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>>
+    Message& operator<<(T v)
+    {
+      return std::is_signed<T>::value ? append((long long) v) : append((unsigned long long) v);
+    }
+
+    // (returns false if the queue is full, the message is dropped)
+    bool push();
+
+  private:
+    Message& append(long long v);
+    Message& append(unsigned long long v);
+
+    Level level;
+    int length{0};
+    char text[LOG_MESSAGESIZE];
+
+    JUCE_DECLARE_NON_COPYABLE (Message)
+  };
+
+  // Thread which writes the messages, shared by the instances (held by
+  // each processor with a juce::SharedResourcePointer<Log::Writer>). The
+  // messages sent while there is none are written by the next one.
+  class Writer : private juce::Thread
+  {
+  public:
+    Writer();
+    ~Writer() override;
+
+  private:
+    void run() override;
+  };
+
+private:
+  // (by the writer only)
+  static void writeMessages();
+
+  static std::atomic<int> maxLevel;
+};
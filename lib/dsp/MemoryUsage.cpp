@@ -0,0 +1,79 @@
+#include "MemoryUsage.h"
+
+static juce::String toMegabytes(size_t bytes)
+{
+  return juce::String(double(bytes)/1048576.0, 1) + " MB";
+}
+
+const char* MemoryUsage::getPartName(Part part)
+{
+  static const char* const names[numParts] = { "calculators", "partitions", "convolutionState", "irCopies",
+                                               "earlyPaths", "buffers", "hrtf", "store" };
+  return names[part];
+}
+
+const char* MemoryUsage::getLevelName(Level level)
+{
+  static const char* const names[] = { "full", "compact", "shortened" };
+  return names[level];
+}
+
+bool MemoryUsage::isShared(Part part)
+{
+  return part == hrtf || part == store;
+}
+
+size_t MemoryUsage::getBytes(const juce::AudioBuffer<float>& buffer)
+{
+  return size_t(buffer.getNumChannels())*size_t(buffer.getNumSamples())*sizeof(float);
+}
+
+size_t MemoryUsage::getDefaultBudget()
+{
+  const auto megabytes = juce::SystemStats::getEnvironmentVariable(MEMORY_VARIABLE, {}).getIntValue();
+  return megabytes > 0 ? size_t(megabytes) << 20 : 0;
+}
+
+void MemoryUsage::add(const MemoryUsage& other)
+{
+  for (int i=0; i<numParts; i++)
+    bytes[i] = isShared(Part(i)) ? juce::jmax(bytes[i], other.bytes[i]) : bytes[i]+other.bytes[i];
+  calculationPeak += other.calculationPeak;
+  budget += other.budget;
+  level = juce::jmax(level, other.level);
+}
+
+size_t MemoryUsage::getInstanceTotal() const
+{
+  size_t total = 0;
+  for (int i=0; i<numParts; i++)
+    if (!isShared(Part(i)))
+      total += bytes[i];
+  return total;
+}
+
+juce::String MemoryUsage::getSummary() const
+{
+  juce::String s = "Memory " + toMegabytes(getInstanceTotal());
+  if (budget > 0)
+    s << " of " << toMegabytes(budget) << " (" << getLevelName(level) << ")";
+  s << ", shared " << toMegabytes(bytes[hrtf]+bytes[store]);
+  return s;
+}
+
+juce::var MemoryUsage::toVar() const
+{
+  auto* o = new juce::DynamicObject();
+  for (int i=0; i<numParts; i++)
+    o->setProperty(getPartName(Part(i)), juce::int64(bytes[i]));
+  o->setProperty("instanceTotal", juce::int64(getInstanceTotal()));
+  o->setProperty("calculationPeak", juce::int64(calculationPeak));
+  o->setProperty("budget", juce::int64(budget));
+  o->setProperty("level", getLevelName(level));
+  return juce::var(o);
+}
+
+juce::String MemoryUsage::toJson() const
+{
+  return juce::JSON::toString(toVar(), true);
+}
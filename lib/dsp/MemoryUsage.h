@@ -0,0 +1,55 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// Environment variable which sets the memory budget of an instance (MB).
+// Without it, there is no budget.
+#define MEMORY_VARIABLE "BIRR_MEMORY"
+// Bytes held by the convolution per sample and channel of an IR : its
+// partitions, and its share of the delay lines (estimate used to apply
+// the budget)
+#define MEMORY_CONVOLUTIONBYTES 13
+// Shortest IR convolved when the budget is exceeded (seconds)
+#define MEMORY_MINIRTIME 0.5
+
+// ==================================================================
+// Bytes held by the structures of an engine (see BoxRoomIR), and the
+// strategy applied to keep them within the budget of the instance.
+// The HRTF tables and the IR store are shared by all the instances of
+// the process : they are reported, but not counted in the total of the
+// instance.
+class MemoryUsage
+{
+public:
+  enum Part { calculators, partitions, convolutionState, irCopies, earlyPaths, buffers, hrtf, store, numParts };
+
+  // Strategies, from the lightest : the buffers of the calculators are
+  // released once their IR is transferred (compact), then the IRs are
+  // also shortened in the convolution to fit the budget (shortened)
+  enum Level { full, compact, shortened };
+
+  static const char* getPartName(Part part);
+  static const char* getLevelName(Level level);
+  static bool isShared(Part part);
+  // (the samples of the buffer)
+  static size_t getBytes(const juce::AudioBuffer<float>& buffer);
+  // Budget set with MEMORY_VARIABLE (bytes, 0 without budget)
+  static size_t getDefaultBudget();
+
+  // Adds the usage of another engine of the same instance (the shared
+  // parts are not added twice)
+  void add(const MemoryUsage& other);
+  size_t getInstanceTotal() const;
+
+  // Compact description, for the editor
+  juce::String getSummary() const;
+  juce::var toVar() const;
+  juce::String toJson() const;
+
+  size_t bytes[numParts]{};
+  // Largest memory used at once by the last calculation (see IrMetrics)
+  size_t calculationPeak{0};
+  // (0 without budget)
+  size_t budget{0};
+  Level level{full};
+};
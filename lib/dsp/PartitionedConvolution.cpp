@@ -0,0 +1,2147 @@
+#include "PartitionedConvolution.h"
+#include "Log.h"
+#include "IrTrimmer.h"
+#include "TraceLog.h"
+#include "RtAudit.h"
+
+#if JUCE_MAC || JUCE_IOS
+ #include <dispatch/dispatch.h>
+#elif JUCE_WINDOWS
+ #define WIN32_LEAN_AND_MEAN
+ #define NOMINMAX
+ #include <windows.h>
+#endif
+
+// ======================================================================
+
+#if JUCE_LINUX || JUCE_BSD || JUCE_ANDROID
+
+ConvolutionSemaphore::ConvolutionSemaphore()
+{
+  sem_init(&semaphore, 0, 0);
+}
+
+ConvolutionSemaphore::~ConvolutionSemaphore()
+{
+  sem_destroy(&semaphore);
+}
+
+void ConvolutionSemaphore::post()
+{
+  sem_post(&semaphore);
+}
+
+void ConvolutionSemaphore::wait(int timeOutMilliseconds)
+{
+  timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  t.tv_nsec += long(timeOutMilliseconds%1000)*1000000;
+  t.tv_sec += timeOutMilliseconds/1000 + t.tv_nsec/1000000000;
+  t.tv_nsec %= 1000000000;
+  sem_timedwait(&semaphore, &t);
+}
+
+#elif JUCE_MAC || JUCE_IOS
+
+ConvolutionSemaphore::ConvolutionSemaphore() : semaphore(dispatch_semaphore_create(0))
+{
+
+}
+
+ConvolutionSemaphore::~ConvolutionSemaphore()
+{
+  dispatch_release(static_cast<dispatch_semaphore_t>(semaphore));
+}
+
+void ConvolutionSemaphore::post()
+{
+  dispatch_semaphore_signal(static_cast<dispatch_semaphore_t>(semaphore));
+}
+
+void ConvolutionSemaphore::wait(int timeOutMilliseconds)
+{
+  dispatch_semaphore_wait(static_cast<dispatch_semaphore_t>(semaphore), dispatch_time(DISPATCH_TIME_NOW, int64_t(timeOutMilliseconds)*NSEC_PER_MSEC));
+}
+
+#elif JUCE_WINDOWS
+
+ConvolutionSemaphore::ConvolutionSemaphore() : semaphore(CreateSemaphore(nullptr, 0, 0x7fffffff, nullptr))
+{
+
+}
+
+ConvolutionSemaphore::~ConvolutionSemaphore()
+{
+  CloseHandle(semaphore);
+}
+
+void ConvolutionSemaphore::post()
+{
+  ReleaseSemaphore(semaphore, 1, nullptr);
+}
+
+void ConvolutionSemaphore::wait(int timeOutMilliseconds)
+{
+  WaitForSingleObject(semaphore, DWORD(timeOutMilliseconds));
+}
+
+#else
+
+ConvolutionSemaphore::ConvolutionSemaphore()
+{
+
+}
+
+ConvolutionSemaphore::~ConvolutionSemaphore()
+{
+
+}
+
+void ConvolutionSemaphore::post()
+{
+  event.signal();
+}
+
+void ConvolutionSemaphore::wait(int timeOutMilliseconds)
+{
+  event.wait(timeOutMilliseconds);
+}
+
+#endif
+
+// ======================================================================
+
+ConvolutionWorkers::Worker::Worker(ConvolutionWorkers& o) : juce::Thread("convolution"), owner(o)
+{
+
+}
+
+void ConvolutionWorkers::Worker::run()
+{
+  while (!threadShouldExit())
+  {
+    if (!owner.runNextJob())
+      owner.jobAvailable.wait(50);
+  }
+}
+
+ConvolutionWorkers::Collector::Collector(ConvolutionWorkers& o) : juce::Thread("convolution garbage"), owner(o)
+{
+
+}
+
+void ConvolutionWorkers::Collector::run()
+{
+  while (!threadShouldExit())
+  {
+    if (!owner.deleteNextGarbage())
+      owner.garbageAvailable.wait(50);
+  }
+}
+
+ConvolutionWorkers::ConvolutionWorkers()
+{
+  LOG_INFO("FFT backend : " << RealFft::getBackendName(RealFft::getDefaultBackend()));
+
+  auto numWorkers = juce::jlimit(1, 4, juce::SystemStats::getNumCpus()/2);
+  for (int i=0; i<numWorkers; i++)
+  {
+    workers.push_back(std::make_unique<Worker>(*this));
+    // (at the priority of the audio threads, which wait for them in
+    // finish() : without the rights to real-time scheduling, the highest)
+    if (!workers.back()->startRealtimeThread(juce::Thread::RealtimeOptions{}))
+      workers.back()->startThread(juce::Thread::Priority::highest);
+  }
+
+  // (the engines are large, and their deletion waits for their jobs)
+  collector.startThread(juce::Thread::Priority::normal);
+}
+
+ConvolutionWorkers::~ConvolutionWorkers()
+{
+  // (the collector first, the deletion of an engine needs the workers)
+  collector.signalThreadShouldExit();
+  garbageAvailable.post();
+  collector.stopThread(1000);
+
+  for (auto& w : workers)
+  {
+    w->signalThreadShouldExit();
+    jobAvailable.post();
+  }
+  for (auto& w : workers)
+    w->stopThread(1000);
+
+  // (the jobs left are not run, their engines are deleted below)
+  while (jobs.pop() != nullptr) {}
+  while (deleteNextGarbage()) {}
+}
+
+void ConvolutionWorkers::submit(ConvolutionJob* job)
+{
+  job->state = ConvolutionJob::queued;
+  // (if the queue is full, the job will be run by the audio thread)
+  jobs.push(job);
+  jobAvailable.post();
+}
+
+// Waits for a job, or runs it if no worker has started it yet
+void ConvolutionWorkers::finish(ConvolutionJob* job)
+{
+  int expected = ConvolutionJob::queued;
+  if (job->state.compare_exchange_strong(expected, ConvolutionJob::running))
+  {
+    job->run();
+    job->state = ConvolutionJob::done;
+  }
+  else if (job->state.load() == ConvolutionJob::running)
+  {
+    // (the worker is late)
+    RtAudit::check(RtAudit::wait);
+    while (job->state.load() == ConvolutionJob::running)
+      juce::Thread::yield();
+  }
+  job->state = ConvolutionJob::idle;
+}
+
+bool ConvolutionWorkers::dispose(ConvolutionGarbage* g)
+{
+  if (!garbage.push(g))
+    return false;
+  garbageAvailable.post();
+  return true;
+}
+
+void ConvolutionWorkers::cancel(ConvolutionJob* job)
+{
+  int expected = ConvolutionJob::queued;
+  job->state.compare_exchange_strong(expected, ConvolutionJob::idle);
+  while (job->state.load() == ConvolutionJob::running)
+    juce::Thread::yield();
+
+  // The queue may still point to the job, which is going to be deleted :
+  // the job is retired until the workers have popped the entries pushed
+  // until now (they skip it, it is no longer queued). This thread never
+  // runs the jobs of the other instances, whose audio threads may be
+  // waiting for them, it is not a real-time one.
+  const auto end = jobs.getNumPushed();
+  while (jobs.getNumPopped() < end || numClaiming.load() > 0)
+    juce::Thread::yield();
+  job->state = ConvolutionJob::idle;
+}
+
+bool ConvolutionWorkers::runNextJob()
+{
+  // (the entries of the jobs already claimed by finish(), or cancelled,
+  // are skipped)
+  // (between the pop and the claim, cancel() can't let the job go)
+  ConvolutionJob* job = nullptr;
+  while (job == nullptr)
+  {
+    numClaiming++;
+    auto* j = jobs.pop();
+    int expected = ConvolutionJob::queued;
+    if (j != nullptr && j->state.compare_exchange_strong(expected, ConvolutionJob::running))
+      job = j;
+    numClaiming--;
+    if (j == nullptr)
+      return false;
+  }
+
+  job->run();
+  job->state = ConvolutionJob::done;
+  return true;
+}
+
+bool ConvolutionWorkers::deleteNextGarbage()
+{
+  auto* g = garbage.pop();
+  if (g == nullptr)
+    return false;
+
+  delete g;
+  return true;
+}
+
+// ======================================================================
+// Partitioning of the IRs : stage 0 is the head, processed by the audio
+// thread, the next ones are the stages of the tail.
+// The stages at a reduced rate have partitions of size samples at
+// 1/factor of the sample rate, their offset is measured at that rate.
+
+struct ConvolutionLayout
+{
+  int size, offset, numPartitions;
+  int factor{1};
+};
+
+// Lags (in samples of the delayed IRs) from which the IRs are
+// convolved at 1/2 and 1/4 of the sample rate, -1 if they are not
+struct ConvolutionSplits
+{
+  int start[CONV_NUMFACTORS];
+};
+
+static int getFactor(int factorIndex)
+{
+  return 2 << factorIndex;
+}
+
+// Partition size of the last full rate stage
+static int getLastStageSize(int headSize)
+{
+  int size = CONV_GROWTH*headSize;
+  while (size*CONV_GROWTH <= CONV_MAXPARTITION)
+    size *= CONV_GROWTH;
+  return size;
+}
+
+// The full rate stages cover the whole IR, the decimated parts are
+// processed by one more stage per factor, with the duration of the
+// partitions of the last full rate stage (they would cost more than
+// they save on the shorter partitions).
+static std::vector<ConvolutionLayout> getLayout(int headSize, int length, const ConvolutionSplits& splits)
+{
+  std::vector<ConvolutionLayout> layout;
+  const int headEnd = juce::jmin(length, 2*CONV_GROWTH*headSize);
+  layout.push_back({headSize, 0, (headEnd+headSize-1)/headSize});
+
+  // Stage k has partitions of headSize*CONV_GROWTH^k samples, and
+  // covers the IR from 2*headSize*CONV_GROWTH^k to 2*headSize*CONV_GROWTH^(k+1)
+  // (up to the end of the IR for the last one)
+  int start = headEnd;
+  int size = CONV_GROWTH*headSize;
+  while (start < length)
+  {
+    const bool isLast = size*CONV_GROWTH > CONV_MAXPARTITION;
+    const int end = isLast ? length : juce::jmin(length, 2*CONV_GROWTH*size);
+    layout.push_back({size, start, (end-start+size-1)/size});
+    start = end;
+    size *= CONV_GROWTH;
+  }
+
+  for (int i=0; i<CONV_NUMFACTORS; i++)
+  {
+    if (splits.start[i] < 0)
+      continue;
+    const int factor = getFactor(i);
+    const int delay = CONV_MULTIRATEFILTERSIZE*factor;
+    const int lowSize = getLastStageSize(headSize)/factor;
+    // (see ConvolutionKernel for the last lag of the decimated IR)
+    const int lowEnd = (length-1-delay)/factor + 1;
+    layout.push_back({lowSize, 2*lowSize, (lowEnd-2*lowSize+lowSize-1)/lowSize, factor});
+  }
+  return layout;
+}
+
+// Moves the starts of the decimated parts to lags the layout can
+// process at their rate, and drops the parts that aren't worth it.
+// The input and output filters of a decimated stage delay its output
+// by 2*delay, and the IR is filtered too, hence the first lag (the
+// offset of the stage at the full rate) plus 3*delay.
+static void fitSplits(int headSize, int length, ConvolutionSplits& splits)
+{
+  int minStart = 0;
+  for (int i=0; i<CONV_NUMFACTORS; i++)
+  {
+    auto& start = splits.start[i];
+    if (start < 0)
+      continue;
+    const int delay = CONV_MULTIRATEFILTERSIZE*getFactor(i);
+    start = juce::jmax(start, minStart, 2*getLastStageSize(headSize) + 3*delay);
+    if (length-start < CONV_MINDECIMATEDLENGTH)
+      start = -1;
+    else
+      minStart = start + CONV_MULTIRATEFADE;
+  }
+
+  // (a short part at 1/2 isn't worth its resampling)
+  if (splits.start[0] >= 0 && splits.start[1] >= 0 && splits.start[1]-splits.start[0] < CONV_MINDECIMATEDLENGTH)
+    splits.start[0] = -1;
+}
+
+// The parts of the IR at the different rates (rate index 0 for the
+// full rate, else the factor index + 1) fade in over CONV_MULTIRATEFADE
+// samples from their start, while the previous part fades out
+
+static float getFadeIn(int start, int lag)
+{
+  if (start < 0 || lag < start)
+    return 0.f;
+  if (lag >= start+CONV_MULTIRATEFADE)
+    return 1.f;
+  return 0.5f - 0.5f*std::cos(juce::MathConstants<float>::pi*float(lag-start)/float(CONV_MULTIRATEFADE));
+}
+
+static int getNextStart(const ConvolutionSplits& splits, int rateIndex)
+{
+  for (int i=rateIndex; i<CONV_NUMFACTORS; i++)
+    if (splits.start[i] >= 0)
+      return splits.start[i];
+  return -1;
+}
+
+static float getPartWeight(const ConvolutionSplits& splits, int rateIndex, int lag)
+{
+  const float fadeIn = rateIndex == 0 ? 1.f : getFadeIn(splits.start[rateIndex-1], lag);
+  return fadeIn - getFadeIn(getNextStart(splits, rateIndex), lag);
+}
+
+static int getPartEnd(const ConvolutionSplits& splits, int rateIndex, int length)
+{
+  const int next = getNextStart(splits, rateIndex);
+  return next < 0 ? length : juce::jmin(length, next+CONV_MULTIRATEFADE);
+}
+
+// Low-pass filter (windowed sinc, cut at the reduced Nyquist frequency)
+// used to decimate and interpolate at 1/factor of the sample rate, of
+// 2*CONV_MULTIRATEFILTERSIZE*factor+1 taps. Its transition band is
+// centered on the cutoff, so that the content of the passband is kept,
+// and the content aliased in the transition band only falls where the
+// decimated IRs are negligible.
+static std::vector<float> getMultirateFilter(int factor)
+{
+  const int delay = CONV_MULTIRATEFILTERSIZE*factor;
+  std::vector<float> filter(size_t(2*delay+1));
+  double sum = 0.0;
+  for (int k=0; k<=2*delay; k++)
+  {
+    const double t = double(k-delay)/factor;
+    const double sinc = k == delay ? 1.0 : std::sin(juce::MathConstants<double>::pi*t)/(juce::MathConstants<double>::pi*t);
+    const double phase = juce::MathConstants<double>::twoPi*k/(2*delay);
+    const double window = 0.42 - 0.5*std::cos(phase) + 0.08*std::cos(2.0*phase);
+    filter[size_t(k)] = float(sinc*window);
+    sum += sinc*window;
+  }
+  for (auto& f : filter)
+    f = float(f/sum);
+  return filter;
+}
+
+// Lags from which an IR has no more content than CONV_MULTIRATELOSS
+// above the passband of each decimated rate, measured on overlapping
+// frames. The lags are measured on the IR, not delayed.
+static ConvolutionSplits getMultirateStarts(const juce::AudioBuffer<float>& ir)
+{
+  ConvolutionSplits starts;
+  const int length = ir.getNumSamples();
+  for (auto& s : starts.start)
+    s = 0;
+  if (length == 0)
+    return starts;
+
+  const int frameOrder = 10;
+  const int frameSize = 1 << frameOrder;
+  const int hop = frameSize/2;
+  const int numFrames = (length+hop-1)/hop;
+
+  RealFft fft(frameOrder);
+  std::vector<float> buffer(size_t(2*frameSize)), window(size_t(2*hop));
+  for (int n=0; n<frameSize; n++)
+    window[size_t(n)] = 0.5f - 0.5f*std::cos(juce::MathConstants<float>::twoPi*float(n)/float(frameSize));
+
+  int cutoff[CONV_NUMFACTORS];
+  for (int i=0; i<CONV_NUMFACTORS; i++)
+    cutoff[i] = int(CONV_MULTIRATEPASSBAND*0.5*frameSize/getFactor(i));
+
+  // (energy above each cutoff, per frame)
+  std::vector<std::vector<double>> high(CONV_NUMFACTORS, std::vector<double>(size_t(numFrames), 0.0));
+  double total = 0.0;
+  for (int c=0; c<ir.getNumChannels(); c++)
+  {
+    auto* h = ir.getReadPointer(c);
+    for (int n=0; n<length; n++)
+      total += double(h[n])*h[n];
+
+    for (int t=0; t<numFrames; t++)
+    {
+      std::fill(buffer.begin(), buffer.end(), 0.f);
+      for (int n=0; n<frameSize && t*hop+n<length; n++)
+        buffer[size_t(n)] = h[t*hop+n]*window[size_t(n)];
+      fft.forward(buffer.data());
+
+      for (int k=cutoff[CONV_NUMFACTORS-1]; k<=frameSize/2; k++)
+      {
+        const double e = double(buffer[size_t(2*k)])*buffer[size_t(2*k)] + double(buffer[size_t(2*k+1)])*buffer[size_t(2*k+1)];
+        for (int i=0; i<CONV_NUMFACTORS; i++)
+          if (k >= cutoff[i])
+            high[size_t(i)][size_t(t)] += e;
+      }
+    }
+  }
+
+  // (Parseval, with the one-sided spectrum and the average power of
+  // the overlapping Hann windows)
+  const double scale = 2.0/frameSize/0.75;
+  const double maxLoss = total*std::pow(10.0, CONV_MULTIRATELOSS/10.0);
+  for (int i=0; i<CONV_NUMFACTORS; i++)
+  {
+    // The samples from (t+1)*hop are only in the frames from t
+    double loss = 0.0;
+    int t = numFrames;
+    while (t > 0 && loss + high[size_t(i)][size_t(t-1)]*scale <= maxLoss)
+      loss += high[size_t(i)][size_t(--t)]*scale;
+    starts.start[i] = juce::jmin(length, t == 0 ? 0 : (t+1)*hop);
+  }
+  return starts;
+}
+
+// Union of two ranges of partitions, either of which can be empty
+static juce::Range<int> unite(juce::Range<int> a, juce::Range<int> b)
+{
+  if (a.isEmpty())
+    return b;
+  if (b.isEmpty())
+    return a;
+  return a.getUnionWith(b);
+}
+
+// Partitions of a stage that depend on a range of lags (of the delayed
+// IR). At a reduced rate, the lag L of a partition is filtered from the
+// lags factor*L+delay to factor*L+3*delay (see ConvolutionKernel).
+static juce::Range<int> getPartitions(const ConvolutionLayout& l, juce::Range<int> lags)
+{
+  if (lags.isEmpty())
+    return {};
+
+  int first = lags.getStart(), last = lags.getEnd()-1;
+  if (l.factor > 1)
+  {
+    const int delay = CONV_MULTIRATEFILTERSIZE*l.factor;
+    if (last < delay)
+      return {};
+    first = (juce::jmax(0, first-3*delay)+l.factor-1)/l.factor;
+    last = (last-delay)/l.factor;
+  }
+  if (last < l.offset || first > last)
+    return {};
+
+  const int end = juce::jmin(l.numPartitions, (last-l.offset)/l.size+1);
+  return {juce::jmin(end, juce::jmax(0, first-l.offset)/l.size), end};
+}
+
+// Samples where two IRs differ (the shorter one being padded with zeros)
+static juce::Range<int> getChangedRange(const juce::AudioBuffer<float>& a, const juce::AudioBuffer<float>& b)
+{
+  const int length = juce::jmax(a.getNumSamples(), b.getNumSamples());
+  if (a.getNumChannels() != b.getNumChannels())
+    return {0, length};
+
+  auto getSample = [](const juce::AudioBuffer<float>& buffer, int c, int n)
+  {
+    return n < buffer.getNumSamples() ? buffer.getSample(c, n) : 0.f;
+  };
+
+  int first = length, end = 0;
+  for (int c=0; c<a.getNumChannels(); c++)
+  {
+    for (int n=0; n<first; n++)
+      if (getSample(a,c,n) != getSample(b,c,n))
+      {
+        first = n;
+        break;
+      }
+    for (int n=length; n>end; n--)
+      if (getSample(a,c,n-1) != getSample(b,c,n-1))
+      {
+        end = n;
+        break;
+      }
+  }
+  return first < end ? juce::Range<int>(first, end) : juce::Range<int>();
+}
+
+// Spectra of the partitions of an IR (delayed by irDelay samples), for
+// each stage of a layout and each channel of the IR. Each part of the
+// IR (see splits) is in the stages at its rate. The decimated stages
+// have the low-passed, decimated, part advanced by the delay of the
+// filters : the partition m holds the lags from
+// factor*(offset+m*size)+2*delay.
+// A kernel can be built from the kernel of the previous IR of its slot
+// (the base), of which only the samples of the changed range (of the IR,
+// not delayed) differ : the partitions that don't depend on them are
+// copied from the base.
+
+// (bytes of the samples of nested vectors)
+static size_t getBytes(const std::vector<float>& v)
+{
+  return v.size()*sizeof(float);
+}
+
+template <typename T>
+static size_t getBytes(const std::vector<std::vector<T>>& v)
+{
+  size_t bytes = 0;
+  for (const auto& w : v)
+    bytes += getBytes(w);
+  return bytes;
+}
+
+struct ConvolutionKernel : public ConvolutionGarbage
+{
+  ConvolutionKernel(const juce::AudioBuffer<float>& ir, int irDelay, const std::vector<ConvolutionLayout>& layout, const ConvolutionSplits& s,
+                    const ConvolutionKernel* base = nullptr, juce::Range<int> changed = {})
+    : numChannels(ir.getNumChannels()), length(ir.getNumSamples() + irDelay), splits(s)
+  {
+    spectra.resize(layout.size());
+    firstPartition.resize(layout.size());
+    numPartitions.resize(layout.size());
+    changedPartitions.resize(layout.size());
+
+    // (only the partitions where the part at the rate of the stage isn't
+    // zero are kept)
+    for (size_t k=0; k<layout.size(); k++)
+    {
+      const auto& l = layout[k];
+      const int rateIndex = getRateIndex(l.factor);
+      const int delay = CONV_MULTIRATEFILTERSIZE*l.factor;
+      const int start = rateIndex == 0 ? 0 : splits.start[rateIndex-1];
+      const int end = getPartEnd(splits, rateIndex, length);
+      const int lowStart = l.factor == 1 ? start : (start-3*delay+l.factor-1)/l.factor;
+      const int lowEnd = l.factor == 1 ? end : (end-1-delay)/l.factor + 1;
+      spectra[k].resize(size_t(numChannels));
+      if (start < 0 || lowEnd <= l.offset)
+        continue;
+      numPartitions[k] = juce::jmin(l.numPartitions, (lowEnd-l.offset+l.size-1)/l.size);
+      firstPartition[k] = juce::jlimit(0, numPartitions[k], (lowStart-l.offset)/l.size);
+    }
+
+    // (partitions kept at each safety level)
+    const double floors[CONV_NUMSAFETYLEVELS] = CONV_SAFETYFLOORS;
+    for (int s=0; s<CONV_NUMSAFETYLEVELS; s++)
+    {
+      const int end = IrTrimmer::getDecayLength(ir, floors[s]) + irDelay;
+      safetyPartitions[s].resize(layout.size());
+      for (size_t k=0; k<layout.size(); k++)
+        safetyPartitions[s][k] = juce::jmin(numPartitions[k], getPartitions(layout[k], {0, end}).getEnd());
+    }
+
+    // Partitions that differ from the ones of the base (all of them
+    // without base)
+    if (base != nullptr && !isCompatible(*base))
+      base = nullptr;
+    for (size_t k=0; k<layout.size(); k++)
+    {
+      if (base == nullptr)
+      {
+        changedPartitions[k] = {0, layout[k].numPartitions};
+        continue;
+      }
+
+      auto& c = changedPartitions[k];
+      c = getPartitions(layout[k], changed + irDelay);
+      // (the partitions that only one of the kernels has)
+      if (firstPartition[k] != base->firstPartition[k])
+        c = unite(c, {juce::jmin(firstPartition[k], base->firstPartition[k]), juce::jmax(firstPartition[k], base->firstPartition[k])});
+      if (numPartitions[k] != base->numPartitions[k])
+        c = unite(c, {juce::jmin(numPartitions[k], base->numPartitions[k]), juce::jmax(numPartitions[k], base->numPartitions[k])});
+      // (if the audio thread hasn't taken the base, this kernel replaces
+      // the previous one, with the changes of the base)
+      if (!base->isTaken.load())
+        c = unite(c, base->changedPartitions[k]);
+    }
+
+    for (int rateIndex=0; rateIndex<=CONV_NUMFACTORS; rateIndex++)
+    {
+      if (rateIndex > 0 && splits.start[rateIndex-1] < 0)
+        continue;
+
+      const int factor = rateIndex == 0 ? 1 : getFactor(rateIndex-1);
+      const auto filter = factor == 1 ? std::vector<float>() : getMultirateFilter(factor);
+      for (int c=0; c<numChannels; c++)
+        for (size_t k=0; k<layout.size(); k++)
+          if (layout[k].factor == factor)
+            createSpectra(int(k), layout[k], c, ir.getReadPointer(c), irDelay, rateIndex, filter, base);
+    }
+  }
+
+  // End of the partitions of a stage used at a safety level
+  int getEndPartition(int stage, int level) const
+  {
+    return level == 0 ? numPartitions[size_t(stage)] : safetyPartitions[level-1][size_t(stage)];
+  }
+
+  size_t getSizeInBytes() const
+  {
+    return getBytes(spectra);
+  }
+
+  // Whether the partitions of the other kernel can be used by this one
+  bool isCompatible(const ConvolutionKernel& other) const
+  {
+    if (other.numChannels != numChannels || other.spectra.size() != spectra.size())
+      return false;
+    for (int i=0; i<CONV_NUMFACTORS; i++)
+      if (other.splits.start[i] != splits.start[i])
+        return false;
+    return true;
+  }
+
+  static int getRateIndex(int factor)
+  {
+    int rateIndex = 0;
+    while (factor > 1)
+    {
+      factor /= 2;
+      rateIndex++;
+    }
+    return rateIndex;
+  }
+
+  // The samples of each partition are read from the IR as it is
+  // transformed (weighted by the part of the rate of the stage, and
+  // filtered in the decimated stages), so that the IR is never copied
+  void createSpectra(int stage, const ConvolutionLayout& l, int channel, const float* h, int irDelay, int rateIndex,
+                     const std::vector<float>& filter, const ConvolutionKernel* base)
+  {
+    const int first = firstPartition[size_t(stage)];
+    const int end = numPartitions[size_t(stage)];
+    auto& partitions = spectra[size_t(stage)];
+    if (first == end)
+      return;
+
+    RealFft fft(juce::roundToInt(std::log2(2*l.size)));
+    std::vector<float> buffer(size_t(4*l.size));
+    const size_t spectrumSize = size_t(2*(l.size+1));
+    const int delay = CONV_MULTIRATEFILTERSIZE*l.factor;
+    const int filterSize = int(filter.size());
+    // (lags of the part read for one partition)
+    std::vector<float> window(size_t(l.factor == 1 ? l.size : l.factor*(l.size-1)+filterSize));
+
+    partitions[size_t(channel)].resize(size_t(end-first)*spectrumSize);
+    for (int m=first; m<end; m++)
+    {
+      auto destination = partitions[size_t(channel)].begin()+long(size_t(m-first)*spectrumSize);
+      // (an unchanged partition, that the base has too)
+      if (base != nullptr && !changedPartitions[size_t(stage)].contains(m))
+      {
+        auto source = base->spectra[size_t(stage)][size_t(channel)].begin()+long(size_t(m-base->firstPartition[size_t(stage)])*spectrumSize);
+        std::copy(source, source+long(spectrumSize), destination);
+        continue;
+      }
+
+      // (filtered at the decimated lag, advanced by 3*delay : the delay
+      // of this filter and of the two filters of the stage)
+      const int windowStart = l.factor == 1 ? l.offset + m*l.size : l.factor*(l.offset + m*l.size) + 3*delay - (filterSize-1);
+      for (int i=0; i<int(window.size()); i++)
+      {
+        const int n = windowStart + i;
+        window[size_t(i)] = n < irDelay || n >= length ? 0.f : h[n-irDelay]*getPartWeight(splits, rateIndex, n);
+      }
+
+      std::fill(buffer.begin(), buffer.end(), 0.f);
+      if (l.factor == 1)
+        std::copy(window.begin(), window.end(), buffer.begin());
+      else
+        for (int i=0; i<l.size; i++)
+        {
+          // (the sum over one lag out of factor is compensated)
+          float sum = 0.f;
+          for (int j=0; j<filterSize; j++)
+            sum += filter[size_t(j)]*window[size_t(l.factor*i+filterSize-1-j)];
+          buffer[size_t(i)] = float(l.factor)*sum;
+        }
+      fft.forward(buffer.data());
+      std::copy(buffer.begin(), buffer.begin()+long(spectrumSize), destination);
+    }
+  }
+
+  int numChannels, length;
+  ConvolutionSplits splits;
+  std::vector<std::vector<std::vector<float>>> spectra;    // [stage][channel], from the first partition
+  std::vector<int> firstPartition, numPartitions;          // [stage]
+  std::vector<int> safetyPartitions[CONV_NUMSAFETYLEVELS]; // [level-1][stage], ends
+  // Partitions that differ from the previous IR of the slot [stage]
+  std::vector<juce::Range<int>> changedPartitions;
+  // Set when the audio thread has taken the kernel
+  std::atomic<bool> isTaken{false};
+};
+
+// The IR channels added to each output
+
+struct ConvolutionRouting
+{
+  struct Source
+  {
+    int slot, input, channel;
+  };
+
+  int numInputs{0}, numOutputs{0}, numSlots{0};
+  std::vector<std::vector<Source>> outputs;
+};
+
+// ======================================================================
+// Uniformly partitioned convolution (overlap-save) of a segment of the
+// IRs. The input history (windows and spectra) is shared by all the IRs
+// fed by the same input.
+
+struct ConvolutionStage
+{
+  ConvolutionStage(int index, const ConvolutionLayout& layout, const ConvolutionRouting& routing);
+  void reset();
+
+  // FFT of the window of an input, stored in the delay line
+  void storeInputSpectrum(int input);
+  // Adds, for the IRs feeding an output, the products of the input
+  // spectra with the partitions firstPartition to endPartition-1.
+  // Returns false if no partition was added.
+  bool accumulate(int output, ConvolutionKernel* const* kernels, int firstPartition, int endPartition, float* acc);
+  // Adds, for the IRs feeding an output that are being replaced, the
+  // products with the previous partitions minus the ones with the new
+  // partitions, over the partitions that have changed (or that are only
+  // used at one of the safety levels) : added to the spectrum of the new
+  // IRs, this gives the spectrum of the previous ones
+  bool accumulateChanges(int output, ConvolutionKernel* const* kernels, ConvolutionKernel* const* previousKernels, float* acc);
+  // Inverse FFT of a spectrum, the output block is then in buffer[size..2*size)
+  void inverse(const float* spectrum);
+  // (delay line and blocks)
+  size_t getSizeInBytes() const;
+
+  const ConvolutionRouting& routing;
+  int index, size, numPartitions, numBins;
+  RealFft fft;
+  std::vector<std::vector<float>> inputSpectra, window;
+  std::vector<float> buffer, changes;
+  int spectrumIndex{0};
+  // (of the current and of the previous IRs, for the tail stages)
+  int safetyLevel{0}, fadeSafetyLevel{0};
+
+  int getEndPartition(const ConvolutionKernel* kernel, int level) const;
+
+private:
+  bool addProducts(const ConvolutionKernel* kernel, const ConvolutionRouting::Source& source, int firstPartition, int endPartition, int level, float* acc);
+};
+
+ConvolutionStage::ConvolutionStage(int stageIndex, const ConvolutionLayout& layout, const ConvolutionRouting& r)
+  : routing(r), index(stageIndex), size(layout.size), numPartitions(layout.numPartitions), numBins(layout.size+1),
+    fft(juce::roundToInt(std::log2(2*layout.size)))
+{
+  buffer.resize(size_t(4*size));
+  changes.resize(size_t(2*numBins));
+  inputSpectra.resize(size_t(routing.numInputs), std::vector<float>(size_t(numPartitions)*size_t(2*numBins)));
+  window.resize(size_t(routing.numInputs), std::vector<float>(size_t(2*size)));
+}
+
+size_t ConvolutionStage::getSizeInBytes() const
+{
+  return getBytes(inputSpectra) + getBytes(window) + getBytes(buffer) + getBytes(changes);
+}
+
+void ConvolutionStage::reset()
+{
+  for (auto& s : inputSpectra)
+    std::fill(s.begin(), s.end(), 0.f);
+  for (auto& w : window)
+    std::fill(w.begin(), w.end(), 0.f);
+  spectrumIndex = 0;
+}
+
+void ConvolutionStage::storeInputSpectrum(int input)
+{
+  auto& w = window[size_t(input)];
+  std::copy(w.begin(), w.end(), buffer.begin());
+  std::fill(buffer.begin()+2*size, buffer.end(), 0.f);
+  fft.forward(buffer.data());
+  std::copy(buffer.begin(), buffer.begin()+2*numBins, inputSpectra[size_t(input)].begin()+long(spectrumIndex)*2*numBins);
+}
+
+bool ConvolutionStage::accumulate(int output, ConvolutionKernel* const* kernels, int firstPartition, int endPartition, float* acc)
+{
+  bool hasAdded = false;
+  for (auto& source : routing.outputs[size_t(output)])
+    hasAdded = addProducts(kernels[source.slot], source, firstPartition, endPartition, safetyLevel, acc) || hasAdded;
+  return hasAdded;
+}
+
+bool ConvolutionStage::accumulateChanges(int output, ConvolutionKernel* const* kernels, ConvolutionKernel* const* previousKernels, float* acc)
+{
+  bool hasAdded = false;
+  for (auto& source : routing.outputs[size_t(output)])
+  {
+    auto* kernel = kernels[source.slot];
+    auto* previous = previousKernels[source.slot];
+    auto changed = kernel == previous ? juce::Range<int>() : kernel == nullptr ? juce::Range<int>(0, numPartitions) : kernel->changedPartitions[size_t(index)];
+    const int end = getEndPartition(kernel, safetyLevel);
+    const int previousEnd = getEndPartition(previous, fadeSafetyLevel);
+    if (end != previousEnd)
+      changed = unite(changed, {juce::jmin(end, previousEnd), juce::jmax(end, previousEnd)});
+    if (changed.isEmpty())
+      continue;
+
+    hasAdded = addProducts(previous, source, changed.getStart(), changed.getEnd(), fadeSafetyLevel, acc) || hasAdded;
+    std::fill(changes.begin(), changes.end(), 0.f);
+    if (addProducts(kernel, source, changed.getStart(), changed.getEnd(), safetyLevel, changes.data()))
+    {
+      juce::FloatVectorOperations::subtract(acc, changes.data(), 2*numBins);
+      hasAdded = true;
+    }
+  }
+  return hasAdded;
+}
+
+int ConvolutionStage::getEndPartition(const ConvolutionKernel* kernel, int level) const
+{
+  return kernel == nullptr ? 0 : kernel->getEndPartition(index, level);
+}
+
+bool ConvolutionStage::addProducts(const ConvolutionKernel* kernel, const ConvolutionRouting::Source& source, int firstPartition, int endPartition, int level, float* acc)
+{
+  if (kernel == nullptr || kernel->numChannels == 0)
+    return false;
+
+  const size_t spectrumSize = size_t(2*numBins);
+  bool hasAdded = false;
+  // (a mono IR feeds all the outputs of its slot)
+  auto* h = kernel->spectra[size_t(index)][size_t(juce::jmin(source.channel, kernel->numChannels-1))].data();
+  auto* x = inputSpectra[size_t(source.input)].data();
+  // (the kernel only has its partitions that aren't zero)
+  const int first = kernel->firstPartition[size_t(index)];
+  const int end = juce::jmin(endPartition, kernel->getEndPartition(index, level));
+  for (int m=juce::jmax(first, firstPartition); m<end; m++)
+  {
+    const int k = (spectrumIndex-m+numPartitions)%numPartitions;
+    RealFft::multiplyAccumulate(acc, x + size_t(k)*spectrumSize, h + size_t(m-first)*spectrumSize, numBins);
+    hasAdded = true;
+  }
+  return hasAdded;
+}
+
+void ConvolutionStage::inverse(const float* spectrum)
+{
+  std::copy(spectrum, spectrum+2*numBins, buffer.begin());
+  fft.inverse(buffer.data());
+}
+
+// ======================================================================
+// Stage of the tail, processed by the workers one block later : the
+// output of the block j is needed after the input block j+1 has been
+// received, which is why the stage of partition size N starts at the
+// sample 2N of the IR.
+// At a reduced rate, the blocks are of factor*N samples, the job
+// decimates the input block and interpolates the output block.
+
+struct ConvolutionTailStage : public ConvolutionStage, public ConvolutionJob
+{
+  ConvolutionTailStage(int stageIndex, const ConvolutionLayout& layout, const ConvolutionRouting& r)
+    : ConvolutionStage(stageIndex, layout, r), factor(layout.factor), blockSize(layout.size*layout.factor)
+  {
+    spectrum.resize(size_t(2*numBins));
+    kernels.resize(size_t(routing.numSlots));
+    fadeKernels.resize(size_t(routing.numSlots));
+    input.resize(size_t(routing.numInputs), std::vector<float>(size_t(blockSize)));
+    for (auto* blocks : {&output[0], &output[1], &fadeOutput})
+      blocks->resize(size_t(routing.numOutputs), std::vector<float>(size_t(blockSize)));
+
+    if (factor > 1)
+    {
+      filter = getMultirateFilter(factor);
+      const int numTaps = int(filter.size());
+      history.resize(size_t(routing.numInputs), std::vector<float>(size_t(numTaps-1+blockSize)));
+
+      // Polyphase interpolation : the output sample factor*q+r is the
+      // product of phases[r] with the low rate samples q-2*CONV_MULTIRATEFILTERSIZE
+      // to q (the filter gain is the factor, for the inserted zeros)
+      const int numLowTaps = 2*CONV_MULTIRATEFILTERSIZE+1;
+      phases.resize(size_t(factor), std::vector<float>(size_t(numLowTaps), 0.f));
+      for (int p=0; p<factor; p++)
+        for (int j=0; j<numLowTaps; j++)
+        {
+          const int k = p + factor*(numLowTaps-1-j);
+          if (k < numTaps)
+            phases[size_t(p)][size_t(j)] = float(factor)*filter[size_t(k)];
+        }
+      lowOutput.resize(size_t(routing.numOutputs), std::vector<float>(size_t(numLowTaps-1+size)));
+      fadeLowOutput.resize(size_t(numLowTaps-1+size));
+      hasLowOutput.resize(size_t(routing.numOutputs), false);
+      phaseBlock.resize(size_t(numLowTaps-1+size));
+    }
+  }
+
+  size_t getSizeInBytes() const
+  {
+    return ConvolutionStage::getSizeInBytes() + getBytes(spectrum) + getBytes(input) + getBytes(output[0]) + getBytes(output[1])
+           + getBytes(fadeOutput) + getBytes(filter) + getBytes(fadeLowOutput) + getBytes(phaseBlock)
+           + getBytes(phases) + getBytes(history) + getBytes(lowOutput);
+  }
+
+  // Called by the audio thread at the end of a block, when the job
+  // is not running
+  void storeInputBlock()
+  {
+    for (int i=0; i<routing.numInputs; i++)
+    {
+      if (factor == 1)
+      {
+        auto& w = window[size_t(i)];
+        std::copy(w.begin()+size, w.end(), w.begin());
+        std::copy(input[size_t(i)].begin(), input[size_t(i)].end(), w.begin()+size);
+      }
+      else
+      {
+        // (the last samples of the previous block are kept for the filter)
+        auto& h = history[size_t(i)];
+        std::copy(h.end()-long(filter.size()-1), h.end(), h.begin());
+        std::copy(input[size_t(i)].begin(), input[size_t(i)].end(), h.begin()+long(filter.size()-1));
+      }
+    }
+  }
+
+  void run() override
+  {
+    if (factor > 1)
+      decimateInput();
+
+    for (int i=0; i<routing.numInputs; i++)
+      storeInputSpectrum(i);
+
+    for (int o=0; o<routing.numOutputs; o++)
+    {
+      std::fill(spectrum.begin(), spectrum.end(), 0.f);
+      const bool hasSpectrum = accumulate(o, kernels.data(), 0, numPartitions, spectrum.data());
+      writeOutput(output[writeIndex][size_t(o)], o, hasSpectrum, false);
+
+      if (isFadingJob)
+      {
+        // (the previous IRs only differ in the partitions that have changed)
+        const bool hasChanges = accumulateChanges(o, kernels.data(), fadeKernels.data(), spectrum.data());
+        writeOutput(fadeOutput[size_t(o)], o, hasSpectrum || hasChanges, true);
+      }
+    }
+    spectrumIndex = (spectrumIndex+1)%numPartitions;
+
+    // (the last low rate samples are kept for the next interpolation)
+    for (auto& l : lowOutput)
+      std::copy(l.end()-2*CONV_MULTIRATEFILTERSIZE, l.end(), l.begin());
+  }
+
+  // The samples factor*q of the input block, low-pass filtered, go to
+  // the window. The filter is symmetric, it is applied to each phase
+  // of the input (the samples factor*m+p).
+  void decimateInput()
+  {
+    const int numTaps = int(filter.size());
+    for (int i=0; i<routing.numInputs; i++)
+    {
+      auto& w = window[size_t(i)];
+      std::copy(w.begin()+size, w.end(), w.begin());
+      auto* decimated = w.data()+size;
+      juce::FloatVectorOperations::clear(decimated, size);
+
+      auto& h = history[size_t(i)];
+      for (int p=0; p<factor; p++)
+      {
+        for (size_t m=0; m<phaseBlock.size(); m++)
+          phaseBlock[m] = h[size_t(factor)*m+size_t(p)];
+        for (int j=0; p+factor*j<numTaps; j++)
+          juce::FloatVectorOperations::addWithMultiply(decimated, phaseBlock.data()+j, filter[size_t(p+factor*j)], size);
+      }
+    }
+  }
+
+  // Inverse transform of the spectrum, to the output block. At a reduced
+  // rate, the previous low rate samples are the ones of the current IRs,
+  // also used for the output of the previous IRs. The outputs fed by no
+  // IR in this stage are skipped.
+  void writeOutput(std::vector<float>& block, int outputIndex, bool hasSpectrum, bool isFade)
+  {
+    if (factor == 1)
+    {
+      if (hasSpectrum)
+      {
+        inverse(spectrum.data());
+        std::copy(buffer.begin()+size, buffer.begin()+2*size, block.begin());
+      }
+      else
+      {
+        std::fill(block.begin(), block.end(), 0.f);
+      }
+      return;
+    }
+
+    const int historySize = 2*CONV_MULTIRATEFILTERSIZE;
+    auto& low = isFade ? fadeLowOutput : lowOutput[size_t(outputIndex)];
+    if (isFade)
+      std::copy(lowOutput[size_t(outputIndex)].begin(), lowOutput[size_t(outputIndex)].begin()+historySize, low.begin());
+
+    if (!isFade)
+    {
+      // (nothing in this block nor in the previous one)
+      const bool isSilent = !hasSpectrum && !hasLowOutput[size_t(outputIndex)];
+      hasLowOutput[size_t(outputIndex)] = hasSpectrum;
+      if (isSilent)
+      {
+        std::fill(block.begin(), block.end(), 0.f);
+        return;
+      }
+    }
+
+    if (hasSpectrum)
+    {
+      inverse(spectrum.data());
+      std::copy(buffer.begin()+size, buffer.begin()+2*size, low.begin()+historySize);
+    }
+    else
+    {
+      std::fill(low.begin()+historySize, low.end(), 0.f);
+    }
+
+    // Polyphase interpolation
+    for (int p=0; p<factor; p++)
+    {
+      juce::FloatVectorOperations::clear(phaseBlock.data(), size);
+      for (int j=0; j<=historySize; j++)
+        if (phases[size_t(p)][size_t(j)] != 0.f)
+          juce::FloatVectorOperations::addWithMultiply(phaseBlock.data(), low.data()+j, phases[size_t(p)][size_t(j)], size);
+      for (int q=0; q<size; q++)
+        block[size_t(factor*q+p)] = phaseBlock[size_t(q)];
+    }
+  }
+
+  void resetTail()
+  {
+    reset();
+    for (auto* blocks : {&input, &output[0], &output[1], &fadeOutput, &history, &lowOutput})
+      for (auto& b : *blocks)
+        std::fill(b.begin(), b.end(), 0.f);
+    std::fill(hasLowOutput.begin(), hasLowOutput.end(), false);
+    position = 0;
+    readIndex = writeIndex = 0;
+    isSubmitted = isFadingJob = false;
+    fadeState = notFading;
+  }
+
+  // When new IRs are loaded, the first job submitted afterwards also
+  // calculates the output with the previous IRs, and its output block
+  // is crossfaded. The stages where the IRs haven't changed only wait
+  // for the job that uses the previous IRs (updating).
+  enum FadeState { notFading, waiting, submitted, crossfading, switched, updating };
+
+  int factor, blockSize;
+  std::vector<float> spectrum;
+  // (copies of the IRs of the engine, for the job)
+  std::vector<ConvolutionKernel*> kernels, fadeKernels;
+  std::vector<std::vector<float>> input, output[2], fadeOutput;
+  int position{0}, readIndex{0}, writeIndex{0};
+  int fadeState{notFading};
+  bool isSubmitted{false}, isFadingJob{false};
+
+  // Resampling, at a reduced rate : input blocks with the end of the
+  // previous one, and low rate output blocks with the end of the
+  // previous one
+  std::vector<float> filter, fadeLowOutput, phaseBlock;
+  std::vector<std::vector<float>> phases, history, lowOutput;
+  std::vector<bool> hasLowOutput;
+};
+
+// ======================================================================
+
+// Crossfade from a to b, at the position of a fade of the given length
+static void crossfade(float* dest, const float* a, const float* b, int n, int position, int length)
+{
+  for (int i=0; i<n; i++)
+  {
+    const float g = juce::jmin(1.f, float(position+i)/float(length));
+    dest[i] = a[i] + g*(b[i]-a[i]);
+  }
+}
+
+static void addCrossfade(float* dest, const float* a, const float* b, int n, int position, int length)
+{
+  for (int i=0; i<n; i++)
+  {
+    const float g = juce::jmin(1.f, float(position+i)/float(length));
+    dest[i] += a[i] + g*(b[i]-a[i]);
+  }
+}
+
+// ======================================================================
+// The processing state of a layout of partitions, with the IRs of the
+// slots partitioned accordingly. The layout is sized for IRs of up to
+// capacity samples, shorter or longer IRs can then be swapped without
+// losing the input history.
+// The head stage is processed by the audio thread, for every call if
+// there is no latency (the spectrum of the current, incomplete, input
+// block is calculated each time), else once per block.
+
+class PartitionedConvolution::Engine : public ConvolutionGarbage
+{
+public:
+  Engine(const ConvolutionRouting& routing, int headSize, int latency, int capacity, const ConvolutionSplits& multirateStarts,
+         int fadeLength, ConvolutionWorkers& w);
+  ~Engine() override;
+  void reset();
+  void process(const juce::dsp::AudioBlock<const float>& input, const juce::dsp::AudioBlock<float>& output);
+  // (called from the audio thread)
+  void clear();
+  int getTailLength() const;
+  // (taken at the next block boundary, with a crossfade, or at once)
+  void setSafetyLevel(int level, bool isImmediate);
+
+  // Called by the loading threads
+  bool canHold(int irLength) const;
+  // (built from the kernel last given to the slot, if there is one, of
+  // which only the changed samples differ)
+  ConvolutionKernel* createKernel(const juce::AudioBuffer<float>& ir, int slot = -1, juce::Range<int> changed = {}) const;
+  void setKernel(int slot, ConvolutionKernel* kernel);            // (before the engine is used)
+  void setPendingKernel(int slot, ConvolutionKernel* kernel);
+  // Partitions of the kernels last given to the slots, and processing
+  // state of the stages (bytes)
+  size_t getKernelBytes() const;
+  size_t getStateBytes() const;
+
+private:
+  ConvolutionWorkers& workers;
+  ConvolutionRouting routing;
+  bool isZeroLatency;
+  int headSize, irDelay, capacity;
+  // (earliest starts of the parts at reduced rates, for all the IRs)
+  ConvolutionSplits splits;
+  std::vector<ConvolutionLayout> layout;
+
+  std::unique_ptr<ConvolutionStage> head;
+  std::vector<std::vector<float>> headSpectrum, headOutput, headFadeSpectrum, headFadeOutput;
+  std::vector<float> spectrum, headBlock;
+  int headPosition{0};
+
+  std::vector<std::unique_ptr<ConvolutionTailStage>> tails;
+
+  // The IRs in use, and the previous ones during a crossfade (the same
+  // for the slots that haven't changed). The new ones are passed by the
+  // loading threads through pendingKernels.
+  std::vector<ConvolutionKernel*> kernels, fadeKernels;
+  std::unique_ptr<std::atomic<ConvolutionKernel*>[]> pendingKernels;
+  // (the kernels last given to the slots, used by the loading threads)
+  std::vector<ConvolutionKernel*> latestKernels;
+  bool isFading{false};
+  int fadePosition{0}, fadeLength;
+  // Safety levels of the tail stages, for the IRs in use and the
+  // previous ones during a crossfade
+  int safetyLevel{0}, fadeSafetyLevel{0}, requestedSafetyLevel{0};
+
+  void endHeadBlock();
+  void endTailBlock(ConvolutionTailStage& tail);
+  void startFade();
+  void finishFade();
+};
+
+PartitionedConvolution::Engine::Engine(const ConvolutionRouting& r, int headSz, int latency, int cap, const ConvolutionSplits& multirateStarts,
+                                       int fadeLen, ConvolutionWorkers& w)
+  : workers(w), routing(r), isZeroLatency(latency == 0), headSize(headSz), irDelay(latency), capacity(cap), fadeLength(juce::jmax(1, fadeLen))
+{
+  // With latency, the IRs are delayed by the size of the head partitions,
+  // so that the first one is empty and the output of a block only
+  // depends on the previous blocks
+  splits = multirateStarts;
+  for (auto& s : splits.start)
+    if (s >= 0)
+      s += irDelay;
+  fitSplits(headSize, capacity, splits);
+  layout = getLayout(headSize, capacity, splits);
+
+  for (int i=0; i<CONV_NUMFACTORS; i++)
+    if (splits.start[i] >= 0)
+      LOG_INFO("Convolution at 1/" << getFactor(i) << " of the sample rate from " << splits.start[i]-irDelay << " samples");
+
+  head = std::make_unique<ConvolutionStage>(0, layout[0], routing);
+  for (auto* spectra : {&headSpectrum, &headFadeSpectrum})
+    spectra->resize(size_t(routing.numOutputs), std::vector<float>(size_t(2*head->numBins)));
+  for (auto* blocks : {&headOutput, &headFadeOutput})
+    blocks->resize(size_t(routing.numOutputs), std::vector<float>(size_t(headSize)));
+  spectrum.resize(size_t(2*head->numBins));
+  headBlock.resize(size_t(headSize));
+
+  for (size_t k=1; k<layout.size(); k++)
+    tails.push_back(std::make_unique<ConvolutionTailStage>(int(k), layout[k], routing));
+
+  kernels.resize(size_t(routing.numSlots), nullptr);
+  fadeKernels.resize(size_t(routing.numSlots), nullptr);
+  latestKernels.resize(size_t(routing.numSlots), nullptr);
+  pendingKernels.reset(new std::atomic<ConvolutionKernel*>[size_t(routing.numSlots)]);
+  for (int s=0; s<routing.numSlots; s++)
+    pendingKernels[size_t(s)] = nullptr;
+
+  reset();
+}
+
+PartitionedConvolution::Engine::~Engine()
+{
+  for (auto& t : tails)
+    workers.cancel(t.get());
+
+  for (int s=0; s<routing.numSlots; s++)
+  {
+    if (fadeKernels[size_t(s)] != kernels[size_t(s)])
+      delete fadeKernels[size_t(s)];
+    delete kernels[size_t(s)];
+    delete pendingKernels[size_t(s)].exchange(nullptr);
+  }
+}
+
+bool PartitionedConvolution::Engine::canHold(int irLength) const
+{
+  return irLength + irDelay <= capacity;
+}
+
+ConvolutionKernel* PartitionedConvolution::Engine::createKernel(const juce::AudioBuffer<float>& ir, int slot, juce::Range<int> changed) const
+{
+  const auto* base = slot < 0 ? nullptr : latestKernels[size_t(slot)];
+
+  // The parts of this IR at reduced rates start where it allows it, but
+  // not before the stages of the engine (else they are convolved at
+  // the full rate). If only the samples before the reduced rates have
+  // changed, the parts of the base are kept.
+  ConvolutionSplits kernelSplits;
+  int firstStart = capacity;
+  if (base != nullptr)
+    for (int i=0; i<CONV_NUMFACTORS; i++)
+      if (base->splits.start[i] >= 0)
+        firstStart = juce::jmin(firstStart, base->splits.start[i]);
+  if (base != nullptr && changed.getEnd()+3*CONV_MULTIRATEFILTERSIZE*getFactor(CONV_NUMFACTORS-1)+irDelay <= firstStart)
+  {
+    kernelSplits = base->splits;
+  }
+  else
+  {
+    kernelSplits = getMultirateStarts(ir);
+    for (int i=0; i<CONV_NUMFACTORS; i++)
+      kernelSplits.start[i] = splits.start[i] < 0 ? -1 : juce::jmax(kernelSplits.start[i]+irDelay, splits.start[i]);
+    fitSplits(headSize, capacity, kernelSplits);
+  }
+  return new ConvolutionKernel(ir, irDelay, layout, kernelSplits, base, changed);
+}
+
+void PartitionedConvolution::Engine::setKernel(int slot, ConvolutionKernel* kernel)
+{
+  delete kernels[size_t(slot)];
+  kernels[size_t(slot)] = fadeKernels[size_t(slot)] = latestKernels[size_t(slot)] = kernel;
+  kernel->isTaken = true;
+}
+
+// (a kernel that the audio thread hasn't taken yet is replaced)
+void PartitionedConvolution::Engine::setPendingKernel(int slot, ConvolutionKernel* kernel)
+{
+  latestKernels[size_t(slot)] = kernel;
+  delete pendingKernels[size_t(slot)].exchange(kernel);
+}
+
+size_t PartitionedConvolution::Engine::getKernelBytes() const
+{
+  size_t bytes = 0;
+  for (auto* k : latestKernels)
+    if (k != nullptr)
+      bytes += k->getSizeInBytes();
+  return bytes;
+}
+
+size_t PartitionedConvolution::Engine::getStateBytes() const
+{
+  size_t bytes = head->getSizeInBytes() + getBytes(headSpectrum) + getBytes(headOutput) + getBytes(headFadeSpectrum)
+                 + getBytes(headFadeOutput) + getBytes(spectrum) + getBytes(headBlock);
+  for (const auto& t : tails)
+    bytes += t->getSizeInBytes();
+  return bytes;
+}
+
+// Not called from the audio thread, the IRs are updated without crossfade
+void PartitionedConvolution::Engine::reset()
+{
+  for (auto& t : tails)
+  {
+    workers.cancel(t.get());
+    t->resetTail();
+  }
+
+  for (int s=0; s<routing.numSlots; s++)
+  {
+    if (fadeKernels[size_t(s)] != kernels[size_t(s)])
+      delete fadeKernels[size_t(s)];
+    if (auto* k = pendingKernels[size_t(s)].exchange(nullptr))
+    {
+      delete kernels[size_t(s)];
+      kernels[size_t(s)] = k;
+      k->isTaken = true;
+    }
+    fadeKernels[size_t(s)] = kernels[size_t(s)];
+  }
+  isFading = false;
+  fadePosition = 0;
+  safetyLevel = fadeSafetyLevel = requestedSafetyLevel;
+
+  head->reset();
+  for (auto* vectors : {&headSpectrum, &headFadeSpectrum, &headOutput, &headFadeOutput})
+    for (auto& v : *vectors)
+      std::fill(v.begin(), v.end(), 0.f);
+  headPosition = 0;
+}
+
+// Unlike reset(), the IRs are kept : the ones loaded meanwhile, or
+// being faded in, are switched to at once, as there is no input left to
+// crossfade (the previous ones are disposed of by finishFade())
+void PartitionedConvolution::Engine::clear()
+{
+  for (auto& t : tails)
+  {
+    if (t->isSubmitted)
+      workers.finish(t.get());
+    t->resetTail();
+  }
+
+  auto endFade = [this]
+  {
+    if (!isFading)
+      return;
+    fadePosition = fadeLength;
+    for (auto& t : tails)
+      t->fadeState = ConvolutionTailStage::switched;
+    finishFade();
+  };
+  endFade();
+  if (!isFading)
+  {
+    startFade();
+    endFade();
+  }
+
+  head->reset();
+  for (auto* vectors : {&headSpectrum, &headFadeSpectrum, &headOutput, &headFadeOutput})
+    for (auto& v : *vectors)
+      std::fill(v.begin(), v.end(), 0.f);
+  headPosition = 0;
+}
+
+// The longest IR in use, with the delay of the interpolation filters
+// of the reduced rates (-1 during a crossfade)
+int PartitionedConvolution::Engine::getTailLength() const
+{
+  if (isFading)
+    return -1;
+  int length = 0;
+  for (auto* k : kernels)
+    if (k != nullptr)
+      length = juce::jmax(length, k->length);
+  return length + 4*CONV_MULTIRATEFILTERSIZE*getFactor(CONV_NUMFACTORS-1);
+}
+
+void PartitionedConvolution::Engine::setSafetyLevel(int level, bool isImmediate)
+{
+  requestedSafetyLevel = level;
+  if (isImmediate && !isFading)
+    safetyLevel = fadeSafetyLevel = level;
+}
+
+void PartitionedConvolution::Engine::process(const juce::dsp::AudioBlock<const float>& input, const juce::dsp::AudioBlock<float>& output)
+{
+  const int numSamples = int(output.getNumSamples());
+
+  // The block is processed in chunks that don't cross the boundaries
+  // of the head blocks (which are also the ones of the tail blocks)
+  for (int start=0; start<numSamples; )
+  {
+    const int n = juce::jmin(numSamples-start, headSize-headPosition);
+    const bool isBlockEnd = headPosition+n == headSize;
+    const bool isHeadFading = isFading && fadePosition < fadeLength;
+
+    for (int i=0; i<routing.numInputs; i++)
+    {
+      auto* data = input.getChannelPointer(size_t(i)) + start;
+      std::copy(data, data+n, head->window[size_t(i)].begin()+headSize+headPosition);
+      for (auto& t : tails)
+        std::copy(data, data+n, t->input[size_t(i)].begin()+t->position);
+
+      // (spectrum of the current, zero padded, block)
+      if (isZeroLatency)
+        head->storeInputSpectrum(i);
+    }
+
+    for (int o=0; o<routing.numOutputs; o++)
+    {
+      auto* data = output.getChannelPointer(size_t(o)) + start;
+
+      if (isZeroLatency)
+      {
+        // Current block times the first partitions, plus the
+        // contribution of the previous blocks
+        spectrum = headSpectrum[size_t(o)];
+        head->accumulate(o, kernels.data(), 0, 1, spectrum.data());
+        head->inverse(spectrum.data());
+        std::copy(head->buffer.begin()+headSize+headPosition, head->buffer.begin()+headSize+headPosition+n, data);
+
+        if (isHeadFading)
+        {
+          std::copy(data, data+n, headBlock.begin());
+          spectrum = headFadeSpectrum[size_t(o)];
+          head->accumulate(o, fadeKernels.data(), 0, 1, spectrum.data());
+          head->inverse(spectrum.data());
+          crossfade(data, head->buffer.data()+headSize+headPosition, headBlock.data(), n, fadePosition, fadeLength);
+        }
+      }
+      else
+      {
+        auto* out = headOutput[size_t(o)].data()+headPosition;
+        if (isHeadFading)
+          crossfade(data, headFadeOutput[size_t(o)].data()+headPosition, out, n, fadePosition, fadeLength);
+        else
+          std::copy(out, out+n, data);
+      }
+
+      for (auto& t : tails)
+      {
+        auto* out = t->output[t->readIndex][size_t(o)].data()+t->position;
+        if (t->fadeState == ConvolutionTailStage::crossfading)
+          addCrossfade(data, t->fadeOutput[size_t(o)].data()+t->position, out, n, t->position, t->blockSize);
+        else
+          juce::FloatVectorOperations::add(data, out, n);
+      }
+    }
+
+    headPosition += n;
+    if (isHeadFading)
+      fadePosition = juce::jmin(fadeLength, fadePosition+n);
+    for (auto& t : tails)
+      t->position += n;
+
+    if (isBlockEnd)
+      endHeadBlock();
+    for (auto& t : tails)
+      if (t->position == t->blockSize)
+        endTailBlock(*t);
+
+    if (isFading)
+      finishFade();
+
+    start += n;
+  }
+}
+
+// The input block is complete : its spectrum goes to the delay line,
+// and the contribution of the previous blocks to the next output
+// block is calculated
+void PartitionedConvolution::Engine::endHeadBlock()
+{
+  for (int i=0; i<routing.numInputs; i++)
+  {
+    // (with zero latency, the spectrum of the complete block has just been stored)
+    if (!isZeroLatency)
+      head->storeInputSpectrum(i);
+    auto& w = head->window[size_t(i)];
+    std::copy(w.begin()+headSize, w.end(), w.begin());
+    std::fill(w.begin()+headSize, w.end(), 0.f);
+  }
+
+  head->spectrumIndex = (head->spectrumIndex+1)%head->numPartitions;
+
+  // New IRs are only taken at a block boundary, where all the stages
+  // can start their crossfade
+  if (!isFading)
+    startFade();
+  const bool isHeadFading = isFading && fadePosition < fadeLength;
+
+  for (int o=0; o<routing.numOutputs; o++)
+  {
+    auto& s = headSpectrum[size_t(o)];
+    std::fill(s.begin(), s.end(), 0.f);
+    head->accumulate(o, kernels.data(), 1, head->numPartitions, s.data());
+    if (!isZeroLatency)
+    {
+      head->inverse(s.data());
+      std::copy(head->buffer.begin()+headSize, head->buffer.begin()+2*headSize, headOutput[size_t(o)].begin());
+    }
+
+    if (isHeadFading)
+    {
+      auto& fs = headFadeSpectrum[size_t(o)];
+      std::fill(fs.begin(), fs.end(), 0.f);
+      head->accumulate(o, fadeKernels.data(), 1, head->numPartitions, fs.data());
+      if (!isZeroLatency)
+      {
+        head->inverse(fs.data());
+        std::copy(head->buffer.begin()+headSize, head->buffer.begin()+2*headSize, headFadeOutput[size_t(o)].begin());
+      }
+    }
+  }
+
+  headPosition = 0;
+}
+
+// The output of the job submitted at the previous boundary is needed
+// from now on, and the input block just received is submitted
+void PartitionedConvolution::Engine::endTailBlock(ConvolutionTailStage& tail)
+{
+  if (tail.isSubmitted)
+    workers.finish(&tail);
+  tail.readIndex = tail.writeIndex;
+  tail.writeIndex = 1-tail.writeIndex;
+
+  if (tail.fadeState == ConvolutionTailStage::crossfading || tail.fadeState == ConvolutionTailStage::updating)
+    tail.fadeState = ConvolutionTailStage::switched;
+  else if (tail.fadeState == ConvolutionTailStage::submitted)
+    tail.fadeState = ConvolutionTailStage::crossfading;
+
+  tail.storeInputBlock();
+
+  std::copy(kernels.begin(), kernels.end(), tail.kernels.begin());
+  tail.safetyLevel = safetyLevel;
+  tail.fadeSafetyLevel = fadeSafetyLevel;
+  tail.isFadingJob = tail.fadeState == ConvolutionTailStage::waiting;
+  if (tail.isFadingJob)
+  {
+    std::copy(fadeKernels.begin(), fadeKernels.end(), tail.fadeKernels.begin());
+    tail.fadeState = ConvolutionTailStage::submitted;
+  }
+
+  tail.position = 0;
+  workers.submit(&tail);
+  tail.isSubmitted = true;
+}
+
+// Takes the IRs passed by the loading threads, and the safety level
+void PartitionedConvolution::Engine::startFade()
+{
+  bool hasChanged = false;
+  for (int s=0; s<routing.numSlots; s++)
+  {
+    if (pendingKernels[size_t(s)].load() == nullptr)
+      continue;
+    fadeKernels[size_t(s)] = kernels[size_t(s)];
+    kernels[size_t(s)] = pendingKernels[size_t(s)].exchange(nullptr);
+    kernels[size_t(s)]->isTaken = true;
+    hasChanged = true;
+  }
+
+  if (!hasChanged && requestedSafetyLevel == safetyLevel)
+    return;
+  if (hasChanged)
+    TraceLog::instant("swap IR");
+
+  fadeSafetyLevel = safetyLevel;
+  safetyLevel = requestedSafetyLevel;
+  isFading = true;
+  // (the head isn't shortened, it only fades to new IRs)
+  fadePosition = hasChanged ? 0 : fadeLength;
+  for (auto& t : tails)
+  {
+    bool hasChangedPartitions = false;
+    for (int s=0; s<routing.numSlots; s++)
+    {
+      auto* k = kernels[size_t(s)];
+      auto* f = fadeKernels[size_t(s)];
+      if (k != f && !k->changedPartitions[size_t(t->index)].isEmpty())
+        hasChangedPartitions = true;
+      if (t->getEndPartition(k, safetyLevel) != t->getEndPartition(f, fadeSafetyLevel))
+        hasChangedPartitions = true;
+    }
+    t->fadeState = hasChangedPartitions ? ConvolutionTailStage::waiting : ConvolutionTailStage::updating;
+  }
+}
+
+// Once all the stages have been crossfaded, the previous IRs are
+// disposed of
+void PartitionedConvolution::Engine::finishFade()
+{
+  if (fadePosition < fadeLength)
+    return;
+  for (auto& t : tails)
+    if (t->fadeState != ConvolutionTailStage::switched)
+      return;
+
+  // (if the workers can't take them now, this is tried again later)
+  for (int s=0; s<routing.numSlots; s++)
+  {
+    auto* k = fadeKernels[size_t(s)];
+    if (k == kernels[size_t(s)])
+      continue;
+    if (k != nullptr && !workers.dispose(k))
+      return;
+    fadeKernels[size_t(s)] = kernels[size_t(s)];
+  }
+
+  isFading = false;
+  fadeSafetyLevel = safetyLevel;
+  for (auto& t : tails)
+    t->fadeState = ConvolutionTailStage::notFading;
+}
+
+// ======================================================================
+
+PartitionedConvolution::Resampler::Resampler(PartitionedConvolution& o) : juce::Thread("convolution resampler"), owner(o)
+{
+
+}
+
+void PartitionedConvolution::Resampler::run()
+{
+  while (!threadShouldExit())
+  {
+    if (!owner.resampleNextIr())
+      wait(-1);
+  }
+}
+
+PartitionedConvolution::PartitionedConvolution()
+{
+
+}
+
+PartitionedConvolution::~PartitionedConvolution()
+{
+  // (a resampling can't be interrupted)
+  resampler.signalThreadShouldExit();
+  resampler.notify();
+  resampler.stopThread(-1);
+
+  deleteEngines();
+}
+
+int PartitionedConvolution::addSlot(int input, int firstOutput, int numChannels)
+{
+  auto slot = std::make_unique<Slot>();
+  slot->input = input;
+  slot->firstOutput = firstOutput;
+  slot->numChannels = numChannels;
+  slots.push_back(std::move(slot));
+
+  numInputs = juce::jmax(numInputs, input+1);
+  numOutputs = juce::jmax(numOutputs, firstOutput+numChannels);
+  return int(slots.size())-1;
+}
+
+int PartitionedConvolution::getNumInputs() const
+{
+  return numInputs;
+}
+
+int PartitionedConvolution::getNumOutputs() const
+{
+  return numOutputs;
+}
+
+void PartitionedConvolution::setLatency(int latencyInSamples)
+{
+  requestedLatency = juce::jmax(0, latencyInSamples);
+}
+
+int PartitionedConvolution::getLatency() const
+{
+  return latency;
+}
+
+std::vector<int> PartitionedConvolution::getPartitionSizes(int headSize)
+{
+  std::vector<int> sizes;
+  for (int size=headSize; size<=CONV_MAXPARTITION; size*=CONV_GROWTH)
+    sizes.push_back(size);
+  for (int i=0; i<CONV_NUMFACTORS; i++)
+    sizes.push_back(getLastStageSize(headSize)/getFactor(i));
+  std::sort(sizes.begin(), sizes.end());
+  sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+  return sizes;
+}
+
+int PartitionedConvolution::getLatencyFromChoice(int choiceIndex)
+{
+  static const int latencies[] = {0, 256, 1024, 4096};
+  return latencies[juce::jlimit(0, 3, choiceIndex)];
+}
+
+void PartitionedConvolution::prepare(const juce::dsp::ProcessSpec& newSpec)
+{
+  const juce::ScopedLock sl(loadLock);
+  deleteEngines();
+
+  const bool rateHasChanged = !juce::approximatelyEqual(newSpec.sampleRate, spec.sampleRate);
+  spec = newSpec;
+  isPrepared = true;
+
+  // Without latency, the head blocks are the host blocks
+  if (requestedLatency > 0)
+  {
+    headSize = juce::jlimit(CONV_MINHEADSIZE, CONV_MAXHEADSIZE, juce::nextPowerOfTwo(requestedLatency));
+    latency = headSize;
+  }
+  else
+  {
+    headSize = juce::jlimit(CONV_MINHEADSIZE, CONV_MAXHEADSIZE, juce::nextPowerOfTwo(int(spec.maximumBlockSize)));
+    latency = 0;
+  }
+
+  fadeBuffer.setSize(numOutputs, int(spec.maximumBlockSize));
+  fadeLength = juce::jmax(1, int(CONV_FADETIME*spec.sampleRate));
+  fadePosition = 0;
+
+  // The long IRs at another sample rate are resampled by the resampler
+  // thread, and loaded when they are ready
+  bool resamples = false;
+  for (auto& s : slots)
+  {
+    if (rateHasChanged)
+      s->resampledIr = nullptr;
+    s->needsResampling = s->ir != nullptr && s->resampledIr == nullptr
+      && !juce::approximatelyEqual(s->irSampleRate, spec.sampleRate)
+      && s->ir->getNumSamples()*s->ir->getNumChannels() > CONV_MAXINLINERESAMPLE;
+    resamples = resamples || s->needsResampling;
+  }
+
+  current = latest = createEngine();
+
+  if (resamples)
+  {
+    if (!resampler.isThreadRunning())
+      resampler.startThread(juce::Thread::Priority::low);
+    resampler.notify();
+  }
+}
+
+void PartitionedConvolution::reset()
+{
+  const juce::ScopedLock sl(loadLock);
+  delete previous;
+  previous = nullptr;
+  if (current != nullptr)
+    current->reset();
+}
+
+juce::Range<double> PartitionedConvolution::loadImpulseResponse(int slot, juce::AudioBuffer<float>&& ir, double sampleRate)
+{
+  return loadImpulseResponse(slot, std::make_shared<const juce::AudioBuffer<float>>(std::move(ir)), sampleRate);
+}
+
+juce::Range<double> PartitionedConvolution::loadImpulseResponse(int slot, std::shared_ptr<const juce::AudioBuffer<float>> ir, double sampleRate)
+{
+  const juce::ScopedLock sl(loadLock);
+  auto& s = *slots[size_t(slot)];
+  s.ir = std::move(ir);
+  s.irSampleRate = sampleRate;
+  s.irSize = s.ir->getNumSamples();
+  s.ownsIr = false;
+  s.resampledIr = nullptr;
+  s.needsResampling = false;
+
+  if (!isPrepared)
+    return {0.0, s.ir->getNumSamples()/sampleRate};
+
+  return loadPartitionedIr(slot, getResampledIr(s));
+}
+
+juce::Range<double> PartitionedConvolution::updateImpulseResponse(int slot, juce::AudioBuffer<float>&& ir, double sampleRate, double updateTime)
+{
+  return updateImpulseResponse(slot, std::make_shared<const juce::AudioBuffer<float>>(std::move(ir)), sampleRate, updateTime);
+}
+
+juce::Range<double> PartitionedConvolution::updateImpulseResponse(int slot, std::shared_ptr<const juce::AudioBuffer<float>> ir, double sampleRate, double updateTime)
+{
+  const juce::ScopedLock sl(loadLock);
+  auto& s = *slots[size_t(slot)];
+  if (!isPrepared || s.partitionedIr == nullptr || s.partitionedIr->getNumSamples() == 0)
+    return loadImpulseResponse(slot, std::move(ir), sampleRate);
+
+  auto resampled = juce::approximatelyEqual(sampleRate, spec.sampleRate) ? std::move(ir)
+    : std::make_shared<const juce::AudioBuffer<float>>(IrResampler::process(*ir, sampleRate, spec.sampleRate));
+
+  // (the whole IR is replaced if one of them is shorter than the update)
+  const auto& current = *s.partitionedIr;
+  const int spliceEnd = int(updateTime*spec.sampleRate);
+  if (resampled->getNumChannels() != current.getNumChannels() || spliceEnd >= juce::jmin(resampled->getNumSamples(), current.getNumSamples()))
+    return loadImpulseResponse(slot, std::move(resampled), spec.sampleRate);
+
+  // The new IR fades into the current one at the end of the update. The
+  // spliced IR is both the IR of the slot and the partitioned one.
+  const int spliceStart = juce::jmax(0, spliceEnd-int(CONV_SPLICETIME*spec.sampleRate));
+  auto spliced = std::make_shared<juce::AudioBuffer<float>>();
+  spliced->makeCopyOf(current);
+  for (int c=0; c<spliced->getNumChannels(); c++)
+  {
+    spliced->copyFrom(c, 0, *resampled, c, 0, spliceStart);
+    auto* data = spliced->getWritePointer(c);
+    auto* updated = resampled->getReadPointer(c);
+    for (int n=spliceStart; n<spliceEnd; n++)
+    {
+      const float g = 0.5f - 0.5f*std::cos(juce::MathConstants<float>::pi*float(n-spliceStart)/float(spliceEnd-spliceStart));
+      data[n] = updated[n] + g*(data[n]-updated[n]);
+    }
+  }
+
+  s.ir = spliced;
+  s.irSampleRate = spec.sampleRate;
+  s.irSize = s.ir->getNumSamples();
+  s.ownsIr = true;
+  s.resampledIr = nullptr;
+  s.needsResampling = false;
+  return loadPartitionedIr(slot, getShortenedIr(std::move(spliced)));
+}
+
+// The IR is partitioned here, the audio thread only swaps it. Only the
+// partitions that depend on the samples that differ from the previous
+// IR are transformed. If it is too long for the delay lines of the
+// latest engine, a new engine is built (and crossfaded with the current
+// one).
+juce::Range<double> PartitionedConvolution::loadPartitionedIr(int slot, std::shared_ptr<const juce::AudioBuffer<float>> ir)
+{
+  TraceLog::Scope trace("partition IR");
+  auto& s = *slots[size_t(slot)];
+  auto changed = s.partitionedIr == nullptr ? juce::Range<int>(0, ir->getNumSamples()) : getChangedRange(*s.partitionedIr, *ir);
+  s.partitionedIr = std::move(ir);
+
+  if (latest != nullptr && latest->canHold(s.partitionedIr->getNumSamples()))
+  {
+    if (!changed.isEmpty())
+      latest->setPendingKernel(slot, latest->createKernel(*s.partitionedIr, slot, changed));
+  }
+  else
+  {
+    latest = createEngine();
+    delete pending.exchange(latest);
+    changed = {0, s.partitionedIr->getNumSamples()};
+  }
+
+  const juce::Range<double> range(changed.getStart()/spec.sampleRate, changed.getEnd()/spec.sampleRate);
+  LOG_INFO("IR updated from " << range.getStart() << " to " << range.getEnd() << " s");
+  return range;
+}
+
+int PartitionedConvolution::getCurrentIRSize(int slot) const
+{
+  return slots[size_t(slot)]->irSize;
+}
+
+// Resamples the first IR awaited, outside of loadLock, and loads it
+// unless it has been replaced meanwhile. Returns false if none is awaited.
+bool PartitionedConvolution::resampleNextIr()
+{
+  int slot = -1;
+  std::shared_ptr<const juce::AudioBuffer<float>> ir;
+  double irSampleRate = 0.0, sampleRate = 0.0;
+  {
+    const juce::ScopedLock sl(loadLock);
+    for (size_t i=0; i<slots.size() && slot<0; i++)
+    {
+      if (slots[i]->needsResampling)
+      {
+        slot = int(i);
+        ir = slots[i]->ir;
+        irSampleRate = slots[i]->irSampleRate;
+        sampleRate = spec.sampleRate;
+      }
+    }
+  }
+  if (slot < 0)
+    return false;
+
+  TraceLog::Scope trace("resample IR");
+  auto resampled = std::make_shared<const juce::AudioBuffer<float>>(IrResampler::process(*ir, irSampleRate, sampleRate));
+
+  const juce::ScopedLock sl(loadLock);
+  auto& s = *slots[size_t(slot)];
+  if (s.needsResampling && s.ir == ir && juce::approximatelyEqual(spec.sampleRate, sampleRate))
+  {
+    s.resampledIr = std::move(resampled);
+    s.needsResampling = false;
+    loadPartitionedIr(slot, getResampledIr(s));
+  }
+  return true;
+}
+
+// (the IR of the slot itself when it is at the sample rate of the engines,
+// and not longer than maxIrTime ; empty while it is awaited from the
+// resampler thread)
+std::shared_ptr<const juce::AudioBuffer<float>> PartitionedConvolution::getResampledIr(const Slot& slot) const
+{
+  if (slot.ir == nullptr || slot.needsResampling)
+    return std::make_shared<const juce::AudioBuffer<float>>();
+  if (slot.ir->getNumSamples() == 0 || juce::approximatelyEqual(slot.irSampleRate, spec.sampleRate))
+    return getShortenedIr(slot.ir);
+  if (slot.resampledIr != nullptr)
+    return getShortenedIr(slot.resampledIr);
+  return getShortenedIr(std::make_shared<const juce::AudioBuffer<float>>(IrResampler::process(*slot.ir, slot.irSampleRate, spec.sampleRate)));
+}
+
+// (a copy of its first maxIrTime seconds, with a fade out, if it is longer)
+std::shared_ptr<const juce::AudioBuffer<float>> PartitionedConvolution::getShortenedIr(std::shared_ptr<const juce::AudioBuffer<float>> ir) const
+{
+  const int maxLength = int(maxIrTime*spec.sampleRate);
+  if (maxLength <= 0 || ir->getNumSamples() <= maxLength)
+    return ir;
+
+  auto shortened = std::make_shared<juce::AudioBuffer<float>>(ir->getNumChannels(), maxLength);
+  const int fadeLength = juce::jlimit(1, maxLength, int(TRIM_FADETIME*spec.sampleRate));
+  for (int c=0; c<ir->getNumChannels(); c++)
+  {
+    shortened->copyFrom(c, 0, *ir, c, 0, maxLength);
+    auto* h = shortened->getWritePointer(c, maxLength-fadeLength);
+    for (int n=0; n<fadeLength; n++)
+      h[n] *= 0.5f + 0.5f*std::cos(juce::MathConstants<float>::pi*float(n)/float(fadeLength));
+  }
+  LOG_INFO("IR shortened from " << ir->getNumSamples()/spec.sampleRate << " to " << maxIrTime << " s (memory budget)");
+  return shortened;
+}
+
+void PartitionedConvolution::setMaxIrTime(double seconds)
+{
+  const juce::ScopedLock sl(loadLock);
+  maxIrTime = juce::jmax(0.0, seconds);
+}
+
+void PartitionedConvolution::addMemoryUsage(MemoryUsage& usage) const
+{
+  const juce::ScopedLock sl(loadLock);
+  if (latest != nullptr)
+  {
+    usage.bytes[MemoryUsage::partitions] += latest->getKernelBytes();
+    usage.bytes[MemoryUsage::convolutionState] += latest->getStateBytes();
+  }
+  usage.bytes[MemoryUsage::buffers] += MemoryUsage::getBytes(fadeBuffer);
+
+  for (const auto& s : slots)
+  {
+    if (s->ownsIr && s->ir != nullptr)
+      usage.bytes[MemoryUsage::irCopies] += MemoryUsage::getBytes(*s->ir);
+    if (s->partitionedIr != nullptr && s->partitionedIr != s->ir && s->partitionedIr != s->resampledIr)
+      usage.bytes[MemoryUsage::irCopies] += MemoryUsage::getBytes(*s->partitionedIr);
+    if (s->resampledIr != nullptr)
+      usage.bytes[MemoryUsage::irCopies] += MemoryUsage::getBytes(*s->resampledIr);
+  }
+}
+
+PartitionedConvolution::Engine* PartitionedConvolution::createEngine()
+{
+  if (!isPrepared)
+    return nullptr;
+
+  ConvolutionRouting routing;
+  routing.numInputs = numInputs;
+  routing.numOutputs = numOutputs;
+  routing.numSlots = int(slots.size());
+  routing.outputs.resize(size_t(numOutputs));
+
+  std::vector<std::shared_ptr<const juce::AudioBuffer<float>>> irs;
+  int maxLength = 0;
+  ConvolutionSplits multirateStarts;
+  for (auto& start : multirateStarts.start)
+    start = 0;
+  for (int i=0; i<routing.numSlots; i++)
+  {
+    auto& s = *slots[size_t(i)];
+    for (int c=0; c<s.numChannels; c++)
+      routing.outputs[size_t(s.firstOutput+c)].push_back({i, s.input, c});
+    irs.push_back(getResampledIr(s));
+    s.partitionedIr = irs.back();
+    maxLength = juce::jmax(maxLength, irs.back()->getNumSamples());
+
+    // (the reduced rates start where all the IRs allow it)
+    auto starts = getMultirateStarts(*irs.back());
+    for (int f=0; f<CONV_NUMFACTORS; f++)
+      multirateStarts.start[f] = juce::jmax(multirateStarts.start[f], starts.start[f]);
+  }
+
+  if (maxLength == 0)
+    return nullptr;
+
+  // (no stage at a rate that none of the IRs uses)
+  for (auto& start : multirateStarts.start)
+    if (start >= maxLength)
+      start = -1;
+
+  const int capacity = int((maxLength+latency)*CONV_CAPACITYMARGIN);
+  auto* engine = new Engine(routing, headSize, latency, capacity, multirateStarts, fadeLength, *workers);
+  for (int i=0; i<routing.numSlots; i++)
+    engine->setKernel(i, engine->createKernel(*irs[size_t(i)]));
+  return engine;
+}
+
+// Called from the audio thread, the previous engine must have been
+// faded out before a new one can be used
+void PartitionedConvolution::swapPendingEngine()
+{
+  if (previous != nullptr || pending.load() == nullptr)
+    return;
+
+  auto* e = pending.exchange(nullptr);
+  TraceLog::instant("swap engine");
+  // (a new engine is crossfaded in anyway)
+  e->setSafetyLevel(safetyLevel, true);
+  if (current != nullptr)
+  {
+    previous = current;
+    fadePosition = 0;
+  }
+  current = e;
+}
+
+void PartitionedConvolution::deleteEngines()
+{
+  delete pending.exchange(nullptr);
+  delete previous;
+  delete current;
+  previous = current = latest = nullptr;
+}
+
+int PartitionedConvolution::getTailLength() const
+{
+  if (previous != nullptr)
+    return -1;
+  return current == nullptr ? 0 : current->getTailLength();
+}
+
+void PartitionedConvolution::clear()
+{
+  // (same for an engine created meanwhile)
+  swapPendingEngine();
+  if (previous != nullptr && workers->dispose(previous))
+    previous = nullptr;
+  for (auto* e : {current, previous})
+    if (e != nullptr)
+      e->clear();
+}
+
+void PartitionedConvolution::setSafetyLevel(int level)
+{
+  safetyLevel = juce::jlimit(0, CONV_NUMSAFETYLEVELS, level);
+  for (auto* e : {current, previous})
+    if (e != nullptr)
+      e->setSafetyLevel(safetyLevel, false);
+}
+
+void PartitionedConvolution::process(const juce::dsp::ProcessContextNonReplacing<float>& context)
+{
+  auto& input = context.getInputBlock();
+  auto& output = context.getOutputBlock();
+  jassert(int(input.getNumChannels()) >= numInputs && int(output.getNumChannels()) >= numOutputs);
+
+  swapPendingEngine();
+
+  if (current == nullptr)
+  {
+    output.clear();
+    return;
+  }
+
+  const size_t numSamples = output.getNumSamples();
+  size_t start = 0;
+
+  // Crossfade between the previous and the current engine
+  while (previous != nullptr && start < numSamples)
+  {
+    const size_t n = juce::jmin(numSamples-start, size_t(fadeBuffer.getNumSamples()));
+    auto inputBlock = input.getSubBlock(start, n);
+    auto outputBlock = output.getSubBlock(start, n);
+    juce::dsp::AudioBlock<float> fadeBlock(fadeBuffer.getArrayOfWritePointers(), size_t(numOutputs), n);
+
+    previous->process(inputBlock, fadeBlock);
+    current->process(inputBlock, outputBlock);
+
+    for (int c=0; c<numOutputs; c++)
+    {
+      auto* out = outputBlock.getChannelPointer(size_t(c));
+      crossfade(out, fadeBlock.getChannelPointer(size_t(c)), out, int(n), fadePosition, fadeLength);
+    }
+
+    fadePosition += int(n);
+    start += n;
+
+    // (if the workers can't take it now, it keeps being faded out at zero gain)
+    if (fadePosition >= fadeLength && workers->dispose(previous))
+      previous = nullptr;
+  }
+
+  if (start < numSamples)
+    current->process(input.getSubBlock(start, numSamples-start), output.getSubBlock(start, numSamples-start));
+}
@@ -0,0 +1,405 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "IrResampler.h"
+#include "RealFft.h"
+#include "MemoryUsage.h"
+#include <atomic>
+#include <cstddef>
+
+#if JUCE_LINUX || JUCE_BSD || JUCE_ANDROID
+ #include <semaphore.h>
+#endif
+
+// Bounds of the head partition size
+#define CONV_MINHEADSIZE 64
+#define CONV_MAXHEADSIZE 4096
+// Ratio between the partition sizes of two successive stages
+#define CONV_GROWTH 4
+// Largest partition size of the tail stages
+#define CONV_MAXPARTITION 16384
+// Duration of the crossfade when a new IR is loaded (seconds)
+#define CONV_FADETIME 0.05
+// Duration of the splice between the new and the kept parts of an IR
+// updated partially (seconds)
+#define CONV_SPLICETIME 0.005
+// Room left for longer IRs when the delay lines are allocated
+#define CONV_CAPACITYMARGIN 1.25
+// The parts of the tail with almost no content in the upper part of the
+// spectrum are convolved at 1/2 or 1/4 of the sample rate :
+// level of the content that can be lost (dB, relative to the IR energy)
+#define CONV_MULTIRATELOSS -60.0
+// Passband of the resampling filters (part of the reduced bandwidth)
+#define CONV_MULTIRATEPASSBAND 0.8
+// Half length of the resampling filters (samples at the reduced rate)
+#define CONV_MULTIRATEFILTERSIZE 14
+// Crossfade between the parts of an IR at different rates (samples)
+#define CONV_MULTIRATEFADE 1024
+// Shortest part of an IR worth convolving at a reduced rate (samples)
+#define CONV_MINDECIMATEDLENGTH 32768
+// Longest IR at another sample rate resampled by prepare() (samples of
+// all its channels), the longer ones are resampled in the background
+#define CONV_MAXINLINERESAMPLE 65536
+// Number of reduced rates (1/2, 1/4)
+#define CONV_NUMFACTORS 2
+// Capacities of the workers queues
+#define CONV_QUEUESIZE 256
+#define CONV_GARBAGESIZE 16
+
+// Shortened tails of the IRs, when the CPU load is too high : they end
+// where their energy decay falls below these levels (dB, relative to the
+// IR energy)
+#define CONV_SAFETYFLOORS {-60.0, -40.0}
+#define CONV_NUMSAFETYLEVELS 2
+
+// Latencies proposed to the user
+#define CONV_LATENCYCHOICES {"None", "256 samples", "1024 samples", "4096 samples"}
+
+// ==================================================================
+// Processing of one block of a tail stage, done by a worker or, if
+// no worker has started it before its deadline, by the audio thread
+class ConvolutionJob
+{
+public:
+  virtual ~ConvolutionJob() = default;
+  virtual void run() = 0;
+
+  enum State { idle, queued, running, done };
+  std::atomic<int> state{idle};
+};
+
+// Object deleted by the collector thread of the workers, so that the
+// audio thread never frees memory
+class ConvolutionGarbage
+{
+public:
+  virtual ~ConvolutionGarbage() = default;
+};
+
+// ==================================================================
+// Wakes the workers up : unlike juce::WaitableEvent::signal(), post()
+// takes no lock (it is called from the audio thread), the semaphore of
+// the system is used where there is one
+class ConvolutionSemaphore
+{
+public:
+  ConvolutionSemaphore();
+  ~ConvolutionSemaphore();
+
+  void post();
+  void wait(int timeOutMilliseconds);
+
+private:
+#if JUCE_LINUX || JUCE_BSD || JUCE_ANDROID
+  sem_t semaphore;
+#elif JUCE_MAC || JUCE_IOS || JUCE_WINDOWS
+  void* semaphore;      // (dispatch_semaphore_t, HANDLE)
+#else
+  juce::WaitableEvent event;
+#endif
+
+  JUCE_DECLARE_NON_COPYABLE (ConvolutionSemaphore)
+};
+
+// ==================================================================
+// Bounded queue of pointers, without locks for any number of threads
+// pushing and popping (the audio threads never wait for a thread that
+// would hold it) : each cell holds the position at which it can be
+// written next, or read (D. Vyukov's bounded MPMC queue)
+template <typename Type, int capacity>
+class ConvolutionQueue
+{
+public:
+  ConvolutionQueue()
+  {
+    for (int i=0; i<capacity; i++)
+      cells[i].position.store(size_t(i), std::memory_order_relaxed);
+  }
+
+  // (false if the queue is full)
+  bool push(Type* item)
+  {
+    auto position = pushPosition.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      auto& cell = cells[position%capacity];
+      const auto difference = std::ptrdiff_t(cell.position.load(std::memory_order_acquire)-position);
+      if (difference == 0)
+      {
+        if (pushPosition.compare_exchange_weak(position, position+1, std::memory_order_relaxed))
+        {
+          cell.item = item;
+          cell.position.store(position+1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (difference < 0)
+        return false;
+      else
+        position = pushPosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  // (nullptr if the queue is empty, or if its first item is still
+  // being pushed)
+  Type* pop()
+  {
+    auto position = popPosition.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      auto& cell = cells[position%capacity];
+      const auto difference = std::ptrdiff_t(cell.position.load(std::memory_order_acquire)-(position+1));
+      if (difference == 0)
+      {
+        // (ordered with the threads that count the pops, see cancel())
+        if (popPosition.compare_exchange_weak(position, position+1))
+        {
+          auto* item = cell.item;
+          cell.position.store(position+capacity, std::memory_order_release);
+          return item;
+        }
+      }
+      else if (difference < 0)
+        return nullptr;
+      else
+        position = popPosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  // Number of items pushed and popped so far
+  size_t getNumPushed() const { return pushPosition.load(); }
+  size_t getNumPopped() const { return popPosition.load(); }
+  bool isEmpty() const { return getNumPopped() >= getNumPushed(); }
+
+private:
+  struct Cell
+  {
+    std::atomic<size_t> position{0};
+    Type* item{nullptr};
+  };
+
+  Cell cells[capacity];
+  std::atomic<size_t> pushPosition{0}, popPosition{0};
+};
+
+// ==================================================================
+// Process-wide pool of threads that process the tail stages of all
+// the convolutions. They are real-time threads (if the system allows
+// it), so that the audio thread which waits for one of them lets it run.
+class ConvolutionWorkers
+{
+public:
+  ConvolutionWorkers();
+  ~ConvolutionWorkers();
+
+  // Called from the audio thread
+  void submit(ConvolutionJob* job);
+  void finish(ConvolutionJob* job);
+  bool dispose(ConvolutionGarbage* g);     // (false if the queue is full)
+
+  // Removes a job from the queue, and waits for it if it is running
+  // (not from the audio thread nor from a worker)
+  void cancel(ConvolutionJob* job);
+
+private:
+  class Worker : public juce::Thread
+  {
+  public:
+    Worker(ConvolutionWorkers& o);
+    void run() override;
+
+  private:
+    ConvolutionWorkers& owner;
+  };
+
+  // Deletes the garbage, at the normal priority
+  class Collector : public juce::Thread
+  {
+  public:
+    Collector(ConvolutionWorkers& o);
+    void run() override;
+
+  private:
+    ConvolutionWorkers& owner;
+  };
+
+  bool runNextJob();
+  bool deleteNextGarbage();
+
+  ConvolutionQueue<ConvolutionJob, CONV_QUEUESIZE> jobs;
+  ConvolutionQueue<ConvolutionGarbage, CONV_GARBAGESIZE> garbage;
+  // (threads holding a job popped but not claimed yet)
+  std::atomic<int> numClaiming{0};
+  ConvolutionSemaphore jobAvailable, garbageAvailable;
+  std::vector<std::unique_ptr<Worker>> workers;
+  Collector collector{*this};
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ConvolutionWorkers)
+};
+
+// ==================================================================
+// Non-uniformly partitioned convolution, used in place of
+// juce::dsp::Convolution for the long IRs of the room models.
+// The head of the IR is processed on the audio thread with small
+// partitions (with zero latency), and the tail with partitions whose
+// size grows geometrically, processed by the background workers
+// during the time left before their output is needed.
+//
+// Several inputs are convolved with several IRs at once : each IR
+// (a "slot") convolves one input with its channels, which are added to
+// consecutive outputs. Every input block is transformed once, whatever
+// the number of IRs it feeds, and every output block is transformed
+// back once, whatever the number of IRs that feed it.
+//
+// The late parts of the IRs, whose high frequencies have been damped,
+// are convolved at 1/2 or 1/4 of the sample rate by the tail stages
+// (the input is decimated, and the output interpolated, by the
+// workers). The parts are chosen from the spectra of the IRs.
+//
+// When an IR is replaced, only its partitions that have changed are
+// transformed and crossfaded : the stages where nothing has changed
+// take the new IR without any additional processing.
+class PartitionedConvolution
+{
+public:
+  PartitionedConvolution();
+  ~PartitionedConvolution();
+
+  // Declares an IR (before prepare()) : the input channel is convolved
+  // with numChannels IR channels, added to the outputs from firstOutput.
+  // Returns the index of the slot.
+  int addSlot(int input, int firstOutput, int numChannels);
+  int getNumInputs() const;
+  int getNumOutputs() const;
+
+  // Latency traded for a lower CPU load (taken into account at the
+  // next prepare()) : 0 for zero latency processing, else the size
+  // of the head partitions, rounded to a power of two
+  void setLatency(int latencyInSamples);
+  int getLatency() const;
+  static int getLatencyFromChoice(int choiceIndex);
+  // Sizes of the partitions of the stages for a head size (the
+  // transforms have twice as many samples), at the full rate and at
+  // the reduced ones
+  static std::vector<int> getPartitionSizes(int headSize);
+
+  // (the number of channels of the spec is not used, see addSlot ; the
+  // long IRs at another sample rate are resampled in the background,
+  // see CONV_MAXINLINERESAMPLE)
+  void prepare(const juce::dsp::ProcessSpec& spec);
+  void reset();
+
+  // Can be called from any thread but the audio thread. The new IR is
+  // crossfaded with the previous one, the processing state (the input
+  // history) is kept. Returns the time range of the IR that has changed
+  // (in seconds).
+  // The IR can be shared with the caller (e.g. the IR it keeps for the
+  // state of the plugin) : it is partitioned as it is, without any copy,
+  // and must not be modified afterwards.
+  juce::Range<double> loadImpulseResponse(int slot, juce::AudioBuffer<float>&& ir, double irSampleRate);
+  juce::Range<double> loadImpulseResponse(int slot, std::shared_ptr<const juce::AudioBuffer<float>> ir, double irSampleRate);
+  // Same, but only the first updateTime seconds of the current IR are
+  // replaced by the ones of the new IR, the rest is kept (e.g. the late
+  // reflections, when only the early ones have changed)
+  juce::Range<double> updateImpulseResponse(int slot, juce::AudioBuffer<float>&& ir, double irSampleRate, double updateTime);
+  juce::Range<double> updateImpulseResponse(int slot, std::shared_ptr<const juce::AudioBuffer<float>> ir, double irSampleRate, double updateTime);
+  int getCurrentIRSize(int slot) const;
+
+  // The input block has getNumInputs() channels, the output block
+  // getNumOutputs() channels, in distinct buffers
+  void process(const juce::dsp::ProcessContextNonReplacing<float>& context);
+
+  // Called from the audio thread. Number of samples after which the
+  // output of a silent input is silent (with the latency), -1 while
+  // IRs are being crossfaded. The caller can skip process() after
+  // this time of silence, and restart where it stopped.
+  int getTailLength() const;
+  // Called from the audio thread before process() is called again after
+  // having been skipped while the input wasn't silent : the input history
+  // and the pending output are cleared, the IRs are kept
+  void clear();
+  // Called from the audio thread. Shortens the tails of the IRs (level
+  // 1 to CONV_NUMSAFETYLEVELS, see CONV_SAFETYFLOORS) or restores them
+  // (level 0) : the tail stages crossfade to the partitions of the new
+  // level. Their input history is kept, so that the tails come back
+  // at once.
+  void setSafetyLevel(int level);
+
+  // Longest part of the IRs that is convolved (in seconds, 0 for the
+  // whole IRs) : the longer IRs are cut with a short fade out, which
+  // saves their partitions and the room of the delay lines. Taken into
+  // account at the next load.
+  void setMaxIrTime(double seconds);
+  // Adds the memory held by the convolution (any thread but the audio
+  // one) : the partitions and the delay lines of the latest engine (not
+  // the one being faded out), and the copies of the IRs made here
+  // (resampled, spliced or shortened)
+  void addMemoryUsage(MemoryUsage& usage) const;
+
+private:
+  class Engine;
+
+  struct Slot
+  {
+    int input, firstOutput, numChannels;
+    std::shared_ptr<const juce::AudioBuffer<float>> ir;
+    double irSampleRate{0.0};
+    std::atomic<int> irSize{0};
+    // (the IR at the sample rate of the engines, as it was partitioned :
+    // the same buffer as ir when no resampling is needed)
+    std::shared_ptr<const juce::AudioBuffer<float>> partitionedIr;
+    // (ir has been made here, by a splice)
+    bool ownsIr{false};
+    // (the IR resampled by the resampler thread, kept until the IR or the
+    // sample rate of the engines changes, and whether it is awaited)
+    std::shared_ptr<const juce::AudioBuffer<float>> resampledIr;
+    bool needsResampling{false};
+  };
+
+  // Resamples the long IRs after a change of the sample rate, so that
+  // prepare() doesn't (their slots are silent meanwhile)
+  class Resampler : public juce::Thread
+  {
+  public:
+    Resampler(PartitionedConvolution& o);
+    void run() override;
+
+  private:
+    PartitionedConvolution& owner;
+  };
+
+  juce::SharedResourcePointer<ConvolutionWorkers> workers;
+
+  std::vector<std::unique_ptr<Slot>> slots;
+  int numInputs{0}, numOutputs{0};
+
+  juce::CriticalSection loadLock;
+  juce::dsp::ProcessSpec spec{0.0, 0, 0};
+  bool isPrepared{false};
+  int requestedLatency{0}, latency{0}, headSize{CONV_MINHEADSIZE};
+
+  // current and previous are only used by the audio thread, the new
+  // engines are passed to it through pending. latest is the last engine
+  // created (used by the loading threads, under loadLock).
+  Engine* current{nullptr};
+  Engine* previous{nullptr};
+  std::atomic<Engine*> pending{nullptr};
+  Engine* latest{nullptr};
+
+  juce::AudioBuffer<float> fadeBuffer;
+  int fadeLength{0}, fadePosition{0};
+  int safetyLevel{0};
+  double maxIrTime{0.0};
+
+  Resampler resampler{*this};
+
+  bool resampleNextIr();
+  std::shared_ptr<const juce::AudioBuffer<float>> getResampledIr(const Slot& slot) const;
+  std::shared_ptr<const juce::AudioBuffer<float>> getShortenedIr(std::shared_ptr<const juce::AudioBuffer<float>> ir) const;
+  juce::Range<double> loadPartitionedIr(int slot, std::shared_ptr<const juce::AudioBuffer<float>> ir);
+  Engine* createEngine();
+  void swapPendingEngine();
+  void deleteEngines();
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PartitionedConvolution)
+};
@@ -0,0 +1,438 @@
+#include "RealFft.h"
+
+#if JUCE_INTEL && (JUCE_GCC || JUCE_CLANG)
+ #include <immintrin.h>
+ #define FFT_HAS_AVX2 1
+ #define FFT_AVX2 __attribute__((target("avx2,fma")))
+#elif JUCE_INTEL && JUCE_MSVC
+ #include <immintrin.h>
+ #define FFT_HAS_AVX2 1
+ #define FFT_AVX2
+#else
+ #define FFT_HAS_AVX2 0
+#endif
+
+static void multiplyAccumulateScalar(float* acc, const float* a, const float* b, int numBins)
+{
+  for (int i=0; i<numBins; i++)
+  {
+    const float ar = a[2*i], ai = a[2*i+1];
+    const float br = b[2*i], bi = b[2*i+1];
+    acc[2*i] += ar*br - ai*bi;
+    acc[2*i+1] += ar*bi + ai*br;
+  }
+}
+
+#if FFT_HAS_AVX2
+
+FFT_AVX2 static void multiplyAccumulateAvx2(float* acc, const float* a, const float* b, int numBins)
+{
+  int i = 0;
+  for (; i+4<=numBins; i+=4)
+  {
+    const __m256 va = _mm256_loadu_ps(a+2*i);
+    const __m256 vb = _mm256_loadu_ps(b+2*i);
+    // (ar*br - ai*bi, ai*br + ar*bi) for each pair
+    const __m256 swapped = _mm256_permute_ps(va, 0xB1);
+    const __m256 product = _mm256_fmaddsub_ps(va, _mm256_moveldup_ps(vb), _mm256_mul_ps(swapped, _mm256_movehdup_ps(vb)));
+    _mm256_storeu_ps(acc+2*i, _mm256_add_ps(_mm256_loadu_ps(acc+2*i), product));
+  }
+  // (the tail is written here, calling the scalar version would cost an
+  // AVX to SSE transition)
+  for (; i<numBins; i++)
+  {
+    const float ar = a[2*i], ai = a[2*i+1];
+    const float br = b[2*i], bi = b[2*i+1];
+    acc[2*i] += ar*br - ai*bi;
+    acc[2*i+1] += ar*bi + ai*br;
+  }
+}
+
+// Even and odd samples to split real and imaginary parts
+FFT_AVX2 static void deinterleaveAvx2(const float* data, float* re, float* im, int n)
+{
+  for (int t=0; t<n; t+=8)
+  {
+    const __m256 v0 = _mm256_loadu_ps(data+2*t);
+    const __m256 v1 = _mm256_loadu_ps(data+2*t+8);
+    const __m256 even = _mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(2,0,2,0));
+    const __m256 odd = _mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(3,1,3,1));
+    _mm256_storeu_ps(re+t, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(even), _MM_SHUFFLE(3,1,2,0))));
+    _mm256_storeu_ps(im+t, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(odd), _MM_SHUFFLE(3,1,2,0))));
+  }
+}
+
+// Interleaves the sums and differences of a butterfly vector, by units
+// of m values
+FFT_AVX2 static void storeInterleaved(float* y, __m256 s, __m256 d, int m)
+{
+  if (m == 1)
+  {
+    const __m256 lo = _mm256_unpacklo_ps(s, d), hi = _mm256_unpackhi_ps(s, d);
+    _mm256_storeu_ps(y, _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps(y+8, _mm256_permute2f128_ps(lo, hi, 0x31));
+  }
+  else if (m == 2)
+  {
+    const __m256d sd = _mm256_castps_pd(s), dd = _mm256_castps_pd(d);
+    const __m256 lo = _mm256_castpd_ps(_mm256_unpacklo_pd(sd, dd)), hi = _mm256_castpd_ps(_mm256_unpackhi_pd(sd, dd));
+    _mm256_storeu_ps(y, _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps(y+8, _mm256_permute2f128_ps(lo, hi, 0x31));
+  }
+  else
+  {
+    _mm256_storeu_ps(y, _mm256_permute2f128_ps(s, d, 0x20));
+    _mm256_storeu_ps(y+8, _mm256_permute2f128_ps(s, d, 0x31));
+  }
+}
+
+// Complex FFT of size n (Stockham autosort) on split arrays, x holds
+// the input and y is a work buffer. The result ends in x or y, the
+// pointers are swapped accordingly.
+// twiddles[0] is exp(-2*i*pi*t/n) for t<n/2, twiddles[1] and [2] the same
+// with each value repeated 2 and 4 times, for the first stages.
+FFT_AVX2 static void transformAvx2(float*& xr, float*& xi, float*& yr, float*& yi, int n,
+                                   const std::vector<float>* twiddlesRe, const std::vector<float>* twiddlesIm)
+{
+  const int half = n/2;
+  for (int l=half, m=1; l>=1; l/=2, m*=2)
+  {
+    if (m >= 8)
+    {
+      for (int j=0; j<l; j++)
+      {
+        const __m256 wr = _mm256_set1_ps(twiddlesRe[0][size_t(j*m)]);
+        const __m256 wi = _mm256_set1_ps(twiddlesIm[0][size_t(j*m)]);
+        for (int k=0; k<m; k+=8)
+        {
+          const int e = k + j*m;
+          const __m256 ar = _mm256_loadu_ps(xr+e), ai = _mm256_loadu_ps(xi+e);
+          const __m256 br = _mm256_loadu_ps(xr+e+half), bi = _mm256_loadu_ps(xi+e+half);
+          const __m256 dr = _mm256_sub_ps(ar, br), di = _mm256_sub_ps(ai, bi);
+          _mm256_storeu_ps(yr+k+2*j*m, _mm256_add_ps(ar, br));
+          _mm256_storeu_ps(yi+k+2*j*m, _mm256_add_ps(ai, bi));
+          _mm256_storeu_ps(yr+k+2*j*m+m, _mm256_fmsub_ps(dr, wr, _mm256_mul_ps(di, wi)));
+          _mm256_storeu_ps(yi+k+2*j*m+m, _mm256_fmadd_ps(dr, wi, _mm256_mul_ps(di, wr)));
+        }
+      }
+    }
+    else
+    {
+      // (less than 8 values per twiddle : vectorized over the twiddles,
+      // the outputs are interleaved)
+      const int table = m == 1 ? 0 : (m == 2 ? 1 : 2);
+      const float* twRe = twiddlesRe[table].data();
+      const float* twIm = twiddlesIm[table].data();
+      for (int e=0; e<half; e+=8)
+      {
+        const __m256 ar = _mm256_loadu_ps(xr+e), ai = _mm256_loadu_ps(xi+e);
+        const __m256 br = _mm256_loadu_ps(xr+e+half), bi = _mm256_loadu_ps(xi+e+half);
+        const __m256 wr = _mm256_loadu_ps(twRe+e), wi = _mm256_loadu_ps(twIm+e);
+        const __m256 dr = _mm256_sub_ps(ar, br), di = _mm256_sub_ps(ai, bi);
+        storeInterleaved(yr+2*e, _mm256_add_ps(ar, br), _mm256_fmsub_ps(dr, wr, _mm256_mul_ps(di, wi)), m);
+        storeInterleaved(yi+2*e, _mm256_add_ps(ai, bi), _mm256_fmadd_ps(dr, wi, _mm256_mul_ps(di, wr)), m);
+      }
+    }
+    std::swap(xr, yr);
+    std::swap(xi, yi);
+  }
+}
+
+#endif
+
+// ======================================================================
+
+class RealFft::Implementation
+{
+public:
+  virtual ~Implementation() = default;
+  virtual void forward(float* data) = 0;
+  virtual void inverse(float* data) = 0;
+};
+
+class RealFft::JuceImplementation : public RealFft::Implementation
+{
+public:
+  JuceImplementation(int order) : fft(order) {}
+  void forward(float* data) override { fft.performRealOnlyForwardTransform(data, true); }
+  void inverse(float* data) override { fft.performRealOnlyInverseTransform(data); }
+
+private:
+  juce::dsp::FFT fft;
+};
+
+#if FFT_HAS_AVX2
+
+// Real FFT of size 2n, calculated with a complex FFT of size n on the
+// even (real part) and odd (imaginary part) samples
+class RealFft::Avx2Implementation : public RealFft::Implementation
+{
+public:
+  Avx2Implementation(int order) : n(1 << (order-1))
+  {
+    for (auto* v : {&re, &im, &workRe, &workIm})
+      v->resize(size_t(n));
+
+    for (int t=0; t<3; t++)
+    {
+      twiddlesRe[t].resize(size_t(n/2));
+      twiddlesIm[t].resize(size_t(n/2));
+    }
+    for (int e=0; e<n/2; e++)
+      for (int t=0; t<3; t++)
+      {
+        // (stage t of the complex FFT has 2^t values per twiddle)
+        const int index = (e >> t) << t;
+        const double angle = -2.0*juce::MathConstants<double>::pi*index/n;
+        twiddlesRe[t][size_t(e)] = float(std::cos(angle));
+        twiddlesIm[t][size_t(e)] = float(std::sin(angle));
+      }
+
+    splitRe.resize(size_t(n+1));
+    splitIm.resize(size_t(n+1));
+    for (int k=0; k<=n; k++)
+    {
+      const double angle = -juce::MathConstants<double>::pi*k/n;
+      splitRe[size_t(k)] = float(std::cos(angle));
+      splitIm[size_t(k)] = float(std::sin(angle));
+    }
+  }
+
+  void forward(float* data) override
+  {
+    deinterleaveAvx2(data, re.data(), im.data(), n);
+    float *zr = re.data(), *zi = im.data(), *yr = workRe.data(), *yi = workIm.data();
+    transformAvx2(zr, zi, yr, yi, n, twiddlesRe, twiddlesIm);
+
+    // Spectra of the even and odd samples : E = (Z[k] + conj(Z[n-k]))/2,
+    // O = (Z[k] - conj(Z[n-k]))/2i, then X[k] = E + exp(-i*pi*k/n)*O
+    const float r0 = zr[0], i0 = zi[0];
+    for (int k=1; k<=n/2; k++)
+    {
+      const int kc = n-k;
+      for (int pass=0; pass<2; pass++)
+      {
+        const int a = pass == 0 ? k : kc;
+        const int b = pass == 0 ? kc : k;
+        const float er = 0.5f*(zr[a] + zr[b]), ei = 0.5f*(zi[a] - zi[b]);
+        const float or_ = 0.5f*(zi[a] + zi[b]), oi = -0.5f*(zr[a] - zr[b]);
+        const float wr = splitRe[size_t(a)], wi = splitIm[size_t(a)];
+        data[2*a] = er + wr*or_ - wi*oi;
+        data[2*a+1] = ei + wr*oi + wi*or_;
+      }
+    }
+    data[0] = r0 + i0;
+    data[1] = 0.f;
+    data[2*n] = r0 - i0;
+    data[2*n+1] = 0.f;
+  }
+
+  void inverse(float* data) override
+  {
+    // Z[k] = E + i*O with E = (X[k] + conj(X[n-k]))/2 and
+    // O = (X[k] - conj(X[n-k]))/2 * exp(i*pi*k/n). The inverse transform
+    // is the conjugate of the forward transform of the conjugate.
+    for (int k=0; k<n; k++)
+    {
+      const int kc = n-k;
+      const float xr = data[2*k], xi = data[2*k+1];
+      const float cr = data[2*kc], ci = -data[2*kc+1];
+      const float er = 0.5f*(xr + cr), ei = 0.5f*(xi + ci);
+      const float dr = 0.5f*(xr - cr), di = 0.5f*(xi - ci);
+      const float wr = splitRe[size_t(k)], wi = -splitIm[size_t(k)];
+      const float or_ = dr*wr - di*wi, oi = dr*wi + di*wr;
+      re[size_t(k)] = er - oi;
+      im[size_t(k)] = -(ei + or_);
+    }
+
+    float *zr = re.data(), *zi = im.data(), *yr = workRe.data(), *yi = workIm.data();
+    transformAvx2(zr, zi, yr, yi, n, twiddlesRe, twiddlesIm);
+
+    const float scale = 1.f/float(n);
+    for (int t=0; t<n; t++)
+    {
+      data[2*t] = zr[t]*scale;
+      data[2*t+1] = -zi[t]*scale;
+    }
+  }
+
+private:
+  int n;
+  std::vector<float> re, im, workRe, workIm;
+  std::vector<float> twiddlesRe[3], twiddlesIm[3];
+  std::vector<float> splitRe, splitIm;
+};
+
+#endif
+
+// ======================================================================
+
+RealFft::RealFft(int order, Backend b) : size(1 << order), backend(b)
+{
+  if (backend == automatic)
+    backend = getDefaultBackend();
+  if (backend == avx2 && (!isAvailable(avx2) || size < FFT_MINSIMDSIZE))
+    backend = juceFft;
+
+#if FFT_HAS_AVX2
+  if (backend == avx2)
+  {
+    implementation = std::make_unique<Avx2Implementation>(order);
+    return;
+  }
+#endif
+  implementation = std::make_unique<JuceImplementation>(order);
+}
+
+RealFft::~RealFft()
+{
+
+}
+
+int RealFft::getSize() const
+{
+  return size;
+}
+
+RealFft::Backend RealFft::getBackend() const
+{
+  return backend;
+}
+
+void RealFft::forward(float* data)
+{
+  implementation->forward(data);
+}
+
+void RealFft::inverse(float* data)
+{
+  implementation->inverse(data);
+}
+
+void RealFft::multiplyAccumulate(float* acc, const float* a, const float* b, int numBins)
+{
+#if FFT_HAS_AVX2
+  static const bool useAvx2 = getDefaultBackend() == avx2;
+  if (useAvx2)
+  {
+    multiplyAccumulateAvx2(acc, a, b, numBins);
+    return;
+  }
+#endif
+  multiplyAccumulateScalar(acc, a, b, numBins);
+}
+
+bool RealFft::isAvailable(Backend b)
+{
+  if (b == avx2)
+  {
+#if FFT_HAS_AVX2
+    return juce::SystemStats::hasAVX2() && juce::SystemStats::hasFMA3();
+#else
+    return false;
+#endif
+  }
+  return true;
+}
+
+// The fastest available backend, unless another one is forced
+// through the environment
+RealFft::Backend RealFft::getDefaultBackend()
+{
+  static const Backend defaultBackend = []
+  {
+    auto name = juce::SystemStats::getEnvironmentVariable(FFT_BACKENDVARIABLE, {});
+    if (name == getBackendName(juceFft))
+      return juceFft;
+    return isAvailable(avx2) ? avx2 : juceFft;
+  }();
+  return defaultBackend;
+}
+
+juce::String RealFft::getBackendName(Backend b)
+{
+  switch (b)
+  {
+    case juceFft: return "juce";
+    case avx2: return "avx2";
+    default: return "automatic";
+  }
+}
+
+// ======================================================================
+
+juce::String RealFft::benchmark(const std::vector<int>& sizes)
+{
+  juce::String report;
+  report << "FFT benchmark (forward + inverse, and spectrum multiply-accumulate, in microseconds)\n";
+
+  juce::Random random;
+  for (int size : sizes)
+  {
+    const int order = juce::roundToInt(std::log2(size));
+    const int iterations = juce::jmax(16, (1 << 22)/size);
+    report << "size " << size << " :";
+
+    std::vector<float> input(size_t(2*size)), reference(size_t(2*size));
+    for (int i=0; i<size; i++)
+      input[size_t(i)] = random.nextFloat()-0.5f;
+
+    for (auto b : {juceFft, avx2})
+    {
+      if (!isAvailable(b))
+        continue;
+
+      RealFft fft(order, b);
+      auto data = input;
+      auto start = juce::Time::getHighResolutionTicks();
+      for (int i=0; i<iterations; i++)
+      {
+        fft.forward(data.data());
+        fft.inverse(data.data());
+      }
+      auto seconds = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks()-start);
+      report << "  " << getBackendName(b) << " " << juce::String(1e6*seconds/iterations, 2);
+
+      // (difference of the spectrum with the one of juce::dsp::FFT)
+      data = input;
+      fft.forward(data.data());
+      if (b == juceFft)
+        reference = data;
+      else
+      {
+        float error = 0.f;
+        for (int i=0; i<size+2; i++)
+          error = juce::jmax(error, std::abs(data[size_t(i)]-reference[size_t(i)]));
+        report << " (max difference " << juce::String(error, 7) << ")";
+      }
+    }
+
+    std::vector<float> acc(size_t(size+2)), a(input.begin(), input.begin()+size+2), b(a);
+    for (int pass=0; pass<2; pass++)
+    {
+#if FFT_HAS_AVX2
+      if (pass == 1 && !isAvailable(avx2))
+        continue;
+#else
+      if (pass == 1)
+        continue;
+#endif
+      auto start = juce::Time::getHighResolutionTicks();
+      for (int i=0; i<iterations; i++)
+      {
+#if FFT_HAS_AVX2
+        if (pass == 1)
+        {
+          multiplyAccumulateAvx2(acc.data(), a.data(), b.data(), size/2+1);
+          continue;
+        }
+#endif
+        multiplyAccumulateScalar(acc.data(), a.data(), b.data(), size/2+1);
+      }
+      auto seconds = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks()-start);
+      report << "  mac " << (pass == 0 ? "scalar " : "avx2 ") << juce::String(1e6*seconds/iterations, 3);
+    }
+    report << "\n";
+  }
+  return report;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// Smallest transform handled by the SIMD backend
+#define FFT_MINSIMDSIZE 32
+// Environment variable forcing the backend ("juce" or "avx2")
+#define FFT_BACKENDVARIABLE "BIRR_FFT"
+
+// ==================================================================
+// Real FFT used by the convolutions, with the layout and scaling of the
+// real-only transforms of juce::dsp::FFT : the spectrum of a block of N
+// samples is made of its N/2+1 first bins, as interleaved (re, im) pairs,
+// and the inverse transform is scaled by 1/N.
+// The AVX2 backend is used when the CPU has it, else juce::dsp::FFT
+// (which uses the platform libraries, e.g. Accelerate on macOS, when
+// they are available).
+// An object has scratch buffers, it must be used by one thread at a time.
+class RealFft
+{
+public:
+  enum Backend { automatic, juceFft, avx2 };
+
+  RealFft(int order, Backend backend = automatic);
+  ~RealFft();
+
+  int getSize() const;
+  Backend getBackend() const;
+
+  // data has 2*size floats, as with juce::dsp::FFT
+  void forward(float* data);
+  void inverse(float* data);
+
+  // acc += a*b, for spectra of numBins interleaved complex values
+  static void multiplyAccumulate(float* acc, const float* a, const float* b, int numBins);
+
+  static bool isAvailable(Backend backend);
+  static Backend getDefaultBackend();
+  static juce::String getBackendName(Backend backend);
+
+  // Times every available backend on transforms of the given sizes
+  // (powers of two, see the FftBenchmark console target)
+  static juce::String benchmark(const std::vector<int>& sizes);
+
+private:
+  class Implementation;
+  class JuceImplementation;
+  class Avx2Implementation;
+
+  int size;
+  Backend backend;
+  std::unique_ptr<Implementation> implementation;
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RealFft)
+};
@@ -0,0 +1,202 @@
+#include "RealtimeWorkers.h"
+#include "Log.h"
+
+// ======================================================================
+
+RealtimeWorkers::Helper::Helper(RealtimeWorkers& o) : juce::Thread("realtime helper"), owner(o)
+{
+
+}
+
+void RealtimeWorkers::Helper::run()
+{
+  // (the tasks are parts of processBlock)
+  const juce::ScopedNoDenormals noDenormals;
+  const auto spinTicks = juce::int64(RTW_SPINTIME*double(juce::Time::getHighResolutionTicksPerSecond()));
+
+  while (!threadShouldExit())
+  {
+    if (owner.runNextTask())
+      continue;
+
+    // (the next block is usually handed over during the polling)
+    const auto end = juce::Time::getHighResolutionTicks()+spinTicks;
+    while (owner.tasks.isEmpty() && juce::Time::getHighResolutionTicks() < end && !threadShouldExit())
+      juce::Thread::yield();
+    if (!owner.tasks.isEmpty())
+      continue;
+
+    // (submit() sees the waiting helper, or the helper sees the task)
+    owner.numWaiting++;
+    if (owner.tasks.isEmpty())
+      owner.taskAvailable.wait(50);
+    owner.numWaiting--;
+  }
+}
+
+RealtimeWorkers::RealtimeWorkers()
+{
+  const int numCpus = juce::SystemStats::getNumCpus();
+  if (numCpus < RTW_MINCPUS || juce::SystemStats::getEnvironmentVariable(RTW_VARIABLE, "1") == "0")
+  {
+    LOG_INFO("Real-time helpers : none");
+    return;
+  }
+
+  auto numHelpers = juce::jlimit(1, RTW_MAXHELPERS, numCpus/4);
+  for (int i=0; i<numHelpers; i++)
+  {
+    helpers.push_back(std::make_unique<Helper>(*this));
+    // (without the rights to real-time scheduling, the highest priority)
+    if (!helpers.back()->startRealtimeThread(juce::Thread::RealtimeOptions{}))
+      helpers.back()->startThread(juce::Thread::Priority::highest);
+  }
+  LOG_INFO("Real-time helpers : " << numHelpers);
+}
+
+RealtimeWorkers::~RealtimeWorkers()
+{
+  for (auto& h : helpers)
+  {
+    h->signalThreadShouldExit();
+    taskAvailable.post();
+  }
+  for (auto& h : helpers)
+    h->stopThread(1000);
+}
+
+bool RealtimeWorkers::hasHelpers() const
+{
+  return !helpers.empty();
+}
+
+bool RealtimeWorkers::submit(RealtimeTask* task)
+{
+  task->state = RealtimeTask::queued;
+  // (if the queue is full, the task will be run by the audio thread)
+  if (!tasks.push(task))
+    return false;
+
+  if (numWaiting.load() > 0)
+    taskAvailable.post();
+  return true;
+}
+
+bool RealtimeWorkers::finish(RealtimeTask* task)
+{
+  int expected = RealtimeTask::queued;
+  if (task->state.compare_exchange_strong(expected, RealtimeTask::running))
+  {
+    task->run();
+    task->state = RealtimeTask::idle;
+    return false;
+  }
+
+  while (task->state.load() == RealtimeTask::running)
+    juce::Thread::yield();
+  task->state = RealtimeTask::idle;
+  return true;
+}
+
+void RealtimeWorkers::cancel(RealtimeTask* task)
+{
+  int expected = RealtimeTask::queued;
+  task->state.compare_exchange_strong(expected, RealtimeTask::idle);
+  while (task->state.load() == RealtimeTask::running)
+    juce::Thread::yield();
+
+  // (as for the convolution jobs, the helpers pop the entries pushed
+  // until now before the task can be deleted, this thread doesn't run
+  // the tasks of the other instances)
+  const auto end = tasks.getNumPushed();
+  while (tasks.getNumPopped() < end || numClaiming.load() > 0)
+    juce::Thread::yield();
+  task->state = RealtimeTask::idle;
+}
+
+bool RealtimeWorkers::runNextTask()
+{
+  // (between the pop and the claim, cancel() can't let the task go)
+  RealtimeTask* task = nullptr;
+  while (task == nullptr)
+  {
+    numClaiming++;
+    auto* t = tasks.pop();
+    int expected = RealtimeTask::queued;
+    if (t != nullptr && t->state.compare_exchange_strong(expected, RealtimeTask::running))
+      task = t;
+    numClaiming--;
+    if (t == nullptr)
+      return false;
+  }
+
+  {
+    const RtAudit::ScopedRealtime realtime;
+    task->run();
+  }
+  task->state = RealtimeTask::done;
+  return true;
+}
+
+// ======================================================================
+
+ParallelChains::ParallelChains(int numChains) : tasks(size_t(numChains))
+{
+  for (int i=0; i<numChains; i++)
+  {
+    tasks[size_t(i)].owner = this;
+    tasks[size_t(i)].index = i;
+  }
+}
+
+ParallelChains::~ParallelChains()
+{
+  for (auto& t : tasks)
+    workers->cancel(&t);
+}
+
+void ParallelChains::ChainTask::run()
+{
+  owner->call(owner->context, index);
+}
+
+bool ParallelChains::isParallel() const
+{
+  return workers->hasHelpers() && tasks.size() > 1 && !isSerial;
+}
+
+void ParallelChains::processChains()
+{
+  const int numChains = int(tasks.size());
+
+  if (isSerial && int(juce::Time::getMillisecondCounter()-serialUntil) >= 0)
+  {
+    isSerial = false;
+    numBlocks = numMisses = 0;
+  }
+
+  if (!isParallel())
+  {
+    for (int i=0; i<numChains; i++)
+      call(context, i);
+    return;
+  }
+
+  for (int i=1; i<numChains; i++)
+    workers->submit(&tasks[size_t(i)]);
+  call(context, 0);
+  for (int i=1; i<numChains; i++)
+    if (!workers->finish(&tasks[size_t(i)]))
+      numMisses++;
+
+  // (the helpers are of no use if they can't start in time)
+  if (++numBlocks == RTW_WINDOW)
+  {
+    if (numMisses > RTW_MAXMISSES)
+    {
+      isSerial = true;
+      serialUntil = juce::Time::getMillisecondCounter()+juce::uint32(RTW_RETRYTIME*1000.0);
+    }
+    numBlocks = numMisses = 0;
+  }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "PartitionedConvolution.h"
+#include "RtAudit.h"
+
+// Environment variable which, set to 0, disables the helpers (the
+// chains are always processed one after the other)
+#define RTW_VARIABLE "BIRR_PARALLEL"
+// Fewest CPUs for which helpers are started, and most helpers
+#define RTW_MINCPUS 4
+#define RTW_MAXHELPERS 2
+// Time during which a helper keeps polling for a task after its last
+// one, before it waits to be woken up (seconds)
+#define RTW_SPINTIME 0.0005
+// Capacity of the queue of the helpers
+#define RTW_QUEUESIZE 32
+// The instances process their chains serially for RTW_RETRYTIME
+// (seconds) when, over RTW_WINDOW blocks, more than RTW_MAXMISSES
+// tasks haven't been started by a helper in time
+#define RTW_WINDOW 64
+#define RTW_MAXMISSES 16
+#define RTW_RETRYTIME 5.0
+
+// ==================================================================
+// Part of the processing of the audio thread handed to a helper (same
+// states as the convolution jobs)
+class RealtimeTask
+{
+public:
+  virtual ~RealtimeTask() = default;
+  virtual void run() = 0;
+
+  enum State { idle, queued, running, done };
+  std::atomic<int> state{idle};
+};
+
+// ==================================================================
+// Process-wide group of real-time threads which help the audio threads
+// within the callback : a helper polls for tasks for a short while
+// after its last one (so that the next block is handed over at once),
+// then waits to be woken up. Unlike the convolution workers, which run
+// the tail stages during the following blocks, the helpers run tasks
+// whose result is needed before the end of the current block.
+class RealtimeWorkers
+{
+public:
+  RealtimeWorkers();
+  ~RealtimeWorkers();
+
+  bool hasHelpers() const;
+
+  // Called from the audio thread : queues the task (false if the queue
+  // is full), then waits for it, or runs it if no helper has started it
+  // yet (returns false in this case)
+  bool submit(RealtimeTask* task);
+  bool finish(RealtimeTask* task);
+
+  // Removes a task from the queue, and waits for it if it is running
+  // (not from the audio thread)
+  void cancel(RealtimeTask* task);
+
+private:
+  class Helper : public juce::Thread
+  {
+  public:
+    Helper(RealtimeWorkers& o);
+    void run() override;
+
+  private:
+    RealtimeWorkers& owner;
+  };
+
+  bool runNextTask();
+
+  ConvolutionQueue<RealtimeTask, RTW_QUEUESIZE> tasks;
+  // (threads holding a task popped but not claimed yet)
+  std::atomic<int> numClaiming{0};
+  std::atomic<int> numWaiting{0};
+  ConvolutionSemaphore taskAvailable;
+  std::vector<std::unique_ptr<Helper>> helpers;
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RealtimeWorkers)
+};
+
+// ==================================================================
+// Processing of independent chains (the inputs of the stereo plugins)
+// in parallel within the audio callback : the calling thread processes
+// the first chain while the helpers process the others.
+// The instance falls back to serial processing for a while when the
+// helpers often fail to start the chains in time, which happens when
+// the cores are already busy with the processing of the host.
+class ParallelChains
+{
+public:
+  ParallelChains(int numChains);
+  ~ParallelChains();
+
+  // Calls processChain(index) for each chain, returns when all of them
+  // have been processed (called from the audio thread, the function
+  // must not write anything shared by the chains)
+  template <typename Function>
+  void process(Function&& processChain)
+  {
+    using Type = typename std::remove_const<typename std::remove_reference<Function>::type>::type;
+    context = const_cast<Type*>(&processChain);
+    call = [] (void* c, int index) { (*static_cast<Type*>(c))(index); };
+    processChains();
+  }
+
+  bool isParallel() const;
+
+private:
+  class ChainTask : public RealtimeTask
+  {
+  public:
+    void run() override;
+
+    ParallelChains* owner;
+    int index;
+  };
+
+  void processChains();
+
+  juce::SharedResourcePointer<RealtimeWorkers> workers;
+  std::vector<ChainTask> tasks;
+  void* context{nullptr};
+  void (*call)(void*, int){nullptr};
+
+  // (audio thread)
+  int numBlocks{0}, numMisses{0};
+  juce::uint32 serialUntil{0};
+  bool isSerial{false};
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ParallelChains)
+};
@@ -7,25 +7,85 @@
 
 // ======================================================================
 
+// Sample rate of the HRTF tables nearest to the given one, and their size
+static float getNearestHrtfRate(double sampleRate, int& size)
+{
+  float nearest = 44100.f;
+  float distance = 200000.f;
+  for (float sr : possibleSampleRates)
+    if (abs(sr-sampleRate)<distance)
+    {
+      distance = abs(sr-sampleRate);
+      nearest = sr;
+    }
+
+  if (juce::approximatelyEqual(nearest, 48000.f))
+    size = NSAMP48;
+  else if (juce::approximatelyEqual(nearest, 88200.f))
+    size = NSAMP88;
+  else if (juce::approximatelyEqual(nearest, 96000.f))
+    size = NSAMP96;
+  else
+    size = NSAMP44;
+  return nearest;
+}
+
+// HRTF of a direction, in the tables at the given sample rate
+static const float* getHrtf(float hrtfRate, bool isLeft, int elevationIndex, int azimutalIndex)
+{
+  if (juce::approximatelyEqual(hrtfRate, 48000.f))
+    return isLeft ? &lhrtf48[elevationIndex][azimutalIndex][0] : &rhrtf48[elevationIndex][azimutalIndex][0];
+  if (juce::approximatelyEqual(hrtfRate, 88200.f))
+    return isLeft ? &lhrtf88[elevationIndex][azimutalIndex][0] : &rhrtf88[elevationIndex][azimutalIndex][0];
+  if (juce::approximatelyEqual(hrtfRate, 96000.f))
+    return isLeft ? &lhrtf96[elevationIndex][azimutalIndex][0] : &rhrtf96[elevationIndex][azimutalIndex][0];
+  // (44.1kHz or any other cases)
+  return isLeft ? &lhrtf44[elevationIndex][azimutalIndex][0] : &rhrtf44[elevationIndex][azimutalIndex][0];
+}
+
+// Memory of the HRTF tables built into the plugin
+static size_t getHrtfBytes()
+{
+  return sizeof(lhrtf44) + sizeof(rhrtf44) + sizeof(lhrtf48) + sizeof(rhrtf48)
+         + sizeof(lhrtf88) + sizeof(rhrtf88) + sizeof(lhrtf96) + sizeof(rhrtf96);
+}
+
 // This is the function where the impulse response is calculated
 void IrBoxCalculator::run()
 {
-    std::cout << "Start calculate" << std::endl;
+    TraceLog::ScopedThread traceThread;
+    TraceLog::Scope trace("calculate");
+    LOG_DEBUG("Start calculate");
 
     isCalculating[0] = true;
+    counters.start();
+
+    // (the grains decay below the normal range of floats)
+    juce::ScopedNoDenormals noDenormals;
+
+    // The reflections of high orders are calculated at a reduced rate,
+    // with the grains and HRTF of that rate. Their delays are rounded at
+    // the full rate : the remainder (the phase) selects their buffer.
+    const double lowRate = p.sampleRate/multirateFactor;
+    int lowSize = nsamp[0];
+    const float lowHrtfRate = multirateFactor > 1 ? getNearestHrtfRate(lowRate, lowSize) : nearestSampleRate[0];
 
     // inBuf is the buffer used for the non-binaural methods
-    float outBuf[NSAMP96]={0.f}, inBuf[NSAMP96]={0.f};
+    float outBuf[NSAMP96]={0.f}, inBuf[NSAMP96]={0.f}, lowInBuf[NSAMP96]={0.f};
     inBuf[10] = 1.f;
+    lowInBuf[10/multirateFactor] = 1.f;
     float x,y,z;
     float dist, time, r, gain, rp, elev, theta, costheta, sintheta, cosphi, sinphi;
     int nbounds, indice;
 
 
-    bp->setSize(2,longueur,true,true);
-    bp->clear();
-    auto* dataL = bp->getWritePointer(0);
-    auto* dataR = bp->getWritePointer(1);
+    // (only the samples of the previous IR are cleared)
+    auto& irBuffer = bp->prepare(2, longueur, capacity);
+    const int lowLength = multirateFactor > 1 ? longueur/multirateFactor+lowSize+1 : 0;
+    const int lowCapacity = multirateFactor > 1 && capacity > 0 ? capacity/multirateFactor+lowSize+1 : 0;
+    int lowStart = lowLength;
+    for (int i=0; i<multirateFactor; i++)
+      lowBuffers[i].prepare(2, lowLength, lowCapacity);
 
     for (float ix = float(nxmin); ix < float(nxmax) ; ++ix)
     {
@@ -40,12 +100,29 @@ void IrBoxCalculator::run()
             z = 2*ceil(iz/2)*p.rz+pow(-1,iz)*p.sz;
             dist = sqrt((x-p.lx)*(x-p.lx)+(y-p.ly)*(y-p.ly)+(z-p.lz)*(z-p.lz));
             time = dist*INV_SOUNDSPEED;
-            nbounds = abs(ix)+abs(iy)+abs(iz);            
+            nbounds = abs(ix)+abs(iy)+abs(iz);
+            counters.countImage(nbounds <= EARLY_ORDER);
+            // (rendered in real time, see getEarlyTaps())
+            if (nbounds <= EARLY_ORDER)
+              continue;
 
             indice = int(round((time+juce::Random::getSystemRandom().nextFloat()*SIGMA_DELTAT)*p.sampleRate));
+
+            const bool isLow = nbounds >= multirateOrder && multirateFactor > 1;
+            const double rate = isLow ? lowRate : p.sampleRate;
+            const int size = isLow ? lowSize : nsamp[0];
+            const float* grain = isLow ? &lowInBuf[0] : &inBuf[0];
+            auto& buffer = isLow ? lowBuffers[indice%multirateFactor].getBuffer() : irBuffer;
+            auto* dataL = buffer.getWritePointer(0);
+            auto* dataR = buffer.getWritePointer(1);
+            if (isLow)
+            {
+              indice /= multirateFactor;
+              lowStart = juce::jmin(lowStart, indice);
+            }
             r = pow(1-p.damp,nbounds);
             // float gain = pow(-1,ix+iy+iz)*r/dist;
-            gain = (r/dist) * float( !(ix==0 && iy==0 && iz==0) || calculateDirectPath ) ;
+            gain = r/dist;
             
             rp = sqrt((p.sx-p.lx)*(p.sx-p.lx)+(p.sy-p.ly)*(p.sy-p.ly));
             elev = atan2f(z-p.lz,rp)*EIGHTYOVERPI;
@@ -53,43 +130,44 @@ void IrBoxCalculator::run()
             // Azimutal angle calculation
             theta = atan2f(y-p.ly,-x+p.lx)*EIGHTYOVERPI-90-p.headAzim;
             
+            counters.beginRender();
             // XY
             if (p.type==0){
               // Apply lowpass filter and add grain to buffer
               auto elevCardio = (1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev)));
               auto panGain = 0.25*(1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(theta+45*p.sWidth)))
                               * elevCardio;
-              lop(&inBuf[0], &outBuf[0], p.sampleRate,p.hfDamp,nbounds,1);
-              addArrayToBuffer(&dataL[indice], &outBuf[0], gain*panGain);
+              lop(grain, &outBuf[0], rate,p.hfDamp,nbounds,1,size);
+              addArrayToBuffer(&dataL[indice], &outBuf[0], gain*panGain, size);
               panGain = 0.25*(1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(theta-45*p.sWidth)))
                           * elevCardio;
-              lop(&inBuf[0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-              addArrayToBuffer(&dataR[indice], &outBuf[0], gain*panGain);
+              lop(grain, &outBuf[0], rate, p.hfDamp,nbounds,1,size);
+              addArrayToBuffer(&dataR[indice], &outBuf[0], gain*panGain, size);
             }
 
             // MS with cardio mic for mid channelabs(ix)+abs(iy)
             if (p.type==1){
               // Apply lowpass filter and add grain to buffer
-              lop(&inBuf[0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
+              lop(grain, &outBuf[0], rate, p.hfDamp,nbounds,1,size);
               auto gainMid = 0.25*(1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(theta)))
                               * (1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev)));
               auto gainSide = juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev))
                               * juce::dsp::FastMathApproximations::sin(PIOVEREIGHTY*(theta));
 
-              addArrayToBuffer(&dataL[indice], &outBuf[0], gain*(gainMid-gainSide*p.sWidth));
-              addArrayToBuffer(&dataR[indice], &outBuf[0], gain*(gainMid+gainSide*p.sWidth));
+              addArrayToBuffer(&dataL[indice], &outBuf[0], gain*(gainMid-gainSide*p.sWidth), size);
+              addArrayToBuffer(&dataR[indice], &outBuf[0], gain*(gainMid+gainSide*p.sWidth), size);
             }
 
             // MS with omni mic for mid channel
             if (p.type==2){
               // Apply lowpass filter and add grain to buffer
-              lop(&inBuf[0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
+              lop(grain, &outBuf[0], rate, p.hfDamp,nbounds,1,size);
               auto gainMid = 1.f;
               auto gainSide = juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev))
                               * juce::dsp::FastMathApproximations::sin(PIOVEREIGHTY*(theta));
 
-              addArrayToBuffer(&dataL[indice], &outBuf[0], gain*(gainMid-gainSide*p.sWidth));
-              addArrayToBuffer(&dataR[indice], &outBuf[0], gain*(gainMid+gainSide*p.sWidth));
+              addArrayToBuffer(&dataL[indice], &outBuf[0], gain*(gainMid-gainSide*p.sWidth), size);
+              addArrayToBuffer(&dataR[indice], &outBuf[0], gain*(gainMid+gainSide*p.sWidth), size);
             }
 
             // Binaural
@@ -97,53 +175,133 @@ void IrBoxCalculator::run()
               int elevationIndex = proximityIndex(&elevations[0],NELEV,elev,false);
               int azimutalIndex = proximityIndex(&azimuths[elevationIndex][0],NAZIM,theta,true);
               gain = gain * .707107f;
-              if (juce::approximatelyEqual(nearestSampleRate[0],48000.f))
-                {
-                  lop(&lhrtf48[elevationIndex][azimutalIndex][0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-                  addArrayToBuffer(&dataL[indice], &outBuf[0], gain);
-                  lop(&rhrtf48[elevationIndex][azimutalIndex][0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-                  addArrayToBuffer(&dataR[indice], &outBuf[0], gain);
-
-                }
-              else if (juce::approximatelyEqual(nearestSampleRate[0],88200.f))
-                {
-                  lop(&lhrtf88[elevationIndex][azimutalIndex][0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-                  addArrayToBuffer(&dataL[indice], &outBuf[0], gain);
-                  lop(&rhrtf88[elevationIndex][azimutalIndex][0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-                  addArrayToBuffer(&dataR[indice], &outBuf[0], gain);
-                }
-              else if (juce::approximatelyEqual(nearestSampleRate[0],96000.f))
-                {
-                  lop(&lhrtf96[elevationIndex][azimutalIndex][0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-                  addArrayToBuffer(&dataL[indice], &outBuf[0], gain);
-                  lop(&rhrtf96[elevationIndex][azimutalIndex][0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-                  addArrayToBuffer(&dataR[indice], &outBuf[0], gain);
-                }
-              else // if 44.1kHz or any other cases, we use 44.1kHz HRTF
-                {
-                  lop(&lhrtf44[elevationIndex][azimutalIndex][0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-                  addArrayToBuffer(&dataL[indice], &outBuf[0], gain);
-                  lop(&rhrtf44[elevationIndex][azimutalIndex][0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
-                  addArrayToBuffer(&dataR[indice], &outBuf[0], gain);
-                }
+              const float hrtfRate = isLow ? lowHrtfRate : nearestSampleRate[0];
+              lop(getHrtf(hrtfRate, true, elevationIndex, azimutalIndex), &outBuf[0], rate, p.hfDamp,nbounds,1,size);
+              addArrayToBuffer(&dataL[indice], &outBuf[0], gain, size);
+              lop(getHrtf(hrtfRate, false, elevationIndex, azimutalIndex), &outBuf[0], rate, p.hfDamp,nbounds,1,size);
+              addArrayToBuffer(&dataR[indice], &outBuf[0], gain, size);
             }
+            counters.endRender();
           }
         }
         progress = float(ix-nxmin)/float(nxmax-nxmin);
       }
       else return;
     }
+
+    // The reflections calculated at the reduced rate are merged
+    const auto mergeStart = juce::Time::getHighResolutionTicks();
+    for (int i=0; i<multirateFactor; i++)
+      IrResampler::addUpsampled(lowBuffers[i].getBuffer(), multirateFactor, lowStart, irBuffer, i);
+    counters.addMergeTime(juce::Time::getHighResolutionTicks()-mergeStart);
+
+    size_t bytes = MemoryUsage::getBytes(irBuffer);
+    for (int i=0; i<multirateFactor; i++)
+      bytes += MemoryUsage::getBytes(lowBuffers[i].getBuffer());
+    counters.memory = bytes;
+
+    if (releasesBuffers)
+      for (auto& b : lowBuffers)
+        b.release();
+    counters.finish();
     isCalculating[0] = false;
-    cout << "Done" << endl;
+    LOG_DEBUG("Done");
+}
+
+int IrBoxCalculator::getEarlyTaps(const IrBoxCalculatorParams& pa, EarlyTap* taps)
+{
+    int numTaps = 0;
+    const float rp = sqrt((pa.sx-pa.lx)*(pa.sx-pa.lx)+(pa.sy-pa.ly)*(pa.sy-pa.ly));
+
+    for (int ix=-EARLY_ORDER; ix<=EARLY_ORDER; ix++)
+    for (int iy=-EARLY_ORDER; iy<=EARLY_ORDER; iy++)
+    for (int iz=-EARLY_ORDER; iz<=EARLY_ORDER; iz++)
+    {
+      const int nbounds = abs(ix)+abs(iy)+abs(iz);
+      if (nbounds > EARLY_ORDER)
+        continue;
+
+      // (same images and gains as in run())
+      const float x = 2*ceil(float(ix)/2)*pa.rx+pow(-1,ix)*pa.sx;
+      const float y = 2*ceil(float(iy)/2)*pa.ry+pow(-1,iy)*pa.sy;
+      const float z = 2*ceil(float(iz)/2)*pa.rz+pow(-1,iz)*pa.sz;
+      // (the gain is bounded when the source is on the listener)
+      const float dist = juce::jmax(0.1f, sqrt((x-pa.lx)*(x-pa.lx)+(y-pa.ly)*(y-pa.ly)+(z-pa.lz)*(z-pa.lz)));
+      const float elev = atan2f(z-pa.lz,rp)*EIGHTYOVERPI;
+      const float theta = atan2f(y-pa.ly,-x+pa.lx)*EIGHTYOVERPI-90-pa.headAzim;
+      float gainL = pow(1-pa.damp,nbounds)/dist, gainR = gainL;
+
+      auto& tap = taps[numTaps++];
+      tap.nbounds = nbounds;
+      tap.elevationIndex = -1;
+      tap.azimutalIndex = -1;
+
+      // XY
+      if (pa.type==0){
+        auto elevCardio = (1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev)));
+        gainL *= 0.25*(1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(theta+45*pa.sWidth))) * elevCardio;
+        gainR *= 0.25*(1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(theta-45*pa.sWidth))) * elevCardio;
+      }
+
+      // MS with cardio mic for mid channel
+      if (pa.type==1){
+        auto gainMid = 0.25*(1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(theta)))
+                        * (1+juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev)));
+        auto gainSide = juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev))
+                        * juce::dsp::FastMathApproximations::sin(PIOVEREIGHTY*(theta));
+        gainL *= gainMid-gainSide*pa.sWidth;
+        gainR *= gainMid+gainSide*pa.sWidth;
+      }
+
+      // MS with omni mic for mid channel
+      if (pa.type==2){
+        auto gainSide = juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev))
+                        * juce::dsp::FastMathApproximations::sin(PIOVEREIGHTY*(theta));
+        gainL *= 1.f-gainSide*pa.sWidth;
+        gainR *= 1.f+gainSide*pa.sWidth;
+      }
+
+      // Binaural
+      if (pa.type==3){
+        tap.elevationIndex = proximityIndex(&elevations[0],NELEV,elev,false);
+        tap.azimutalIndex = proximityIndex(&azimuths[tap.elevationIndex][0],NAZIM,theta,true);
+        gainL *= .707107f;
+        gainR *= .707107f;
+      }
+
+      tap.gains[0] = gainL;
+      tap.gains[1] = gainR;
+      // (with the mean of the random delays of the reflections)
+      tap.delay = (dist*INV_SOUNDSPEED+0.5f*SIGMA_DELTAT)*float(pa.sampleRate);
+    }
+    return numTaps;
+}
+
+void IrBoxCalculator::getEarlyKernel(const IrBoxCalculatorParams& pa, const EarlyTap& tap, float hrtfRate, int size, float* left, float* right)
+{
+    if (tap.elevationIndex >= 0)
+    {
+      lop(getHrtf(hrtfRate, true, tap.elevationIndex, tap.azimutalIndex), left, pa.sampleRate, pa.hfDamp,tap.nbounds,1,size);
+      lop(getHrtf(hrtfRate, false, tap.elevationIndex, tap.azimutalIndex), right, pa.sampleRate, pa.hfDamp,tap.nbounds,1,size);
+    }
+    else
+    {
+      float inBuf[NSAMP96]={0.f};
+      inBuf[10] = 1.f;
+      lop(&inBuf[0], left, pa.sampleRate, pa.hfDamp,tap.nbounds,1,size);
+      juce::FloatVectorOperations::copy(right, left, size);
+    }
 }
 
 // Add a given array to a buffer
-void IrBoxCalculator::addArrayToBuffer(float *bufPtr, const float *hrtfPtr, const float gain)
+void IrBoxCalculator::addArrayToBuffer(float *bufPtr, const float *hrtfPtr, const float gain, const int length)
 {
-  for (int i=0; i<nsamp[0]; i++)
+  const auto splatStart = counters.beginSplat();
+  for (int i=0; i<length; i++)
   {
     bufPtr[i] += hrtfPtr[i]*gain;
   }
+  counters.endSplat(splatStart);
 }
 
 // Compares the values in data to a float prameter value and returns the nearest index
@@ -173,20 +331,20 @@ int IrBoxCalculator::proximityIndex(const float *data, const int length, const f
 }
 
 // Basic lowpass filter
-void IrBoxCalculator::lop(const float* in, float* out, const int sampleFreq, const float hfDamping, const int nRebounds, const int order)
+void IrBoxCalculator::lop(const float* in, float* out, const int sampleFreq, const float hfDamping, const int nRebounds, const int order, const int length)
 {
     const float om = OMEGASTART*(exp(-hfDamping*nRebounds));
     const float alpha1 = exp(-om/sampleFreq);
     const float alpha = 1 - alpha1;
     out[0] = alpha*in[0];
-    for (int i=1;i<nsamp[0];i++)
+    for (int i=1;i<length;i++)
     {
       out[i] = alpha*in[i] + alpha1*out[i-1];
     }
     for (int j=0; j<order-1; j++)
     {
       out[0] *= alpha;
-      for (int i=1;i<nsamp[0];i++)
+      for (int i=1;i<length;i++)
       {
         out[i] = alpha*out[i] + alpha1*out[i-1];
       }
@@ -225,14 +383,17 @@ void IrBoxCalculator::setCalculatingBool(bool* cp)
   isCalculating = cp;
 }
 
-void IrBoxCalculator::setBuffer(juce::AudioBuffer<float>* b)
+void IrBoxCalculator::setBuffer(ArenaBuffer* b)
 {
   bp = b;
 }
 
-void IrBoxCalculator::setCalculateDirectPath(bool c)
+size_t IrBoxCalculator::getSizeInBytes() const
 {
-  calculateDirectPath = c;
+  size_t bytes = bp != nullptr ? bp->getSizeInBytes() : 0;
+  for (auto& b : lowBuffers)
+    bytes += b.getSizeInBytes();
+  return bytes;
 }
 
 void IrBoxCalculator::setHrtfVars(int* ns, float* nsr)
@@ -255,6 +416,9 @@ IrTransfer::IrTransfer() : juce::Thread("transfer")
 
 void IrTransfer::run()
 {
+  // (the span includes the wait for the calculators)
+  TraceLog::ScopedThread traceThread;
+  TraceLog::Scope trace("IR transfer");
 
   hasTransferred = false;
   
@@ -276,33 +440,56 @@ void IrTransfer::run()
       }
   }
 
-  std::cout << "Buffer copy...." ;
-  tempBuf.makeCopyOf(bp[0],true);
-  std:cout << "Buffer copy done. Size : " << tempBuf.getNumSamples() << std::endl;
+  // (the calculators have finished)
+  if (calculators != nullptr)
+  {
+    IrCalculatorCounters counters[MAXTHREADS];
+    for (int i=0; i<threadsNum; i++)
+      counters[i] = calculators[i].counters;
+    metrics.addCalculators(counters, threadsNum);
+  }
 
-  for (int i=0;i<threadsNum;i++)
-    {
-      tempBuf.addFrom(0,0,bp[i],0,0,bp[i].getNumSamples());
-      tempBuf.addFrom(1,0,bp[i],1,0,bp[i].getNumSamples());
-    }
+  const auto reductionStart = juce::Time::getHighResolutionTicks();
+  {
+    TraceLog::Scope traceReduce("reduce");
+    LOG_DEBUG("Buffer copy....");
+    // (without its silent end)
+    sumBuffers(bp, threadsNum, tempBuf, sampleRate, releasesBuffers);
+    LOG_DEBUG("Buffer copy done. Size : " << tempBuf.getNumSamples());
+    metrics.peakMemory += MemoryUsage::getBytes(tempBuf);
+  }
+
+  const auto transferStart = juce::Time::getHighResolutionTicks();
+  metrics.phaseTimes[IrMetrics::reduction] += juce::Time::highResolutionTicksToSeconds(transferStart-reductionStart);
+  TraceLog::Scope traceLoad("load");
+  auto ir = onTransferred ? onTransferred(std::move(tempBuf))
+                          : std::make_shared<const juce::AudioBuffer<float>>(std::move(tempBuf));
 
-  irp->loadImpulseResponse(std::move (tempBuf),
-                      sampleRate,
-                      juce::dsp::Convolution::Stereo::yes,
-                      juce::dsp::Convolution::Trim::no,
-                      juce::dsp::Convolution::Normalise::no);
+  // (only the first updateTime seconds, if set)
+  if (updateTime > 0.0)
+    irp->updateImpulseResponse(irSlot, ir, sampleRate, updateTime);
+  else
+    irp->loadImpulseResponse(irSlot, ir, sampleRate);
 
   hasTransferred = true;
+
+  const auto end = juce::Time::getHighResolutionTicks();
+  metrics.phaseTimes[IrMetrics::transfer] += juce::Time::highResolutionTicksToSeconds(end-transferStart);
+  metrics.irLength = ir->getNumSamples();
+  metrics.timeToLoad = juce::Time::highResolutionTicksToSeconds(end-changeTicks);
+  if (onMeasured)
+    onMeasured(metrics);
 }
 
-void IrTransfer::setBuffer(juce::AudioBuffer<float>* bufPointer)
+void IrTransfer::setBuffer(ArenaBuffer* bufPointer)
 {
   bp = bufPointer;
 
 }
-void IrTransfer::setIr(juce::dsp::Convolution* irPointer)
+void IrTransfer::setIr(PartitionedConvolution* irPointer, int slot)
 {
   irp = irPointer;
+  irSlot = slot;
 }
 
 void IrTransfer::setCalculatingBool(bool* cp)
@@ -315,6 +502,11 @@ void IrTransfer::setSampleRate(double sr)
   sampleRate = sr;
 }
 
+void IrTransfer::setUpdateTime(double t)
+{
+  updateTime = t;
+}
+
 double IrTransfer::getSampleRate()
 {
   return sampleRate;
@@ -330,27 +522,218 @@ void IrTransfer::setThreadsNum(int n)
   threadsNum = std::min<int>(n,MAXTHREADS);
 }
 
+void IrTransfer::setCalculators(IrBoxCalculator* c)
+{
+  calculators = c;
+}
+
+void IrTransfer::setReleasesBuffers(bool shouldRelease)
+{
+  releasesBuffers = shouldRelease;
+}
+
+void IrTransfer::startMetrics(juce::uint64 k, juce::int64 ticks)
+{
+  metrics = IrMetrics();
+  metrics.key = k;
+  metrics.sampleRate = sampleRate;
+  changeTicks = ticks;
+}
+
+// Sums the buffers filled by the calculator threads
+// (in place : only the trimmed IR is allocated)
+void IrTransfer::sumBuffers(ArenaBuffer* buffers, int num, juce::AudioBuffer<float>& dest, double sampleRate, bool releaseBuffers)
+{
+  auto& sum = buffers[0].getBuffer();
+  for (int i=1;i<num;i++)
+    {
+      auto& b = buffers[i].getBuffer();
+      sum.addFrom(0,0,b,0,0,b.getNumSamples());
+      sum.addFrom(1,0,b,1,0,b.getNumSamples());
+    }
+  IrTrimmer::copyTrimmed(sum, dest, sampleRate);
+  if (releaseBuffers)
+    for (int i=0;i<num;i++)
+      buffers[i].release();
+}
+
+// ===============================================================
+// ===============================================================
+IrSpeculator::IrSpeculator(BoxRoomIR& o) : juce::Thread("speculator"), owner(o)
+{
+
+}
+
+void IrSpeculator::run()
+{
+  while (!threadShouldExit())
+  {
+    IrBoxCalculatorParams candidate;
+    if (owner.getNextSpeculationCandidate(candidate))
+      owner.runSpeculativeCalculation(candidate);
+    else
+      wait(-1);
+  }
+}
+
 
 // ========================================================
 // ========================================================
 
+// Number of reflections orders needed for the given damping
+static int getReflectionsOrder(const IrBoxCalculatorParams& pa)
+{
+  return int(log10(2e-2)/log10(1-pa.damp));
+}
+
+// IR length (in samples) needed to hold reflections up to order n
+static int getIrLength(const IrBoxCalculatorParams& pa, int n, int nsamp)
+{
+  auto dur = (n+1)*sqrt(pa.rx*pa.rx+pa.ry*pa.ry+pa.rz*pa.rz)/340;
+  return int(ceil(dur*pa.sampleRate)+nsamp+int(pa.sampleRate*SIGMA_DELTAT));
+}
+
+// Length of the IR of the largest room with the lowest damping
+static int getLongestIrLength(double sampleRate, int nsamp)
+{
+  IrBoxCalculatorParams pa{};
+  pa.rx = pa.ry = pa.rz = MAXSIZE;
+  pa.damp = MINDAMPING;
+  pa.sampleRate = sampleRate;
+  return getIrLength(pa, getReflectionsOrder(pa), nsamp);
+}
+
+// Order from which the reflections can be calculated at 1/factor of
+// the sample rate : with the HF damping of their order, the part of
+// their spectrum above the reduced band is negligible
+static int getMultirateOrder(const IrBoxCalculatorParams& pa, int factor)
+{
+  if (factor == 1)
+    return std::numeric_limits<int>::max();
+
+  const double bandEdge = RESAMPLER_CUTOFF*0.5*pa.sampleRate/factor;
+  const double maxLevel = pow(10.0, MULTIRATE_LOSS/10.0);
+  const int maxOrder = 3*getReflectionsOrder(pa);
+  for (int order=0; order<=maxOrder; order++)
+  {
+    // (energy of the one-pole lowpass above the band edge, relative
+    // to its total energy)
+    const double cutoff = OMEGASTART*exp(-pa.hfDamp*order)/juce::MathConstants<double>::twoPi;
+    const double highPart = 1.0-2.0/juce::MathConstants<double>::pi*atan(bandEdge/cutoff);
+    if (pow(1-pa.damp, 2*order)*highPart <= maxLevel)
+      return order;
+  }
+  return std::numeric_limits<int>::max();
+}
+
+// Whether calculating the reflections from order at 1/factor of the
+// sample rate is faster : the grains saved must outweigh the upsampling
+// of the reduced rate reflections, done by each thread over the whole IR
+static bool isMultirateFaster(const IrBoxCalculatorParams& pa, int n, int order, int factor, int nsamp, int longueur, int threadsNum)
+{
+  int lowSize;
+  getNearestHrtfRate(pa.sampleRate/factor, lowSize);
+  double numLow = 0.0;
+  for (int ix=-n+1; ix<n; ix++)
+    for (int iy=-n+1; iy<n; iy++)
+    {
+      // (the images of orders below order have |iz| < k)
+      const int k = order-abs(ix)-abs(iy);
+      numLow += k <= 0 ? 2*n-1 : std::max(0, 2*n-1-(2*k-1));
+    }
+  return numLow*(nsamp-lowSize) > MULTIRATE_MERGECOST*threadsNum*double(longueur);
+}
+
+// Key of the direct path and of the early reflections : the same key
+// gives the same taps and kernels
+static juce::uint64 getEarlyPathsKey(const IrBoxCalculatorParams& pa, float directLevel, float reflectionsLevel)
+{
+  return IrKeyBuilder().add(pa.rx,1e-3f).add(pa.ry,1e-3f).add(pa.rz,1e-3f)
+                       .add(pa.lx,EARLY_POSITIONQUANTUM).add(pa.ly,EARLY_POSITIONQUANTUM).add(pa.lz,EARLY_POSITIONQUANTUM)
+                       .add(pa.sx,EARLY_POSITIONQUANTUM).add(pa.sy,EARLY_POSITIONQUANTUM).add(pa.sz,EARLY_POSITIONQUANTUM)
+                       .add(pa.damp,1e-4f).add(pa.hfDamp,1e-4f)
+                       .add(pa.type)
+                       .add(pa.headAzim,0.1f)
+                       .add(pa.sWidth,1e-3f)
+                       .add(directLevel,1e-4f).add(reflectionsLevel,1e-4f)
+                       .getKey();
+}
+
+// Whether the late reflections are nearly the same with both parameters :
+// same room and settings, and small moves of the source and the listener
+static bool isSmallMove(const IrBoxCalculatorParams& a, const IrBoxCalculatorParams& b)
+{
+  return juce::approximatelyEqual(a.rx,b.rx)
+      && juce::approximatelyEqual(a.ry,b.ry)
+      && juce::approximatelyEqual(a.rz,b.rz)
+      && juce::approximatelyEqual(a.damp,b.damp)
+      && juce::approximatelyEqual(a.hfDamp,b.hfDamp)
+      && a.type == b.type
+      && juce::approximatelyEqual(a.headAzim,b.headAzim)
+      && juce::approximatelyEqual(a.sWidth,b.sWidth)
+      && juce::approximatelyEqual(a.sampleRate,b.sampleRate)
+      && sqrt((a.lx-b.lx)*(a.lx-b.lx)+(a.ly-b.ly)*(a.ly-b.ly)+(a.lz-b.lz)*(a.lz-b.lz)) <= PARTIAL_MAXMOVE
+      && sqrt((a.sx-b.sx)*(a.sx-b.sx)+(a.sy-b.sy)*(a.sy-b.sy)+(a.sz-b.sz)*(a.sz-b.sz)) <= PARTIAL_MAXMOVE;
+}
+
+// Identifies the kernel of a tap in the tap network
+static juce::uint64 getEarlyKernelId(const IrBoxCalculatorParams& pa, const EarlyTap& tap)
+{
+  return IrKeyBuilder().add(tap.nbounds)
+                       .add(pa.hfDamp,1e-6f)
+                       .add(tap.elevationIndex).add(tap.azimutalIndex)
+                       .getKey();
+}
+
+// Guess the next parameters from the two last ones, assuming that
+// the user keeps on moving the control in the same direction
+static IrBoxCalculatorParams extrapolateParams(const IrBoxCalculatorParams& from, const IrBoxCalculatorParams& to)
+{
+  auto next = to;
+  next.rx = juce::jlimit(1.f, MAXSIZE, 2*to.rx-from.rx);
+  next.ry = juce::jlimit(1.f, MAXSIZE, 2*to.ry-from.ry);
+  next.rz = juce::jlimit(1.f, MAXSIZE, 2*to.rz-from.rz);
+  next.lx = juce::jlimit(0.01f*next.rx, 0.99f*next.rx, 2*to.lx-from.lx);
+  next.ly = juce::jlimit(0.01f*next.ry, 0.99f*next.ry, 2*to.ly-from.ly);
+  next.lz = juce::jlimit(0.01f*next.rz, 0.99f*next.rz, 2*to.lz-from.lz);
+  next.sx = juce::jlimit(0.01f*next.rx, 0.99f*next.rx, 2*to.sx-from.sx);
+  next.sy = juce::jlimit(0.01f*next.ry, 0.99f*next.ry, 2*to.sy-from.sy);
+  next.sz = juce::jlimit(0.01f*next.rz, 0.99f*next.rz, 2*to.sz-from.sz);
+  next.damp = juce::jlimit(MINDAMPING, 0.99f, 2*to.damp-from.damp);
+  next.hfDamp = juce::jlimit(0.01f, 0.3f, 2*to.hfDamp-from.hfDamp);
+  next.headAzim = juce::jlimit(-180.f, 180.f, 2*to.headAzim-from.headAzim);
+  next.sWidth = juce::jlimit(0.f, 1.f, 2*to.sWidth-from.sWidth);
+  return next;
+}
+
 BoxRoomIR::BoxRoomIR()
 {
+  boxSlot = convolution.addSlot(0, 0, 2);
+}
 
+BoxRoomIR::~BoxRoomIR()
+{
+  stopSpeculation();
+  speculator.stopThread(1000);
+  abandonPendingIr();
 }
 
 void BoxRoomIR::initialize()
 {
+    // Threads and buffers are set once for all
+    if (hasInitialized)
+      return;
+
     hasInitialized = false;
 
-    std::cout << "In BoxRoomIR::initialize()" << std::endl;
+    LOG_DEBUG("In BoxRoomIR::initialize()");
 
     int numCpus = juce::SystemStats::getNumPhysicalCpus();
 
-    cout << "Number of CPUs : " << juce::SystemStats::getNumCpus() << endl;
-    cout << "Number of physical CPUs : " << numCpus << endl;
+    LOG_INFO("Number of CPUs : " << juce::SystemStats::getNumCpus());
+    LOG_INFO("Number of physical CPUs : " << numCpus);
     threadsNum = std::max<int>(0,std::min<int>(numCpus-1,MAXTHREADS));
-    cout << "Number of threads : " << threadsNum << endl;
+    LOG_INFO("Number of threads : " << threadsNum);
 
     // Calculators for the room reflexions (box)
 
@@ -358,26 +741,21 @@ void BoxRoomIR::initialize()
     {
       boxCalculator[i].setCalculatingBool(&isCalculating[i]);
       boxCalculator[i].setBuffer(&boxIrBuffer[i]);
-      boxCalculator[i].setCalculateDirectPath(false);
       boxCalculator[i].setHrtfVars(&nsamp, &nearestSampleRate);
     }
 
     boxIrTransfer.setCalculatingBool(&isCalculating[0]);
     boxIrTransfer.setBuffer(&boxIrBuffer[0]);
-    boxIrTransfer.setIr(&boxConvolution);
+    boxIrTransfer.setIr(&convolution, boxSlot);
     boxIrTransfer.setThreadsNum(threadsNum);
+    boxIrTransfer.setCalculators(boxCalculator);
 
-    // Calculator for the direct path
-
-    directCalculator.setCalculatingBool(&isCalculatingDirect);
-    directCalculator.setBuffer(&directIrBuffer);
-    directCalculator.setCalculateDirectPath(true);
-    directCalculator.setHrtfVars(&nsamp, &nearestSampleRate);
+    // The summed IR is kept in the cache once it is transferred
+    boxIrTransfer.onTransferred = [this](juce::AudioBuffer<float>&& b) { return storeTransferredIr(std::move(b)); };
+    boxIrTransfer.onMeasured = [this](const IrMetrics& m) { setIrMetrics(m); };
 
-    directIrTransfer.setCalculatingBool(&isCalculatingDirect);
-    directIrTransfer.setBuffer(&directIrBuffer);
-    directIrTransfer.setIr(&directConvolution);
-    directIrTransfer.setThreadsNum(1);
+    if (!speculator.isThreadRunning())
+      speculator.startThread(juce::Thread::Priority::low);
 
     hasInitialized = true;
 
@@ -385,48 +763,58 @@ void BoxRoomIR::initialize()
 
 void BoxRoomIR::prepare(juce::dsp::ProcessSpec spec)
 {
+    // If nothing has changed, the loaded IRs are kept
+    // (only the processing state is cleared)
+    if (hasPrepared
+        && juce::approximatelyEqual(spec.sampleRate, preparedSpec.sampleRate)
+        && spec.maximumBlockSize == preparedSpec.maximumBlockSize
+        && spec.numChannels == preparedSpec.numChannels)
+    {
+      convolution.reset();
+      earlyPaths.reset();
+      hasEarlyParams = false;
+      for (int i=0; i<2; i++)
+        filter[i].reset();
+      return;
+    }
+
+    // IRs being calculated at the previous sample rate are useless
+    bool rateHasChanged = hasPrepared && !juce::approximatelyEqual(spec.sampleRate, preparedSpec.sampleRate);
+    if (rateHasChanged)
+      stopCalculation();
+
 
-    inputBufferCopy.setSize(2, spec.maximumBlockSize ,false,true);
+    convolutionOutput.setSize(convolution.getNumOutputs()+2, spec.maximumBlockSize ,false,true);
 
-    cout << "Actual sampleRate : " << spec.sampleRate << " Hz." << endl;
+    LOG_INFO("Actual sampleRate : " << spec.sampleRate << " Hz.");
 
     // We have hrtf only for a discrete set of samplerates
     // (typically 44.1, 48, 88.2, 96)
-    nearestSampleRate = 44100.f;
-    float distance = 200000.f;
-    for (float sr : possibleSampleRates)
-      if (abs(sr-spec.sampleRate)<distance)
-      {
-        distance = abs(sr-spec.sampleRate);
-        nearestSampleRate = sr;
-      };
-
-      if (juce::approximatelyEqual(nearestSampleRate, 44100.f))
-        nsamp = NSAMP44;
-      else if (juce::approximatelyEqual(nearestSampleRate, 48000.f))
-        nsamp = NSAMP48;
-      else if (juce::approximatelyEqual(nearestSampleRate, 88200.f))
-        nsamp = NSAMP88;
-      else if (juce::approximatelyEqual(nearestSampleRate, 96000.f))
-        nsamp = NSAMP96;
-    
+    nearestSampleRate = getNearestHrtfRate(spec.sampleRate, nsamp);
+    float distance = abs(nearestSampleRate-float(spec.sampleRate));
+
     if (!juce::approximatelyEqual(distance,0.f))
-      cout << "Warning : sample rate of " << p.sampleRate
-            << " Hz not in possible sample rates, using HRTF at "
-            << nearestSampleRate << " Hz." << endl;
+      LOG_WARNING("Warning : sample rate of " << p.sampleRate
+                  << " Hz not in possible sample rates, using HRTF at "
+                  << nearestSampleRate << " Hz.");
     else
       {
-        cout << "Sample rate : " << nearestSampleRate << " Hz" << endl;
-        cout << "HRTF size : " << nsamp << endl;
+        LOG_INFO("Sample rate : " << nearestSampleRate << " Hz");
+        LOG_INFO("HRTF size : " << nsamp);
       }
 
     boxIrTransfer.setSampleRate(spec.sampleRate);
-    boxConvolution.reset();
-    boxConvolution.prepare(spec);
 
-    directIrTransfer.setSampleRate(spec.sampleRate);
-    directConvolution.reset();
-    directConvolution.prepare(spec);
+    // (until the exact IR is calculated at the new sample rate, the
+    // convolution uses a resampled copy of the current one : made here
+    // if it is short, else by its resampler thread, silent until then)
+    convolution.reset();
+    convolution.prepare(spec);
+
+    // (room for the largest latency of the convolution)
+    earlyPaths.prepare(spec.sampleRate, int(spec.maximumBlockSize), 2, nsamp, int(EARLY_MAXDELAY*spec.sampleRate)+CONV_MAXHEADSIZE, EARLY_NUMTAPS);
+    earlyKernels.setSize(2, nsamp);
+    hasEarlyParams = false;
 
     // Output highpass filter to cut everything below 15Hz
     for (int i=0; i<2; i++)
@@ -435,59 +823,210 @@ void BoxRoomIR::prepare(juce::dsp::ProcessSpec spec)
       filter[i].prepare(spec);  
     }
 
-    std::cout << "BoxRoomIR::prepare has finished. \n";
+    preparedSpec = spec;
+    hasPrepared = true;
+
+    LOG_DEBUG("BoxRoomIR::prepare has finished.");
+
+}
+
+// Latency of the convolutions (0 for zero latency processing),
+// traded for a lower CPU load
+void BoxRoomIR::setLatency(int latencyInSamples)
+{
+  convolution.setLatency(latencyInSamples);
 
+  // (the engines are only rebuilt if the latency changes, prepareToPlay
+  // sets it each time)
+  if (!hasPrepared || latencyInSamples == convolution.getLatency())
+    return;
+  convolution.prepare(preparedSpec);
+
+  // (the early paths are delayed by the new latency)
+  earlyPaths.reset();
+  hasEarlyParams = false;
+}
+
+void BoxRoomIR::setSafetyLevel(int level)
+{
+  convolution.setSafetyLevel(level);
+}
+
+int BoxRoomIR::getLatency()
+{
+  return convolution.getLatency();
 }
 
 void BoxRoomIR::calculate(IrBoxCalculatorParams& p)
 {
     if (setIrCaclulatorsParams(p))     // (We run the calculation only if a parameter has changed)
     {    
+      changeTicks = juce::Time::getHighResolutionTicks();
+
+      // (when a control is released on the parameters being speculated,
+      // the calculation in flight is kept)
+      const auto key = getParamsKey(p);
+      if (adoptSpeculation(key))
+      {
+        waitingKey = key;
+        return;
+      }
 
-      // We have to stop an eventual running thread (and next restart)
+      stopCalculation();
+      runCalculation(key);
+    }
+    else if (waitingKey != 0)
+    {
+      checkWaitingIr();
+    }
+}
 
-      for (int i=0;i<threadsNum;i++)
+// Stops any running calculation (real or speculative) and IR transfer
+void BoxRoomIR::stopCalculation()
+{
+    // Real work has arrived, speculative calculations are abandoned
+    stopSpeculation();
+
+    // We have to stop an eventual running thread (and next restart)
+
+    for (int i=0;i<threadsNum;i++)
+    {
+      if (boxCalculator[i].isThreadRunning())
+        {
+          LOG_DEBUG("Thread no " << i << " running");
+          if (boxCalculator[i].stopThread(1000))
+            LOG_DEBUG("Thread no " << i << " stopped");
+        }
+    }
+
+    // We should also ask for any IR transfer to stop
+
+    if (boxIrTransfer.isThreadRunning())
       {
-        if (boxCalculator[i].isThreadRunning())
-          {
-            std::cout << "Thread no " << i << " running" << endl;
-            if (boxCalculator[i].stopThread(1000))
-              std::cout << "Thread no " << i << " stopped" << endl;
-          }
+        LOG_DEBUG("Box IR thread running");
+        if (boxIrTransfer.stopThread(500))
+          LOG_DEBUG("Thread box IR stopped");
       }
-      if (directCalculator.isThreadRunning())
+
+    abandonPendingIr();
+}
+
+void BoxRoomIR::runCalculation(juce::uint64 key)
+{
+      // Small moves keep the current IR
+      std::shared_ptr<const IrSnapshot> restored;
       {
-        std::cout << "Thread direct running" << endl;
-        if (directCalculator.stopThread(500))
-          std::cout << "Thread direct stopped" << endl;            
+        const juce::ScopedLock sl(irLock);
+        if (currentIr != nullptr && currentIr->key == key)
+          return;
+        if (restoredIr != nullptr && restoredIr->key == key)
+          std::swap(restored, restoredIr);
       }
-      
-      // We should also ask for any IR transfer to stop
 
-      if (boxIrTransfer.isThreadRunning())
-        {
-          std::cout << "Box IR thread running" << endl;
-          if (boxIrTransfer.stopThread(500))
-            std::cout << "Thread box IR stopped" << endl;
-        }
+      // The IR restored from the plugin state is loaded even if the
+      // store has evicted it
+      if (restored != nullptr)
+      {
+        LOG_INFO("IR restored from the state");
+        loadSnapshot(restored);
+        return;
+      }
 
-      if (directIrTransfer.isThreadRunning())
+      // If this IR has already been calculated (or speculated),
+      // possibly by another instance, it is loaded directly
+
+      if (auto ir = irStore->find(key))
       {
-        std::cout << "Thread direct running" << endl;
-        if (directIrTransfer.stopThread(500))
-          std::cout << "Thread direct IR stopped" << endl;            
+        LOG_INFO("IR found in store");
+        loadSnapshot(ir);
+        return;
       }
 
+      // If another instance is calculating it, we wait for it
+      if (!irStore->beginCalculation(key))
+      {
+        LOG_INFO("IR being calculated elsewhere");
+        waitingKey = key;
+        return;
+      }
+
+      {
+        const juce::ScopedLock sl(irLock);
+        hasLoadedFromCache = false;
+        pendingIr = std::make_shared<IrSnapshot>();
+        pendingIr->key = key;
+        pendingIr->sampleRate = p.sampleRate;
+        pendingParams = p;
+        pendingUpdateTime = getUpdateTime(p);
+      }
+
+      applyMemoryBudget(getIrLength(p, getReflectionsOrder(p), nsamp));
+      startCalculators(p, juce::Thread::Priority::normal);
+
+      boxIrTransfer.startMetrics(key, changeTicks);
+      boxIrTransfer.setUpdateTime(pendingUpdateTime);
+      boxIrTransfer.startThread();
+}
+
+// Called on each update while waiting for an IR calculated elsewhere
+void BoxRoomIR::checkWaitingIr()
+{
+  auto key = waitingKey;
+  // (in flight state is read first, the IR is stored before it is cleared)
+  bool stillInFlight = irStore->isInFlight(key);
+  if (auto ir = irStore->find(key))
+  {
+    waitingKey = 0;
+    loadSnapshot(ir);
+  }
+  else if (!stillInFlight)
+  {
+    // The other calculation has been abandoned
+    waitingKey = 0;
+    runCalculation(key);
+  }
+}
+
+// The IR being calculated will not be stored
+void BoxRoomIR::abandonPendingIr()
+{
+  waitingKey = 0;
+  const juce::ScopedLock sl(irLock);
+  if (pendingIr != nullptr)
+  {
+    irStore->endCalculation(pendingIr->key);
+    pendingIr = nullptr;
+  }
+}
+
+void BoxRoomIR::startCalculators(IrBoxCalculatorParams& pa, juce::Thread::Priority priority)
+{
       // Set some multithread loops parameters
 
-      int n = int(log10(2e-2)/log10(1-p.damp));
-      auto dur = (n+1)*sqrt(p.rx*p.rx+p.ry*p.ry+p.rz*p.rz)/340;
-      int longueur = int(ceil(dur*p.sampleRate)+nsamp+int(p.sampleRate*SIGMA_DELTAT));
+      int n = getReflectionsOrder(pa);
+      int longueur = getIrLength(pa, n, nsamp);
       int chunksize = floor(2*float(n)/threadsNum);
 
+      // At high sample rates, the late reflections are calculated at a
+      // reduced rate
+      int multirateFactor = pa.sampleRate >= MULTIRATE_MINRATE ? MULTIRATE_FACTOR : 1;
+      int multirateOrder = getMultirateOrder(pa, multirateFactor);
+      if (multirateFactor > 1 && !isMultirateFaster(pa, n, multirateOrder, multirateFactor, nsamp, longueur, threadsNum))
+      {
+        multirateFactor = 1;
+        multirateOrder = std::numeric_limits<int>::max();
+      }
+      if (multirateFactor > 1)
+        LOG_INFO("Reflections from order " << multirateOrder << " calculated at 1/" << multirateFactor << " of the sample rate");
+
       for (int i=0;i<threadsNum;i++)
       {
+          boxCalculator[i].setParams(pa);
           boxCalculator[i].longueur = longueur;
+          boxCalculator[i].capacity = arenaCapacity;
+          boxCalculator[i].multirateFactor = multirateFactor;
+          boxCalculator[i].multirateOrder = multirateOrder;
+          boxCalculator[i].releasesBuffers = memoryLevel >= MemoryUsage::compact;
           boxCalculator[i].n = n;
           boxCalculator[i].nxmin = -n+1 + i*chunksize;
           boxCalculator[i].nxmax = -n+1 + (i+1)*chunksize;
@@ -496,29 +1035,13 @@ void BoxRoomIR::calculate(IrBoxCalculatorParams& p)
           boxCalculator[i].resetProgress();
       }
 
-      n = 1;
-      dur = (n+1)*sqrt(p.rx*p.rx+p.ry*p.ry+p.rz*p.rz)/340;
-      longueur = int(ceil(dur*p.sampleRate)+nsamp+int(p.sampleRate*SIGMA_DELTAT));
-
-      directCalculator.longueur = longueur;
-      directCalculator.n = n;
-      directCalculator.nxmin = 0;
-      directCalculator.nxmax = 1;
-      directCalculator.resetProgress();
-
       // Start the threads
 
       for (int i=0;i<threadsNum;i++)
       {
-        std::cout << "Start box thread no " << i << std::endl;
-        boxCalculator[i].startThread();
+        LOG_DEBUG("Start box thread no " << i);
+        boxCalculator[i].startThread(priority);
       }
-      std::cout << "Start direct path thread" << std::endl;
-      directCalculator.startThread();
-
-      boxIrTransfer.startThread();
-      directIrTransfer.startThread();
-    }
 }
 
 bool BoxRoomIR::setIrCaclulatorsParams(IrBoxCalculatorParams& pa)
@@ -526,7 +1049,6 @@ bool BoxRoomIR::setIrCaclulatorsParams(IrBoxCalculatorParams& pa)
     // We check if a parameter has changed
     // If nothing has changed, we do nothing and return false
     // If at least one parameter has changed we update params
-    // of each threaded calculator
     if (juce::approximatelyEqual(p.rx,pa.rx)
       && juce::approximatelyEqual(p.ry,pa.ry)
       && juce::approximatelyEqual(p.rz,pa.rz)
@@ -547,10 +1069,9 @@ bool BoxRoomIR::setIrCaclulatorsParams(IrBoxCalculatorParams& pa)
       }
     else
       {
+        // (the calculators receive them when they are started, they may
+        // still be busy with a speculative calculation)
         p = pa;
-        for (int i=0;i<threadsNum;i++)
-          boxCalculator[i].setParams(pa);
-        directCalculator.setParams(pa);
         return true;
       }
 }
@@ -570,6 +1091,14 @@ float BoxRoomIR::getProgress()
 
 bool BoxRoomIR::getCalculatingState()
 {
+  // Waiting for an IR calculated by another instance
+  if (waitingKey != 0)
+    return true;
+
+  // Speculative calculations are invisible from the outside
+  if (isSpeculating)
+    return false;
+
   bool isCalc = false;
   for (int i=0;i<threadsNum;i++)
     isCalc = isCalc || isCalculating[i];
@@ -578,85 +1107,542 @@ bool BoxRoomIR::getCalculatingState()
 
 bool BoxRoomIR::getBufferTransferState()
 {
-  return boxIrTransfer.getBufferTransferState();
+  return hasLoadedFromCache || boxIrTransfer.getBufferTransferState();
 }
 
-void BoxRoomIR::process(juce::AudioBuffer<float> &buffer)
+void BoxRoomIR::process(const juce::AudioBuffer<float>& input, int inputChannel, juce::AudioBuffer<float>& output, bool addToOutput)
 {
+    const int numSamples = input.getNumSamples();
+
+    // Blocks longer than announced to prepare() are processed in parts,
+    // the buffers are never resized on the audio thread
+    const int maxSamples = convolutionOutput.getNumSamples();
+    if (numSamples > maxSamples && maxSamples > 0)
+    {
+      for (int start=0; start<numSamples; start+=maxSamples)
+      {
+        const int n = juce::jmin(maxSamples, numSamples-start);
+        // (the input is only read)
+        const juce::AudioBuffer<float> inputPart(const_cast<float* const*>(input.getArrayOfReadPointers()), input.getNumChannels(), start, n);
+        juce::AudioBuffer<float> outputPart(output.getArrayOfWritePointers(), output.getNumChannels(), start, n);
+        process(inputPart, inputChannel, outputPart, addToOutput);
+      }
+      return;
+    }
+
+    // The input channel is convolved with the two IR channels and goes
+    // through the early paths, and is entirely read before anything is
+    // written to the output (which can be the input buffer)
+    auto* inputData = input.getReadPointer(inputChannel);
+    juce::dsp::AudioBlock<const float> inputBlock (&inputData, 1, size_t(numSamples));
+    juce::dsp::AudioBlock<float> convolutionBlock = juce::dsp::AudioBlock<float>(convolutionOutput).getSubBlock(0, size_t(numSamples)).getSubsetChannelBlock(0, 2);
+    juce::dsp::AudioBlock<float> earlyBlock = juce::dsp::AudioBlock<float>(convolutionOutput).getSubBlock(0, size_t(numSamples)).getSubsetChannelBlock(2, 2);
+
+    // The convolution and the early paths are skipped when their tails
+    // have passed since the last input, and while they are muted
+    auto range = juce::FloatVectorOperations::findMinAndMax(inputData, numSamples);
+    silentSamples = juce::jmax(-range.getStart(), range.getEnd()) > IDLE_THRESHOLD ? 0 : silentSamples+numSamples;
+    const bool isBoxMuted = reflectionsLevel <= IDLE_MUTEDGAIN;
+    const bool isEarlyMuted = isBoxMuted && directLevel <= IDLE_MUTEDGAIN;
+    const bool runsBox = !isBoxMuted && !isPastTail(convolution.getTailLength());
+    const bool runsEarly = !isEarlyMuted && !isPastTail(earlyPaths.getTailLength());
+
+    if (runsBox)
+    {
+      if (mustClearBox)
+        convolution.clear();
+      mustClearBox = false;
+      const LoadMeter::ScopedSection section(loadSections, LoadMeter::boxConvolution);
+      convolution.process(juce::dsp::ProcessContextNonReplacing<float>(inputBlock, convolutionBlock));
+    }
+    else
+    {
+      mustClearBox = mustClearBox || isBoxMuted;
+      convolutionBlock.clear();
+    }
 
-    for (int i=0;i<buffer.getNumChannels();i++)
+    if (runsEarly)
+    {
+      if (mustClearEarly)
+        earlyPaths.clear();
+      mustClearEarly = false;
+      const LoadMeter::ScopedSection section(loadSections, LoadMeter::directPaths);
+      earlyPaths.process(inputData, convolutionOutput.getArrayOfWritePointers()+2, numSamples);
+    }
+    else
     {
-      inputBufferCopy.copyFrom(i,0,buffer,i,0,buffer.getNumSamples());
+      mustClearEarly = mustClearEarly || isEarlyMuted;
+      earlyBlock.clear();
     }
-    
-    juce::dsp::AudioBlock<float> block (buffer);
-    juce::dsp::AudioBlock<float> blockCopy (inputBufferCopy);
-    juce::dsp::AudioBlock<float> blockL = block.getSingleChannelBlock(0);
-    juce::dsp::AudioBlock<float> blockR = block.getSingleChannelBlock(1);
 
-    if (boxConvolution.getCurrentIRSize()>0)
+    // (an idle instance only clears its output)
+    if (!runsBox && !runsEarly)
     {
-        boxConvolution.process(juce::dsp::ProcessContextReplacing<float>(block));        
+      if (!addToOutput)
+        for (int c=0; c<2; c++)
+          output.clear(c, 0, numSamples);
+      return;
     }
 
-    buffer.applyGain(reflectionsLevel);
+    {
+      const LoadMeter::ScopedSection section(loadSections, LoadMeter::mixing);
+      for (int c=0; c<2; c++)
+      {
+        auto* data = convolutionOutput.getWritePointer(c);
+        juce::FloatVectorOperations::multiply(data, reflectionsLevel, numSamples);
+        // (the levels of the early paths are in the gains of their taps)
+        juce::FloatVectorOperations::add(data, convolutionOutput.getReadPointer(2+c), numSamples);
+      }
+    }
 
-    if (directConvolution.getCurrentIRSize()>0)
     {
-        directConvolution.process(juce::dsp::ProcessContextReplacing<float>(blockCopy));        
+      const LoadMeter::ScopedSection section(loadSections, LoadMeter::filtering);
+      for (int c=0; c<2; c++)
+      {
+        juce::dsp::AudioBlock<float> block = convolutionBlock.getSingleChannelBlock(size_t(c));
+        filter[c].process(juce::dsp::ProcessContextReplacing<float>(block));
+      }
     }
 
-    buffer.addFrom(0,0,inputBufferCopy,0,0,inputBufferCopy.getNumSamples(),directLevel);
-    buffer.addFrom(1,0,inputBufferCopy,1,0,inputBufferCopy.getNumSamples(),directLevel);
+    const LoadMeter::ScopedSection section(loadSections, LoadMeter::mixing);
+    for (int c=0; c<2; c++)
+    {
+      if (addToOutput)
+        output.addFrom(c,0,convolutionOutput,c,0,numSamples);
+      else
+        output.copyFrom(c,0,convolutionOutput,c,0,numSamples);
+    }
 
-    filter[0].process(juce::dsp::ProcessContextReplacing<float>(blockL));
-    filter[1].process(juce::dsp::ProcessContextReplacing<float>(blockR));
+}
 
+// Whether the input has been silent for longer than a tail (the tail
+// is unknown while IRs are crossfaded)
+bool BoxRoomIR::isPastTail(int tailLength) const
+{
+  return tailLength >= 0 && silentSamples > tailLength;
 }
 
 void BoxRoomIR::exportIrToWav(juce::File file)
 {
 
-  std::unique_ptr<juce::AudioFormatWriter> writer;
-  juce::FileOutputStream stream(file);
-
-  // Mix the Ir buffers to get a single 2-channels buffer
-  juce::AudioBuffer<float> fullBuffer(2, boxCalculator[0].longueur);
-  std::cout << "Box buffer length : " << fullBuffer.getNumSamples() << std::endl; 
-  fullBuffer.clear();
+  std::shared_ptr<const IrSnapshot> ir;
+  {
+    const juce::ScopedLock sl(irLock);
+    ir = currentIr;
+  }
 
-  if (getBufferTransferState())
+  if (getBufferTransferState() && ir != nullptr)
   {
-    for (int i=0;i<threadsNum;i++)
+    // Mix the Ir buffers to get a single 2-channels buffer
+    juce::AudioBuffer<float> fullBuffer(ir->box);
+    LOG_DEBUG("Box buffer length : " << fullBuffer.getNumSamples()); 
+
+    // The direct path and the early reflections at the current positions
+    auto pa = p;
+    pa.sampleRate = ir->sampleRate;
+    EarlyTap taps[EARLY_NUMTAPS];
+    const int numTaps = IrBoxCalculator::getEarlyTaps(pa, taps);
+    juce::AudioBuffer<float> kernels(2, nsamp);
+    for (int i=0; i<numTaps; i++)
     {
-    fullBuffer.addFrom(0,0,boxIrBuffer[i],0,0,boxIrBuffer[i].getNumSamples());
-    fullBuffer.addFrom(1,0,boxIrBuffer[i],1,0,boxIrBuffer[i].getNumSamples());
+      IrBoxCalculator::getEarlyKernel(pa, taps[i], nearestSampleRate, nsamp, kernels.getWritePointer(0), kernels.getWritePointer(1));
+      const int delay = juce::roundToInt(taps[i].delay);
+      // (the buffer is lengthened if a tap ends after the box IR)
+      fullBuffer.setSize(fullBuffer.getNumChannels(), juce::jmax(fullBuffer.getNumSamples(), delay+nsamp), true, true);
+      for (int c=0; c<2; c++)
+        fullBuffer.addFrom(c,delay,kernels,c,0,nsamp,taps[i].gains[c]);
     }
 
-    fullBuffer.addFrom(0,0,directIrBuffer,0,0,directIrBuffer.getNumSamples());
-    fullBuffer.addFrom(1,0,directIrBuffer,1,0,directIrBuffer.getNumSamples());
-
     juce::WavAudioFormat format;
     std::unique_ptr<juce::AudioFormatWriter> writer;
     writer.reset (format.createWriterFor (new juce::FileOutputStream (file),
-                                          boxIrTransfer.getSampleRate(),
+                                          ir->sampleRate,
                                           fullBuffer.getNumChannels(),
                                           24,
                                           {},
                                           0));
     if (writer != nullptr)
       {
-        cout << "fullBuffer length : " << fullBuffer.getNumSamples() << endl; 
+        LOG_DEBUG("fullBuffer length : " << fullBuffer.getNumSamples()); 
         writer->writeFromAudioSampleBuffer (fullBuffer, 0, fullBuffer.getNumSamples());
       }
     else
       {
-        std::cout << "Writer = nullptr" << std::endl;
+        LOG_WARNING("Writer = nullptr");
       }     
   }
   else
   {
-    std::cout << "Buffers not ready" << std::endl;
+    LOG_WARNING("Buffers not ready");
   }
   
 }
+
+// ========================================================
+
+juce::uint64 BoxRoomIR::getParamsKey(const IrBoxCalculatorParams& pa)
+{
+  return IrKeyBuilder().add("RoomIR3D")
+                       .add(pa.rx,1e-3f).add(pa.ry,1e-3f).add(pa.rz,1e-3f)
+                       .add(pa.lx,EARLY_POSITIONQUANTUM).add(pa.ly,EARLY_POSITIONQUANTUM).add(pa.lz,EARLY_POSITIONQUANTUM)
+                       .add(pa.sx,EARLY_POSITIONQUANTUM).add(pa.sy,EARLY_POSITIONQUANTUM).add(pa.sz,EARLY_POSITIONQUANTUM)
+                       .add(pa.damp,1e-4f).add(pa.hfDamp,1e-4f)
+                       .add(pa.type)
+                       .add(pa.headAzim,0.1f)
+                       .add(pa.sWidth,1e-3f)
+                       .add(float(pa.sampleRate),1.f)
+                       .add(EARLY_ORDER)
+                       .getKey();
+}
+
+void BoxRoomIR::loadSnapshot(std::shared_ptr<const IrSnapshot> ir)
+{
+  TraceLog::Scope trace("load stored IR");
+  double updateTime;
+  {
+    const juce::ScopedLock sl(irLock);
+    updateTime = getUpdateTime(p);
+    if (updateTime <= 0.0)
+    {
+      tailParams = p;
+      hasTailParams = true;
+    }
+  }
+  applyMemoryBudget(ir->box.getNumSamples());
+  loadIntoConvolutions(ir, updateTime);
+
+  // (nothing has been calculated)
+  IrMetrics m;
+  m.key = ir->key;
+  m.sampleRate = ir->sampleRate;
+  m.isFromStore = true;
+  m.irLength = ir->box.getNumSamples();
+  m.timeToLoad = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks()-changeTicks);
+  setIrMetrics(m);
+
+  const juce::ScopedLock sl(irLock);
+  currentIr = ir;
+  hasLoadedFromCache = true;
+
+  // The IR will be available for the next sessions
+  irStore->persist(ir);
+}
+
+// Part of the IR of the parameters to load (in seconds, 0 for the whole
+// IR) : after small moves, the late reflections loaded before are kept
+// (called under irLock)
+double BoxRoomIR::getUpdateTime(const IrBoxCalculatorParams& pa)
+{
+  return hasTailParams && isSmallMove(tailParams, pa) ? PARTIAL_UPDATETIME : 0.0;
+}
+
+// The convolution engine shares the box of the snapshot (which keeps
+// the snapshot alive)
+void BoxRoomIR::loadIntoConvolutions(std::shared_ptr<const IrSnapshot> ir, double updateTime)
+{
+  std::shared_ptr<const juce::AudioBuffer<float>> box(ir, &ir->box);
+  if (updateTime > 0.0)
+    convolution.updateImpulseResponse(boxSlot, box, ir->sampleRate, updateTime);
+  else
+    convolution.loadImpulseResponse(boxSlot, box, ir->sampleRate);
+}
+
+// The box IR and the early paths (up to EARLY_MAXDELAY, plus the length
+// of a kernel) are both delayed by the latency of the convolution
+double BoxRoomIR::getTailLengthSeconds() const
+{
+  double box = 0.0;
+  {
+    const juce::ScopedLock sl(irLock);
+    if (currentIr != nullptr)
+      box = currentIr->box.getNumSamples()/currentIr->sampleRate;
+  }
+  if (!hasPrepared)
+    return box;
+
+  const double early = EARLY_MAXDELAY+nsamp/preparedSpec.sampleRate;
+  return convolution.getLatency()/preparedSpec.sampleRate+juce::jmax(box, early);
+}
+
+IrMetrics BoxRoomIR::getIrMetrics() const
+{
+  const juce::ScopedLock sl(metricsLock);
+  return irMetrics;
+}
+
+void BoxRoomIR::setIrMetrics(const IrMetrics& m)
+{
+  {
+    const juce::ScopedLock sl(metricsLock);
+    irMetrics = m;
+  }
+  LOG_INFO("IR metrics : " << m.toJson());
+  LOG_DEBUG("Memory : " << getMemoryUsage().toJson());
+}
+
+MemoryUsage BoxRoomIR::getMemoryUsage() const
+{
+  MemoryUsage m;
+  for (int i=0; i<(hasInitialized ? threadsNum : 0); i++)
+    m.bytes[MemoryUsage::calculators] += boxCalculator[i].getSizeInBytes();
+  convolution.addMemoryUsage(m);
+  m.bytes[MemoryUsage::earlyPaths] = earlyPaths.getSizeInBytes();
+  m.bytes[MemoryUsage::buffers] += MemoryUsage::getBytes(convolutionOutput) + MemoryUsage::getBytes(earlyKernels);
+  m.bytes[MemoryUsage::hrtf] = getHrtfBytes();
+  m.bytes[MemoryUsage::store] = irStore->getSizeInBytes();
+  m.calculationPeak = getIrMetrics().peakMemory;
+  m.budget = memoryBudget;
+  m.level = MemoryUsage::Level(memoryLevel.load());
+  return m;
+}
+
+void BoxRoomIR::setMemoryBudget(size_t bytes)
+{
+  memoryBudget = bytes;
+}
+
+// Chooses the strategy that keeps the engine within its budget, for an
+// IR of irLength samples : the buffers of the calculators are released
+// after each transfer if keeping them would exceed it, and the IR is
+// also shortened in the convolution if its partitions and delay lines
+// alone would (see MEMORY_CONVOLUTIONBYTES). The buffers are allocated
+// once for the longest IR at the sample rate, unless the budget doesn't
+// allow it (they grow with the IRs then).
+void BoxRoomIR::applyMemoryBudget(int irLength)
+{
+  const size_t budget = memoryBudget;
+  auto level = MemoryUsage::full;
+  double maxIrTime = 0.0;
+  int capacity = hasPrepared ? getLongestIrLength(preparedSpec.sampleRate, nsamp) : 0;
+  if (budget > 0 && hasPrepared)
+  {
+    const auto usage = getMemoryUsage();
+    // (what doesn't depend on the IR)
+    const size_t fixed = usage.bytes[MemoryUsage::earlyPaths] + usage.bytes[MemoryUsage::buffers];
+    const size_t bytesPerSample = 2*MEMORY_CONVOLUTIONBYTES;
+    const size_t convolutionBytes = bytesPerSample*size_t(irLength);
+    const size_t bytesPerLength = size_t(threadsNum)*2*sizeof(float);
+    const size_t calculatorBytes = bytesPerLength*size_t(irLength);
+    if (fixed+convolutionBytes+bytesPerLength*size_t(capacity) > budget)
+      capacity = 0;
+    if (fixed+convolutionBytes+calculatorBytes > budget)
+      level = MemoryUsage::compact;
+    if (fixed+convolutionBytes > budget)
+    {
+      level = MemoryUsage::shortened;
+      const size_t room = budget > fixed ? budget-fixed : 0;
+      maxIrTime = juce::jmax(MEMORY_MINIRTIME, double(room/bytesPerSample)/preparedSpec.sampleRate);
+    }
+  }
+
+  arenaCapacity = capacity;
+  convolution.setMaxIrTime(maxIrTime);
+  boxIrTransfer.setReleasesBuffers(level >= MemoryUsage::compact);
+  if (memoryLevel.exchange(level) != level)
+    LOG_INFO("Memory budget of " << double(budget)/1048576.0 << " MB : " << MemoryUsage::getLevelName(level));
+}
+
+// The IR currently loaded in the convolution engines (or nullptr)
+std::shared_ptr<const IrSnapshot> BoxRoomIR::getCurrentIr()
+{
+  const juce::ScopedLock sl(irLock);
+  return currentIr;
+}
+
+// Keeps an IR restored from the plugin state (or nullptr) until its
+// parameters are calculated, so that it isn't calculated again. It is
+// also stored for the other instances.
+void BoxRoomIR::restoreIr(std::shared_ptr<const IrSnapshot> ir)
+{
+  if (ir != nullptr)
+    irStore->insert(ir);
+
+  const juce::ScopedLock sl(irLock);
+  restoredIr = std::move(ir);
+}
+
+// Called from the transfer thread : the IR is moved into the pending
+// snapshot, whose box is then shared by the convolution engine
+std::shared_ptr<const juce::AudioBuffer<float>> BoxRoomIR::storeTransferredIr(juce::AudioBuffer<float>&& buffer)
+{
+  const juce::ScopedLock sl(irLock);
+  if (pendingIr == nullptr)
+    return std::make_shared<const juce::AudioBuffer<float>>(std::move(buffer));
+
+  pendingIr->box = std::move(buffer);
+  std::shared_ptr<const juce::AudioBuffer<float>> box(pendingIr, &pendingIr->box);
+  irStore->insert(pendingIr);
+  irStore->endCalculation(pendingIr->key);
+  irStore->persist(pendingIr);
+  currentIr = pendingIr;
+  pendingIr = nullptr;
+  if (pendingUpdateTime <= 0.0)
+  {
+    tailParams = pendingParams;
+    hasTailParams = true;
+  }
+  return box;
+}
+
+// Called from the audio thread before process(), with the current
+// parameters and levels : the direct path and the early reflections
+// follow the positions without any calculation of the IR
+void BoxRoomIR::updateEarlyPaths(const IrBoxCalculatorParams& pa)
+{
+  // (called at each block : the taps and the kernels are only built
+  // again when the quantized parameters change)
+  const auto key = getEarlyPathsKey(pa, directLevel, reflectionsLevel);
+  if (!hasPrepared || (hasEarlyParams && key == earlyKey))
+    return;
+
+  earlyParams = pa;
+  earlyParams.sampleRate = preparedSpec.sampleRate;
+  earlyKey = key;
+  hasEarlyParams = true;
+
+  EarlyTap taps[EARLY_NUMTAPS];
+  const int numTaps = IrBoxCalculator::getEarlyTaps(earlyParams, taps);
+  for (int i=0; i<numTaps; i++)
+  {
+    const auto id = getEarlyKernelId(earlyParams, taps[i]);
+    int kernel = earlyPaths.findKernel(id);
+    if (kernel < 0)
+    {
+      IrBoxCalculator::getEarlyKernel(earlyParams, taps[i], nearestSampleRate, nsamp, earlyKernels.getWritePointer(0), earlyKernels.getWritePointer(1));
+      kernel = earlyPaths.addKernel(id, earlyKernels.getArrayOfReadPointers());
+      // (no free slot until the fades end, tried again at the next block)
+      if (kernel < 0)
+        hasEarlyParams = false;
+    }
+
+    const float level = taps[i].nbounds == 0 ? directLevel : reflectionsLevel;
+    const float gains[2] = { taps[i].gains[0]*level, taps[i].gains[1]*level };
+    earlyPaths.setTap(i, taps[i].delay+float(convolution.getLatency()), gains, kernel);
+  }
+}
+
+// While the user is moving a control, this is called with the current
+// parameters. The matching IR, and the one the user is heading to, are
+// calculated in the background and kept in the cache.
+void BoxRoomIR::speculate(IrBoxCalculatorParams& pa)
+{
+  // Never compete with a real calculation
+  if (getCalculatingState() || boxIrTransfer.isThreadRunning())
+    return;
+
+  auto key = getParamsKey(pa);
+  if (key == lastSpeculatedKey)
+    return;
+
+  std::vector<IrBoxCalculatorParams> candidates;
+  candidates.push_back(pa);
+  if (lastSpeculatedKey != 0)
+    candidates.push_back(extrapolateParams(lastSpeculated, pa));
+
+  lastSpeculated = pa;
+  lastSpeculatedKey = key;
+
+  {
+    const juce::ScopedLock sl(speculationLock);
+    speculationQueue.clear();
+    for (auto& c : candidates)
+    {
+      auto k = getParamsKey(c);
+      if (isSpeculating && k == speculatedKey)
+        continue;
+      if (!irStore->contains(k) && !irStore->isInFlight(k))
+        speculationQueue.push_back(c);
+    }
+    // The IR being calculated is no longer of interest
+    if (isSpeculating && speculationQueue.size() == candidates.size())
+      abandonSpeculation = true;
+  }
+  speculator.notify();
+}
+
+bool BoxRoomIR::getNextSpeculationCandidate(IrBoxCalculatorParams& candidate)
+{
+  const juce::ScopedLock sl(speculationLock);
+  while (!speculationQueue.empty())
+  {
+    candidate = speculationQueue.front();
+    speculationQueue.erase(speculationQueue.begin());
+    speculatedKey = getParamsKey(candidate);
+    // Another instance may have started it in the meantime
+    if (irStore->contains(speculatedKey) || !irStore->beginCalculation(speculatedKey))
+      continue;
+    abandonSpeculation = false;
+    speculationStopped.reset();
+    isSpeculating = true;
+    return true;
+  }
+  return false;
+}
+
+// Runs in the speculator thread
+void BoxRoomIR::runSpeculativeCalculation(IrBoxCalculatorParams& candidate)
+{
+  startCalculators(candidate, juce::Thread::Priority::low);
+
+  bool running = true;
+  while (running)
+  {
+    if (speculator.threadShouldExit() || abandonSpeculation)
+    {
+      for (int i=0;i<threadsNum;i++)
+      {
+        boxCalculator[i].stopThread(1000);
+        isCalculating[i] = false;
+      }
+      irStore->endCalculation(speculatedKey);
+      isSpeculating = false;
+      speculationStopped.signal();
+      return;
+    }
+    running = false;
+    for (int i=0;i<threadsNum;i++)
+      running = running || boxCalculator[i].isThreadRunning();
+    speculator.wait(5);
+  }
+
+  auto ir = std::make_shared<IrSnapshot>();
+  ir->key = speculatedKey;
+  ir->sampleRate = candidate.sampleRate;
+  IrTransfer::sumBuffers(boxIrBuffer, threadsNum, ir->box, ir->sampleRate, memoryLevel >= MemoryUsage::compact);
+  irStore->insert(ir);
+  irStore->endCalculation(speculatedKey);
+  LOG_INFO("Speculative IR ready");
+
+  isSpeculating = false;
+  speculationStopped.signal();
+}
+
+// If the speculator is calculating the IR of key, the calculation goes
+// on at the priority of the real ones, and nothing else is speculated :
+// its IR is picked up by checkWaitingIr() when it is stored
+bool BoxRoomIR::adoptSpeculation(juce::uint64 key)
+{
+  const juce::ScopedLock sl(speculationLock);
+  if (!isSpeculating || abandonSpeculation || speculatedKey != key)
+    return false;
+
+  speculationQueue.clear();
+  for (int i=0;i<threadsNum;i++)
+    boxCalculator[i].setPriority(juce::Thread::Priority::normal);
+  LOG_INFO("Speculative IR adopted");
+  return true;
+}
+
+// Blocks until the calculators are free for real work
+void BoxRoomIR::stopSpeculation()
+{
+  {
+    const juce::ScopedLock sl(speculationLock);
+    speculationQueue.clear();
+    if (isSpeculating)
+      abandonSpeculation = true;
+  }
+  speculator.notify();
+  while (isSpeculating)
+    speculationStopped.wait(100);
+}
@@ -1,9 +1,19 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include "IrStore.h"
+#include "IrResampler.h"
+#include "IrTrimmer.h"
+#include "PartitionedConvolution.h"
+#include "LoadMeter.h"
+#include "IrMetrics.h"
+#include "MemoryUsage.h"
+#include "ArenaBuffer.h"
+#include "TraceLog.h"
+#include "TapNetwork.h"
 
 
-#include <iostream>
+#include "Log.h"
 using namespace std;
 
 #define CHOICES {"XY", "MS with Cardio", "MS with Omni", "Binaural"}
@@ -20,6 +30,44 @@ using namespace std;
 #define MAXSIZE 10.f
 #define MINDAMPING 0.005f
 
+// At high sample rates, the reflections whose high frequencies are
+// damped are calculated at 1/MULTIRATE_FACTOR of the sample rate, then
+// upsampled (from MULTIRATE_MINRATE, Hz)
+#define MULTIRATE_MINRATE 88000.0
+#define MULTIRATE_FACTOR 2
+// Level of the part of a reflection above the reduced band (relative
+// to the direct sound, dB) under which it is calculated at the reduced rate
+#define MULTIRATE_LOSS -30.0
+// Cost of the upsampling of the reduced rate reflections, per sample
+// of the IR (in samples of grains)
+#define MULTIRATE_MERGECOST 12.0
+
+// The reflections up to EARLY_ORDER are rendered in real time with the
+// direct path (see TapNetwork), the IRs hold the next ones
+#define EARLY_ORDER 2
+// Images up to EARLY_ORDER, direct path included
+#define EARLY_NUMTAPS 13
+// Longest delay of the early reflections, latency excluded (seconds)
+#define EARLY_MAXDELAY 0.25
+// Quantization of the positions in the keys of the IRs (m) : the late
+// reflections change little with small moves, which don't require any
+// new IR
+#define EARLY_POSITIONQUANTUM 0.05f
+
+// After moves of the source and the listener of up to PARTIAL_MAXMOVE
+// (m) from the IR whose late reflections are loaded, only the first
+// PARTIAL_UPDATETIME (seconds) of the new IR are loaded : the late
+// reflections are nearly the same, and are kept
+#define PARTIAL_MAXMOVE 0.5f
+#define PARTIAL_UPDATETIME 0.3
+
+// Input level under which an instance stops processing, once the tails
+// of the convolution and of the early paths have passed (-120 dB), and
+// levels under which the reflections and the direct path are muted and
+// not processed (-90 dB, the lowest level of the controls)
+#define IDLE_THRESHOLD 1e-6f
+#define IDLE_MUTEDGAIN 3.17e-5f
+
 struct IrBoxCalculatorParams{
   float rx;
   float ry;
@@ -35,6 +83,15 @@ struct IrBoxCalculatorParams{
   double sampleRate;
 };
 
+// Image of the source rendered in real time
+struct EarlyTap{
+  float delay;        // (samples)
+  float gains[2];
+  int nbounds;
+  // (HRTF of the tap, binaural only)
+  int elevationIndex, azimutalIndex;
+};
+
 // ==================================================================
 class IrBoxCalculator : public juce::Thread
   {
@@ -47,29 +104,45 @@ class IrBoxCalculator : public juce::Thread
     float getProgress();
     void resetProgress();
     void setCalculatingBool(bool* cp);
-    void setBuffer(juce::AudioBuffer<float>* b);
-    void setCalculateDirectPath(bool c);
+    void setBuffer(ArenaBuffer* b);
     void setHrtfVars(int* ns, float* nsr);
 
+    // Direct sound and reflections up to EARLY_ORDER of the given
+    // parameters, that run() leaves out : returns the number of taps
+    static int getEarlyTaps(const IrBoxCalculatorParams& pa, EarlyTap* taps);
+    // Grain or HRTF of a tap, filtered as run() would (size samples)
+    static void getEarlyKernel(const IrBoxCalculatorParams& pa, const EarlyTap& tap, float hrtfRate, int size, float* left, float* right);
+
     // min and max indices which iR is calculated in this thread
-    // If only the direct sound is needed, one has to select
-    // n=1, nxmin=0, nxmax=1
     int n, nxmin, nxmax;
     int longueur;
+    // Samples that the buffers get when they grow (see ArenaBuffer, 0
+    // for the size of the IR)
+    int capacity{0};
+    // Images and times of the last run (see IrMetrics)
+    IrCalculatorCounters counters;
+    // The reflections from multirateOrder are calculated at
+    // 1/multirateFactor of the sample rate
+    int multirateFactor{1}, multirateOrder{0};
+    // The buffers at the reduced rate are released at the end of the run
+    bool releasesBuffers{false};
+    // Memory held by the buffers (any thread)
+    size_t getSizeInBytes() const;
     
   private:
     IrBoxCalculatorParams p;
     float progress;
     bool* isCalculating;
-    juce::AudioBuffer<float>* bp;
-    bool calculateDirectPath;
+    ArenaBuffer* bp{nullptr};
+    // (reflections at the reduced rate, by phase of their delay at the full rate)
+    ArenaBuffer lowBuffers[MULTIRATE_FACTOR];
     int* nsamp;
     float* nearestSampleRate;
     // int threadsNum;
     
-    void addArrayToBuffer(float *bufPtr, const float *hrtfPtr, const float gain);
-    int proximityIndex(const float *data, const int length, const float value, const bool wrap);
-    void lop(const float* in, float* out, const int sampleFreq, const float hfDamping, const int nRebounds, const int order);
+    void addArrayToBuffer(float *bufPtr, const float *hrtfPtr, const float gain, const int length);
+    static int proximityIndex(const float *data, const int length, const float value, const bool wrap);
+    static void lop(const float* in, float* out, const int sampleFreq, const float hfDamping, const int nRebounds, const int order, const int length);
     float max(const float* in);
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (IrBoxCalculator)
@@ -82,31 +155,75 @@ class IrTransfer : public juce::Thread
 public:
     IrTransfer();
     void run() override ;
-    void setBuffer(juce::AudioBuffer<float>* bufPointer);
-    void setIr(juce::dsp::Convolution* irPointer);
+    void setBuffer(ArenaBuffer* bufPointer);
+    void setIr(PartitionedConvolution* irPointer, int slot);
     void setCalculatingBool(bool* cp);
     void setSampleRate(double sr);
+    // Part of the IR to load (in seconds, 0 for the whole IR)
+    void setUpdateTime(double t);
     double getSampleRate();    
     bool getBufferTransferState();
     void setThreadsNum(int n);
+    void setCalculators(IrBoxCalculator* c);
+    // The buffers of the calculators are released once they are summed
+    void setReleasesBuffers(bool shouldRelease);
+    // Starts the metrics of the IR to transfer (ticks : time of the
+    // change of the parameters)
+    void startMetrics(juce::uint64 key, juce::int64 changeTicks);
+    // Sums the buffers of the calculators into the first one, and copies
+    // the sum into dest without its silent end (see IrTrimmer)
+    static void sumBuffers(ArenaBuffer* buffers, int num, juce::AudioBuffer<float>& dest, double sampleRate, bool releaseBuffers = false);
+
+    // Called from the transfer thread with the summed IR, just before
+    // it is sent to the convolution engine : returns the IR to load,
+    // which the engine shares instead of copying it
+    std::function<std::shared_ptr<const juce::AudioBuffer<float>>(juce::AudioBuffer<float>&&)> onTransferred;
+    // Called from the transfer thread once the IR is loaded, with the
+    // metrics of its calculation
+    std::function<void(const IrMetrics&)> onMeasured;
 
 private:
     juce::AudioBuffer<float> tempBuf;
-    juce::AudioBuffer<float>* bp;
-    juce::dsp::Convolution* irp;
+    ArenaBuffer* bp{nullptr};
+    PartitionedConvolution* irp;
+    int irSlot;
     bool* isCalculating;
     bool hasTransferred;
     double sampleRate;
+    double updateTime{0.0};
     int threadsNum;
+    IrBoxCalculator* calculators{nullptr};
+    std::atomic<bool> releasesBuffers{false};
+    IrMetrics metrics;
+    juce::int64 changeTicks{0};
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (IrTransfer)
 };
 
+// ==================================================================
+class BoxRoomIR;
+
+// Low priority thread that uses the idle calculators to precompute
+// the IRs the user is likely to ask for next
+class IrSpeculator : public juce::Thread
+{
+
+public:
+    IrSpeculator(BoxRoomIR& o);
+    void run() override ;
+
+private:
+    BoxRoomIR& owner;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (IrSpeculator)
+};
+
 // ====================================================
 class BoxRoomIR{
 
 public:
     BoxRoomIR();
+    ~BoxRoomIR();
     void initialize();
     void prepare(juce::dsp::ProcessSpec spec);
     void calculate(IrBoxCalculatorParams& p);
@@ -114,24 +231,120 @@ public:
     float getProgress();
     bool getCalculatingState();
     bool getBufferTransferState();
-    void process(juce::AudioBuffer<float>& buffer);
+    void process(const juce::AudioBuffer<float>& input, int inputChannel, juce::AudioBuffer<float>& output, bool addToOutput);
     void exportIrToWav(juce::File file);
+    void setLatency(int latencyInSamples);
+    // (audio thread) Shortens the tail of the IR, see CpuSafety
+    void setSafetyLevel(int level);
+    int getLatency();
+    void speculate(IrBoxCalculatorParams& pa);
+    void updateEarlyPaths(const IrBoxCalculatorParams& pa);
+    std::shared_ptr<const IrSnapshot> getCurrentIr();
+    void restoreIr(std::shared_ptr<const IrSnapshot> ir);
+    static juce::uint64 getParamsKey(const IrBoxCalculatorParams& pa);
+    // Length of the output after the input stops (in seconds) : the IR
+    // currently loaded or the early paths, after the latency
+    double getTailLengthSeconds() const;
+    // Metrics of the last IR loaded, calculated or found in the store
+    // (any thread)
+    IrMetrics getIrMetrics() const;
+    // Bytes held by the engine, and strategy of its budget (any thread
+    // but the audio one)
+    MemoryUsage getMemoryUsage() const;
+    // Memory budget of the engine (bytes, 0 for none), applied from the
+    // next IR loaded (see MemoryUsage::Level)
+    void setMemoryBudget(size_t bytes);
 
-    juce::AudioBuffer<float> inputBufferCopy;
-    juce::dsp::Convolution boxConvolution, directConvolution;
-    IrBoxCalculator boxCalculator[MAXTHREADS], directCalculator;
-    bool isCalculating[MAXTHREADS], isCalculatingDirect;
-    juce::AudioBuffer<float> boxIrBuffer[MAXTHREADS], directIrBuffer;
-    IrTransfer boxIrTransfer, directIrTransfer;
+    // The input is convolved with the box IR (outputs 0 and 1), the
+    // direct path and the early reflections are rendered on the audio
+    // thread (outputs 2 and 3)
+    PartitionedConvolution convolution;
+    int boxSlot;
+    TapNetwork earlyPaths;
+    juce::AudioBuffer<float> convolutionOutput;
+    // Times of the parts of process() (see LoadMeter)
+    LoadMeter::Sections loadSections;
+    IrBoxCalculator boxCalculator[MAXTHREADS];
+    bool isCalculating[MAXTHREADS];
+    ArenaBuffer boxIrBuffer[MAXTHREADS];
+    IrTransfer boxIrTransfer;
     float directLevel, reflectionsLevel;
     bool hasInitialized{false};
 
 private:
+    friend class IrSpeculator;
+
     IrBoxCalculatorParams p;
     int threadsNum;
     int nsamp;
     float nearestSampleRate;
 
+    // Finished IRs, including the ones prepared by the speculator,
+    // shared with the other instances
+    juce::SharedResourcePointer<IrStore> irStore;
+    juce::uint64 waitingKey{0};
+
+    juce::dsp::ProcessSpec preparedSpec;
+    bool hasPrepared{false};
+    mutable juce::CriticalSection irLock;
+    std::shared_ptr<IrSnapshot> pendingIr;
+    std::shared_ptr<const IrSnapshot> currentIr;
+    // (IR of the plugin state, until its parameters are calculated)
+    std::shared_ptr<const IrSnapshot> restoredIr;
+    bool hasLoadedFromCache{false};
+    // Time of the last change of the parameters (ticks), and metrics of
+    // the last IR loaded
+    juce::int64 changeTicks{0};
+    mutable juce::CriticalSection metricsLock;
+    IrMetrics irMetrics;
+    void setIrMetrics(const IrMetrics& m);
+    std::atomic<size_t> memoryBudget{0};
+    std::atomic<int> memoryLevel{MemoryUsage::full};
+    // Capacity of the buffers of the calculators (samples, see ArenaBuffer)
+    std::atomic<int> arenaCapacity{0};
+    void applyMemoryBudget(int irLength);
+    // Parameters of the IR whose late reflections are loaded, and of the
+    // IR being calculated, with the part of it to load (0 for the whole IR)
+    IrBoxCalculatorParams tailParams, pendingParams;
+    bool hasTailParams{false};
+    double pendingUpdateTime{0.0};
+
+    // Parameters of the early paths being rendered, and key of these
+    // parameters and of the levels (audio thread)
+    IrBoxCalculatorParams earlyParams;
+    juce::uint64 earlyKey{0};
+    bool hasEarlyParams{false};
+    juce::AudioBuffer<float> earlyKernels;
+
+    // Samples since the input was last above IDLE_THRESHOLD, and whether
+    // the convolution and the early paths have missed some input while
+    // they were muted (audio thread)
+    juce::int64 silentSamples{0};
+    bool mustClearBox{false}, mustClearEarly{false};
+    bool isPastTail(int tailLength) const;
+
+    IrSpeculator speculator{*this};
+    juce::CriticalSection speculationLock;
+    std::vector<IrBoxCalculatorParams> speculationQueue;
+    IrBoxCalculatorParams lastSpeculated;
+    juce::uint64 lastSpeculatedKey{0}, speculatedKey{0};
+    std::atomic<bool> isSpeculating{false}, abandonSpeculation{false};
+    // (signalled by the speculator when it stops a calculation)
+    juce::WaitableEvent speculationStopped{true};
+
+    void stopCalculation();
+    void runCalculation(juce::uint64 key);
+    void checkWaitingIr();
+    void abandonPendingIr();
+    void startCalculators(IrBoxCalculatorParams& pa, juce::Thread::Priority priority);
+    void loadSnapshot(std::shared_ptr<const IrSnapshot> ir);
+    double getUpdateTime(const IrBoxCalculatorParams& pa);
+    void loadIntoConvolutions(std::shared_ptr<const IrSnapshot> ir, double updateTime = 0.0);
+    std::shared_ptr<const juce::AudioBuffer<float>> storeTransferredIr(juce::AudioBuffer<float>&& buffer);
+    bool getNextSpeculationCandidate(IrBoxCalculatorParams& candidate);
+    void runSpeculativeCalculation(IrBoxCalculatorParams& candidate);
+    bool adoptSpeculation(juce::uint64 key);
+    void stopSpeculation();
 
     juce::dsp::IIR::Filter<float> filter[2];
     
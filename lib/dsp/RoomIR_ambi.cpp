@@ -5,8 +5,11 @@
 // This is the function where the impulse response is calculated
 void IrBoxCalculator::run()
 {
+    TraceLog::ScopedThread traceThread;
+    TraceLog::Scope trace("calculate");
     
     isCalculating[0] = true;
+    counters.start();
 
     // inBuf is the buffer used for the non-binaural methods
     float outBuf[NSAMP]={0.f}, inBuf[NSAMP]={0.f};
@@ -15,15 +18,14 @@ void IrBoxCalculator::run()
     float dist, time, r, gain, rp, elev, theta, costheta, sintheta, cosphi, sinphi;
     int nbounds, indice;
 
-    bpWY->setSize(2,longueur,true,true);
-    bpWY->clear();
-    bpZX->setSize(2,longueur,true,true);
-    bpZX->clear();
+    // (only the samples of the previous IR are cleared)
+    auto& bufferWY = bpWY->prepare(2, longueur, capacity);
+    auto& bufferZX = bpZX->prepare(2, longueur, capacity);
 
-    auto* dataW = bpWY->getWritePointer(0);
-    auto* dataY = bpWY->getWritePointer(1);
-    auto* dataZ = bpZX->getWritePointer(0);
-    auto* dataX = bpZX->getWritePointer(1);
+    auto* dataW = bufferWY.getWritePointer(0);
+    auto* dataY = bufferWY.getWritePointer(1);
+    auto* dataZ = bufferZX.getWritePointer(0);
+    auto* dataX = bufferZX.getWritePointer(1);
 
     for (float ix = float(nxmin); ix < float(nxmax) ; ++ix)
     {
@@ -40,10 +42,14 @@ void IrBoxCalculator::run()
             dist = sqrt((x-p.lx)*(x-p.lx)+(y-p.ly)*(y-p.ly)+(z-p.lz)*(z-p.lz));
             time = dist*INV_SOUNDSPEED;
             nbounds = abs(ix)+abs(iy)+abs(iz);
+            counters.countImage(nbounds <= EARLY_ORDER);
+            // (rendered in real time, see getEarlyTaps())
+            if (nbounds <= EARLY_ORDER)
+              continue;
 
             indice = int(round((time+(juce::Random::getSystemRandom().nextFloat())*p.diffusion)*p.sampleRate));
             r = pow(1-p.damp,nbounds);
-            gain = (r/dist) * float( !(ix==0.f && iy==0.f && iz==0.f) || calculateDirectPath ) ;
+            gain = r/dist;
             
             rp = sqrt((p.sx-p.lx)*(p.sx-p.lx)+(p.sy-p.ly)*(p.sy-p.ly));
             elev = atan2f(z-p.lz,rp)*EIGHTYOVERPI;
@@ -53,6 +59,7 @@ void IrBoxCalculator::run()
             // at the end of the process by matrix multiplication
             theta = atan2f(y-p.ly,-x+p.lx)*EIGHTYOVERPI-90;
 
+            counters.beginRender();
             // Apply filter on the grain
             lop(&inBuf[0], &outBuf[0], p.sampleRate, p.hfDamp,nbounds,1);
             // Add grains to the buffers
@@ -64,23 +71,76 @@ void IrBoxCalculator::run()
             addArrayToBuffer(&dataY[indice], &outBuf[0], gain*sintheta*cosphi);
             addArrayToBuffer(&dataZ[indice], &outBuf[0], gain*sinphi);
             addArrayToBuffer(&dataX[indice], &outBuf[0], gain*costheta*cosphi);
+            counters.endRender();
           }
         }
         progress = float(ix-nxmin)/float(nxmax-nxmin);
       }
       else return;
     }
+    counters.memory = MemoryUsage::getBytes(bufferWY) + MemoryUsage::getBytes(bufferZX);
+    counters.finish();
     isCalculating[0] = false;
-    cout << "Done" << endl;
+    LOG_DEBUG("Done");
+}
+
+int IrBoxCalculator::getEarlyTaps(const IrBoxCalculatorParams& pa, EarlyTap* taps)
+{
+    int numTaps = 0;
+    const float rp = sqrt((pa.sx-pa.lx)*(pa.sx-pa.lx)+(pa.sy-pa.ly)*(pa.sy-pa.ly));
+
+    for (int ix=-EARLY_ORDER; ix<=EARLY_ORDER; ix++)
+    for (int iy=-EARLY_ORDER; iy<=EARLY_ORDER; iy++)
+    for (int iz=-EARLY_ORDER; iz<=EARLY_ORDER; iz++)
+    {
+      const int nbounds = abs(ix)+abs(iy)+abs(iz);
+      if (nbounds > EARLY_ORDER)
+        continue;
+
+      // (same images and gains as in run())
+      const float x = 2*ceil(float(ix)/2)*pa.rx+pow(-1,ix)*pa.sx;
+      const float y = 2*ceil(float(iy)/2)*pa.ry+pow(-1,iy)*pa.sy;
+      const float z = 2*ceil(float(iz)/2)*pa.rz+pow(-1,iz)*pa.sz;
+      // (the gain is bounded when the source is on the listener)
+      const float dist = juce::jmax(0.1f, sqrt((x-pa.lx)*(x-pa.lx)+(y-pa.ly)*(y-pa.ly)+(z-pa.lz)*(z-pa.lz)));
+      const float elev = atan2f(z-pa.lz,rp)*EIGHTYOVERPI;
+      // (the head orientation is applied in process())
+      const float theta = atan2f(y-pa.ly,-x+pa.lx)*EIGHTYOVERPI-90;
+
+      const float gain = pow(1-pa.damp,nbounds)/dist;
+      const float costheta = juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(-theta));
+      const float sintheta = juce::dsp::FastMathApproximations::sin(PIOVEREIGHTY*(-theta));
+      const float cosphi = juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*(elev));
+      const float sinphi = juce::dsp::FastMathApproximations::sin(PIOVEREIGHTY*(elev));
+
+      auto& tap = taps[numTaps++];
+      tap.nbounds = nbounds;
+      tap.gains[0] = gain;
+      tap.gains[1] = gain*sintheta*cosphi;
+      tap.gains[2] = gain*sinphi;
+      tap.gains[3] = gain*costheta*cosphi;
+      // (with the mean of the random delays of the reflections)
+      tap.delay = (dist*INV_SOUNDSPEED+0.5f*pa.diffusion)*float(pa.sampleRate);
+    }
+    return numTaps;
+}
+
+void IrBoxCalculator::getEarlyKernel(const IrBoxCalculatorParams& pa, const EarlyTap& tap, float* kernel)
+{
+    float inBuf[NSAMP]={0.f};
+    inBuf[2] = 1.f;
+    lop(&inBuf[0], kernel, pa.sampleRate, pa.hfDamp,tap.nbounds,1);
 }
 
 // Add a given array to a buffer
 void IrBoxCalculator::addArrayToBuffer(float *bufPtr, const float *hrtfPtr, const float gain)
 {
+  const auto splatStart = counters.beginSplat();
   for (int i=0; i<NSAMP; i++)
   {
     bufPtr[i] += hrtfPtr[i]*gain;
   }
+  counters.endSplat(splatStart);
 }
 
 // Basic lowpass filter applied to each grain
@@ -95,7 +155,6 @@ void IrBoxCalculator::lop(const float* in, float* out, const int sampleFreq, con
     {
       out[i] = alpha*in[i] + alpha1*out[i-1];
     }
-    // std::cout << "In Lop, nsamp = " << nsamp[0]<< std::endl;            
     for (int j=0; j<order-1; j++)
     {
       out[0] *= alpha;
@@ -138,15 +197,15 @@ void IrBoxCalculator::setCalculatingBool(bool* cp)
   isCalculating = cp;
 }
 
-void IrBoxCalculator::setBuffers(juce::AudioBuffer<float>* bWY, juce::AudioBuffer<float>* bZX)
+void IrBoxCalculator::setBuffers(ArenaBuffer* bWY, ArenaBuffer* bZX)
 {
   bpWY = bWY;
   bpZX = bZX;
 }
 
-void IrBoxCalculator::setCalculateDirectPath(bool c)
+size_t IrBoxCalculator::getSizeInBytes() const
 {
-  calculateDirectPath = c;
+  return (bpWY != nullptr ? bpWY->getSizeInBytes() : 0) + (bpZX != nullptr ? bpZX->getSizeInBytes() : 0);
 }
 
 IrBoxCalculator::IrBoxCalculator() : juce::Thread("calc")
@@ -163,6 +222,9 @@ IrTransfer::IrTransfer() : juce::Thread("transfer")
 
 void IrTransfer::run()
 {
+  // (the span includes the wait for the calculators)
+  TraceLog::ScopedThread traceThread;
+  TraceLog::Scope trace("IR transfer");
 
   hasTransferred = false;
 
@@ -184,42 +246,66 @@ void IrTransfer::run()
       }
   }
 
-  std::cout << "Buffer copy...." ;
-  tempBuf.makeCopyOf(bp[0],true);
-  std:cout << "Buffer copy done. Size : " << tempBuf.getNumSamples() << std::endl;
+  // (the calculators have finished)
+  if (calculators != nullptr)
+  {
+    IrCalculatorCounters counters[MAXTHREADS];
+    for (int i=0; i<threadsNum; i++)
+      counters[i] = calculators[i].counters;
+    metrics.addCalculators(counters, threadsNum);
+  }
 
-  for (int i=0;i<threadsNum;i++)
-    {
-      tempBuf.addFrom(0,0,bp[i],0,0,bp[i].getNumSamples());
-      tempBuf.addFrom(1,0,bp[i],1,0,bp[i].getNumSamples());
-    }
+  const auto reductionStart = juce::Time::getHighResolutionTicks();
+  {
+    TraceLog::Scope traceReduce("reduce");
+    LOG_DEBUG("Buffer copy....");
+    // (without its silent end)
+    sumBuffers(bp, threadsNum, tempBuf, sampleRate, releasesBuffers);
+    LOG_DEBUG("Buffer copy done. Size : " << tempBuf.getNumSamples());
+    metrics.peakMemory += MemoryUsage::getBytes(tempBuf);
+  }
+
+  const auto transferStart = juce::Time::getHighResolutionTicks();
+  metrics.phaseTimes[IrMetrics::reduction] += juce::Time::highResolutionTicksToSeconds(transferStart-reductionStart);
+  TraceLog::Scope traceLoad("load");
+  auto ir = onTransferred ? onTransferred(std::move(tempBuf))
+                          : std::make_shared<const juce::AudioBuffer<float>>(std::move(tempBuf));
 
   if (irp != nullptr)
   {
-    std::cout << "Transferring impulse response..." << std::endl;
-    irp->loadImpulseResponse(std::move(tempBuf),
-                        sampleRate,
-                        juce::dsp::Convolution::Stereo::yes,
-                        juce::dsp::Convolution::Trim::no,
-                        juce::dsp::Convolution::Normalise::no);
+    LOG_DEBUG("Transferring impulse response...");
+    // (only the first updateTime seconds, if set)
+    if (updateTime > 0.0)
+      irp->updateImpulseResponse(irSlot, ir, sampleRate, updateTime);
+    else
+      irp->loadImpulseResponse(irSlot, ir, sampleRate);
     hasTransferred = true;
-    std::cout << "Transfer done." << std::endl;
+    LOG_DEBUG("Transfer done.");
   }
   else
   {
-    std::cerr << "Error: irp pointer is null in IrTransfer::run()" << std::endl;
+    LOG_ERROR("Error: irp pointer is null in IrTransfer::run()");
     hasTransferred = false;
+    return;
   }
+
+  const auto end = juce::Time::getHighResolutionTicks();
+  metrics.phaseTimes[IrMetrics::transfer] += juce::Time::highResolutionTicksToSeconds(end-transferStart);
+  metrics.irLength = ir->getNumSamples();
+  metrics.timeToLoad = juce::Time::highResolutionTicksToSeconds(end-changeTicks);
+  if (onMeasured)
+    onMeasured(metrics);
 }
 
-void IrTransfer::setBuffer(juce::AudioBuffer<float>* bufPointer)
+void IrTransfer::setBuffer(ArenaBuffer* bufPointer)
 {
   bp = bufPointer;
 
 }
-void IrTransfer::setIr(juce::dsp::Convolution* irPointer)
+void IrTransfer::setIr(PartitionedConvolution* irPointer, int slot)
 {
   irp = irPointer;
+  irSlot = slot;
 }
 
 void IrTransfer::setCalculatingBool(bool* cp)
@@ -232,6 +318,11 @@ void IrTransfer::setSampleRate(double sr)
   sampleRate = sr;
 }
 
+void IrTransfer::setUpdateTime(double t)
+{
+  updateTime = t;
+}
+
 double IrTransfer::getSampleRate()
 {
   return sampleRate;
@@ -247,28 +338,185 @@ void IrTransfer::setThreadsNum(int n)
   threadsNum = std::min<int>(n,MAXTHREADS);
 }
 
+void IrTransfer::setCalculators(IrBoxCalculator* c)
+{
+  calculators = c;
+}
+
+void IrTransfer::setReleasesBuffers(bool shouldRelease)
+{
+  releasesBuffers = shouldRelease;
+}
+
+void IrTransfer::startMetrics(juce::uint64 k, juce::int64 ticks)
+{
+  metrics = IrMetrics();
+  metrics.key = k;
+  metrics.sampleRate = sampleRate;
+  changeTicks = ticks;
+}
+
+// Sums the buffers filled by the calculator threads
+// (in place : only the trimmed IR is allocated)
+void IrTransfer::sumBuffers(ArenaBuffer* buffers, int num, juce::AudioBuffer<float>& dest, double sampleRate, bool releaseBuffers)
+{
+  auto& sum = buffers[0].getBuffer();
+  for (int i=1;i<num;i++)
+    {
+      auto& b = buffers[i].getBuffer();
+      sum.addFrom(0,0,b,0,0,b.getNumSamples());
+      sum.addFrom(1,0,b,1,0,b.getNumSamples());
+    }
+  IrTrimmer::copyTrimmed(sum, dest, sampleRate);
+  if (releaseBuffers)
+    for (int i=0;i<num;i++)
+      buffers[i].release();
+}
+
+// ===============================================================
+// ===============================================================
+IrSpeculator::IrSpeculator(BoxRoomIR& o) : juce::Thread("speculator"), owner(o)
+{
+
+}
+
+void IrSpeculator::run()
+{
+  while (!threadShouldExit())
+  {
+    IrBoxCalculatorParams candidate;
+    if (owner.getNextSpeculationCandidate(candidate))
+      owner.runSpeculativeCalculation(candidate);
+    else
+      wait(-1);
+  }
+}
+
+
 
 // ========================================================
 // ========================================================
 
+// Number of reflections orders needed for the given damping
+static int getReflectionsOrder(const IrBoxCalculatorParams& pa)
+{
+  return int(log10(2e-2)/log10(1-pa.damp));
+}
+
+// IR length (in samples) needed to hold reflections up to order n
+static int getIrLength(const IrBoxCalculatorParams& pa, int n)
+{
+  auto dur = (n+1)*sqrt(pa.rx*pa.rx+pa.ry*pa.ry+pa.rz*pa.rz)/340;
+  return int(ceil(dur*pa.sampleRate)+NSAMP+int(pa.sampleRate*pa.diffusion));
+}
+
+// Length of the IR of the largest room with the lowest damping
+static int getLongestIrLength(double sampleRate)
+{
+  IrBoxCalculatorParams pa{};
+  pa.rx = pa.ry = pa.rz = MAXSIZE;
+  pa.damp = MINDAMPING;
+  pa.diffusion = MAXDIFFUSION;
+  pa.sampleRate = sampleRate;
+  return getIrLength(pa, getReflectionsOrder(pa));
+}
+
+// Key of the direct path and of the early reflections : the same key
+// gives the same taps and kernels (the head orientation is applied in
+// process())
+static juce::uint64 getEarlyPathsKey(const IrBoxCalculatorParams& pa, float directLevel, float reflectionsLevel)
+{
+  return IrKeyBuilder().add(pa.rx,1e-3f).add(pa.ry,1e-3f).add(pa.rz,1e-3f)
+                       .add(pa.lx,EARLY_POSITIONQUANTUM).add(pa.ly,EARLY_POSITIONQUANTUM).add(pa.lz,EARLY_POSITIONQUANTUM)
+                       .add(pa.sx,EARLY_POSITIONQUANTUM).add(pa.sy,EARLY_POSITIONQUANTUM).add(pa.sz,EARLY_POSITIONQUANTUM)
+                       .add(pa.damp,1e-4f).add(pa.hfDamp,1e-4f)
+                       .add(pa.diffusion,1e-5f)
+                       .add(directLevel,1e-4f).add(reflectionsLevel,1e-4f)
+                       .getKey();
+}
+
+// Whether the late reflections are nearly the same with both parameters :
+// same room and settings, and small moves of the source and the listener
+static bool isSmallMove(const IrBoxCalculatorParams& a, const IrBoxCalculatorParams& b)
+{
+  return juce::approximatelyEqual(a.rx,b.rx)
+      && juce::approximatelyEqual(a.ry,b.ry)
+      && juce::approximatelyEqual(a.rz,b.rz)
+      && juce::approximatelyEqual(a.damp,b.damp)
+      && juce::approximatelyEqual(a.hfDamp,b.hfDamp)
+      && juce::approximatelyEqual(a.diffusion,b.diffusion)
+      && juce::approximatelyEqual(a.sampleRate,b.sampleRate)
+      && sqrt((a.lx-b.lx)*(a.lx-b.lx)+(a.ly-b.ly)*(a.ly-b.ly)+(a.lz-b.lz)*(a.lz-b.lz)) <= PARTIAL_MAXMOVE
+      && sqrt((a.sx-b.sx)*(a.sx-b.sx)+(a.sy-b.sy)*(a.sy-b.sy)+(a.sz-b.sz)*(a.sz-b.sz)) <= PARTIAL_MAXMOVE;
+}
+
+// Identifies the kernel of a tap in the tap network
+static juce::uint64 getEarlyKernelId(const IrBoxCalculatorParams& pa, const EarlyTap& tap)
+{
+  return IrKeyBuilder().add(tap.nbounds)
+                       .add(pa.hfDamp,1e-6f)
+                       .getKey();
+}
+
+// Guess the next parameters from the two last ones, assuming that
+// the user keeps on moving the control in the same direction
+static IrBoxCalculatorParams extrapolateParams(const IrBoxCalculatorParams& from, const IrBoxCalculatorParams& to)
+{
+  auto next = to;
+  next.rx = juce::jlimit(1.f, MAXSIZE, 2*to.rx-from.rx);
+  next.ry = juce::jlimit(1.f, MAXSIZE, 2*to.ry-from.ry);
+  next.rz = juce::jlimit(1.f, MAXSIZE, 2*to.rz-from.rz);
+  next.lx = juce::jlimit(0.01f*next.rx, 0.99f*next.rx, 2*to.lx-from.lx);
+  next.ly = juce::jlimit(0.01f*next.ry, 0.99f*next.ry, 2*to.ly-from.ly);
+  next.lz = juce::jlimit(0.01f*next.rz, 0.99f*next.rz, 2*to.lz-from.lz);
+  next.sx = juce::jlimit(0.01f*next.rx, 0.99f*next.rx, 2*to.sx-from.sx);
+  next.sy = juce::jlimit(0.01f*next.ry, 0.99f*next.ry, 2*to.sy-from.sy);
+  next.sz = juce::jlimit(0.01f*next.rz, 0.99f*next.rz, 2*to.sz-from.sz);
+  next.damp = juce::jlimit(MINDAMPING, 0.99f, 2*to.damp-from.damp);
+  next.hfDamp = juce::jlimit(0.01f, 0.3f, 2*to.hfDamp-from.hfDamp);
+  next.diffusion = juce::jlimit(0.f, 0.01f, 2*to.diffusion-from.diffusion);
+  return next;
+}
+
+// Two channels (WY or ZX) of a 4 channels IR, referring to its samples
+// (the snapshot is kept alive as long as the pair is used)
+static std::shared_ptr<const juce::AudioBuffer<float>> getChannelPair(std::shared_ptr<const IrSnapshot> ir, int firstChannel)
+{
+  auto* channels = const_cast<float* const*>(ir->box.getArrayOfReadPointers()) + firstChannel;
+  return std::shared_ptr<const juce::AudioBuffer<float>>(new juce::AudioBuffer<float>(channels, 2, ir->box.getNumSamples()),
+                                                         [ir](const juce::AudioBuffer<float>* pair) { delete pair; });
+}
+
 BoxRoomIR::BoxRoomIR()
 {
+  boxSlotWY = convolution.addSlot(0, 0, 2);
+  boxSlotZX = convolution.addSlot(0, 2, 2);
+}
 
+BoxRoomIR::~BoxRoomIR()
+{
+  stopSpeculation();
+  speculator.stopThread(1000);
+  abandonPendingIr();
 }
 
 void BoxRoomIR::initialize()
 {
+    // Threads and buffers are set once for all
+    if (hasInitialized)
+      return;
+
 
     hasInitialized = false;
 
-    std::cout << "In BoxRoomIR::initialize()" << std::endl;
+    LOG_DEBUG("In BoxRoomIR::initialize()");
 
     int numCpus = juce::SystemStats::getNumPhysicalCpus();
 
-    cout << "Number of CPUs : " << juce::SystemStats::getNumCpus() << endl;
-    cout << "Number of physical CPUs : " << numCpus << endl;
+    LOG_INFO("Number of CPUs : " << juce::SystemStats::getNumCpus());
+    LOG_INFO("Number of physical CPUs : " << numCpus);
     threadsNum = std::max<int>(0,std::min<int>(numCpus-1,MAXTHREADS));
-    cout << "Number of threads : " << threadsNum << endl;
+    LOG_INFO("Number of threads : " << threadsNum);
 
     // Calculators for the room reflexions (box)
 
@@ -276,60 +524,74 @@ void BoxRoomIR::initialize()
     {
       boxCalculator[i].setCalculatingBool(&isCalculating[i]);
       boxCalculator[i].setBuffers(&boxIrBufferWY[i], &boxIrBufferZX[i]);
-      boxCalculator[i].setCalculateDirectPath(false);
     }
 
     boxIrTransferWY.setCalculatingBool(&isCalculating[0]);
     boxIrTransferWY.setBuffer(&boxIrBufferWY[0]);
-    boxIrTransferWY.setIr(&boxConvolutionWY);
+    boxIrTransferWY.setIr(&convolution, boxSlotWY);
     boxIrTransferWY.setThreadsNum(threadsNum);
+    boxIrTransferWY.setCalculators(boxCalculator);
 
     boxIrTransferZX.setCalculatingBool(&isCalculating[0]);
     boxIrTransferZX.setBuffer(&boxIrBufferZX[0]);
-    boxIrTransferZX.setIr(&boxConvolutionZX);
+    boxIrTransferZX.setIr(&convolution, boxSlotZX);
     boxIrTransferZX.setThreadsNum(threadsNum);
 
-    // Calculator for the direct path
-
-    directCalculator.setCalculatingBool(&isCalculatingDirect);
-    directCalculator.setBuffers(&directIrBufferWY, &directIrBufferZX);
-    directCalculator.setCalculateDirectPath(true);
+    // The summed IR is kept in the cache once both parts are transferred
+    boxIrTransferWY.onTransferred = [this](juce::AudioBuffer<float>&& b) { return storeTransferredIr(std::move(b), 0); };
+    boxIrTransferZX.onTransferred = [this](juce::AudioBuffer<float>&& b) { return storeTransferredIr(std::move(b), 2); };
+    // (the calculators are measured with the first part)
+    boxIrTransferWY.onMeasured = [this](const IrMetrics& m) { addIrMetrics(m); };
+    boxIrTransferZX.onMeasured = [this](const IrMetrics& m) { addIrMetrics(m); };
 
-    directIrTransferWY.setCalculatingBool(&isCalculatingDirect);
-    directIrTransferWY.setBuffer(&directIrBufferWY);
-    directIrTransferWY.setIr(&directConvolutionWY);
-    directIrTransferWY.setThreadsNum(1);
-
-    directIrTransferZX.setCalculatingBool(&isCalculatingDirect);
-    directIrTransferZX.setBuffer(&directIrBufferZX);
-    directIrTransferZX.setIr(&directConvolutionZX);
-    directIrTransferZX.setThreadsNum(1);
+    if (!speculator.isThreadRunning())
+      speculator.startThread(juce::Thread::Priority::low);
 
     hasInitialized = true;
-    std::cout << "Has initialized" << std::endl;
+    LOG_DEBUG("Has initialized");
 
 }
 
 void BoxRoomIR::prepare(juce::dsp::ProcessSpec spec)
 {
+    // If nothing has changed, the loaded IRs are kept
+    // (only the processing state is cleared)
+    if (hasPrepared
+        && juce::approximatelyEqual(spec.sampleRate, preparedSpec.sampleRate)
+        && spec.maximumBlockSize == preparedSpec.maximumBlockSize
+        && spec.numChannels == preparedSpec.numChannels)
+    {
+      convolution.reset();
+      earlyPaths.reset();
+      hasEarlyParams = false;
+      for (int i=0; i<4; i++)
+        filter[i].reset();
+      return;
+    }
+
+    // IRs being calculated at the previous sample rate are useless
+    bool rateHasChanged = hasPrepared && !juce::approximatelyEqual(spec.sampleRate, preparedSpec.sampleRate);
+    if (rateHasChanged)
+      stopCalculation();
+
 
-    inputBufferCopyWYZX.setSize(4, spec.maximumBlockSize ,false,true);
+    convolutionOutput.setSize(convolution.getNumOutputs()+4, spec.maximumBlockSize ,false,true);
 
-    cout << "Actual sampleRate : " << spec.sampleRate << " Hz." << endl;
+    LOG_INFO("Actual sampleRate : " << spec.sampleRate << " Hz.");
 
     boxIrTransferWY.setSampleRate(spec.sampleRate);
-    boxConvolutionWY.reset();
-    boxConvolutionWY.prepare(spec);
     boxIrTransferZX.setSampleRate(spec.sampleRate);
-    boxConvolutionZX.reset();
-    boxConvolutionZX.prepare(spec);
 
-    directIrTransferWY.setSampleRate(spec.sampleRate);
-    directConvolutionWY.reset();
-    directConvolutionWY.prepare(spec);
-    directIrTransferZX.setSampleRate(spec.sampleRate);
-    directConvolutionZX.reset();
-    directConvolutionZX.prepare(spec);
+    // (until the exact IR is calculated at the new sample rate, the
+    // convolution uses a resampled copy of the current one : made here
+    // if it is short, else by its resampler thread, silent until then)
+    convolution.reset();
+    convolution.prepare(spec);
+
+    // (room for the largest latency of the convolution)
+    earlyPaths.prepare(spec.sampleRate, int(spec.maximumBlockSize), 4, NSAMP, int(EARLY_MAXDELAY*spec.sampleRate)+CONV_MAXHEADSIZE, EARLY_NUMTAPS);
+    earlyKernels.setSize(4, NSAMP);
+    hasEarlyParams = false;
 
     // Output highpass filter to cut everything below 15Hz
     for (int i=0; i<4; i++)
@@ -338,75 +600,208 @@ void BoxRoomIR::prepare(juce::dsp::ProcessSpec spec)
       filter[i].prepare(spec);  
     }
 
-    std::cout << "BoxRoomIR::prepare has finished. \n";
+    preparedSpec = spec;
+    hasPrepared = true;
+
+    LOG_DEBUG("BoxRoomIR::prepare has finished.");
 
 }
 
+// Latency of the convolutions (0 for zero latency processing),
+// traded for a lower CPU load
+void BoxRoomIR::setLatency(int latencyInSamples)
+{
+  convolution.setLatency(latencyInSamples);
+
+  // (the engines are only rebuilt if the latency changes, prepareToPlay
+  // sets it each time)
+  if (!hasPrepared || latencyInSamples == convolution.getLatency())
+    return;
+  convolution.prepare(preparedSpec);
+
+  // (the early paths are delayed by the new latency)
+  earlyPaths.reset();
+  hasEarlyParams = false;
+}
+
+void BoxRoomIR::setSafetyLevel(int level)
+{
+  convolution.setSafetyLevel(level);
+}
+
+int BoxRoomIR::getLatency()
+{
+  return convolution.getLatency();
+}
+
 void BoxRoomIR::calculate(IrBoxCalculatorParams& p)
 {
-    // std::cout << "Start calculate" << std::endl;
+    LOG_TRACE("Start calculate");
 
     if (setIrCaclulatorsParams(p))     // (We run the calculation only if a parameter has changed)
     {    
+      changeTicks = juce::Time::getHighResolutionTicks();
 
-      // We have to stop an eventual running thread (and next restart)
+      // (when a control is released on the parameters being speculated,
+      // the calculation in flight is kept)
+      const auto key = getParamsKey(p);
+      if (adoptSpeculation(key))
+      {
+        waitingKey = key;
+        return;
+      }
 
-      for (int i=0;i<threadsNum;i++)
+      stopCalculation();
+      runCalculation(key);
+    }
+    else if (waitingKey != 0)
+    {
+      checkWaitingIr();
+    }
+}
+
+// Stops any running calculation (real or speculative) and IR transfer
+void BoxRoomIR::stopCalculation()
+{
+    // Real work has arrived, speculative calculations are abandoned
+    stopSpeculation();
+
+    // We have to stop an eventual running thread (and next restart)
+
+    for (int i=0;i<threadsNum;i++)
+    {
+      if (boxCalculator[i].isThreadRunning())
+        {
+          LOG_DEBUG("Thread no " << i << " running");
+          if (boxCalculator[i].stopThread(1000))
+            LOG_DEBUG("Thread no " << i << " stopped");
+        }
+    }
+    
+    // We should also ask for any IR transfer to stop
+
+    if (boxIrTransferWY.isThreadRunning())
       {
-        if (boxCalculator[i].isThreadRunning())
-          {
-            std::cout << "Thread no " << i << " running" << endl;
-            if (boxCalculator[i].stopThread(1000))
-              std::cout << "Thread no " << i << " stopped" << endl;
-          }
+        LOG_DEBUG("Box IR WY thread running");
+        if (boxIrTransferWY.stopThread(500))
+          LOG_DEBUG("Thread box IR WY stopped");
       }
-      if (directCalculator.isThreadRunning())
+    if (boxIrTransferZX.isThreadRunning())
       {
-        std::cout << "Thread direct running" << endl;
-        if (directCalculator.stopThread(500))
-          std::cout << "Thread direct stopped" << endl;            
+        LOG_DEBUG("Box IR ZX thread running");
+        if (boxIrTransferZX.stopThread(500))
+          LOG_DEBUG("Thread box IR ZX stopped");
       }
-      
-      // We should also ask for any IR transfer to stop
+    
+    abandonPendingIr();
+}
 
-      if (boxIrTransferWY.isThreadRunning())
-        {
-          std::cout << "Box IR WY thread running" << endl;
-          if (boxIrTransferWY.stopThread(500))
-            std::cout << "Thread box IR WY stopped" << endl;
-        }
-      if (boxIrTransferZX.isThreadRunning())
-        {
-          std::cout << "Box IR ZX thread running" << endl;
-          if (boxIrTransferZX.stopThread(500))
-            std::cout << "Thread box IR ZX stopped" << endl;
-        }
+void BoxRoomIR::runCalculation(juce::uint64 key)
+{
+      // Small moves keep the current IR
+      std::shared_ptr<const IrSnapshot> restored;
+      {
+        const juce::ScopedLock sl(irLock);
+        if (currentIr != nullptr && currentIr->key == key)
+          return;
+        if (restoredIr != nullptr && restoredIr->key == key)
+          std::swap(restored, restoredIr);
+      }
+
+      // The IR restored from the plugin state is loaded even if the
+      // store has evicted it
+      if (restored != nullptr)
+      {
+        LOG_INFO("IR restored from the state");
+        loadSnapshot(restored);
+        return;
+      }
 
-      if (directIrTransferWY.isThreadRunning())
+      // If this IR has already been calculated (or speculated),
+      // possibly by another instance, it is loaded directly
+
+      if (auto ir = irStore->find(key))
       {
-        std::cout << "Thread direct WY running" << endl;
-        if (directIrTransferWY.stopThread(500))
-          std::cout << "Thread direct IR WY stopped" << endl;            
+        LOG_INFO("IR found in store");
+        loadSnapshot(ir);
+        return;
       }
-      
-      if (directIrTransferZX.isThreadRunning())
+
+      // If another instance is calculating it, we wait for it
+      if (!irStore->beginCalculation(key))
+      {
+        LOG_INFO("IR being calculated elsewhere");
+        waitingKey = key;
+        return;
+      }
+
       {
-        std::cout << "Thread direct ZX running" << endl;
-        if (directIrTransferZX.stopThread(500))
-          std::cout << "Thread direct IR ZX stopped" << endl;            
+        const juce::ScopedLock sl(irLock);
+        hasLoadedFromCache = false;
+        pendingIr = std::make_shared<IrSnapshot>();
+        pendingIr->key = key;
+        pendingIr->sampleRate = p.sampleRate;
+        pendingParams = p;
+        pendingUpdateTime = getUpdateTime(p);
+        pendingParts = 0;
       }
 
+      applyMemoryBudget(getIrLength(p, getReflectionsOrder(p)));
+      startCalculators(p, juce::Thread::Priority::normal);
+
+      boxIrTransferWY.startMetrics(key, changeTicks);
+      boxIrTransferZX.startMetrics(key, changeTicks);
+      boxIrTransferWY.setUpdateTime(pendingUpdateTime);
+      boxIrTransferZX.setUpdateTime(pendingUpdateTime);
+      boxIrTransferWY.startThread();
+      boxIrTransferZX.startThread();
+}
+
+// Called on each update while waiting for an IR calculated elsewhere
+void BoxRoomIR::checkWaitingIr()
+{
+  auto key = waitingKey;
+  // (in flight state is read first, the IR is stored before it is cleared)
+  bool stillInFlight = irStore->isInFlight(key);
+  if (auto ir = irStore->find(key))
+  {
+    waitingKey = 0;
+    loadSnapshot(ir);
+  }
+  else if (!stillInFlight)
+  {
+    // The other calculation has been abandoned
+    waitingKey = 0;
+    runCalculation(key);
+  }
+}
+
+// The IR being calculated will not be stored
+void BoxRoomIR::abandonPendingIr()
+{
+  waitingKey = 0;
+  const juce::ScopedLock sl(irLock);
+  if (pendingIr != nullptr)
+  {
+    irStore->endCalculation(pendingIr->key);
+    pendingIr = nullptr;
+  }
+}
+
+void BoxRoomIR::startCalculators(IrBoxCalculatorParams& pa, juce::Thread::Priority priority)
+{
       // Set some multithread loops parameters
 
-      int n = int(log10(2e-2)/log10(1-p.damp));
-      std::cout << "n = " << n << std::endl;
-      auto dur = (n+1)*sqrt(p.rx*p.rx+p.ry*p.ry+p.rz*p.rz)/340;
-      int longueur = int(ceil(dur*p.sampleRate)+NSAMP+int(p.sampleRate*p.diffusion));
+      int n = getReflectionsOrder(pa);
+      LOG_DEBUG("n = " << n);
+      int longueur = getIrLength(pa, n);
       int chunksize = floor(2*float(n)/threadsNum);
 
       for (int i=0;i<threadsNum;i++)
       {
+          boxCalculator[i].setParams(pa);
           boxCalculator[i].longueur = longueur;
+          boxCalculator[i].capacity = arenaCapacity;
           boxCalculator[i].n = n;
           boxCalculator[i].nxmin = -n+1 + i*chunksize;
           boxCalculator[i].nxmax = -n+1 + (i+1)*chunksize;
@@ -415,31 +810,13 @@ void BoxRoomIR::calculate(IrBoxCalculatorParams& p)
           boxCalculator[i].resetProgress();
       }
 
-      n = 1;
-      dur = (n+1)*sqrt(p.rx*p.rx+p.ry*p.ry+p.rz*p.rz)/340;
-      longueur = int(ceil(dur*p.sampleRate)+NSAMP+int(p.sampleRate*p.diffusion));
-
-      directCalculator.longueur = longueur;
-      directCalculator.n = n;
-      directCalculator.nxmin = 0;
-      directCalculator.nxmax = 1;
-      directCalculator.resetProgress();
-
       // Start the threads
 
       for (int i=0;i<threadsNum;i++)
       {
-        std::cout << "Start box thread no " << i << std::endl;
-        boxCalculator[i].startThread();
+        LOG_DEBUG("Start box thread no " << i);
+        boxCalculator[i].startThread(priority);
       }
-      std::cout << "Start direct path thread" << std::endl;
-      directCalculator.startThread();
-
-      boxIrTransferWY.startThread();
-      directIrTransferWY.startThread();
-      boxIrTransferZX.startThread();
-      directIrTransferZX.startThread();
-    }
 }
 
 bool BoxRoomIR::setIrCaclulatorsParams(IrBoxCalculatorParams& pa)
@@ -447,7 +824,6 @@ bool BoxRoomIR::setIrCaclulatorsParams(IrBoxCalculatorParams& pa)
     // We check if a parameter has changed
     // If nothing has changed, we do nothing and return false
     // If at least one parameter has changed we update params
-    // of each threaded calculator
     //
     // We do not test on headAzim because it doesn't necessitate
     // to recompute IRs when changed
@@ -466,18 +842,16 @@ bool BoxRoomIR::setIrCaclulatorsParams(IrBoxCalculatorParams& pa)
       && juce::approximatelyEqual(p.diffusion,pa.diffusion)
       && juce::approximatelyEqual(p.sampleRate,pa.sampleRate))
       {
+        // Calculators are left untouched, they may be
+        // busy with a speculative calculation
         p = pa;
-        for (int i=0;i<threadsNum;i++)
-          boxCalculator[i].setParams(pa);
-        directCalculator.setParams(pa);
         return false;
       }
     else
       {
+        // (the calculators receive them when they are started, they may
+        // still be busy with a speculative calculation)
         p = pa;
-        for (int i=0;i<threadsNum;i++)
-          boxCalculator[i].setParams(pa);
-        directCalculator.setParams(pa);
         return true;
       }
 }
@@ -497,6 +871,14 @@ float BoxRoomIR::getProgress()
 
 bool BoxRoomIR::getCalculatingState()
 {
+  // Waiting for an IR calculated by another instance
+  if (waitingKey != 0)
+    return true;
+
+  // Speculative calculations are invisible from the outside
+  if (isSpeculating)
+    return false;
+
   bool isCalc = false;
   for (int i=0;i<threadsNum;i++)
     isCalc = isCalc || isCalculating[i];
@@ -505,71 +887,125 @@ bool BoxRoomIR::getCalculatingState()
 
 bool BoxRoomIR::getBufferTransferState()
 {
-  return (boxIrTransferWY.getBufferTransferState() && boxIrTransferZX.getBufferTransferState()) ;
+  return hasLoadedFromCache
+         || (boxIrTransferWY.getBufferTransferState() && boxIrTransferZX.getBufferTransferState()) ;
 }
 
-void BoxRoomIR::process(juce::AudioBuffer<float> &bufferWYZX)
+void BoxRoomIR::process(const juce::AudioBuffer<float>& input, int inputChannel, juce::AudioBuffer<float>& outputWYZX, bool addToOutput)
 {
 
-    // cout << "In BoxRoomIR::process" << endl;
+    LOG_TRACE("In BoxRoomIR::process");
 
-    inputBufferCopyWYZX.makeCopyOf(bufferWYZX,true);
+    const int numSamples = input.getNumSamples();
 
-    juce::dsp::AudioBlock<float> blockWYZX (bufferWYZX);
-    juce::dsp::AudioBlock<float> blockCopyWYZX (inputBufferCopyWYZX);
-
-    juce::dsp::AudioBlock<float> blockWY = blockWYZX.getSubsetChannelBlock(0,2);
-    juce::dsp::AudioBlock<float> blockZX = blockWYZX.getSubsetChannelBlock(2,2);
-    juce::dsp::AudioBlock<float> blockCopyWY = blockCopyWYZX.getSubsetChannelBlock(0,2);
-    juce::dsp::AudioBlock<float> blockCopyZX = blockCopyWYZX.getSubsetChannelBlock(2,2);
+    // Blocks longer than announced to prepare() are processed in parts,
+    // the buffers are never resized on the audio thread
+    const int maxSamples = convolutionOutput.getNumSamples();
+    if (numSamples > maxSamples && maxSamples > 0)
+    {
+      for (int start=0; start<numSamples; start+=maxSamples)
+      {
+        const int n = juce::jmin(maxSamples, numSamples-start);
+        // (the input is only read)
+        const juce::AudioBuffer<float> inputPart(const_cast<float* const*>(input.getArrayOfReadPointers()), input.getNumChannels(), start, n);
+        juce::AudioBuffer<float> outputPart(outputWYZX.getArrayOfWritePointers(), outputWYZX.getNumChannels(), start, n);
+        process(inputPart, inputChannel, outputPart, addToOutput);
+      }
+      return;
+    }
 
-    juce::dsp::AudioBlock<float> blockW = blockWYZX.getSingleChannelBlock(0);
-    juce::dsp::AudioBlock<float> blockY = blockWYZX.getSingleChannelBlock(1);
-    juce::dsp::AudioBlock<float> blockZ = blockWYZX.getSingleChannelBlock(2);
-    juce::dsp::AudioBlock<float> blockX = blockWYZX.getSingleChannelBlock(3);
+    // The input channel is convolved with the four IR channels and goes
+    // through the early paths, and is entirely read before anything is
+    // written to the output
+    auto* inputData = input.getReadPointer(inputChannel);
+    juce::dsp::AudioBlock<const float> inputBlock (&inputData, 1, size_t(numSamples));
+    juce::dsp::AudioBlock<float> convolutionBlock = juce::dsp::AudioBlock<float>(convolutionOutput).getSubBlock(0, size_t(numSamples));
+    // (the four last channels are used again for the rotation below)
+    juce::dsp::AudioBlock<float> boxBlock = convolutionBlock.getSubsetChannelBlock(0, 4);
+    juce::dsp::AudioBlock<float> earlyBlock = convolutionBlock.getSubsetChannelBlock(4, 4);
+
+    // The convolution and the early paths are skipped when their tails
+    // have passed since the last input, and while they are muted
+    auto range = juce::FloatVectorOperations::findMinAndMax(inputData, numSamples);
+    silentSamples = juce::jmax(-range.getStart(), range.getEnd()) > IDLE_THRESHOLD ? 0 : silentSamples+numSamples;
+    const bool isBoxMuted = reflectionsLevel <= IDLE_MUTEDGAIN;
+    const bool isEarlyMuted = isBoxMuted && directLevel <= IDLE_MUTEDGAIN;
+    const bool runsBox = !isBoxMuted && !isPastTail(convolution.getTailLength());
+    const bool runsEarly = !isEarlyMuted && !isPastTail(earlyPaths.getTailLength());
+
+    if (runsBox)
+    {
+      if (mustClearBox)
+        convolution.clear();
+      mustClearBox = false;
+      const LoadMeter::ScopedSection section(loadSections, LoadMeter::boxConvolution);
+      convolution.process(juce::dsp::ProcessContextNonReplacing<float>(inputBlock, boxBlock));
+    }
+    else
+    {
+      mustClearBox = mustClearBox || isBoxMuted;
+      boxBlock.clear();
+    }
 
-    if (boxConvolutionWY.getCurrentIRSize()>0)
+    if (runsEarly)
     {
-        boxConvolutionWY.process(juce::dsp::ProcessContextReplacing<float>(blockWY));        
+      if (mustClearEarly)
+        earlyPaths.clear();
+      mustClearEarly = false;
+      const LoadMeter::ScopedSection section(loadSections, LoadMeter::directPaths);
+      earlyPaths.process(inputData, convolutionOutput.getArrayOfWritePointers()+4, numSamples);
+    }
+    else
+    {
+      mustClearEarly = mustClearEarly || isEarlyMuted;
+      earlyBlock.clear();
     }
 
-    if (boxConvolutionZX.getCurrentIRSize()>0)
+    // (an idle instance only clears its output)
+    if (!runsBox && !runsEarly)
     {
-        boxConvolutionZX.process(juce::dsp::ProcessContextReplacing<float>(blockZX));        
+      if (!addToOutput)
+        for (int c=0; c<4; c++)
+          outputWYZX.clear(c, 0, numSamples);
+      return;
     }
 
-    bufferWYZX.applyGain(reflectionsLevel);
-    
-    if (directConvolutionWY.getCurrentIRSize()>0)
     {
-        directConvolutionWY.process(juce::dsp::ProcessContextReplacing<float>(blockCopyWY));        
+      const LoadMeter::ScopedSection section(loadSections, LoadMeter::mixing);
+      for (int c=0; c<4; c++)
+      {
+        auto* data = convolutionOutput.getWritePointer(c);
+        juce::FloatVectorOperations::multiply(data, reflectionsLevel, numSamples);
+        // (the levels of the early paths are in the gains of their taps)
+        juce::FloatVectorOperations::add(data, convolutionOutput.getReadPointer(4+c), numSamples);
+      }
     }
 
-    if (directConvolutionZX.getCurrentIRSize()>0)
     {
-        directConvolutionZX.process(juce::dsp::ProcessContextReplacing<float>(blockCopyZX));        
+      const LoadMeter::ScopedSection section(loadSections, LoadMeter::filtering);
+      for (int c=0; c<4; c++)
+      {
+        juce::dsp::AudioBlock<float> block = convolutionBlock.getSingleChannelBlock(size_t(c));
+        filter[c].process(juce::dsp::ProcessContextReplacing<float>(block));
+      }
     }
 
-    bufferWYZX.addFrom(0,0,inputBufferCopyWYZX,0,0,inputBufferCopyWYZX.getNumSamples(),directLevel);
-    bufferWYZX.addFrom(1,0,inputBufferCopyWYZX,1,0,inputBufferCopyWYZX.getNumSamples(),directLevel);
-    bufferWYZX.addFrom(2,0,inputBufferCopyWYZX,2,0,inputBufferCopyWYZX.getNumSamples(),directLevel);
-    bufferWYZX.addFrom(3,0,inputBufferCopyWYZX,3,0,inputBufferCopyWYZX.getNumSamples(),directLevel);
+    // (the rotation and the output are mixing)
+    const LoadMeter::ScopedSection section(loadSections, LoadMeter::mixing);
 
-    filter[0].process(juce::dsp::ProcessContextReplacing<float>(blockW));
-    filter[1].process(juce::dsp::ProcessContextReplacing<float>(blockY));
-    filter[2].process(juce::dsp::ProcessContextReplacing<float>(blockZ));
-    filter[3].process(juce::dsp::ProcessContextReplacing<float>(blockX));
+    juce::dsp::AudioBlock<float> blockY = convolutionBlock.getSingleChannelBlock(1);
+    juce::dsp::AudioBlock<float> blockX = convolutionBlock.getSingleChannelBlock(3);
 
-    // We use the copy block for the rotation operation
+    // We use the direct path channels (already mixed) for the rotation operation
     // As we only rotate around Z, only X and Y components are modified
     // However, the four components are needed to compute the four trigonometric operations
     // sin(X) cos(X) sin(Y) cos(Y)
-    juce::dsp::AudioBlock<float> blockCopyY1 = blockCopyWYZX.getSingleChannelBlock(0);
-    juce::dsp::AudioBlock<float> blockCopyY2 = blockCopyWYZX.getSingleChannelBlock(1);
-    juce::dsp::AudioBlock<float> blockCopyX1 = blockCopyWYZX.getSingleChannelBlock(2);
-    juce::dsp::AudioBlock<float> blockCopyX2 = blockCopyWYZX.getSingleChannelBlock(3);
+    juce::dsp::AudioBlock<float> blockCopyY1 = convolutionBlock.getSingleChannelBlock(4);
+    juce::dsp::AudioBlock<float> blockCopyY2 = convolutionBlock.getSingleChannelBlock(5);
+    juce::dsp::AudioBlock<float> blockCopyX1 = convolutionBlock.getSingleChannelBlock(6);
+    juce::dsp::AudioBlock<float> blockCopyX2 = convolutionBlock.getSingleChannelBlock(7);
 
-    // std::cout << "Head azim" << p.headAzim << std::endl;
+    LOG_TRACE("Head azim" << p.headAzim);
 
     blockCopyX1.replaceWithProductOf(blockX,juce::dsp::FastMathApproximations::cos(PIOVEREIGHTY*p.headAzim));
     blockCopyX2.replaceWithProductOf(blockX,juce::dsp::FastMathApproximations::sin(PIOVEREIGHTY*p.headAzim));
@@ -579,57 +1015,495 @@ void BoxRoomIR::process(juce::AudioBuffer<float> &bufferWYZX)
     blockX.replaceWithSumOf(blockCopyX1,blockCopyY2);
     blockY.replaceWithSumOf(blockCopyX2,blockCopyY1);
 
-    // cout << "End of BoxRoomIR::process" << endl;
+    for (int c=0; c<4; c++)
+    {
+      if (addToOutput)
+        outputWYZX.addFrom(c,0,convolutionOutput,c,0,numSamples);
+      else
+        outputWYZX.copyFrom(c,0,convolutionOutput,c,0,numSamples);
+    }
+
+    LOG_TRACE("End of BoxRoomIR::process");
 
 }
 
-void BoxRoomIR::exportIrToWav(juce::File file)
+// Whether the input has been silent for longer than a tail (the tail
+// is unknown while IRs are crossfaded)
+bool BoxRoomIR::isPastTail(int tailLength) const
 {
+  return tailLength >= 0 && silentSamples > tailLength;
+}
 
-  std::unique_ptr<juce::AudioFormatWriter> writer;
-  juce::FileOutputStream stream(file);
+void BoxRoomIR::exportIrToWav(juce::File file)
+{
 
-  // Mix the Ir buffers to get a single 4-channels buffer
-  juce::AudioBuffer<float> fullBuffer(4, boxCalculator[0].longueur);
-  std::cout << "Box buffer length : " << fullBuffer.getNumSamples() << std::endl; 
-  fullBuffer.clear();
+  std::shared_ptr<const IrSnapshot> ir;
+  {
+    const juce::ScopedLock sl(irLock);
+    ir = currentIr;
+  }
 
-  if (getBufferTransferState())
+  if (getBufferTransferState() && ir != nullptr)
   {
-    for (int i=0;i<threadsNum;i++)
+    // Mix the Ir buffers to get a single 4-channels buffer
+    juce::AudioBuffer<float> fullBuffer(ir->box);
+    LOG_DEBUG("Box buffer length : " << fullBuffer.getNumSamples()); 
+
+    // The direct path and the early reflections at the current positions
+    auto pa = p;
+    pa.sampleRate = ir->sampleRate;
+    EarlyTap taps[EARLY_NUMTAPS];
+    const int numTaps = IrBoxCalculator::getEarlyTaps(pa, taps);
+    float kernel[NSAMP];
+    for (int i=0; i<numTaps; i++)
     {
-    fullBuffer.addFrom(0,0,boxIrTransferWY.bp[i],0,0,boxIrBufferWY[i].getNumSamples());
-    fullBuffer.addFrom(1,0,boxIrTransferWY.bp[i],1,0,boxIrBufferWY[i].getNumSamples());
-    fullBuffer.addFrom(2,0,boxIrTransferZX.bp[i],0,0,boxIrBufferZX[i].getNumSamples());
-    fullBuffer.addFrom(3,0,boxIrTransferZX.bp[i],1,0,boxIrBufferZX[i].getNumSamples());
+      IrBoxCalculator::getEarlyKernel(pa, taps[i], kernel);
+      const int delay = juce::roundToInt(taps[i].delay);
+      // (the buffer is lengthened if a tap ends after the box IR)
+      fullBuffer.setSize(fullBuffer.getNumChannels(), juce::jmax(fullBuffer.getNumSamples(), delay+NSAMP), true, true);
+      for (int c=0;c<4;c++)
+        juce::FloatVectorOperations::addWithMultiply(fullBuffer.getWritePointer(c,delay), kernel, taps[i].gains[c], NSAMP);
     }
 
-    fullBuffer.addFrom(0,0,directIrTransferWY.bp[0],0,0,directIrBufferWY.getNumSamples());
-    fullBuffer.addFrom(1,0,directIrTransferWY.bp[0],1,0,directIrBufferWY.getNumSamples());
-    fullBuffer.addFrom(2,0,directIrTransferZX.bp[0],0,0,directIrBufferZX.getNumSamples());
-    fullBuffer.addFrom(3,0,directIrTransferZX.bp[0],1,0,directIrBufferZX.getNumSamples());
-
     juce::WavAudioFormat format;
     std::unique_ptr<juce::AudioFormatWriter> writer;
     writer.reset (format.createWriterFor (new juce::FileOutputStream (file),
-                                          boxIrTransferWY.getSampleRate(),
+                                          ir->sampleRate,
                                           fullBuffer.getNumChannels(),
                                           24,
                                           {},
                                           0));
     if (writer != nullptr)
       {
-        cout << "fullBuffer length : " << fullBuffer.getNumSamples() << endl; 
+        LOG_DEBUG("fullBuffer length : " << fullBuffer.getNumSamples()); 
         writer->writeFromAudioSampleBuffer (fullBuffer, 0, fullBuffer.getNumSamples());
       }
     else
       {
-        std::cout << "Writer = nullptr" << std::endl;
+        LOG_WARNING("Writer = nullptr");
       }     
   }
   else
   {
-    std::cout << "Buffers not ready" << std::endl;
+    LOG_WARNING("Buffers not ready");
   }
   
 }
+
+// ========================================================
+
+juce::uint64 BoxRoomIR::getParamsKey(const IrBoxCalculatorParams& pa)
+{
+  // headAzim is not part of the key, rotation is done in process()
+  return IrKeyBuilder().add("RoomIRAmbi")
+                       .add(pa.rx,1e-3f).add(pa.ry,1e-3f).add(pa.rz,1e-3f)
+                       .add(pa.lx,EARLY_POSITIONQUANTUM).add(pa.ly,EARLY_POSITIONQUANTUM).add(pa.lz,EARLY_POSITIONQUANTUM)
+                       .add(pa.sx,EARLY_POSITIONQUANTUM).add(pa.sy,EARLY_POSITIONQUANTUM).add(pa.sz,EARLY_POSITIONQUANTUM)
+                       .add(pa.damp,1e-4f).add(pa.hfDamp,1e-4f)
+                       .add(pa.diffusion,1e-5f)
+                       .add(float(pa.sampleRate),1.f)
+                       .add(EARLY_ORDER)
+                       .getKey();
+}
+
+void BoxRoomIR::loadSnapshot(std::shared_ptr<const IrSnapshot> ir)
+{
+  TraceLog::Scope trace("load stored IR");
+  double updateTime;
+  {
+    const juce::ScopedLock sl(irLock);
+    updateTime = getUpdateTime(p);
+    if (updateTime <= 0.0)
+    {
+      tailParams = p;
+      hasTailParams = true;
+    }
+  }
+  applyMemoryBudget(ir->box.getNumSamples());
+  loadIntoConvolutions(ir, updateTime);
+
+  // (nothing has been calculated)
+  IrMetrics m;
+  m.key = ir->key;
+  m.sampleRate = ir->sampleRate;
+  m.isFromStore = true;
+  m.irLength = ir->box.getNumSamples();
+  m.timeToLoad = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks()-changeTicks);
+  setIrMetrics(m);
+
+  const juce::ScopedLock sl(irLock);
+  currentIr = ir;
+  hasLoadedFromCache = true;
+
+  // The IR will be available for the next sessions
+  irStore->persist(ir);
+}
+
+// Part of the IR of the parameters to load (in seconds, 0 for the whole
+// IR) : after small moves, the late reflections loaded before are kept
+// (called under irLock)
+double BoxRoomIR::getUpdateTime(const IrBoxCalculatorParams& pa)
+{
+  return hasTailParams && isSmallMove(tailParams, pa) ? PARTIAL_UPDATETIME : 0.0;
+}
+
+void BoxRoomIR::loadIntoConvolutions(std::shared_ptr<const IrSnapshot> ir, double updateTime)
+{
+  if (updateTime > 0.0)
+  {
+    convolution.updateImpulseResponse(boxSlotWY, getChannelPair(ir,0), ir->sampleRate, updateTime);
+    convolution.updateImpulseResponse(boxSlotZX, getChannelPair(ir,2), ir->sampleRate, updateTime);
+  }
+  else
+  {
+    convolution.loadImpulseResponse(boxSlotWY, getChannelPair(ir,0), ir->sampleRate);
+    convolution.loadImpulseResponse(boxSlotZX, getChannelPair(ir,2), ir->sampleRate);
+  }
+}
+
+// The box IR and the early paths (up to EARLY_MAXDELAY, plus the length
+// of a kernel) are both delayed by the latency of the convolution
+double BoxRoomIR::getTailLengthSeconds() const
+{
+  double box = 0.0;
+  {
+    const juce::ScopedLock sl(irLock);
+    if (currentIr != nullptr)
+      box = currentIr->box.getNumSamples()/currentIr->sampleRate;
+  }
+  if (!hasPrepared)
+    return box;
+
+  const double early = EARLY_MAXDELAY+NSAMP/preparedSpec.sampleRate;
+  return convolution.getLatency()/preparedSpec.sampleRate+juce::jmax(box, early);
+}
+
+IrMetrics BoxRoomIR::getIrMetrics() const
+{
+  const juce::ScopedLock sl(metricsLock);
+  return irMetrics;
+}
+
+void BoxRoomIR::setIrMetrics(const IrMetrics& m)
+{
+  {
+    const juce::ScopedLock sl(metricsLock);
+    irMetrics = m;
+  }
+  LOG_INFO("IR metrics : " << m.toJson());
+  LOG_DEBUG("Memory : " << getMemoryUsage().toJson());
+}
+
+MemoryUsage BoxRoomIR::getMemoryUsage() const
+{
+  MemoryUsage m;
+  for (int i=0; i<(hasInitialized ? threadsNum : 0); i++)
+    m.bytes[MemoryUsage::calculators] += boxCalculator[i].getSizeInBytes();
+  convolution.addMemoryUsage(m);
+  m.bytes[MemoryUsage::earlyPaths] = earlyPaths.getSizeInBytes();
+  m.bytes[MemoryUsage::buffers] += MemoryUsage::getBytes(convolutionOutput) + MemoryUsage::getBytes(earlyKernels);
+  m.bytes[MemoryUsage::store] = irStore->getSizeInBytes();
+  m.calculationPeak = getIrMetrics().peakMemory;
+  m.budget = memoryBudget;
+  m.level = MemoryUsage::Level(memoryLevel.load());
+  return m;
+}
+
+void BoxRoomIR::setMemoryBudget(size_t bytes)
+{
+  memoryBudget = bytes;
+}
+
+// Chooses the strategy that keeps the engine within its budget, for an
+// IR of irLength samples (4 channels) : the buffers of the calculators
+// are released after each transfer if keeping them would exceed it, and
+// the IR is also shortened in the convolution if its partitions and
+// delay lines alone would (see MEMORY_CONVOLUTIONBYTES). The buffers are
+// allocated once for the longest IR at the sample rate, unless the
+// budget doesn't allow it (they grow with the IRs then).
+void BoxRoomIR::applyMemoryBudget(int irLength)
+{
+  const size_t budget = memoryBudget;
+  auto level = MemoryUsage::full;
+  double maxIrTime = 0.0;
+  int capacity = hasPrepared ? getLongestIrLength(preparedSpec.sampleRate) : 0;
+  if (budget > 0 && hasPrepared)
+  {
+    const auto usage = getMemoryUsage();
+    // (what doesn't depend on the IR)
+    const size_t fixed = usage.bytes[MemoryUsage::earlyPaths] + usage.bytes[MemoryUsage::buffers];
+    const size_t bytesPerSample = 4*MEMORY_CONVOLUTIONBYTES;
+    const size_t convolutionBytes = bytesPerSample*size_t(irLength);
+    const size_t bytesPerLength = size_t(threadsNum)*4*sizeof(float);
+    const size_t calculatorBytes = bytesPerLength*size_t(irLength);
+    if (fixed+convolutionBytes+bytesPerLength*size_t(capacity) > budget)
+      capacity = 0;
+    if (fixed+convolutionBytes+calculatorBytes > budget)
+      level = MemoryUsage::compact;
+    if (fixed+convolutionBytes > budget)
+    {
+      level = MemoryUsage::shortened;
+      const size_t room = budget > fixed ? budget-fixed : 0;
+      maxIrTime = juce::jmax(MEMORY_MINIRTIME, double(room/bytesPerSample)/preparedSpec.sampleRate);
+    }
+  }
+
+  arenaCapacity = capacity;
+  convolution.setMaxIrTime(maxIrTime);
+  boxIrTransferWY.setReleasesBuffers(level >= MemoryUsage::compact);
+  boxIrTransferZX.setReleasesBuffers(level >= MemoryUsage::compact);
+  if (memoryLevel.exchange(level) != level)
+    LOG_INFO("Memory budget of " << double(budget)/1048576.0 << " MB : " << MemoryUsage::getLevelName(level));
+}
+
+void BoxRoomIR::addIrMetrics(const IrMetrics& m)
+{
+  IrMetrics complete;
+  {
+    const juce::ScopedLock sl(metricsLock);
+    if (numMeasuredParts == 0 || pendingMetrics.key != m.key)
+    {
+      pendingMetrics = m;
+      numMeasuredParts = 1;
+      return;
+    }
+    pendingMetrics.addPart(m);
+    numMeasuredParts = 0;
+    complete = pendingMetrics;
+  }
+  setIrMetrics(complete);
+}
+
+// The IR currently loaded in the convolution engines (or nullptr)
+std::shared_ptr<const IrSnapshot> BoxRoomIR::getCurrentIr()
+{
+  const juce::ScopedLock sl(irLock);
+  return currentIr;
+}
+
+// Keeps an IR restored from the plugin state (or nullptr) until its
+// parameters are calculated, so that it isn't calculated again. It is
+// also stored for the other instances.
+void BoxRoomIR::restoreIr(std::shared_ptr<const IrSnapshot> ir)
+{
+  if (ir != nullptr)
+    irStore->insert(ir);
+
+  const juce::ScopedLock sl(irLock);
+  restoredIr = std::move(ir);
+}
+
+// Called from the transfer threads, the WY part goes to
+// channels 0 and 1, the ZX part to channels 2 and 3
+std::shared_ptr<const juce::AudioBuffer<float>> BoxRoomIR::storeTransferredIr(juce::AudioBuffer<float>&& buffer, int firstChannel)
+{
+  const juce::ScopedLock sl(irLock);
+  if (pendingIr == nullptr)
+    return std::make_shared<const juce::AudioBuffer<float>>(std::move(buffer));
+
+  // (the parts are trimmed apart, the box has the length of the longer)
+  auto& dest = pendingIr->box;
+  if (dest.getNumChannels() != 4)
+  {
+    dest.setSize(4, buffer.getNumSamples());
+    dest.clear();
+  }
+  else if (buffer.getNumSamples() > dest.getNumSamples())
+    dest.setSize(4, buffer.getNumSamples(), true, true);
+  dest.copyFrom(firstChannel,0,buffer,0,0,buffer.getNumSamples());
+  dest.copyFrom(firstChannel+1,0,buffer,1,0,buffer.getNumSamples());
+
+  if (++pendingParts == 2)
+  {
+    irStore->insert(pendingIr);
+    irStore->endCalculation(pendingIr->key);
+    irStore->persist(pendingIr);
+    currentIr = pendingIr;
+    pendingIr = nullptr;
+    if (pendingUpdateTime <= 0.0)
+    {
+      tailParams = pendingParams;
+      hasTailParams = true;
+    }
+  }
+  return std::make_shared<const juce::AudioBuffer<float>>(std::move(buffer));
+}
+
+// Called from the audio thread before process(), with the current
+// parameters and levels : the direct path and the early reflections
+// follow the positions without any calculation of the IR
+void BoxRoomIR::updateEarlyPaths(const IrBoxCalculatorParams& pa)
+{
+  // (called at each block : the taps and the kernels are only built
+  // again when the quantized parameters change)
+  const auto key = getEarlyPathsKey(pa, directLevel, reflectionsLevel);
+  if (!hasPrepared || (hasEarlyParams && key == earlyKey))
+    return;
+
+  earlyParams = pa;
+  earlyParams.sampleRate = preparedSpec.sampleRate;
+  earlyKey = key;
+  hasEarlyParams = true;
+
+  EarlyTap taps[EARLY_NUMTAPS];
+  const int numTaps = IrBoxCalculator::getEarlyTaps(earlyParams, taps);
+  for (int i=0; i<numTaps; i++)
+  {
+    const auto id = getEarlyKernelId(earlyParams, taps[i]);
+    int kernel = earlyPaths.findKernel(id);
+    if (kernel < 0)
+    {
+      // (the same grain on the four channels)
+      IrBoxCalculator::getEarlyKernel(earlyParams, taps[i], earlyKernels.getWritePointer(0));
+      for (int c=1; c<4; c++)
+        earlyKernels.copyFrom(c, 0, earlyKernels, 0, 0, NSAMP);
+      kernel = earlyPaths.addKernel(id, earlyKernels.getArrayOfReadPointers());
+      // (no free slot until the fades end, tried again at the next block)
+      if (kernel < 0)
+        hasEarlyParams = false;
+    }
+
+    const float level = taps[i].nbounds == 0 ? directLevel : reflectionsLevel;
+    float gains[4];
+    for (int c=0; c<4; c++)
+      gains[c] = taps[i].gains[c]*level;
+    earlyPaths.setTap(i, taps[i].delay+float(convolution.getLatency()), gains, kernel);
+  }
+}
+
+// While the user is moving a control, this is called with the current
+// parameters. The matching IR, and the one the user is heading to, are
+// calculated in the background and kept in the cache.
+void BoxRoomIR::speculate(IrBoxCalculatorParams& pa)
+{
+  // Never compete with a real calculation
+  if (getCalculatingState()
+      || boxIrTransferWY.isThreadRunning() || boxIrTransferZX.isThreadRunning())
+    return;
+
+  auto key = getParamsKey(pa);
+  if (key == lastSpeculatedKey)
+    return;
+
+  std::vector<IrBoxCalculatorParams> candidates;
+  candidates.push_back(pa);
+  if (lastSpeculatedKey != 0)
+    candidates.push_back(extrapolateParams(lastSpeculated, pa));
+
+  lastSpeculated = pa;
+  lastSpeculatedKey = key;
+
+  {
+    const juce::ScopedLock sl(speculationLock);
+    speculationQueue.clear();
+    for (auto& c : candidates)
+    {
+      auto k = getParamsKey(c);
+      if (isSpeculating && k == speculatedKey)
+        continue;
+      if (!irStore->contains(k) && !irStore->isInFlight(k))
+        speculationQueue.push_back(c);
+    }
+    // The IR being calculated is no longer of interest
+    if (isSpeculating && speculationQueue.size() == candidates.size())
+      abandonSpeculation = true;
+  }
+  speculator.notify();
+}
+
+bool BoxRoomIR::getNextSpeculationCandidate(IrBoxCalculatorParams& candidate)
+{
+  const juce::ScopedLock sl(speculationLock);
+  while (!speculationQueue.empty())
+  {
+    candidate = speculationQueue.front();
+    speculationQueue.erase(speculationQueue.begin());
+    speculatedKey = getParamsKey(candidate);
+    // Another instance may have started it in the meantime
+    if (irStore->contains(speculatedKey) || !irStore->beginCalculation(speculatedKey))
+      continue;
+    abandonSpeculation = false;
+    speculationStopped.reset();
+    isSpeculating = true;
+    return true;
+  }
+  return false;
+}
+
+// Runs in the speculator thread
+void BoxRoomIR::runSpeculativeCalculation(IrBoxCalculatorParams& candidate)
+{
+  startCalculators(candidate, juce::Thread::Priority::low);
+
+  bool running = true;
+  while (running)
+  {
+    if (speculator.threadShouldExit() || abandonSpeculation)
+    {
+      for (int i=0;i<threadsNum;i++)
+      {
+        boxCalculator[i].stopThread(1000);
+        isCalculating[i] = false;
+      }
+      irStore->endCalculation(speculatedKey);
+      isSpeculating = false;
+      speculationStopped.signal();
+      return;
+    }
+    running = false;
+    for (int i=0;i<threadsNum;i++)
+      running = running || boxCalculator[i].isThreadRunning();
+    speculator.wait(5);
+  }
+
+  auto ir = std::make_shared<IrSnapshot>();
+  ir->key = speculatedKey;
+  ir->sampleRate = candidate.sampleRate;
+  juce::AudioBuffer<float> wy, zx;
+  const bool isReleasing = memoryLevel >= MemoryUsage::compact;
+  // (trimmed as the transferred parts, the shorter one is padded)
+  IrTransfer::sumBuffers(boxIrBufferWY, threadsNum, wy, ir->sampleRate, isReleasing);
+  IrTransfer::sumBuffers(boxIrBufferZX, threadsNum, zx, ir->sampleRate, isReleasing);
+  ir->box.setSize(4, juce::jmax(wy.getNumSamples(), zx.getNumSamples()));
+  ir->box.clear();
+  ir->box.copyFrom(0,0,wy,0,0,wy.getNumSamples());
+  ir->box.copyFrom(1,0,wy,1,0,wy.getNumSamples());
+  ir->box.copyFrom(2,0,zx,0,0,zx.getNumSamples());
+  ir->box.copyFrom(3,0,zx,1,0,zx.getNumSamples());
+  irStore->insert(ir);
+  irStore->endCalculation(speculatedKey);
+  LOG_INFO("Speculative IR ready");
+
+  isSpeculating = false;
+  speculationStopped.signal();
+}
+
+// If the speculator is calculating the IR of key, the calculation goes
+// on at the priority of the real ones, and nothing else is speculated :
+// its IR is picked up by checkWaitingIr() when it is stored
+bool BoxRoomIR::adoptSpeculation(juce::uint64 key)
+{
+  const juce::ScopedLock sl(speculationLock);
+  if (!isSpeculating || abandonSpeculation || speculatedKey != key)
+    return false;
+
+  speculationQueue.clear();
+  for (int i=0;i<threadsNum;i++)
+    boxCalculator[i].setPriority(juce::Thread::Priority::normal);
+  LOG_INFO("Speculative IR adopted");
+  return true;
+}
+
+// Blocks until the calculators are free for real work
+void BoxRoomIR::stopSpeculation()
+{
+  {
+    const juce::ScopedLock sl(speculationLock);
+    speculationQueue.clear();
+    if (isSpeculating)
+      abandonSpeculation = true;
+  }
+  speculator.notify();
+  while (isSpeculating)
+    speculationStopped.wait(100);
+}
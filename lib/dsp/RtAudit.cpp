@@ -0,0 +1,201 @@
+#include "RtAudit.h"
+#include "Log.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#if RTAUDIT_ENABLED && defined(__GLIBC__)
+ #include <dlfcn.h>
+ #include <pthread.h>
+ #define RTAUDIT_INTERPOSESLIBC 1
+#else
+ #define RTAUDIT_INTERPOSESLIBC 0
+#endif
+
+#if defined(__GNUC__)
+ // (static TLS, which the interceptors read without allocating anything)
+ #define RTAUDIT_TLSMODEL __attribute__((tls_model("initial-exec")))
+#else
+ #define RTAUDIT_TLSMODEL
+#endif
+
+namespace
+{
+  // Number of ScopedRealtimes alive on the thread
+  thread_local int realtimeDepth RTAUDIT_TLSMODEL = 0;
+  std::atomic<int> violations[RtAudit::numViolationTypes];
+  const bool abortsOnViolation = std::getenv(RTAUDIT_ABORTVARIABLE) != nullptr;
+}
+
+#if RTAUDIT_ENABLED
+RtAudit::ScopedRealtime::ScopedRealtime()
+{
+  realtimeDepth++;
+}
+
+RtAudit::ScopedRealtime::~ScopedRealtime()
+{
+  realtimeDepth--;
+}
+#endif
+
+void RtAudit::check(Violation v)
+{
+  if (!RTAUDIT_ENABLED || realtimeDepth == 0)
+    return;
+
+  violations[v].fetch_add(1, std::memory_order_relaxed);
+  if (abortsOnViolation)
+    std::abort();
+}
+
+int RtAudit::getNumViolations(Violation v)
+{
+  return violations[v].load();
+}
+
+int RtAudit::getNumViolations()
+{
+  int n = 0;
+  for (auto& v : violations)
+    n += v.load();
+  return n;
+}
+
+void RtAudit::resetViolations()
+{
+  for (auto& v : violations)
+    v = 0;
+}
+
+int RtAudit::checkViolations()
+{
+  static const char* const names[numViolationTypes] = { "allocations", "releases", "mutex locks", "waits for a worker" };
+
+  int total = 0;
+  for (int v=0; v<numViolationTypes; v++)
+  {
+    const int n = violations[v].exchange(0);
+    if (n > 0)
+      LOG_WARNING("Real-time audit : " << n << " " << names[v] << " on the audio thread");
+    total += n;
+  }
+
+  // (see RTAUDIT_ABORTVARIABLE to find where they come from)
+  jassert(total == 0);
+  return total;
+}
+
+// ======================================================================
+
+#if RTAUDIT_INTERPOSESLIBC
+
+// The glibc allocator and mutexes stay in use, behind the checks
+using MutexLockFunction = int (*)(pthread_mutex_t*);
+static std::atomic<MutexLockFunction> libcMutexLock{nullptr};
+
+extern "C"
+{
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t num, size_t size);
+  void* __libc_realloc(void* ptr, size_t size);
+  void __libc_free(void* ptr);
+
+  void* malloc(size_t size) noexcept
+  {
+    RtAudit::check(RtAudit::allocation);
+    return __libc_malloc(size);
+  }
+
+  void* calloc(size_t num, size_t size) noexcept
+  {
+    RtAudit::check(RtAudit::allocation);
+    return __libc_calloc(num, size);
+  }
+
+  void* realloc(void* ptr, size_t size) noexcept
+  {
+    RtAudit::check(RtAudit::allocation);
+    return __libc_realloc(ptr, size);
+  }
+
+  void free(void* ptr) noexcept
+  {
+    if (ptr != nullptr)
+      RtAudit::check(RtAudit::release);
+    __libc_free(ptr);
+  }
+
+  int pthread_mutex_lock(pthread_mutex_t* mutex) noexcept
+  {
+    RtAudit::check(RtAudit::lock);
+    auto lock = libcMutexLock.load(std::memory_order_relaxed);
+    if (lock == nullptr)
+    {
+      lock = reinterpret_cast<MutexLockFunction>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+      libcMutexLock.store(lock, std::memory_order_relaxed);
+    }
+    return lock(mutex);
+  }
+}
+
+#elif RTAUDIT_ENABLED
+
+void* operator new(std::size_t size)
+{
+  RtAudit::check(RtAudit::allocation);
+  if (auto* p = std::malloc(size > 0 ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  RtAudit::check(RtAudit::allocation);
+  return std::malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+  return operator new(size, tag);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  if (ptr != nullptr)
+    RtAudit::check(RtAudit::release);
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  operator delete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+  operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+  operator delete(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+  operator delete(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+  operator delete(ptr);
+}
+
+#endif
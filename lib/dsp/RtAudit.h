@@ -0,0 +1,63 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// The audit is built in the debug builds (it can be forced with
+// RTAUDIT_ENABLED=1 or disabled with RTAUDIT_ENABLED=0)
+#ifndef RTAUDIT_ENABLED
+ #if JUCE_DEBUG
+  #define RTAUDIT_ENABLED 1
+ #else
+  #define RTAUDIT_ENABLED 0
+ #endif
+#endif
+
+// Environment variable which, when set, makes the process abort at the
+// first violation (to get its call stack in a debugger or a test run)
+#define RTAUDIT_ABORTVARIABLE "BIRR_RTAUDIT_ABORT"
+
+// ==================================================================
+// Audit of the real-time safety of the audio thread, in the debug
+// builds : processBlock() is marked with a ScopedRealtime, and any heap
+// allocation or release and any mutex acquisition made meanwhile by the
+// thread is counted as a violation, as is any wait of the thread for a
+// convolution worker (the job had a whole block to run, see
+// ConvolutionWorkers::finish()). The helpers of the ParallelChains are
+// audited as the audio thread, the audio thread waiting for them within
+// the block by design. The violations are checked when the processing
+// stops (releaseResources()), or by the RtAuditRunner console target.
+// With glibc, malloc() and pthread_mutex_lock() are intercepted, which
+// covers the C++ allocations, the juce::HeapBlocks and the locks of the
+// juce::CriticalSections and of the standard library. Elsewhere, only
+// the C++ allocations (operator new and delete) are intercepted.
+// The interception takes effect where the definitions of the plugin
+// come first (the standalone application), the hosts keep their own
+// allocator for the plugins they load.
+class RtAudit
+{
+public:
+  enum Violation { allocation, release, lock, wait, numViolationTypes };
+
+  // Marks the current thread as real-time while it exists
+  class ScopedRealtime
+  {
+  public:
+#if RTAUDIT_ENABLED
+    ScopedRealtime();
+    ~ScopedRealtime();
+#else
+    ScopedRealtime() {}
+#endif
+    JUCE_DECLARE_NON_COPYABLE (ScopedRealtime)
+  };
+
+  // (called by the interceptors, never allocates nor locks)
+  static void check(Violation v);
+
+  static int getNumViolations(Violation v);
+  static int getNumViolations();
+  static void resetViolations();
+  // Prints the violations since the last check and resets them, returns
+  // their number (asserts that there is none)
+  static int checkViolations();
+};
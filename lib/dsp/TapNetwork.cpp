@@ -0,0 +1,306 @@
+#include "TapNetwork.h"
+
+// ======================================================================
+
+TapNetwork::TapNetwork()
+{
+}
+
+void TapNetwork::prepare(double sampleRate, int maximumBlockSize, int nc, int length, int md, int maxTaps)
+{
+  numChannels = juce::jmin(nc, TAPS_MAXCHANNELS);
+  kernelLength = length;
+  maxDelay = md;
+  fadeLength = juce::jmax(1, int(TAPS_FADETIME*sampleRate));
+
+  // (room for the delay, the block and the interpolation points)
+  const int lineSize = juce::nextPowerOfTwo(maxDelay+maximumBlockSize+4);
+  line.assign(size_t(lineSize), 0.f);
+  lineMask = lineSize-1;
+  delayed.assign(size_t(maximumBlockSize), 0.f);
+
+  taps.assign(size_t(maxTaps), Tap());
+  kernels.resize(size_t(maxTaps*TAPS_KERNELSPERTAP));
+  for (auto& k : kernels)
+  {
+    k.taps.setSize(numChannels, kernelLength);
+    k.bus.setSize(numChannels, kernelLength-1+maximumBlockSize);
+  }
+
+  reset();
+}
+
+void TapNetwork::reset()
+{
+  std::fill(line.begin(), line.end(), 0.f);
+  writePosition = 0;
+  std::fill(taps.begin(), taps.end(), Tap());
+  for (auto& k : kernels)
+  {
+    k.isValid = false;
+    k.isFed = false;
+    k.isNew = false;
+    k.ringing = 0;
+    k.bus.clear();
+  }
+  isStarting = true;
+}
+
+// ======================================================================
+
+int TapNetwork::findKernel(juce::uint64 id) const
+{
+  for (size_t i=0; i<kernels.size(); i++)
+    if (kernels[i].isValid && kernels[i].id == id)
+      return int(i);
+  return -1;
+}
+
+bool TapNetwork::isKernelUsed(int index) const
+{
+  for (auto& tap : taps)
+    if (tap.kernel == index || tap.previousKernel == index || tap.pendingKernel == index)
+      return true;
+  return false;
+}
+
+int TapNetwork::addKernel(juce::uint64 id, const float* const* t)
+{
+  // (empty slots first)
+  int index = -1;
+  for (size_t i=0; i<kernels.size() && index<0; i++)
+    if (!kernels[i].isValid)
+      index = int(i);
+  for (size_t i=0; i<kernels.size() && index<0; i++)
+    if (!kernels[i].isNew && kernels[i].ringing == 0 && !isKernelUsed(int(i)))
+      index = int(i);
+  if (index < 0)
+    return -1;
+
+  auto& kernel = kernels[size_t(index)];
+  kernel.id = id;
+  kernel.isValid = true;
+  kernel.isNew = true;
+  kernel.ringing = 0;
+  kernel.bus.clear();
+
+  float peak = 0.f;
+  for (int c=0; c<numChannels; c++)
+  {
+    kernel.taps.copyFrom(c, 0, t[c], kernelLength);
+    peak = juce::jmax(peak, kernel.taps.getMagnitude(c, 0, kernelLength));
+  }
+
+  // Range of the taps that are not negligible
+  const float threshold = peak*TAPS_KERNELTHRESHOLD;
+  kernel.start = kernelLength;
+  kernel.end = 0;
+  for (int c=0; c<numChannels; c++)
+  {
+    auto* h = kernel.taps.getReadPointer(c);
+    for (int k=0; k<kernelLength; k++)
+      if (std::abs(h[k]) > threshold)
+      {
+        kernel.start = juce::jmin(kernel.start, k);
+        kernel.end = juce::jmax(kernel.end, k+1);
+      }
+  }
+  return index;
+}
+
+void TapNetwork::setTap(int index, float d, const float* gains, int k)
+{
+  auto& tap = taps[size_t(index)];
+  tap.targetDelay = juce::jlimit(1.f, float(maxDelay), d);
+  for (int c=0; c<numChannels; c++)
+    tap.targetGains[c] = gains[c];
+
+  if (isStarting)
+  {
+    tap.delay = tap.targetDelay;
+    for (int c=0; c<numChannels; c++)
+      tap.gains[c] = gains[c];
+    tap.rampLength = 0;
+    if (k >= 0)
+      tap.kernel = k;
+    return;
+  }
+
+  if (tap.kernel < 0)
+  {
+    // (a new tap is faded in at its position)
+    tap.delay = tap.targetDelay;
+    tap.kernel = k;
+  }
+  else if (k >= 0 && k != tap.kernel)
+  {
+    if (tap.previousKernel < 0)
+    {
+      tap.previousKernel = tap.kernel;
+      tap.kernel = k;
+      tap.fadePosition = 0;
+    }
+    else
+      tap.pendingKernel = k;
+  }
+  else if (k == tap.kernel)
+    tap.pendingKernel = -1;
+
+  tap.rampLength = fadeLength;
+  for (int c=0; c<numChannels; c++)
+    tap.gainSteps[c] = (tap.targetGains[c]-tap.gains[c])/float(fadeLength);
+}
+
+// ======================================================================
+
+void TapNetwork::process(const float* input, float* const* output, int numSamples)
+{
+  for (int i=0; i<numSamples; i++)
+    line[size_t((writePosition+i) & lineMask)] = input[i];
+
+  // The kernels fed in this block, or still ringing, are filtered
+  for (auto& k : kernels)
+  {
+    k.isFed = false;
+    k.isNew = false;
+  }
+  for (auto& tap : taps)
+  {
+    if (tap.kernel >= 0)
+      kernels[size_t(tap.kernel)].isFed = true;
+    if (tap.previousKernel >= 0)
+      kernels[size_t(tap.previousKernel)].isFed = true;
+  }
+  for (auto& k : kernels)
+    if (k.isFed || k.ringing > 0)
+      for (int c=0; c<numChannels; c++)
+        juce::FloatVectorOperations::clear(k.bus.getWritePointer(c, kernelLength-1), numSamples);
+
+  for (auto& tap : taps)
+  {
+    if (tap.kernel < 0)
+      continue;
+
+    // Fractional delay (cubic Lagrange interpolation between the
+    // samples at -1, 0, 1 and 2 around the read position)
+    for (int i=0; i<numSamples; i++)
+    {
+      tap.delay += juce::jlimit(-TAPS_MAXSLEW, TAPS_MAXSLEW, tap.targetDelay-tap.delay);
+      const int integer = int(tap.delay);
+      const float u = 1.f-(tap.delay-float(integer));
+      const int position = writePosition+i-integer;
+      const float ym1 = line[size_t((position-2) & lineMask)];
+      const float y0 = line[size_t((position-1) & lineMask)];
+      const float y1 = line[size_t(position & lineMask)];
+      const float y2 = line[size_t((position+1) & lineMask)];
+      delayed[size_t(i)] = -u*(u-1.f)*(u-2.f)/6.f*ym1
+                           + (u+1.f)*(u-1.f)*(u-2.f)/2.f*y0
+                           - (u+1.f)*u*(u-2.f)/2.f*y1
+                           + (u+1.f)*u*(u-1.f)/6.f*y2;
+    }
+
+    auto& kernel = kernels[size_t(tap.kernel)];
+    if (tap.rampLength == 0 && tap.previousKernel < 0)
+    {
+      for (int c=0; c<numChannels; c++)
+        juce::FloatVectorOperations::addWithMultiply(kernel.bus.getWritePointer(c, kernelLength-1), delayed.data(), tap.gains[c], numSamples);
+      continue;
+    }
+
+    // Gain ramps, and crossfade from the previous kernel
+    auto* previous = tap.previousKernel >= 0 ? &kernels[size_t(tap.previousKernel)] : nullptr;
+    for (int i=0; i<numSamples; i++)
+    {
+      if (tap.rampLength > 0 && --tap.rampLength == 0)
+        for (int c=0; c<numChannels; c++)
+          tap.gains[c] = tap.targetGains[c];
+      else if (tap.rampLength > 0)
+        for (int c=0; c<numChannels; c++)
+          tap.gains[c] += tap.gainSteps[c];
+
+      const float fade = previous == nullptr ? 1.f : juce::jmin(1.f, float(tap.fadePosition+i+1)/float(fadeLength));
+      for (int c=0; c<numChannels; c++)
+      {
+        const float y = tap.gains[c]*delayed[size_t(i)];
+        kernel.bus.getWritePointer(c, kernelLength-1)[i] += fade*y;
+        if (previous != nullptr)
+          previous->bus.getWritePointer(c, kernelLength-1)[i] += y-fade*y;
+      }
+    }
+
+    if (previous != nullptr)
+    {
+      tap.fadePosition += numSamples;
+      if (tap.fadePosition >= fadeLength)
+      {
+        tap.previousKernel = -1;
+        // (a kernel received during the fade is faded in now)
+        if (tap.pendingKernel >= 0)
+        {
+          tap.previousKernel = tap.kernel;
+          tap.kernel = tap.pendingKernel;
+          tap.pendingKernel = -1;
+          tap.fadePosition = 0;
+        }
+      }
+    }
+  }
+  writePosition = (writePosition+numSamples) & lineMask;
+
+  for (int c=0; c<numChannels; c++)
+    juce::FloatVectorOperations::clear(output[c], numSamples);
+  for (auto& k : kernels)
+    if (k.isFed || k.ringing > 0)
+    {
+      applyKernel(k, output, numSamples);
+      k.ringing = k.isFed ? kernelLength-1 : juce::jmax(0, k.ringing-numSamples);
+    }
+
+  isStarting = false;
+}
+
+int TapNetwork::getTailLength() const
+{
+  float delay = 0.f;
+  for (auto& tap : taps)
+    if (tap.kernel >= 0)
+      delay = juce::jmax(delay, tap.delay, tap.targetDelay);
+  // (with the samples after the read position used by the interpolation)
+  return int(std::ceil(delay)) + 2 + kernelLength;
+}
+
+void TapNetwork::clear()
+{
+  std::fill(line.begin(), line.end(), 0.f);
+  for (auto& k : kernels)
+  {
+    k.ringing = 0;
+    k.bus.clear();
+  }
+}
+
+size_t TapNetwork::getSizeInBytes() const
+{
+  size_t bytes = (line.size()+delayed.size())*sizeof(float) + taps.size()*sizeof(Tap);
+  for (auto& k : kernels)
+    bytes += sizeof(Kernel) + size_t(k.taps.getNumChannels()*k.taps.getNumSamples()
+                                     + k.bus.getNumChannels()*k.bus.getNumSamples())*sizeof(float);
+  return bytes;
+}
+
+// FIR of the bus of a kernel : each tap adds the bus shifted by its
+// index
+void TapNetwork::applyKernel(Kernel& kernel, float* const* output, int numSamples)
+{
+  for (int c=0; c<numChannels; c++)
+  {
+    auto* h = kernel.taps.getReadPointer(c);
+    auto* d = kernel.bus.getWritePointer(c);
+    for (int k=kernel.start; k<kernel.end; k++)
+      if (h[k] != 0.f)
+        juce::FloatVectorOperations::addWithMultiply(output[c], d+kernelLength-1-k, h[k], numSamples);
+
+    // (the end of the block is the history of the next one)
+    std::copy(d+numSamples, d+numSamples+kernelLength-1, d);
+  }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// Fastest change of the delay of a tap (samples per sample) : a jump
+// of the source is followed like a movement at 6% of the speed of sound
+#define TAPS_MAXSLEW 0.06f
+// Duration of the gain ramps and of the crossfades between two
+// kernels (seconds)
+#define TAPS_FADETIME 0.01
+// The taps at the ends of the kernels below this part of their peak
+// are skipped (-120 dB)
+#define TAPS_KERNELTHRESHOLD 1e-6f
+#define TAPS_MAXCHANNELS 4
+// Kernel slots per tap (the kernel fed, the one faded out, the one
+// waiting for the end of the fade, and one still ringing)
+#define TAPS_KERNELSPERTAP 4
+
+// ==================================================================
+// Direct sound and early reflections rendered on the audio thread.
+// Each tap reads the input from a shared delay line at a fractional
+// delay, with a gain per output channel, and feeds the bus of its
+// kernel (the grain or HRTF of its reflection). Each bus is then
+// filtered by its kernel, so the taps that share a kernel cost a
+// single FIR.
+// The taps are set from the current positions before each block : the
+// delays glide towards their targets, as they would with moving
+// sources, the gains are ramped, and a tap that changes of kernel is
+// crossfaded from a bus to the other.
+class TapNetwork
+{
+public:
+  TapNetwork();
+
+  // (maxDelay in samples, latency included)
+  void prepare(double sampleRate, int maximumBlockSize, int numChannels, int kernelLength, int maxDelay, int maxTaps);
+  void reset();
+
+  // The kernels are identified by the caller (e.g. by a hash of their
+  // parameters). Returns the index of the kernel, -1 if it isn't there.
+  int findKernel(juce::uint64 id) const;
+  // Stores a kernel (numChannels channels of kernelLength samples) in a
+  // slot that no tap uses anymore. Returns its index, -1 if there is no
+  // free slot yet.
+  int addKernel(juce::uint64 id, const float* const* taps);
+
+  // Called from the audio thread. The delay is in samples, there is a
+  // gain per channel, a negative kernel keeps the current one.
+  void setTap(int index, float delay, const float* gains, int kernel);
+
+  // Replaces the numChannels first output channels with the taps of
+  // the input (at most maximumBlockSize samples)
+  void process(const float* input, float* const* output, int numSamples);
+
+  // Called from the audio thread : number of samples after which the
+  // output of a silent input is silent, and clearing of the input
+  // history (the taps are kept) before process() is called again after
+  // having been skipped while the input wasn't silent
+  int getTailLength() const;
+  void clear();
+
+  // Memory held by the delay line and the kernels (bytes)
+  size_t getSizeInBytes() const;
+
+private:
+  struct Kernel
+  {
+    juce::uint64 id{0};
+    bool isValid{false};
+    juce::AudioBuffer<float> taps;
+    // (range of the taps that are not negligible)
+    int start{0}, end{0};
+    // Input of the kernel, preceded by the end of the previous block
+    juce::AudioBuffer<float> bus;
+    // Samples for which the FIR still rings without any input
+    int ringing{0};
+    bool isFed{false};
+    // (added since the last block, not given to a tap yet)
+    bool isNew{false};
+  };
+
+  struct Tap
+  {
+    float delay{0.f}, targetDelay{0.f};
+    float gains[TAPS_MAXCHANNELS]{}, targetGains[TAPS_MAXCHANNELS]{}, gainSteps[TAPS_MAXCHANNELS]{};
+    int rampLength{0};
+    // Kernel fed, kernel faded out and kernel waiting for the end of
+    // the fade (-1 if none)
+    int kernel{-1}, previousKernel{-1}, pendingKernel{-1};
+    int fadePosition{0};
+  };
+
+  int numChannels{0}, kernelLength{0}, maxDelay{0}, fadeLength{1};
+
+  // Input history (its size is a power of two)
+  std::vector<float> line;
+  int lineMask{0}, writePosition{0};
+  // (input of the tap being fed)
+  std::vector<float> delayed;
+
+  std::vector<Tap> taps;
+  std::vector<Kernel> kernels;
+  // (the targets are applied without gliding nor fading until the
+  // first block after reset())
+  bool isStarting{true};
+
+  bool isKernelUsed(int index) const;
+  void applyKernel(Kernel& kernel, float* const* output, int numSamples);
+
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (TapNetwork)
+};
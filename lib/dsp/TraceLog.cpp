@@ -0,0 +1,196 @@
+#include "TraceLog.h"
+#include "Log.h"
+
+#include <cstring>
+#include <memory>
+
+namespace
+{
+  // Ring buffer of a thread. The fields are written by the thread only,
+  // and read while they may be overwritten : the events are checked
+  // against the counter after they have been read.
+  struct ThreadEvents
+  {
+    enum State { unused, naming, taken, released };
+
+    struct Event
+    {
+      std::atomic<const char*> name{nullptr};
+      std::atomic<juce::int64> ticks{0};
+      std::atomic<char> phase{0};
+    };
+
+    std::atomic<int> state{unused};
+    // (set when the buffer is first taken)
+    char threadName[32]{};
+    std::atomic<juce::uint32> numEvents{0};
+    Event events[TRACELOG_CAPACITY];
+  };
+
+  std::atomic<ThreadEvents*> threads{nullptr};
+  juce::int64 startTicks{0};
+  juce::CriticalSection enableLock;
+
+  // Index of the buffer of the thread (-1 before its first event, -2
+  // when there was none left)
+  thread_local int threadIndex = -1;
+
+  // (without allocating, it may be the audio thread)
+  void getThreadName(char* dest, size_t size)
+  {
+    if (auto* t = juce::Thread::getCurrentThread())
+    {
+      t->getThreadName().copyToUTF8(dest, size);
+      return;
+    }
+    const char* name = juce::MessageManager::existsAndIsCurrentThread() ? "message" : "host";
+    std::strncpy(dest, name, size-1);
+    dest[size-1] = 0;
+  }
+
+  // (the buffers released by the threads with the same name first, so
+  // that a restarted thread keeps its line in the timeline)
+  int takeBuffer(ThreadEvents* t)
+  {
+    char name[32];
+    getThreadName(name, sizeof(name));
+
+    for (int i=0; i<TRACELOG_MAXTHREADS; i++)
+    {
+      int expected = ThreadEvents::released;
+      if (t[i].state.load() == expected && std::strcmp(t[i].threadName, name) == 0
+          && t[i].state.compare_exchange_strong(expected, ThreadEvents::taken))
+        return i;
+    }
+    for (int i=0; i<TRACELOG_MAXTHREADS; i++)
+    {
+      int expected = ThreadEvents::unused;
+      if (t[i].state.compare_exchange_strong(expected, ThreadEvents::naming))
+      {
+        std::memcpy(t[i].threadName, name, sizeof(name));
+        t[i].state.store(ThreadEvents::taken);
+        return i;
+      }
+    }
+    return -2;
+  }
+
+  struct EnabledAtStartup
+  {
+    EnabledAtStartup()
+    {
+      if (std::getenv(TRACELOG_VARIABLE) != nullptr)
+        TraceLog::setEnabled(true);
+    }
+  };
+}
+
+std::atomic<bool> TraceLog::enabled{false};
+
+#if TRACELOG_ENABLED
+static EnabledAtStartup enabledAtStartup;
+
+TraceLog::ScopedThread::~ScopedThread()
+{
+  auto* t = threads.load(std::memory_order_acquire);
+  if (t != nullptr && threadIndex >= 0)
+    t[threadIndex].state.store(ThreadEvents::released);
+  threadIndex = -1;
+}
+#endif
+
+void TraceLog::record(const char* name, char phase)
+{
+  auto* t = threads.load(std::memory_order_acquire);
+  if (t == nullptr)
+    return;
+  if (threadIndex == -1)
+    threadIndex = takeBuffer(t);
+  if (threadIndex < 0)
+    return;
+
+  auto& b = t[threadIndex];
+  const auto n = b.numEvents.load(std::memory_order_relaxed);
+  auto& e = b.events[n%TRACELOG_CAPACITY];
+  e.name.store(name, std::memory_order_relaxed);
+  e.ticks.store(juce::Time::getHighResolutionTicks(), std::memory_order_relaxed);
+  e.phase.store(phase, std::memory_order_relaxed);
+  b.numEvents.store(n+1, std::memory_order_release);
+}
+
+void TraceLog::setEnabled(bool shouldBeEnabled)
+{
+  const juce::ScopedLock sl(enableLock);
+  // (the buffers are kept once allocated, threads may still be writing)
+  if (shouldBeEnabled && threads.load() == nullptr)
+  {
+    startTicks = juce::Time::getHighResolutionTicks();
+    threads.store(new ThreadEvents[TRACELOG_MAXTHREADS], std::memory_order_release);
+    LOG_INFO("Tracing enabled, the trace will be written to " << getDefaultFile().getFullPathName());
+  }
+  enabled = shouldBeEnabled;
+}
+
+juce::File TraceLog::getDefaultFile()
+{
+  const auto path = juce::SystemStats::getEnvironmentVariable(TRACELOG_VARIABLE, {});
+  if (juce::File::isAbsolutePath(path))
+    return juce::File(path);
+  return juce::File::getSpecialLocation(juce::File::userHomeDirectory).getChildFile("BiRR_trace.json");
+}
+
+bool TraceLog::writeChromeTrace(const juce::File& file)
+{
+  auto* t = threads.load(std::memory_order_acquire);
+  if (t == nullptr)
+    return false;
+
+  const double microsecondsPerTick = 1.0e6/double(juce::Time::getHighResolutionTicksPerSecond());
+  juce::MemoryOutputStream out;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool isFirst = true;
+  auto separate = [&]() { out << (isFirst ? "\n" : ",\n"); isFirst = false; };
+
+  for (int i=0; i<TRACELOG_MAXTHREADS; i++)
+  {
+    auto& b = t[i];
+    const auto state = b.state.load();
+    if (state == ThreadEvents::unused || state == ThreadEvents::naming)
+      continue;
+
+    separate();
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << i
+        << ",\"args\":{\"name\":" << juce::JSON::toString(juce::String(b.threadName)) << "}}";
+
+    const auto end = b.numEvents.load(std::memory_order_acquire);
+    const auto start = end > TRACELOG_CAPACITY ? end-TRACELOG_CAPACITY : 0;
+    std::vector<std::tuple<const char*, juce::int64, char>> events;
+    events.reserve(size_t(end-start));
+    for (auto n=start; n<end; n++)
+    {
+      const auto& e = b.events[n%TRACELOG_CAPACITY];
+      events.emplace_back(e.name.load(std::memory_order_relaxed), e.ticks.load(std::memory_order_relaxed), e.phase.load(std::memory_order_relaxed));
+    }
+    // (without those overwritten meanwhile)
+    const auto newEnd = b.numEvents.load(std::memory_order_acquire);
+    const size_t first = newEnd > TRACELOG_CAPACITY+start ? newEnd-TRACELOG_CAPACITY-start : 0;
+
+    for (size_t n=first; n<events.size(); n++)
+    {
+      const auto& [name, ticks, phase] = events[n];
+      separate();
+      out << "{\"name\":\"" << name << "\",\"ph\":\"" << juce::String::charToString(phase)
+          << "\",\"ts\":" << juce::String(double(ticks-startTicks)*microsecondsPerTick, 1)
+          << ",\"pid\":1,\"tid\":" << i << (phase == 'i' ? ",\"s\":\"t\"}" : "}");
+    }
+  }
+  out << "\n]}\n";
+
+  if (!file.replaceWithData(out.getData(), out.getDataSize()))
+  {
+    LOG_ERROR("Error: the trace can't be written to " << file.getFullPathName());
+    return false;
+  }
+  LOG_INFO("Trace written to " << file.getFullPathName());
+  return true;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+
+// The tracing is built in by default (it can be removed with
+// TRACELOG_ENABLED=0), and off until it is enabled
+#ifndef TRACELOG_ENABLED
+ #define TRACELOG_ENABLED 1
+#endif
+
+// Events kept per thread (the oldest ones are overwritten)
+#define TRACELOG_CAPACITY 8192
+// Threads traced at once (the events of the others are dropped)
+#define TRACELOG_MAXTHREADS 64
+// Environment variable which, when set, enables the tracing at startup.
+// Its value is the file of the trace if it is an absolute path, otherwise
+// the trace is written in the home directory.
+#define TRACELOG_VARIABLE "BIRR_TRACE"
+
+// ==================================================================
+// Timeline of the calculations of the IRs and of their loads, written
+// as a Chrome trace (chrome://tracing or ui.perfetto.dev).
+// Each thread records its events in its own ring buffer, without
+// allocating nor locking, so that the audio thread can be traced too.
+// The names of the events must be string literals.
+class TraceLog
+{
+public:
+  // Span of the current thread, from its construction to its destruction
+  class Scope
+  {
+  public:
+#if TRACELOG_ENABLED
+    explicit Scope(const char* n) : name(isEnabled() ? n : nullptr)
+    {
+      if (name != nullptr)
+        record(name, 'B');
+    }
+    ~Scope()
+    {
+      if (name != nullptr)
+        record(name, 'E');
+    }
+  private:
+    const char* name;
+#else
+    explicit Scope(const char*) {}
+#endif
+    JUCE_DECLARE_NON_COPYABLE (Scope)
+  };
+
+  // Placed at the start of the run() of the threads which are restarted
+  // (e.g. the calculators) : their ring buffer is released when they
+  // stop, and taken again by the next thread with the same name. The
+  // other threads keep theirs.
+  class ScopedThread
+  {
+  public:
+    ScopedThread() {}
+#if TRACELOG_ENABLED
+    ~ScopedThread();
+#endif
+    JUCE_DECLARE_NON_COPYABLE (ScopedThread)
+  };
+
+  static void instant(const char* name)
+  {
+#if TRACELOG_ENABLED
+    if (isEnabled())
+      record(name, 'i');
+#else
+    juce::ignoreUnused(name);
+#endif
+  }
+
+  static bool isEnabled()
+  {
+    return enabled.load(std::memory_order_relaxed);
+  }
+  static void setEnabled(bool shouldBeEnabled);
+
+  // File set with TRACELOG_VARIABLE, or BiRR_trace.json in the home
+  // directory
+  static juce::File getDefaultFile();
+  // Writes the events recorded by all the threads (from any thread but
+  // the audio one, returns false if the file can't be written)
+  static bool writeChromeTrace(const juce::File& file);
+
+private:
+  static void record(const char* name, char phase);
+
+  static std::atomic<bool> enabled;
+};